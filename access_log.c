@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include "access_log.h"
+#include "metrics.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_MAX_LEN (ACCESS_LOG_PATH_MAX * 6 + 160) // worst case with every path byte escaped
+#define IDLE_SLEEP_NS 20000000 // 20ms between polls of an empty ring
+
+static access_log_ring* ring = NULL;
+static volatile sig_atomic_t flusher_stop = 0;
+
+// producer side: claim a slot, fill it and publish it, never blocks
+static int ring_push(const access_log_record* rec)
+{
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        access_log_record* slot = &ring->slots[pos & (ACCESS_LOG_SLOTS - 1)];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                memcpy((char*)slot + sizeof(slot->seq), (const char*)rec + sizeof(rec->seq), sizeof(*rec) - sizeof(rec->seq));
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+            // lost the race, pos now holds the current head
+        } else if (diff < 0) {
+            return -1; // full: the flusher has not consumed this slot yet
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// consumer side: copy out the next published record, -1 when empty
+static int ring_pop(access_log_record* out)
+{
+    uint64_t pos = ring->tail;
+    access_log_record* slot = &ring->slots[pos & (ACCESS_LOG_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return -1;
+
+    memcpy(out, slot, sizeof(*out));
+    __atomic_store_n(&slot->seq, pos + ACCESS_LOG_SLOTS, __ATOMIC_RELEASE);
+    ring->tail = pos + 1;
+    return 0;
+}
+
+// append the path as a JSON string body
+static int escape_json(char* dst, const char* src)
+{
+    char* d = dst;
+    for (const unsigned char* s = (const unsigned char*)src; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            *d++ = '\\';
+            *d++ = *s;
+        } else if (*s < 0x20 || *s >= 0x7f) {
+            d += sprintf(d, "\\u%04x", *s);
+        } else
+            *d++ = *s;
+    }
+    *d = '\0';
+    return d - dst;
+}
+
+static int format_record(char* line, const access_log_record* rec)
+{
+    char ts[32], client[INET_ADDRSTRLEN], path[ACCESS_LOG_PATH_MAX * 6 + 1];
+    struct tm tm;
+    time_t sec = rec->ts_sec;
+    gmtime_r(&sec, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    struct in_addr addr = { .s_addr = rec->client_ip };
+    inet_ntop(AF_INET, &addr, client, sizeof(client));
+    escape_json(path, rec->path);
+
+    return snprintf(line, LINE_MAX_LEN,
+        "{\"ts\":\"%s.%03dZ\",\"client\":\"%s:%u\",\"path\":\"%s\",\"status\":%u,\"bytes\":%lu,\"latency_us\":%u}\n",
+        ts, rec->ts_nsec / 1000000, client, ntohs(rec->client_port), path,
+        rec->status, (unsigned long)rec->bytes, rec->latency_us);
+}
+
+static int open_log(const char* path)
+{
+    if (strcmp(path, "-") == 0)
+        return dup(STDOUT_FILENO);
+    return open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+// shift path.N-1 -> path.N ... path -> path.1 and start a fresh file
+static int rotate_log(const char* path, int fd)
+{
+    char from[1024], to[1024];
+    close(fd);
+    for (int i = ACCESS_LOG_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", path, i);
+        snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", path);
+    rename(path, to);
+    return open_log(path);
+}
+
+static void flusher_sigterm(int signum)
+{
+    (void)signum;
+    flusher_stop = 1;
+}
+
+// background process draining the ring into the log file in batches
+static void run_flusher(const char* path)
+{
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, flusher_sigterm);
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // drain and exit with the server
+
+    int fd = open_log(path);
+    if (fd == -1) {
+        perror("Error: failed to open access log");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    off_t written = fstat(fd, &st) == 0 ? st.st_size : 0;
+    int rotates = strcmp(path, "-") != 0;
+
+    char* batch = malloc((size_t)ACCESS_LOG_BATCH * LINE_MAX_LEN);
+    if (!batch) {
+        perror("Error: failed to allocate access log batch");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        size_t len = 0;
+        int n = 0;
+        access_log_record rec;
+        while (n < ACCESS_LOG_BATCH && ring_pop(&rec) == 0) {
+            len += format_record(batch + len, &rec);
+            n++;
+        }
+
+        if (n == 0) {
+            if (flusher_stop)
+                break;
+            struct timespec idle = { 0, IDLE_SLEEP_NS };
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        for (size_t off = 0; off < len;) {
+            ssize_t w = write(fd, batch + off, len - off);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("Error: failed to write access log");
+                break;
+            }
+            off += w;
+        }
+        written += len;
+
+        if (rotates && written >= ACCESS_LOG_ROTATE_BYTES) {
+            fd = rotate_log(path, fd);
+            if (fd == -1) {
+                perror("Error: failed to reopen access log after rotation");
+                exit(EXIT_FAILURE);
+            }
+            written = 0;
+        }
+    }
+
+    free(batch);
+    close(fd);
+    exit(EXIT_SUCCESS);
+}
+
+// map the shared ring and start the flusher, call before forking handlers
+int access_log_init(const char* path)
+{
+    ring = mmap(NULL, sizeof(access_log_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        perror("Error: failed to map access log ring");
+        ring = NULL;
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < ACCESS_LOG_SLOTS; i++)
+        ring->slots[i].seq = i;
+
+    fflush(stdout); // don't let the flusher inherit buffered output
+    pid_t p = fork();
+    if (p < 0) {
+        perror("Error: cannot fork access log flusher");
+        munmap(ring, sizeof(access_log_ring));
+        ring = NULL;
+        return -1;
+    }
+    if (p == 0)
+        run_flusher(path);
+
+    return 0;
+}
+
+// queue one access log line, dropped (and counted) if the ring is full
+void access_log_write(const struct sockaddr_in* client, const char* path, int status, uint64_t bytes, uint64_t latency_us)
+{
+    if (!ring)
+        return;
+
+    access_log_record rec;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.ts_sec = now.tv_sec;
+    rec.ts_nsec = now.tv_nsec;
+    rec.client_ip = client ? client->sin_addr.s_addr : 0;
+    rec.client_port = client ? client->sin_port : 0;
+    rec.status = status;
+    rec.bytes = bytes;
+    rec.latency_us = latency_us > UINT32_MAX ? UINT32_MAX : latency_us;
+    snprintf(rec.path, sizeof(rec.path), "%s", path ? path : "");
+
+    if (ring_push(&rec) == -1)
+        metrics_counter_add(&metrics->access_log_dropped, 1);
+}
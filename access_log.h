@@ -0,0 +1,38 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define ACCESS_LOG_SLOTS 4096 // ring capacity, must be a power of two
+#define ACCESS_LOG_PATH_MAX 128
+#define ACCESS_LOG_ROTATE_BYTES (10 * 1024 * 1024) // rotate the log file at 10MB
+#define ACCESS_LOG_KEEP 3 // rotated files kept as path.1 .. path.N
+#define ACCESS_LOG_BATCH 256 // records formatted per write() by the flusher
+
+// Fixed-size record pushed by request handlers
+typedef struct {
+    uint64_t seq; // slot sequence number used by the ring protocol
+    int64_t ts_sec;
+    int32_t ts_nsec;
+    uint32_t client_ip; // network byte order
+    uint16_t client_port; // network byte order
+    uint16_t status;
+    uint32_t latency_us;
+    uint64_t bytes;
+    char path[ACCESS_LOG_PATH_MAX];
+} access_log_record;
+
+// Bounded multi-producer single-consumer ring in shared memory. Producers
+// claim a slot with a CAS on head and publish it by bumping the slot's
+// sequence number; the flusher process is the only consumer.
+typedef struct {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    access_log_record slots[ACCESS_LOG_SLOTS];
+} access_log_ring;
+
+int access_log_init(const char* path);
+void access_log_write(const struct sockaddr_in* client, const char* path, int status, uint64_t bytes, uint64_t latency_us);
+
+#endif /* ACCESS_LOG_H */
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+
+#include "admission.h"
+#include "metrics.h"
+#include "my_threads.h"
+#include "timer_wheel.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAIT_SLICE_MS 5 // how often a queued fiber checks whether it was granted a slot
+
+typedef enum {
+    WAITER_FREE,
+    WAITER_QUEUED,
+    WAITER_GRANTED
+} waiter_state;
+
+// A request waiting for a slot. A releasing request hands its slot straight
+// to the oldest waiter, so a queued request is never overtaken by a newer one.
+typedef struct {
+    uint32_t state; // futex word, QUEUED until granted
+    pid_t pid;
+    int holder; // slot handed over with the grant
+    uint64_t seq; // arrival order
+    uint64_t since_ms;
+} waiter;
+
+// Shared by every process, so the limits hold across forked children and
+// prefork workers. A slot remembers its holder's pid, so slots held by a
+// process that died can be taken back.
+typedef struct {
+    uint32_t lock;
+    int in_flight;
+    int queued;
+    uint64_t next_seq;
+    uint64_t reaped_ms;
+    pid_t holders[ADMISSION_LIMIT_MAX];
+    waiter waiters[ADMISSION_QUEUE_MAX];
+} class_state;
+
+static const char* class_names[CLASS_COUNT] = { "static", "cached", "cgi", "serial" };
+
+// static files are only bounded by the connection limits, scripts are not
+// allowed to pile up, and the serial port serves one script at a time
+static admission_limits limits[CLASS_COUNT] = {
+    [CLASS_STATIC] = { 0, 0, 0 },
+    [CLASS_CACHED] = { 0, 0, 0 },
+    [CLASS_CGI] = { 16, 64, 2000 },
+    [CLASS_SERIAL] = { 1, 16, 5000 },
+};
+
+static class_state* classes = NULL;
+
+static void class_lock(class_state* s)
+{
+    while (__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void class_unlock(class_state* s)
+{
+    __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+// shared (not private) futex ops: the classes are mapped in several processes
+static void futex_wait(uint32_t* addr, uint32_t val, int timeout_ms)
+{
+    struct timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t* addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int process_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// the class with this name in the route config, CLASS_NONE if there is none
+admission_class admission_class_named(const char* name)
+{
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        if (strcmp(name, class_names[i]) == 0)
+            return i;
+    }
+    return CLASS_NONE;
+}
+
+const char* admission_class_name(admission_class cls)
+{
+    return cls == CLASS_NONE ? "none" : class_names[cls];
+}
+
+// change a class's limits, only before admission_init
+int admission_configure(admission_class cls, const admission_limits* l)
+{
+    if (classes || cls == CLASS_NONE || l->limit < 0 || l->limit > ADMISSION_LIMIT_MAX
+        || l->queue < 0 || l->queue > ADMISSION_QUEUE_MAX || l->target_ms < 0)
+        return -1;
+    limits[cls] = *l;
+    return 0;
+}
+
+const admission_limits* admission_get_limits(admission_class cls)
+{
+    return &limits[cls];
+}
+
+// the longest waiting request, NULL if the queue is empty
+static waiter* oldest_waiter(class_state* s)
+{
+    waiter* oldest = NULL;
+    for (int i = 0; i < ADMISSION_QUEUE_MAX; i++) {
+        waiter* w = &s->waiters[i];
+        if (w->state == WAITER_QUEUED && (!oldest || w->seq < oldest->seq))
+            oldest = w;
+    }
+    return oldest;
+}
+
+// hand a freed slot to the oldest waiter, or give it back; class locked
+static void pass_slot(admission_class cls, class_state* s, int holder)
+{
+    waiter* w = s->queued ? oldest_waiter(s) : NULL;
+    if (!w) {
+        s->holders[holder] = 0;
+        s->in_flight--;
+        metrics_gauge_add(&metrics->admission_in_flight[cls], -1);
+        return;
+    }
+    s->holders[holder] = w->pid;
+    s->queued--;
+    metrics_gauge_add(&metrics->admission_queued[cls], -1);
+    w->holder = holder;
+    __atomic_store_n(&w->state, WAITER_GRANTED, __ATOMIC_RELEASE);
+    futex_wake(&w->state);
+}
+
+// take back slots and queue entries of processes that died holding them,
+// at most once per ADMISSION_REAP_MS; class locked
+static void reap_dead(admission_class cls, class_state* s, uint64_t now)
+{
+    if (now - s->reaped_ms < ADMISSION_REAP_MS)
+        return;
+    s->reaped_ms = now;
+
+    for (int i = 0; i < ADMISSION_QUEUE_MAX; i++) {
+        waiter* w = &s->waiters[i];
+        if (w->state == WAITER_QUEUED && !process_alive(w->pid)) {
+            w->state = WAITER_FREE;
+            s->queued--;
+            metrics_gauge_add(&metrics->admission_queued[cls], -1);
+        }
+    }
+    for (int i = 0; i < limits[cls].limit; i++) {
+        if (s->holders[i] && !process_alive(s->holders[i]))
+            pass_slot(cls, s, i);
+    }
+}
+
+// block until the waiter is granted a slot or the deadline passes; a
+// fiber sleeps in short slices so the rest of its process keeps running
+static int wait_grant(waiter* w, uint64_t deadline)
+{
+    for (;;) {
+        if (__atomic_load_n(&w->state, __ATOMIC_ACQUIRE) == WAITER_GRANTED)
+            return 0;
+        uint64_t now = timer_now_ms();
+        if (now >= deadline)
+            return -1;
+        int remaining = deadline - now;
+        if (fiber_running())
+            fiber_sleep(remaining < WAIT_SLICE_MS ? remaining : WAIT_SLICE_MS);
+        else
+            futex_wait(&w->state, WAITER_QUEUED, remaining);
+    }
+}
+
+static void shed(admission_class cls, admission_shed reason)
+{
+    metrics_counter_add(&metrics->admission_shed[cls][reason], 1);
+}
+
+// admit the current request into its class: 0 once it holds a slot, which
+// may mean waiting in the queue, or -1 if it should be answered with 503
+// because the queue is full or it waited (or would wait) too long. A
+// process serving other connections without fibers can't wait, for it
+// the queue is always full.
+int admission_acquire(admission_class cls, int may_wait, admission_ticket* ticket)
+{
+    ticket->cls = CLASS_NONE;
+    ticket->holder = -1;
+    if (cls == CLASS_NONE || !classes || limits[cls].limit == 0)
+        return 0;
+
+    const admission_limits* l = &limits[cls];
+    class_state* s = &classes[cls];
+    uint64_t now = timer_now_ms();
+    uint64_t start_us = metrics_now_us();
+
+    class_lock(s);
+    if (s->in_flight == l->limit || s->queued)
+        reap_dead(cls, s, now);
+
+    if (s->in_flight < l->limit && !s->queued) {
+        int holder = 0;
+        while (s->holders[holder])
+            holder++;
+        s->holders[holder] = getpid();
+        s->in_flight++;
+        class_unlock(s);
+        metrics_gauge_add(&metrics->admission_in_flight[cls], 1);
+        ticket->cls = cls;
+        ticket->holder = holder;
+        return 0;
+    }
+
+    // a queue whose head is already past the target only grows the backlog
+    waiter* head = s->queued ? oldest_waiter(s) : NULL;
+    if (!may_wait || s->queued >= l->queue || (head && now - head->since_ms >= (uint64_t)l->target_ms)) {
+        class_unlock(s);
+        shed(cls, may_wait && head && s->queued < l->queue ? SHED_QUEUE_DELAY : SHED_QUEUE_FULL);
+        return -1;
+    }
+
+    // entries granted a moment ago are only freed once their owner wakes up
+    waiter* w = s->waiters;
+    while (w < s->waiters + ADMISSION_QUEUE_MAX && w->state != WAITER_FREE)
+        w++;
+    if (w == s->waiters + ADMISSION_QUEUE_MAX) {
+        class_unlock(s);
+        shed(cls, SHED_QUEUE_FULL);
+        return -1;
+    }
+    w->state = WAITER_QUEUED;
+    w->pid = getpid();
+    w->holder = -1;
+    w->seq = s->next_seq++;
+    w->since_ms = now;
+    s->queued++;
+    class_unlock(s);
+    metrics_gauge_add(&metrics->admission_queued[cls], 1);
+    metrics_counter_add(&metrics->admission_waits[cls], 1);
+
+    int granted = wait_grant(w, now + l->target_ms) == 0;
+    class_lock(s);
+    if (!granted && w->state == WAITER_GRANTED) // handed a slot just as time ran out
+        granted = 1;
+    int holder = w->holder;
+    if (!granted) {
+        s->queued--;
+        metrics_gauge_add(&metrics->admission_queued[cls], -1);
+    }
+    w->state = WAITER_FREE;
+    class_unlock(s);
+    metrics_observe(PHASE_QUEUE, metrics_now_us() - start_us);
+
+    if (!granted) {
+        shed(cls, SHED_QUEUE_DELAY);
+        return -1;
+    }
+    ticket->cls = cls;
+    ticket->holder = holder;
+    return 0;
+}
+
+// give the slot to the next queued request; safe to call twice or on a
+// ticket that holds nothing
+void admission_release(admission_ticket* ticket)
+{
+    if (ticket->cls == CLASS_NONE)
+        return;
+    class_state* s = &classes[ticket->cls];
+    class_lock(s);
+    pass_slot(ticket->cls, s, ticket->holder);
+    class_unlock(s);
+    ticket->cls = CLASS_NONE;
+    ticket->holder = -1;
+}
+
+// leave the slot to another process, e.g. a script nobody waits for; it is
+// taken back once that process has exited and the class is congested
+void admission_hand_off(admission_ticket* ticket, pid_t pid)
+{
+    if (ticket->cls == CLASS_NONE)
+        return;
+    class_state* s = &classes[ticket->cls];
+    class_lock(s);
+    s->holders[ticket->holder] = pid;
+    class_unlock(s);
+    ticket->cls = CLASS_NONE;
+    ticket->holder = -1;
+}
+
+// map the shared class state, call before forking
+int admission_init(void)
+{
+    void* p = mmap(NULL, sizeof(class_state) * CLASS_COUNT, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("Error: failed to map admission state");
+        return -1;
+    }
+    classes = p;
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <sys/types.h>
+
+#define ADMISSION_LIMIT_MAX 256 // highest concurrency limit a class can have
+#define ADMISSION_QUEUE_MAX 256 // longest queue a class can have
+#define ADMISSION_RETRY_AFTER_S 1 // Retry-After sent with a shed request
+#define ADMISSION_REAP_MS 100 // how often a congested class looks for exited holders
+
+// Route classes admitted under their own concurrency limit
+typedef enum {
+    CLASS_STATIC, // files from disk and directory listings
+    CLASS_CACHED, // files through the shared cache, proxied requests
+    CLASS_CGI, // scripts
+    CLASS_SERIAL, // scripts that talk to the Arduino over the serial port
+    CLASS_COUNT,
+    CLASS_NONE = -1 // never queued or shed, e.g. /metrics
+} admission_class;
+
+// Reasons a request is answered with 503 instead of being served
+typedef enum {
+    SHED_QUEUE_FULL,
+    SHED_QUEUE_DELAY,
+    SHED_COUNT
+} admission_shed;
+
+typedef struct {
+    int limit; // requests served at once, 0 for no limit
+    int queue; // requests allowed to wait for a slot beyond that
+    int target_ms; // longest a request may wait in the queue
+} admission_limits;
+
+// a slot held by the current request, released by admission_release
+typedef struct {
+    admission_class cls;
+    int holder;
+} admission_ticket;
+
+admission_class admission_class_named(const char* name);
+const char* admission_class_name(admission_class cls);
+int admission_configure(admission_class cls, const admission_limits* limits);
+const admission_limits* admission_get_limits(admission_class cls);
+int admission_init(void);
+int admission_acquire(admission_class cls, int may_wait, admission_ticket* ticket);
+void admission_release(admission_ticket* ticket);
+void admission_hand_off(admission_ticket* ticket, pid_t pid);
+
+#endif /* ADMISSION_H */
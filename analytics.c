@@ -0,0 +1,283 @@
+#include "analytics.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// Per-device session statistics, kept up to date as totals arrive instead
+// of being recomputed from the saved files. The device process is the
+// only writer; handlers in any process read a slot through its sequence
+// number, copying again if a write was in progress, so every query is a
+// copy of one struct. Entries and exits are the rises and falls of the
+// firmware's total; a total seen after connecting, or set by a config
+// command, moves the occupancy without counting as either. Rolling rates
+// come from a ring of ANALYTICS_BUCKETS counters, ANALYTICS_BUCKET_MS
+// each, with the window sums adjusted as buckets fall out.
+
+#define ANALYTICS_READ_TRIES 1000 // a writer that died mid-update never finishes
+
+typedef struct {
+    unsigned seq; // odd while the device process is writing
+    analytics_session current;
+    analytics_session last; // closed most recently, started_ms is 0 before the first
+    int last_unsaved;
+    // below only the device process looks at
+    int known; // current.occupancy is the firmware's; cleared while disconnected
+    int observed; // the occupancy was known at some point this session
+    int64_t epoch; // number of the newest bucket, counted from the epoch
+    int64_t bucket_entries[ANALYTICS_BUCKETS];
+    int64_t bucket_exits[ANALYTICS_BUCKETS];
+} analytics_slot;
+
+static analytics_slot* slots = NULL;
+static int slot_count = 0;
+static char sessions_path[512];
+static char totals_path[512];
+
+static int64_t wall_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void write_begin(analytics_slot* a)
+{
+    __atomic_store_n(&a->seq, a->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(analytics_slot* a)
+{
+    __atomic_store_n(&a->seq, a->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int read_session(const analytics_slot* a, const analytics_session* from, analytics_session* s)
+{
+    for (int i = 0; i < ANALYTICS_READ_TRIES; i++) {
+        unsigned seq = __atomic_load_n(&a->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(s, from, sizeof(*s));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&a->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+    return -1;
+}
+
+static void start_session(analytics_slot* a, int64_t now)
+{
+    memset(&a->current, 0, sizeof(a->current));
+    memset(a->bucket_entries, 0, sizeof(a->bucket_entries));
+    memset(a->bucket_exits, 0, sizeof(a->bucket_exits));
+    a->current.started_ms = a->current.updated_ms = a->current.peak_ms = now;
+    a->epoch = now / ANALYTICS_BUCKET_MS;
+}
+
+// drop the buckets that fell out of the window and bring the occupancy
+// integral up to now; call between write_begin and write_end
+static void advance(analytics_slot* a, int64_t now)
+{
+    analytics_session* s = &a->current;
+    int64_t epoch = now / ANALYTICS_BUCKET_MS;
+    if (epoch - a->epoch > ANALYTICS_BUCKETS)
+        a->epoch = epoch - ANALYTICS_BUCKETS;
+    while (a->epoch < epoch) {
+        int b = ++a->epoch % ANALYTICS_BUCKETS;
+        s->window_entries -= a->bucket_entries[b];
+        s->window_exits -= a->bucket_exits[b];
+        a->bucket_entries[b] = a->bucket_exits[b] = 0;
+    }
+    if (now > s->updated_ms) {
+        s->occupancy_ms += s->occupancy * (now - s->updated_ms);
+        s->updated_ms = now;
+    }
+}
+
+static void change(analytics_slot* a, int64_t occupancy, int counted)
+{
+    int64_t now = wall_ms();
+    analytics_session* s = &a->current;
+    write_begin(a);
+    advance(a, now);
+    int64_t delta = occupancy - s->occupancy;
+    int b = a->epoch % ANALYTICS_BUCKETS;
+    if (counted && delta > 0) {
+        s->entries += delta;
+        s->window_entries += delta;
+        a->bucket_entries[b] += delta;
+    } else if (counted && delta < 0) {
+        s->exits -= delta;
+        s->window_exits -= delta;
+        a->bucket_exits[b] -= delta;
+    }
+    s->occupancy = occupancy;
+    if (occupancy > s->peak) {
+        s->peak = occupancy;
+        s->peak_ms = now;
+    }
+    write_end(a);
+    a->known = a->observed = 1;
+}
+
+static analytics_slot* writable(int slot)
+{
+    return slots && slot >= 0 && slot < slot_count ? &slots[slot] : NULL;
+}
+
+// a total the firmware printed
+void analytics_observe(int slot, int64_t occupancy)
+{
+    analytics_slot* a = writable(slot);
+    if (a && !(a->known && occupancy == a->current.occupancy))
+        change(a, occupancy, a->known);
+}
+
+// the firmware acknowledged a new total, nobody crossed
+void analytics_set(int slot, int64_t occupancy)
+{
+    analytics_slot* a = writable(slot);
+    if (a)
+        change(a, occupancy, 0);
+}
+
+// the device went away; whatever it prints after reconnecting is a new
+// baseline, it may have rebooted meanwhile
+void analytics_lost(int slot)
+{
+    analytics_slot* a = writable(slot);
+    if (a)
+        a->known = 0;
+}
+
+// the firmware acknowledged a reset: the session ends and one starts at 0
+void analytics_close(int slot)
+{
+    analytics_slot* a = writable(slot);
+    if (!a)
+        return;
+    int64_t now = wall_ms();
+    write_begin(a);
+    advance(a, now);
+    a->last = a->current;
+    a->last.ended_ms = now;
+    a->last_unsaved = a->observed;
+    start_session(a, now);
+    write_end(a);
+    a->known = a->observed = 1;
+}
+
+// append the last closed session to the history, once; its final total
+// also goes on the totals file the plot is drawn from
+int analytics_save(int slot)
+{
+    analytics_slot* a = writable(slot);
+    if (!a || !a->last_unsaved)
+        return -1;
+    const analytics_session* s = &a->last;
+
+    FILE* f = fopen(sessions_path, "a");
+    if (!f) {
+        perror("Error: failed to open attendance sessions");
+        return -1;
+    }
+    if (ftell(f) == 0)
+        fprintf(f, "# started ended total peak peak_at entries exits occupancy_s\n");
+    fprintf(f, "%lld %lld %lld %lld %lld %lld %lld %lld\n", (long long)(s->started_ms / 1000), (long long)(s->ended_ms / 1000),
+        (long long)s->occupancy, (long long)s->peak, (long long)(s->peak_ms / 1000), (long long)s->entries, (long long)s->exits,
+        (long long)(s->occupancy_ms / 1000));
+    if (fclose(f) == EOF) {
+        perror("Error: failed to save attendance session");
+        return -1;
+    }
+
+    f = fopen(totals_path, "a");
+    if (!f || fprintf(f, "%lld\n", (long long)s->occupancy) < 0 || fclose(f) == EOF) {
+        perror("Error: failed to save attendance total");
+        return -1;
+    }
+    a->last_unsaved = 0;
+    return 0;
+}
+
+// move the rolling windows along while nothing changes; cheap enough to
+// call every time the device process wakes up
+void analytics_tick(void)
+{
+    int64_t now = wall_ms();
+    for (int i = 0; i < slot_count; i++) {
+        analytics_slot* a = &slots[i];
+        if (now / ANALYTICS_BUCKET_MS == a->epoch)
+            continue;
+        write_begin(a);
+        advance(a, now);
+        write_end(a);
+    }
+}
+
+static int64_t window(int64_t elapsed)
+{
+    int64_t full = (int64_t)ANALYTICS_BUCKET_MS * ANALYTICS_BUCKETS;
+    return elapsed < full ? elapsed : full;
+}
+
+// the open session, with the occupancy integral up to now
+int analytics_current(int slot, analytics_session* s)
+{
+    if (!slots || slot < 0 || slot >= slot_count || read_session(&slots[slot], &slots[slot].current, s) == -1)
+        return -1;
+    int64_t now = wall_ms();
+    if (now > s->updated_ms) {
+        s->occupancy_ms += s->occupancy * (now - s->updated_ms);
+        s->updated_ms = now;
+    }
+    s->window_ms = window(now - s->started_ms);
+    return 0;
+}
+
+// the session the last reset closed, -1 before there was one
+int analytics_last(int slot, analytics_session* s)
+{
+    if (!slots || slot < 0 || slot >= slot_count || read_session(&slots[slot], &slots[slot].last, s) == -1 || !s->started_ms)
+        return -1;
+    s->window_ms = window(s->ended_ms - s->started_ms);
+    return 0;
+}
+
+// "occupancy=12 peak=40 ..." with times in seconds since the epoch and
+// rates per minute over the rolling window
+int analytics_format(const analytics_session* s, char* buf, size_t len)
+{
+    int64_t end = s->ended_ms ? s->ended_ms : s->updated_ms;
+    int64_t duration = end - s->started_ms;
+    double mean = duration > 0 ? (double)s->occupancy_ms / duration : (double)s->occupancy;
+    double minutes = s->window_ms / 60000.0;
+    return snprintf(buf, len, "occupancy=%lld peak=%lld peak_at=%lld entries=%lld exits=%lld occupancy_s=%lld mean=%.1f"
+        " entries_per_min=%.1f exits_per_min=%.1f started=%lld",
+        (long long)s->occupancy, (long long)s->peak, (long long)(s->peak_ms / 1000), (long long)s->entries, (long long)s->exits,
+        (long long)(s->occupancy_ms / 1000), mean, minutes > 0 ? s->window_entries / minutes : 0.0,
+        minutes > 0 ? s->window_exits / minutes : 0.0, (long long)(s->started_ms / 1000));
+}
+
+// map the shared slots, one per device; call before the device process
+// and the handlers are forked
+int analytics_init(const char* root_dir, int count)
+{
+    if (snprintf(sessions_path, sizeof(sessions_path), "%s%s", root_dir, ANALYTICS_SESSIONS_FILE) >= (int)sizeof(sessions_path)
+        || snprintf(totals_path, sizeof(totals_path), "%s%s", root_dir, ANALYTICS_TOTALS_FILE) >= (int)sizeof(totals_path)) {
+        fprintf(stderr, "Error: server root %s is too long\n", root_dir);
+        return -1;
+    }
+    slots = mmap(NULL, sizeof(analytics_slot) * count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("Error: failed to map session analytics");
+        slots = NULL;
+        return -1;
+    }
+    slot_count = count;
+    int64_t now = wall_ms();
+    for (int i = 0; i < count; i++)
+        start_session(&slots[i], now);
+    return 0;
+}
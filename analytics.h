@@ -0,0 +1,45 @@
+#ifndef ANALYTICS_H
+#define ANALYTICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ANALYTICS_SESSIONS_FILE "static/attendance_sessions.txt" // one line per saved session
+#define ANALYTICS_TOTALS_FILE "static/attendance_data.txt" // only the final totals, what handle_plot.cgi plots
+#define ANALYTICS_BUCKET_MS 10000
+#define ANALYTICS_BUCKETS 30 // rolling rates cover the last five minutes
+#define ANALYTICS_LINE_MAX 192 // one session formatted as key=value pairs
+
+// One counting session, from a reset (or the server start) to the next
+// reset. Times are CLOCK_REALTIME milliseconds, since they are saved.
+typedef struct {
+    int64_t started_ms;
+    int64_t ended_ms; // 0 while the session is open
+    int64_t updated_ms; // occupancy_ms is integrated up to here
+    int64_t occupancy;
+    int64_t peak;
+    int64_t peak_ms;
+    int64_t entries;
+    int64_t exits;
+    int64_t occupancy_ms; // occupancy integrated over time, person-milliseconds
+    int64_t window_entries; // within the last window_ms
+    int64_t window_exits;
+    int64_t window_ms; // the rolling window, shorter early in a session
+} analytics_session;
+
+int analytics_init(const char* root_dir, int slots);
+
+// from the device process, the only writer
+void analytics_observe(int slot, int64_t occupancy);
+void analytics_set(int slot, int64_t occupancy);
+void analytics_lost(int slot);
+void analytics_close(int slot);
+int analytics_save(int slot);
+void analytics_tick(void);
+
+// from anywhere, O(1)
+int analytics_current(int slot, analytics_session* s);
+int analytics_last(int slot, analytics_session* s);
+int analytics_format(const analytics_session* s, char* buf, size_t len);
+
+#endif /* ANALYTICS_H */
@@ -0,0 +1,432 @@
+#include "archive.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A columnar archive of rows, each a timestamp and up to
+// ARCHIVE_COLUMNS_MAX integers, for the attendance history that otherwise
+// grows as text files. Rows are stored in blocks of ARCHIVE_BLOCK_ROWS,
+// every column of a block contiguous: timestamps as delta-of-delta, values
+// as deltas from the row before, both zigzag varints, so a total that
+// moves by one per row and a timestamp that ticks steadily take a byte
+// each. An index at the end keeps every block's offset, time range and
+// per-column min/max, and a scan skips the blocks those rule out without
+// touching their bytes. Everything is little-endian, fixed-size where a
+// reader needs to seek, so the file is read in place through mmap.
+//
+// header:  magic[8] columns:u32 block_rows:u32
+// block:   rows:u32 len[1 + columns]:u32, then the columns' bytes
+// index:   per block offset:u64 rows:u32 t_min:i64 t_max:i64 (min:i64 max:i64)[columns]
+// trailer: index_offset:u64 blocks:u32 columns:u32 magic[8]
+
+#define ZONE_LEN(columns) (8 + 4 + 16 + 16 * (size_t)(columns))
+#define VARINT_MAX 10
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const uint8_t* p)
+{
+    return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static uint8_t* put_varint(uint8_t* p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// NULL when the varint runs past end
+static const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, uint64_t* v)
+{
+    if (p < end && *p < 0x80) { // the common case: a delta under 64 either way
+        *v = *p;
+        return p + 1;
+    }
+    uint64_t x = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (b < 0x80) {
+            *v = x;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int write_all(archive_writer* w, const void* buf, size_t len)
+{
+    if (fwrite(buf, 1, len, w->f) != len) {
+        perror("Error: failed to write archive");
+        return -1;
+    }
+    w->offset += len;
+    return 0;
+}
+
+int archive_create(archive_writer* w, const char* path, int columns)
+{
+    memset(w, 0, sizeof(*w));
+    if (columns < 1 || columns > ARCHIVE_COLUMNS_MAX) {
+        fprintf(stderr, "Error: an archive holds 1 to %d columns\n", ARCHIVE_COLUMNS_MAX);
+        return -1;
+    }
+    w->f = fopen(path, "wb");
+    if (!w->f) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    w->columns = columns;
+
+    uint8_t header[ARCHIVE_HEADER_LEN];
+    memcpy(header, ARCHIVE_MAGIC, 8);
+    put_u32(header + 8, columns);
+    put_u32(header + 12, ARCHIVE_BLOCK_ROWS);
+    if (write_all(w, header, sizeof(header)) == -1) {
+        fclose(w->f);
+        w->f = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// encode the buffered rows as one block and note its zone map
+static int flush_block(archive_writer* w)
+{
+    if (!w->rows)
+        return 0;
+    if (w->blocks == w->zones_cap) {
+        w->zones_cap = w->zones_cap ? w->zones_cap * 2 : 64;
+        archive_zone* zones = realloc(w->zones, w->zones_cap * sizeof(archive_zone));
+        if (!zones) {
+            perror("Error: failed to grow archive index");
+            return -1;
+        }
+        w->zones = zones;
+    }
+
+    archive_zone* z = &w->zones[w->blocks];
+    z->offset = w->offset;
+    z->rows = w->rows;
+    z->t_min = z->t_max = w->t[0];
+    for (uint32_t i = 1; i < w->rows; i++) {
+        if (w->t[i] < z->t_min)
+            z->t_min = w->t[i];
+        if (w->t[i] > z->t_max)
+            z->t_max = w->t[i];
+    }
+
+    size_t head_len = 4 + 4 * (1 + w->columns);
+    uint8_t* block = malloc(head_len + (size_t)w->rows * (1 + w->columns) * VARINT_MAX);
+    if (!block) {
+        perror("Error: failed to encode archive block");
+        return -1;
+    }
+    put_u32(block, w->rows);
+    uint8_t* p = block + head_len;
+
+    uint8_t* start = p;
+    int64_t delta = 0;
+    for (uint32_t i = 0; i < w->rows; i++) {
+        if (i == 0) {
+            p = put_varint(p, zigzag(w->t[0]));
+        } else {
+            int64_t d = w->t[i] - w->t[i - 1];
+            p = put_varint(p, zigzag(d - delta));
+            delta = d;
+        }
+    }
+    put_u32(block + 4, p - start);
+
+    for (int c = 0; c < w->columns; c++) {
+        const int64_t* v = w->v[c];
+        start = p;
+        z->min[c] = z->max[c] = v[0];
+        p = put_varint(p, zigzag(v[0]));
+        for (uint32_t i = 1; i < w->rows; i++) {
+            p = put_varint(p, zigzag(v[i] - v[i - 1]));
+            if (v[i] < z->min[c])
+                z->min[c] = v[i];
+            if (v[i] > z->max[c])
+                z->max[c] = v[i];
+        }
+        put_u32(block + 8 + 4 * c, p - start);
+    }
+
+    int r = write_all(w, block, p - block);
+    free(block);
+    if (r == -1)
+        return -1;
+    w->blocks++;
+    w->rows = 0;
+    return 0;
+}
+
+int archive_append(archive_writer* w, int64_t t, const int64_t* values)
+{
+    w->t[w->rows] = t;
+    for (int c = 0; c < w->columns; c++)
+        w->v[c][w->rows] = values[c];
+    if (++w->rows == ARCHIVE_BLOCK_ROWS)
+        return flush_block(w);
+    return 0;
+}
+
+// write the last block, the index and the trailer, and close the file
+int archive_finish(archive_writer* w)
+{
+    int r = flush_block(w);
+    uint64_t index_offset = w->offset;
+    uint8_t zone[ZONE_LEN(ARCHIVE_COLUMNS_MAX)];
+    for (uint32_t b = 0; r == 0 && b < w->blocks; b++) {
+        const archive_zone* z = &w->zones[b];
+        put_u64(zone, z->offset);
+        put_u32(zone + 8, z->rows);
+        put_u64(zone + 12, z->t_min);
+        put_u64(zone + 20, z->t_max);
+        for (int c = 0; c < w->columns; c++) {
+            put_u64(zone + 28 + 16 * c, z->min[c]);
+            put_u64(zone + 36 + 16 * c, z->max[c]);
+        }
+        r = write_all(w, zone, ZONE_LEN(w->columns));
+    }
+
+    uint8_t trailer[ARCHIVE_TRAILER_LEN];
+    put_u64(trailer, index_offset);
+    put_u32(trailer + 8, w->blocks);
+    put_u32(trailer + 12, w->columns);
+    memcpy(trailer + 16, ARCHIVE_MAGIC, 8);
+    if (r == 0)
+        r = write_all(w, trailer, sizeof(trailer));
+    if (fclose(w->f) == EOF && r == 0) {
+        perror("Error: failed to close archive");
+        r = -1;
+    }
+    w->f = NULL;
+    free(w->zones);
+    w->zones = NULL;
+    return r;
+}
+
+// map an archive and read its index; -1 if it isn't one or is cut short
+int archive_open(archive_reader* r, const char* path)
+{
+    memset(r, 0, sizeof(*r));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < ARCHIVE_HEADER_LEN + ARCHIVE_TRAILER_LEN) {
+        fprintf(stderr, "Error: %s is not an archive\n", path);
+        close(fd);
+        return -1;
+    }
+    r->len = st.st_size;
+    r->base = mmap(NULL, r->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r->base == MAP_FAILED) {
+        perror("Error: failed to map archive");
+        r->base = NULL;
+        return -1;
+    }
+    madvise((void*)r->base, r->len, MADV_SEQUENTIAL);
+
+    const uint8_t* trailer = r->base + r->len - ARCHIVE_TRAILER_LEN;
+    uint64_t index_offset = get_u64(trailer);
+    r->blocks = get_u32(trailer + 8);
+    r->columns = get_u32(trailer + 12);
+    if (memcmp(r->base, ARCHIVE_MAGIC, 8) != 0 || memcmp(trailer + 16, ARCHIVE_MAGIC, 8) != 0
+        || r->columns < 1 || r->columns > ARCHIVE_COLUMNS_MAX || (int)get_u32(r->base + 8) != r->columns
+        || index_offset < ARCHIVE_HEADER_LEN || index_offset + (uint64_t)r->blocks * ZONE_LEN(r->columns) != r->len - ARCHIVE_TRAILER_LEN) {
+        fprintf(stderr, "Error: %s is not an archive\n", path);
+        archive_close(r);
+        return -1;
+    }
+
+    r->zones = malloc(sizeof(archive_zone) * (r->blocks ? r->blocks : 1));
+    if (!r->zones) {
+        perror("Error: failed to read archive index");
+        archive_close(r);
+        return -1;
+    }
+    const uint8_t* p = r->base + index_offset;
+    for (uint32_t b = 0; b < r->blocks; b++, p += ZONE_LEN(r->columns)) {
+        archive_zone* z = &r->zones[b];
+        z->offset = get_u64(p);
+        z->rows = get_u32(p + 8);
+        z->t_min = get_u64(p + 12);
+        z->t_max = get_u64(p + 20);
+        for (int c = 0; c < r->columns; c++) {
+            z->min[c] = get_u64(p + 28 + 16 * c);
+            z->max[c] = get_u64(p + 36 + 16 * c);
+        }
+        if (z->offset < ARCHIVE_HEADER_LEN || z->offset + 8 + 4 * r->columns > index_offset || !z->rows || z->rows > ARCHIVE_BLOCK_ROWS) {
+            fprintf(stderr, "Error: %s has a damaged index\n", path);
+            archive_close(r);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void archive_close(archive_reader* r)
+{
+    if (r->base)
+        munmap((void*)r->base, r->len);
+    free(r->zones);
+    memset(r, 0, sizeof(*r));
+}
+
+void archive_cursor_init(archive_cursor* c, const archive_reader* r, int64_t from, int64_t to)
+{
+    c->r = r;
+    c->from = from;
+    c->to = to;
+    c->where = -1;
+    c->block = c->rows = c->row = 0;
+}
+
+// also skip rows whose value in column is outside [min, max]
+void archive_cursor_where(archive_cursor* c, int column, int64_t min, int64_t max)
+{
+    c->where = column;
+    c->where_min = min;
+    c->where_max = max;
+}
+
+static int decode_block(archive_cursor* c, const archive_zone* z)
+{
+    const archive_reader* r = c->r;
+    const uint8_t* block = r->base + z->offset;
+    const uint8_t* limit = r->base + r->len - ARCHIVE_TRAILER_LEN;
+    if (get_u32(block) != z->rows)
+        return -1;
+    const uint8_t* p = block + 4 + 4 * (1 + r->columns);
+    uint32_t rows = z->rows;
+
+    const uint8_t* end = p + get_u32(block + 4);
+    if (end > limit)
+        return -1;
+    uint64_t u;
+    int64_t t = 0, delta = 0;
+    for (uint32_t i = 0; i < rows; i++) {
+        if (!(p = get_varint(p, end, &u)))
+            return -1;
+        if (i == 0) {
+            t = unzigzag(u);
+        } else {
+            delta += unzigzag(u);
+            t += delta;
+        }
+        c->t[i] = t;
+    }
+
+    for (int col = 0; col < r->columns; col++) {
+        p = end;
+        end = p + get_u32(block + 8 + 4 * col);
+        if (end > limit)
+            return -1;
+        int64_t* v = c->v[col];
+        int64_t x = 0;
+        for (uint32_t i = 0; i < rows; i++) {
+            if (!(p = get_varint(p, end, &u)))
+                return -1;
+            x += unzigzag(u);
+            v[i] = x;
+        }
+    }
+    return rows;
+}
+
+// decode the next block with rows in bounds into c->t and c->v, dropping
+// the rest; returns how many rows it kept, 0 at the end, -1 if the
+// archive is damaged
+int archive_next_block(archive_cursor* c)
+{
+    const archive_reader* r = c->r;
+    while (c->block < r->blocks) {
+        const archive_zone* z = &r->zones[c->block++];
+        if (z->t_max < c->from || z->t_min > c->to)
+            continue;
+        if (c->where != -1 && (z->max[c->where] < c->where_min || z->min[c->where] > c->where_max))
+            continue;
+        int rows = decode_block(c, z);
+        if (rows == -1)
+            return -1;
+
+        // only a block the bounds cut through is filtered row by row
+        int inside = z->t_min >= c->from && z->t_max <= c->to
+            && (c->where == -1 || (z->min[c->where] >= c->where_min && z->max[c->where] <= c->where_max));
+        if (!inside) {
+            int kept = 0;
+            for (int i = 0; i < rows; i++) {
+                if (c->t[i] < c->from || c->t[i] > c->to
+                    || (c->where != -1 && (c->v[c->where][i] < c->where_min || c->v[c->where][i] > c->where_max)))
+                    continue;
+                c->t[kept] = c->t[i];
+                for (int col = 0; col < r->columns; col++)
+                    c->v[col][kept] = c->v[col][i];
+                kept++;
+            }
+            rows = kept;
+        }
+        if (rows) {
+            c->rows = rows;
+            c->row = 0;
+            return rows;
+        }
+    }
+    c->rows = c->row = 0;
+    return 0;
+}
+
+// one row at a time on top of archive_next_block: 1 with a row, 0 at the
+// end, -1 if the archive is damaged
+int archive_next(archive_cursor* c, int64_t* t, int64_t* values)
+{
+    if (c->row == c->rows) {
+        int rows = archive_next_block(c);
+        if (rows <= 0)
+            return rows;
+    }
+    *t = c->t[c->row];
+    for (int col = 0; col < c->r->columns; col++)
+        values[col] = c->v[col][c->row];
+    c->row++;
+    return 1;
+}
@@ -0,0 +1,74 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ARCHIVE_MAGIC "WSARCHV1"
+#define ARCHIVE_COLUMNS_MAX 8 // values per row, besides the timestamp
+#define ARCHIVE_BLOCK_ROWS 4096 // rows per block, the unit zone maps skip
+#define ARCHIVE_HEADER_LEN 16 // magic, columns, rows per block
+#define ARCHIVE_TRAILER_LEN 24 // index offset, block count, columns, magic
+
+// What the index keeps per block, so a scan can tell without decoding
+// whether the block can hold rows it wants
+typedef struct {
+    uint64_t offset; // of the block in the file
+    uint32_t rows;
+    int64_t t_min;
+    int64_t t_max;
+    int64_t min[ARCHIVE_COLUMNS_MAX];
+    int64_t max[ARCHIVE_COLUMNS_MAX];
+} archive_zone;
+
+// rows are buffered until a block is full, then encoded and written
+typedef struct {
+    FILE* f;
+    int columns;
+    uint32_t rows;
+    int64_t t[ARCHIVE_BLOCK_ROWS];
+    int64_t v[ARCHIVE_COLUMNS_MAX][ARCHIVE_BLOCK_ROWS];
+    archive_zone* zones;
+    uint32_t blocks;
+    uint32_t zones_cap;
+    uint64_t offset;
+} archive_writer;
+
+// a mapped archive; the index is decoded once at open
+typedef struct {
+    const uint8_t* base;
+    size_t len;
+    int columns;
+    uint32_t blocks;
+    archive_zone* zones;
+} archive_reader;
+
+// streaming decode: one block is expanded into the arrays at a time,
+// rows outside [from, to] or the column bounds are skipped
+typedef struct {
+    const archive_reader* r;
+    int64_t from;
+    int64_t to;
+    int where; // column the bounds apply to, -1 for none
+    int64_t where_min;
+    int64_t where_max;
+    uint32_t block; // next block to look at
+    uint32_t rows; // decoded in the arrays
+    uint32_t row; // next one to hand out
+    int64_t t[ARCHIVE_BLOCK_ROWS];
+    int64_t v[ARCHIVE_COLUMNS_MAX][ARCHIVE_BLOCK_ROWS];
+} archive_cursor;
+
+int archive_create(archive_writer* w, const char* path, int columns);
+int archive_append(archive_writer* w, int64_t t, const int64_t* values);
+int archive_finish(archive_writer* w);
+
+int archive_open(archive_reader* r, const char* path);
+void archive_close(archive_reader* r);
+void archive_cursor_init(archive_cursor* c, const archive_reader* r, int64_t from, int64_t to);
+void archive_cursor_where(archive_cursor* c, int column, int64_t min, int64_t max);
+int archive_next_block(archive_cursor* c);
+int archive_next(archive_cursor* c, int64_t* t, int64_t* values);
+
+#endif /* ARCHIVE_H */
@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+
+#include "archive.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Converts the attendance text files into archives and reads them back.
+//
+//   archive_tool live [-d YYYY-MM-DD] live_data.txt live_time.txt out
+//       one row per live reading: unix time, total. live_time.txt only has
+//       the time of day, the date is -d or the day the file was last
+//       written, counted back over any midnight the session ran past
+//   archive_tool sessions attendance_sessions.txt out
+//       one row per saved session: started, then ended total peak peak_at
+//       entries exits occupancy_s
+//   archive_tool totals attendance_data.txt out
+//       one row per saved total, the session number as its time
+//   archive_tool cat [-f from] [-t to] [-c column -m min -M max] archive...
+//       the rows as text, "time value...", skipping what the bounds rule out
+//   archive_tool info archive...
+//       rows, blocks and size, and every block's zone map
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: archive_tool live [-d YYYY-MM-DD] live_data.txt live_time.txt out\n"
+                    "       archive_tool sessions attendance_sessions.txt out\n"
+                    "       archive_tool totals attendance_data.txt out\n"
+                    "       archive_tool cat [-f from] [-t to] [-c column -m min -M max] archive...\n"
+                    "       archive_tool info archive...\n");
+    exit(EXIT_FAILURE);
+}
+
+static FILE* open_text(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+        fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+    return f;
+}
+
+static int convert_live(int argc, char** argv)
+{
+    const char* date = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        if (opt != 'd')
+            usage();
+        date = optarg;
+    }
+    if (argc - optind != 3)
+        usage();
+    const char *data_path = argv[optind], *time_path = argv[optind + 1];
+
+    // the day the session ended, at midnight local time
+    struct tm day = { 0 };
+    if (date) {
+        if (!strptime(date, "%Y-%m-%d", &day)) {
+            fprintf(stderr, "Error: invalid date %s\n", date);
+            return -1;
+        }
+    } else {
+        struct stat st;
+        if (stat(time_path, &st) == -1) {
+            fprintf(stderr, "Error: cannot stat %s: %s\n", time_path, strerror(errno));
+            return -1;
+        }
+        localtime_r(&st.st_mtime, &day);
+        day.tm_hour = day.tm_min = day.tm_sec = 0;
+    }
+    day.tm_isdst = -1;
+
+    FILE* data = open_text(data_path);
+    FILE* times = data ? open_text(time_path) : NULL;
+    if (!times) {
+        if (data)
+            fclose(data);
+        return -1;
+    }
+
+    // seconds into the session's first day; a time earlier than the one
+    // before it means the session ran past midnight
+    size_t len = 0, cap = 0;
+    int64_t *secs = NULL, *totals = NULL;
+    int days = 0, prev = -1;
+    char line[64], time_line[64];
+    while (fgets(line, sizeof(line), data) && fgets(time_line, sizeof(time_line), times)) {
+        int h, m, s;
+        if (sscanf(time_line, "%d:%d:%d", &h, &m, &s) != 3)
+            continue;
+        int sec = h * 3600 + m * 60 + s;
+        if (prev != -1 && sec < prev)
+            days++;
+        prev = sec;
+        if (len == cap) {
+            cap = cap ? cap * 2 : 4096;
+            secs = realloc(secs, cap * sizeof(int64_t));
+            totals = realloc(totals, cap * sizeof(int64_t));
+            if (!secs || !totals) {
+                perror("Error: failed to read live data");
+                exit(EXIT_FAILURE);
+            }
+        }
+        secs[len] = (int64_t)days * 86400 + sec;
+        totals[len++] = strtoll(line, NULL, 10);
+    }
+    fclose(data);
+    fclose(times);
+
+    if (!date)
+        day.tm_mday -= days;
+    int64_t midnight = mktime(&day);
+
+    archive_writer* w = malloc(sizeof(archive_writer));
+    int r = w ? archive_create(w, argv[optind + 2], 1) : -1;
+    for (size_t i = 0; r == 0 && i < len; i++)
+        r = archive_append(w, midnight + secs[i], &totals[i]);
+    if (w && w->f && archive_finish(w) == -1)
+        r = -1;
+    free(w);
+    free(secs);
+    free(totals);
+    if (r == 0)
+        printf("%zu readings\n", len);
+    return r;
+}
+
+// rows of whitespace-separated integers, '#' lines skipped; the first
+// field is the time unless numbered is set, then it's the row number
+static int convert_rows(const char* in, const char* out, int columns, int numbered)
+{
+    FILE* f = open_text(in);
+    if (!f)
+        return -1;
+    archive_writer* w = malloc(sizeof(archive_writer));
+    if (!w || archive_create(w, out, columns) == -1) {
+        free(w);
+        fclose(f);
+        return -1;
+    }
+
+    char line[512];
+    long rows = 0, lineno = 0;
+    int r = 0;
+    while (r == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        int64_t fields[ARCHIVE_COLUMNS_MAX + 1];
+        int n = 0;
+        char *p = line, *end;
+        if (numbered)
+            fields[n++] = rows + 1;
+        while (n <= columns) {
+            fields[n] = strtoll(p, &end, 10);
+            if (end == p)
+                break;
+            n++;
+            p = end;
+        }
+        if (n != columns + 1) {
+            fprintf(stderr, "Error: %s:%ld: expected %d numbers\n", in, lineno, columns + !numbered);
+            r = -1;
+            break;
+        }
+        r = archive_append(w, fields[0], fields + 1);
+        rows++;
+    }
+    fclose(f);
+    if (archive_finish(w) == -1)
+        r = -1;
+    free(w);
+    if (r == 0)
+        printf("%ld rows\n", rows);
+    return r;
+}
+
+static int cat(int argc, char** argv)
+{
+    int64_t from = INT64_MIN, to = INT64_MAX, min = INT64_MIN, max = INT64_MAX;
+    int column = -1, opt;
+    while ((opt = getopt(argc, argv, "f:t:c:m:M:")) != -1) {
+        switch (opt) {
+        case 'f':
+            from = strtoll(optarg, NULL, 10);
+            break;
+        case 't':
+            to = strtoll(optarg, NULL, 10);
+            break;
+        case 'c':
+            column = atoi(optarg);
+            break;
+        case 'm':
+            min = strtoll(optarg, NULL, 10);
+            break;
+        case 'M':
+            max = strtoll(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind == argc)
+        usage();
+
+    archive_cursor* c = malloc(sizeof(archive_cursor));
+    if (!c) {
+        perror("Error: failed to allocate cursor");
+        return -1;
+    }
+    int r = 0;
+    for (int i = optind; r == 0 && i < argc; i++) {
+        archive_reader reader;
+        if (archive_open(&reader, argv[i]) == -1) {
+            r = -1;
+            break;
+        }
+        archive_cursor_init(c, &reader, from, to);
+        if (column >= 0 && column < reader.columns)
+            archive_cursor_where(c, column, min, max);
+        int rows;
+        while ((rows = archive_next_block(c)) > 0) {
+            for (int row = 0; row < rows; row++) {
+                printf("%lld", (long long)c->t[row]);
+                for (int col = 0; col < reader.columns; col++)
+                    printf(" %lld", (long long)c->v[col][row]);
+                putchar('\n');
+            }
+        }
+        if (rows == -1) {
+            fprintf(stderr, "Error: %s is damaged\n", argv[i]);
+            r = -1;
+        }
+        archive_close(&reader);
+    }
+    free(c);
+    return r;
+}
+
+static int info(int argc, char** argv)
+{
+    if (argc < 2)
+        usage();
+    for (int i = 1; i < argc; i++) {
+        archive_reader r;
+        if (archive_open(&r, argv[i]) == -1)
+            return -1;
+        uint64_t rows = 0;
+        for (uint32_t b = 0; b < r.blocks; b++)
+            rows += r.zones[b].rows;
+        printf("%s: %llu rows, %u blocks, %d columns, %zu bytes, %.2f bytes per row\n", argv[i], (unsigned long long)rows, r.blocks,
+            r.columns, r.len, rows ? (double)r.len / rows : 0.0);
+        for (uint32_t b = 0; b < r.blocks; b++) {
+            const archive_zone* z = &r.zones[b];
+            printf("  block %u at %llu: %u rows, time %lld..%lld", b, (unsigned long long)z->offset, z->rows, (long long)z->t_min,
+                (long long)z->t_max);
+            for (int c = 0; c < r.columns; c++)
+                printf(", column %d %lld..%lld", c, (long long)z->min[c], (long long)z->max[c]);
+            putchar('\n');
+        }
+        archive_close(&r);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+        usage();
+    const char* command = argv[1];
+    argc--;
+    argv++;
+
+    int r;
+    if (strcmp(command, "live") == 0)
+        r = convert_live(argc, argv);
+    else if (strcmp(command, "sessions") == 0 && argc == 3)
+        r = convert_rows(argv[1], argv[2], 7, 0);
+    else if (strcmp(command, "totals") == 0 && argc == 3)
+        r = convert_rows(argv[1], argv[2], 1, 1);
+    else if (strcmp(command, "cat") == 0)
+        r = cat(argc, argv);
+    else if (strcmp(command, "info") == 0)
+        r = info(argc, argv);
+    else
+        usage();
+    return r == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,132 @@
+#include "crossing.h"
+#include <string.h>
+
+// Detection works on debounced blockages of the two sensors. A blockage
+// that starts while nobody waits on the other sensor is pending: someone
+// approaching from that side. The other sensor blocking next completes
+// the oldest pending crossing. A follower who reaches the first sensor
+// while the leader still holds the second never makes the second block
+// anew, so a pending blockage that ends while the other sensor is held by
+// a crossing in the same direction completes as well. People not seen
+// again within timeout_ms turned back before the door. Someone who turns
+// back in the door clears the far sensor before the near one; their
+// crossing is retracted once the near one clears too. Nothing here waits:
+// time only moves with the timestamps passed in, so the sketch and the
+// replay tool drive it the same way.
+
+static const crossing_config defaults = {
+    CROSSING_RANGE_CM, CROSSING_DEBOUNCE_MS, CROSSING_RELEASE_MS, CROSSING_TIMEOUT_MS
+};
+
+void crossing_init(crossing_detector* d, const crossing_config* config)
+{
+    memset(d, 0, sizeof(*d));
+    d->config = config ? *config : defaults;
+}
+
+static void pending_push(crossing_sensor* s, uint32_t at)
+{
+    if (s->pending == CROSSING_PENDING_MAX) { // the oldest is the likeliest to have turned back
+        memmove(s->pending_ms, s->pending_ms + 1, sizeof(s->pending_ms[0]) * (CROSSING_PENDING_MAX - 1));
+        s->pending--;
+    }
+    s->pending_ms[s->pending++] = at;
+}
+
+// drop the oldest pending person; with none left, the current blockage
+// was it
+static void pending_pop(crossing_sensor* s)
+{
+    memmove(s->pending_ms, s->pending_ms + 1, sizeof(s->pending_ms[0]) * (s->pending - 1));
+    if (--s->pending == 0)
+        s->waiting = 0;
+}
+
+static int emit(crossing_event* events, int n, crossing_side to, int retract, uint32_t at)
+{
+    if (n == CROSSING_EVENTS_MAX)
+        return n;
+    events[n].direction = to == CROSSING_INSIDE ? CROSSING_ENTER : CROSSING_EXIT;
+    events[n].retract = retract;
+    events[n].at_ms = at;
+    return n + 1;
+}
+
+static int block(crossing_detector* d, crossing_side x, uint32_t at, crossing_event* events, int n)
+{
+    crossing_sensor* s = &d->sensor[x];
+    crossing_sensor* o = &d->sensor[!x];
+    s->blocked = 1;
+    s->near = s->far = s->waiting = s->turned = 0;
+    o->turned = 0; // back at the far sensor, so not turning around after all
+
+    if (!o->pending) {
+        pending_push(s, at);
+        s->waiting = 1;
+        return n;
+    }
+    int leader = o->waiting && o->pending == 1; // the person still on the other sensor
+    pending_pop(o);
+    o->near = leader;
+    s->far = 1;
+    return emit(events, n, x, 0, at);
+}
+
+static int release(crossing_detector* d, crossing_side x, uint32_t at, crossing_event* events, int n)
+{
+    crossing_sensor* s = &d->sensor[x];
+    crossing_sensor* o = &d->sensor[!x];
+    s->blocked = 0;
+
+    if (s->waiting) {
+        s->waiting = 0;
+        s->pending_ms[s->pending - 1] = at;
+        if (o->blocked && o->far) { // a follower, the leader still holds the other sensor
+            pending_pop(s);
+            n = emit(events, n, (crossing_side)!x, 0, at);
+        }
+    }
+    if (s->far && o->blocked && o->near)
+        o->turned = 1;
+    if (s->near && s->turned && !o->blocked)
+        n = emit(events, n, (crossing_side)!x, 1, at);
+    s->near = s->far = s->turned = 0;
+    return n;
+}
+
+// feed one reading of both sensors (cm, 0 when there was no echo) taken at
+// now_ms; fills events with the crossings it completed, returns how many
+int crossing_sample(crossing_detector* d, uint32_t now_ms, int cm_outside, int cm_inside, crossing_event* events)
+{
+    const crossing_config* c = &d->config;
+    int cm[2] = { cm_outside, cm_inside };
+    int due[2];
+    for (int i = 0; i < 2; i++) {
+        crossing_sensor* s = &d->sensor[i];
+        uint8_t raw = cm[i] > 0 && cm[i] <= c->range_cm;
+        if (raw != s->raw) {
+            s->raw = raw;
+            s->raw_since = now_ms;
+        }
+        due[i] = s->raw != s->blocked && now_ms - s->raw_since >= (s->raw ? c->debounce_ms : c->release_ms);
+    }
+
+    // in the order the readings changed, so the direction comes out right
+    int n = 0;
+    int first = due[0] && due[1] && (int32_t)(d->sensor[1].raw_since - d->sensor[0].raw_since) < 0;
+    for (int k = 0; k < 2; k++) {
+        crossing_side x = (crossing_side)(first ^ k);
+        crossing_sensor* s = &d->sensor[x];
+        if (!due[x])
+            continue;
+        n = s->raw ? block(d, x, s->raw_since, events, n) : release(d, x, s->raw_since, events, n);
+    }
+
+    // forget people who never reached the other sensor
+    for (int i = 0; i < 2; i++) {
+        crossing_sensor* s = &d->sensor[i];
+        while (s->pending && !(s->waiting && s->pending == 1) && now_ms - s->pending_ms[0] > c->timeout_ms)
+            pending_pop(s);
+    }
+    return n;
+}
@@ -0,0 +1,67 @@
+#ifndef CROSSING_H
+#define CROSSING_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CROSSING_PENDING_MAX 4 // people seen by one sensor and not yet by the other
+#define CROSSING_EVENTS_MAX 4 // crossings one sample can complete or retract
+#define CROSSING_RANGE_CM 35
+#define CROSSING_DEBOUNCE_MS 40 // a sensor must read blocked this long to count as blocked
+#define CROSSING_RELEASE_MS 80 // and clear this long to count as clear, bridging a dropped echo
+#define CROSSING_TIMEOUT_MS 750 // a person seen by one sensor has this long to reach the other
+
+typedef enum {
+    CROSSING_OUTSIDE, // the sensor on the hallway side of the door
+    CROSSING_INSIDE
+} crossing_side;
+
+typedef enum {
+    CROSSING_ENTER,
+    CROSSING_EXIT
+} crossing_direction;
+
+typedef struct {
+    int16_t range_cm; // a reading at or under this distance blocks a sensor, 0 means no echo
+    uint16_t debounce_ms;
+    uint16_t release_ms;
+    uint16_t timeout_ms;
+} crossing_config;
+
+// one sensor's debounced state and the people waiting on it
+typedef struct {
+    uint8_t raw; // the last reading, before debouncing
+    uint8_t blocked;
+    uint8_t near; // this blockage started a crossing the other sensor completed
+    uint8_t far; // this blockage completed a crossing from the other sensor
+    uint8_t waiting; // this blockage is the newest of the pending ones
+    uint8_t turned; // the far side cleared first: a turn back if this one clears alone
+    uint8_t pending;
+    uint32_t raw_since; // when the raw reading last changed
+    uint32_t pending_ms[CROSSING_PENDING_MAX]; // when each pending person was last seen, oldest first
+} crossing_sensor;
+
+typedef struct {
+    crossing_config config;
+    crossing_sensor sensor[2];
+} crossing_detector;
+
+// a crossing, or with retract set, the take-back of one counted before
+// the person turned around
+typedef struct {
+    uint8_t direction;
+    uint8_t retract;
+    uint32_t at_ms;
+} crossing_event;
+
+void crossing_init(crossing_detector* d, const crossing_config* config);
+int crossing_sample(crossing_detector* d, uint32_t now_ms, int cm_outside, int cm_inside, crossing_event* events);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CROSSING_H */
@@ -1,9 +1,8 @@
-#include <assert.h>
 #include <TM1637Display.h>
+#include "crossing.h"
 
-#define __ASSERT_USE_STDERR
-#define TRIG1 13
-#define TRIG2 4
+#define TRIG1 13 // sensor 1 faces the hallway
+#define TRIG2 4 // sensor 2 faces the room
 #define ECHO1 12
 #define ECHO2 2
 #define CLK 7
@@ -11,14 +10,28 @@
 #define BUZZER 5
 #define NOTE1 2489
 #define NOTE2 311
+#define COMMAND_MAX 48 // longest line from the server, "@<id> config <range> <delay> <total>"
+#define ACK_TONE_MS 150
+#define COUNT_TONE_MS 100
+#define ECHO_TIMEOUT_US 25000 // about 4m there and back, anything further reads as no echo
+#define SAMPLE_MS 20 // between readings, so one sensor's echo dies down before the next ping
+#define PRINT_MS 250 // the total is printed when it changes and at least this often
 
-bool entering, exiting, enter_sensed, exit_sensed, first_iter = true; // initialize indicators to be ready for first person to enter room
-int range_val = 35, delay_val = 750, total = 0; // initialize defaults
+bool first_iter = true, tracing = false;
+int total = 0;
 long cm1, cm2;
+unsigned long last_sample = 0, last_print = 0;
+
+crossing_detector detector; // range and delay from the server end up in its config
 
 TM1637Display display(CLK, DIO);
 const uint8_t done_count[] = {0x40, 0x40, 0x40, 0x40};
 
+char command[COMMAND_MAX + 1]; // the command line received so far
+int command_len = 0;
+bool command_overflow = false;
+long last_id = 0; // id of the last command applied, a resend of it is only acknowledged again
+
 void setup() {
   // initialize serial communication:
   Serial.begin(9600);
@@ -27,7 +40,7 @@ void setup() {
   pinMode(TRIG2, OUTPUT); // for sensor 2
   pinMode(ECHO2, INPUT);
   pinMode(BUZZER, OUTPUT);
-  entering = exiting = false;
+  crossing_init(&detector, NULL);
 }
 
 long ultrasonic_sensor (int trig, int echo) {
@@ -38,8 +51,8 @@ long ultrasonic_sensor (int trig, int echo) {
   delayMicroseconds(10);
   digitalWrite(trig, LOW);
 
-  // get the duration and convert microseconds to cm, and return that distance
-  long duration = pulseIn(echo, HIGH);
+  // get the duration and convert microseconds to cm, and return that distance; 0 when nothing echoed
+  long duration = pulseIn(echo, HIGH, ECHO_TIMEOUT_US);
   long cm = microsecondsToCentimeters(duration);
   return cm;
 }
@@ -59,67 +72,108 @@ void loop() {
     tone(BUZZER, NOTE2);
     delay(1000);
     noTone(BUZZER);
+    display.showNumberDec(total); // from here on only redrawn when it changes
   }
 
-  if  (Serial.available() > 0) { // if signal sent from server
-    String comm = Serial.readString();
-    if (comm.equals("reset")) // case 1: arduino needs to reset its counter
-      total = 0;
-    else { // case 2: config data received     
-      int index1 = comm.indexOf('%'); // get index of first separator
-      int index2 = comm.lastIndexOf('%'); // get index of last separator
-      assert(index1 >= 0 && index2 >= 0); // make sure that the parsing didn't fail
-      int r = comm.substring(0, index1).toInt(); // extract range value
-      int d = comm.substring(index1 + 1, index2).toInt(); // extract delay value
-      int t = comm.substring(index2 + 1).toInt(); // extract total value
-      range_val = r;
-      delay_val = d;
-      total = t;
-    }
-    display.setSegments(done_count);
-    tone(BUZZER, NOTE2);
-    delay(1000);
-    noTone(BUZZER);
-  }  
+  poll_commands(); // take commands from the server without waiting for them
 
-  display.showNumberDec(total); // display the current total on 7 segment display
+  unsigned long now = millis();
+  if (now - last_sample < SAMPLE_MS)
+    return;
+  last_sample = now;
 
   // get the distances sensed from both sensors
   cm1 = ultrasonic_sensor(TRIG1, ECHO1);
   cm2 = ultrasonic_sensor(TRIG2, ECHO2);
+  if (tracing) { // raw readings for bench/crossing_replay
+    Serial.print("t ");
+    Serial.print(now);
+    Serial.print(' ');
+    Serial.print(cm1);
+    Serial.print(' ');
+    Serial.println(cm2);
+  }
 
-  // see if enter or exit was sensed
-  enter_sensed = cm1 <= range_val ? true : false;
-  exit_sensed = cm2 <= range_val ? true : false;
-
-  if (!entering && !exiting) { // there is no current pending enter/exit, so create new pending enter/exit based on which was sensed
-    if (enter_sensed && !exit_sensed)
-      entering = true; 
-    else if (exit_sensed && !enter_sensed)
-      exiting = true;
-  } else { // there is a pending enter/exit, so handle the followup on it
-    assert(!(entering && exiting)); // make sure that configuration didn't get messed up
-    if (entering && exit_sensed) { // someone entered the room, increment total
+  // the detector decides who crossed; it never waits, so commands keep being taken meanwhile
+  crossing_event events[CROSSING_EVENTS_MAX];
+  int n = crossing_sample(&detector, now, cm1, cm2, events);
+  for (int i = 0; i < n; i++) {
+    bool entered = events[i].direction == CROSSING_ENTER;
+    if (entered != (bool)events[i].retract) // someone entered, or someone counted leaving turned back
       total++;
-      entering = false;
-      display.showNumberDec(total); // display the current total on 7 segment display
-      Serial.println(total);
-      tone(BUZZER, NOTE1);
-      delay(delay_val); // delay a bit before reading data again
-    } else if (exiting && enter_sensed) { // someone exited the room, decrement the total unless it is already 0
-      total = total > 0 ? total - 1 : total; // decrement total if it is not already 0
-      exiting = false;
-      display.showNumberDec(total); // display the current total on 7 segment display
-      Serial.println(total);
-      tone(BUZZER, NOTE2);
-      delay(delay_val); // delay a bit before reading data again
-    }
-    noTone(BUZZER);
+    else if (total > 0) // someone exited or turned back in, unless the total is already 0
+      total--;
+    tone(BUZZER, entered ? NOTE1 : NOTE2, COUNT_TONE_MS);
   }
+  if (n > 0)
+    display.showNumberDec(total); // display the current total on 7 segment display
 
-  Serial.println(total); // print the current total for serial communication
+  if (n > 0 || now - last_print >= PRINT_MS) { // print the current total for serial communication
+    Serial.println(total);
+    last_print = now;
+  }
+}
+
+// apply one "@<id> reset", "@<id> config <range> <delay> <total>" or
+// "@<id> trace <1|0>" line from the server and answer "ack <id>" or
+// "nak <id> <reason>"
+void run_command(char* line) {
+  char* rest;
+  long id = line[0] == '@' ? strtol(line + 1, &rest, 10) : 0;
+  if (id <= 0 || *rest != ' ') {
+    Serial.println("nak 0 syntax");
+    return;
+  }
+  rest++;
+
+  if (id != last_id) { // a resend after a lost ack is not applied twice
+    int r, d, t;
+    if (strcmp(rest, "reset") == 0) { // case 1: arduino needs to reset its counter
+      total = 0;
+    } else if (sscanf(rest, "config %d %d %d", &r, &d, &t) == 3) { // case 2: config data received
+      if (r <= 0 || d < 0 || t < 0) {
+        Serial.print("nak ");
+        Serial.print(id);
+        Serial.println(" range");
+        return;
+      }
+      detector.config.range_cm = r;
+      detector.config.timeout_ms = d; // how long someone seen by one sensor has to reach the other
+      total = t;
+    } else if (sscanf(rest, "trace %d", &r) == 1) { // case 3: print raw readings, or stop
+      tracing = r != 0;
+    } else {
+      Serial.print("nak ");
+      Serial.print(id);
+      Serial.println(" unknown");
+      return;
+    }
+    last_id = id;
+    display.showNumberDec(total);
+    tone(BUZZER, NOTE2, ACK_TONE_MS); // plays on its own while sensing goes on
+  }
+  Serial.print("ack ");
+  Serial.println(id);
+}
 
-  delay(10); // configure delay on sensing for best results
+// take whatever bytes the server sent so far, running each command as its
+// newline arrives; never waits for the rest of a line
+void poll_commands() {
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c == '\n') {
+      command[command_len] = '\0';
+      if (command_len > 0 && !command_overflow)
+        run_command(command);
+      command_len = 0;
+      command_overflow = false;
+    } else if (c != '\r') {
+      if (command_len < COMMAND_MAX)
+        command[command_len++] = c;
+      else
+        command_overflow = true; // dropped, the server sends it again
+    }
+  }
 }
 
 long microsecondsToCentimeters(long microseconds) {
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+
+#include "archive.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compares scanning the live attendance history as the text files the
+// CGIs write (live_data.txt and live_time.txt, one number or time per
+// line) against the same readings in an archive, used by `make scan`.
+// A semester of readings is generated: class days of ten hours, a reading
+// every few seconds while people come and go, the total back at 0 each
+// morning. Both forms are written to a temporary directory and scanned
+// for the sum and maximum of the totals, best of -p passes; the archive is
+// also scanned for one week through its zone maps. Output is one JSON
+// object.
+
+#define NSEC_PER_SEC 1000000000ULL
+#define SEMESTER_START 1788220800 // 2026-09-01 00:00 UTC
+#define DAY_START_S (8 * 3600)
+#define DAY_END_S (18 * 3600)
+
+typedef struct {
+    uint64_t rows;
+    int64_t sum;
+    int64_t max;
+    uint64_t ns;
+} scan;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static off_t file_size(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+static void generate(const char* dir, long rows, char* data_path, char* time_path, char* archive_path)
+{
+    FILE* data = fopen(data_path, "w");
+    FILE* times = fopen(time_path, "w");
+    archive_writer* w = malloc(sizeof(archive_writer));
+    if (!data || !times || !w || archive_create(w, archive_path, 1) == -1) {
+        fprintf(stderr, "Error: cannot write the test files in %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+
+    int64_t day = SEMESTER_START, sec = DAY_START_S, total = 0;
+    for (long i = 0; i < rows; i++) {
+        sec += 1 + random() % 8;
+        if (sec >= DAY_END_S) { // the next weekday morning, an empty room
+            day += 86400;
+            if ((day / 86400 + 4) % 7 == 6) // skip the weekend
+                day += 2 * 86400;
+            sec = DAY_START_S + random() % 60;
+            total = 0;
+        }
+        total += random() % 100 < 52 ? 1 : -1; // the room fills up a little over the day
+        if (total < 0)
+            total = 0;
+        fprintf(data, "%lld\n", (long long)total);
+        fprintf(times, "%02d:%02d:%02d\n", (int)(sec / 3600), (int)(sec / 60 % 60), (int)(sec % 60));
+        if (archive_append(w, day + sec, &total) == -1)
+            exit(EXIT_FAILURE);
+    }
+    if (fclose(data) == EOF || fclose(times) == EOF || archive_finish(w) == -1) {
+        fprintf(stderr, "Error: cannot write the test files in %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    free(w);
+}
+
+// what the CGIs do, in C: a number and a time parsed from every line pair
+static scan scan_text(const char* data_path, const char* time_path)
+{
+    scan s = { 0, 0, 0, 0 };
+    uint64_t start = now_ns();
+    FILE* data = fopen(data_path, "r");
+    FILE* times = fopen(time_path, "r");
+    if (!data || !times) {
+        perror("Error: cannot open the text files");
+        exit(EXIT_FAILURE);
+    }
+    char line[64], time_line[64];
+    int64_t seconds = 0;
+    while (fgets(line, sizeof(line), data) && fgets(time_line, sizeof(time_line), times)) {
+        char* p;
+        long h = strtol(time_line, &p, 10);
+        long m = strtol(p + 1, &p, 10);
+        long sec = strtol(p + 1, NULL, 10);
+        seconds += h * 3600 + m * 60 + sec;
+        int64_t total = strtoll(line, NULL, 10);
+        s.sum += total;
+        if (total > s.max)
+            s.max = total;
+        s.rows++;
+    }
+    fclose(data);
+    fclose(times);
+    s.ns = now_ns() - start;
+    if (seconds == 0) // keep the time parsing from being optimized out
+        fprintf(stderr, "no readings\n");
+    return s;
+}
+
+static scan scan_archive(const char* path, archive_cursor* c, int64_t from, int64_t to, uint32_t* blocks_read)
+{
+    scan s = { 0, 0, 0, 0 };
+    uint64_t start = now_ns();
+    archive_reader r;
+    if (archive_open(&r, path) == -1)
+        exit(EXIT_FAILURE);
+    archive_cursor_init(c, &r, from, to);
+    int rows;
+    *blocks_read = 0;
+    while ((rows = archive_next_block(c)) > 0) {
+        const int64_t* v = c->v[0];
+        for (int i = 0; i < rows; i++) {
+            s.sum += v[i];
+            if (v[i] > s.max)
+                s.max = v[i];
+        }
+        s.rows += rows;
+        (*blocks_read)++;
+    }
+    if (rows == -1) {
+        fprintf(stderr, "Error: %s is damaged\n", path);
+        exit(EXIT_FAILURE);
+    }
+    archive_close(&r);
+    s.ns = now_ns() - start;
+    return s;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: archive_scan [-n readings] [-p passes] [-s seed]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    long rows = 640000; // about a 16 week semester
+    int passes = 5, opt;
+    unsigned seed = 1;
+    while ((opt = getopt(argc, argv, "n:p:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            rows = atol(optarg);
+            break;
+        case 'p':
+            passes = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (rows < 1 || passes < 1)
+        usage();
+    srandom(seed);
+
+    char dir[] = "/tmp/archive_scan.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("Error: cannot create a temporary directory");
+        return EXIT_FAILURE;
+    }
+    char data_path[64], time_path[64], archive_path[64];
+    snprintf(data_path, sizeof(data_path), "%s/live_data.txt", dir);
+    snprintf(time_path, sizeof(time_path), "%s/live_time.txt", dir);
+    snprintf(archive_path, sizeof(archive_path), "%s/live.war", dir);
+    generate(dir, rows, data_path, time_path, archive_path);
+
+    archive_cursor* c = malloc(sizeof(archive_cursor));
+    if (!c) {
+        perror("Error: failed to allocate cursor");
+        return EXIT_FAILURE;
+    }
+
+    // the second week of the semester
+    int64_t week_from = SEMESTER_START + 7 * 86400, week_to = week_from + 7 * 86400 - 1;
+    scan text = { 0, 0, 0, UINT64_MAX }, full = text, week = text;
+    uint32_t blocks_full = 0, blocks_week = 0;
+    for (int i = 0; i < passes; i++) {
+        scan s = scan_text(data_path, time_path);
+        if (s.ns < text.ns)
+            text = s;
+        s = scan_archive(archive_path, c, INT64_MIN, INT64_MAX, &blocks_full);
+        if (s.ns < full.ns)
+            full = s;
+        s = scan_archive(archive_path, c, week_from, week_to, &blocks_week);
+        if (s.ns < week.ns)
+            week = s;
+    }
+    free(c);
+
+    off_t text_bytes = file_size(data_path) + file_size(time_path), archive_bytes = file_size(archive_path);
+    unlink(data_path);
+    unlink(time_path);
+    unlink(archive_path);
+    rmdir(dir);
+
+    if (text.rows != full.rows || text.sum != full.sum || text.max != full.max) {
+        fprintf(stderr, "Error: the archive read back differently from the text\n");
+        return EXIT_FAILURE;
+    }
+    printf("{\n");
+    printf("  \"readings\": %lu,\n", (unsigned long)text.rows);
+    printf("  \"text\": {\"bytes\": %lld, \"ns_per_reading\": %.2f},\n", (long long)text_bytes, (double)text.ns / text.rows);
+    printf("  \"archive\": {\"bytes\": %lld, \"ns_per_reading\": %.2f, \"blocks\": %u},\n", (long long)archive_bytes,
+        (double)full.ns / full.rows, blocks_full);
+    printf("  \"week\": {\"readings\": %lu, \"blocks\": %u, \"ms\": %.3f},\n", (unsigned long)week.rows, blocks_week, week.ns / 1e6);
+    printf("  \"size_ratio\": %.3f,\n", (double)archive_bytes / text_bytes);
+    printf("  \"scan_speedup\": %.1f\n", (double)text.ns / full.ns);
+    printf("}\n");
+    return EXIT_SUCCESS;
+}
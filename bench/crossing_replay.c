@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include "crossing.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Replays distance traces through the door's crossing detector on the
+// host, used by `make replay`. A trace is what the firmware prints with
+// tracing on, one "t <ms> <cm-outside> <cm-inside>" line per sample; other
+// lines are ignored, so a raw capture of the serial port replays as is. A
+// "# expect enter=N exit=M" line gives the true counts to score against.
+// -g writes (or, without -o, replays) a synthetic trace with walkers,
+// tailgaters, people turning back and sensor noise.
+//
+// Each trace is scored for the detector and for the old loop() logic it
+// replaced, and timed over -n passes. Output is one JSON object per trace.
+
+#define NSEC_PER_SEC 1000000000ULL
+
+typedef struct {
+    uint32_t ms;
+    int16_t cm[2];
+} sample;
+
+typedef struct {
+    sample* vals;
+    size_t len;
+    size_t cap;
+    long expect_enter; // -1 when the trace doesn't say
+    long expect_exit;
+} trace;
+
+typedef struct {
+    long enter;
+    long exit;
+    uint64_t ns;
+} result;
+
+static crossing_config config = {
+    CROSSING_RANGE_CM, CROSSING_DEBOUNCE_MS, CROSSING_RELEASE_MS, CROSSING_TIMEOUT_MS
+};
+static int passes = 20;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void trace_push(trace* t, uint32_t ms, int cm_outside, int cm_inside)
+{
+    if (t->len == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 4096;
+        t->vals = realloc(t->vals, t->cap * sizeof(sample));
+        if (!t->vals) {
+            perror("Error: failed to grow trace");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->vals[t->len++] = (sample) { ms, { cm_outside, cm_inside } };
+}
+
+static int trace_load(const char* path, trace* t)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    memset(t, 0, sizeof(*t));
+    t->expect_enter = t->expect_exit = -1;
+
+    char line[256];
+    unsigned long ms;
+    int a, b;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "t %lu %d %d", &ms, &a, &b) == 3)
+            trace_push(t, ms, a, b);
+        else
+            sscanf(line, "# expect enter=%ld exit=%ld", &t->expect_enter, &t->expect_exit);
+    }
+    fclose(f);
+    return 0;
+}
+
+static double uniform(double lo, double hi)
+{
+    return lo + (hi - lo) * (random() / (double)RAND_MAX);
+}
+
+// how long one sensor is blocked
+typedef struct {
+    uint32_t from;
+    uint32_t to;
+} blockage;
+
+static void blockage_add(blockage** list, size_t* len, size_t* cap, uint32_t from, uint32_t to)
+{
+    if (*len == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *list = realloc(*list, *cap * sizeof(blockage));
+        if (!*list) {
+            perror("Error: failed to grow trace");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*list)[(*len)++] = (blockage) { from, to };
+}
+
+// people walk through at random, 15% close behind the one before them in
+// the same direction (at the first sensor 100-400ms after it cleared), 5%
+// turn back at the door; readings come every 25-35ms (two pulseIn calls)
+// with dropouts, stray echoes and no-echo zeros
+static void trace_generate(trace* t, int people)
+{
+    blockage* blocks[2] = { NULL, NULL };
+    size_t len[2] = { 0, 0 }, cap[2] = { 0, 0 };
+    memset(t, 0, sizeof(*t));
+
+    uint32_t start = 1000, prev_end = 0;
+    int prev_side = 0;
+    for (int i = 0; i < people; i++) {
+        int near = random() % 2; // sensor seen first
+        double r = uniform(0, 1);
+        if (i > 0 && r < 0.15) { // tailgating, right behind the one before
+            near = prev_side;
+            start = prev_end + uniform(100, 400);
+        }
+        uint32_t width = uniform(250, 600); // time one sensor sees the body
+        uint32_t lag = uniform(150, 450); // from the near sensor to the far one
+
+        if (r >= 0.15 && r < 0.20) { // turns back, perhaps after reaching the far sensor
+            if (random() % 2) {
+                blockage_add(&blocks[!near], &len[!near], &cap[!near], start + lag, start + lag + 150);
+                blockage_add(&blocks[near], &len[near], &cap[near], start, start + lag + 150 + width);
+            } else {
+                blockage_add(&blocks[near], &len[near], &cap[near], start, start + width);
+            }
+        } else {
+            blockage_add(&blocks[near], &len[near], &cap[near], start, start + width);
+            blockage_add(&blocks[!near], &len[!near], &cap[!near], start + lag, start + lag + width);
+            if (near == CROSSING_OUTSIDE)
+                t->expect_enter++;
+            else
+                t->expect_exit++;
+        }
+        prev_end = start + width;
+        prev_side = near;
+        start += uniform(1500, 4000);
+    }
+
+    // readings, with blockages looked up in start order
+    size_t next[2] = { 0, 0 };
+    for (uint32_t ms = 0; ms < start + 2000; ms += uniform(25, 35)) {
+        int cm[2];
+        for (int s = 0; s < 2; s++) {
+            while (next[s] < len[s] && blocks[s][next[s]].to <= ms)
+                next[s]++;
+            int blocked = 0;
+            for (size_t k = next[s]; k < len[s] && blocks[s][k].from <= ms; k++)
+                blocked |= ms < blocks[s][k].to;
+            double noise = uniform(0, 1);
+            if (noise < 0.01)
+                cm[s] = 0; // no echo
+            else if (blocked ? noise < 0.04 : noise > 0.995)
+                blocked = !blocked; // a dropout or a stray echo
+            if (noise >= 0.01)
+                cm[s] = blocked ? uniform(10, config.range_cm - 5) : uniform(80, 250);
+        }
+        trace_push(t, ms, cm[0], cm[1]);
+    }
+    free(blocks[0]);
+    free(blocks[1]);
+}
+
+static int trace_write(const char* path, const trace* t)
+{
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "# expect enter=%ld exit=%ld\n", t->expect_enter, t->expect_exit);
+    for (size_t i = 0; i < t->len; i++)
+        fprintf(f, "t %lu %d %d\n", (unsigned long)t->vals[i].ms, t->vals[i].cm[0], t->vals[i].cm[1]);
+    return fclose(f);
+}
+
+static result replay(const trace* t)
+{
+    result r = { 0, 0, 0 };
+    crossing_detector d;
+    crossing_event events[CROSSING_EVENTS_MAX];
+    uint64_t start = now_ns();
+    for (int p = 0; p < passes; p++) {
+        long enter = 0, exit = 0;
+        crossing_init(&d, &config);
+        for (size_t i = 0; i < t->len; i++) {
+            int n = crossing_sample(&d, t->vals[i].ms, t->vals[i].cm[0], t->vals[i].cm[1], events);
+            for (int k = 0; k < n; k++) {
+                long* count = events[k].direction == CROSSING_ENTER ? &enter : &exit;
+                *count += events[k].retract ? -1 : 1;
+            }
+        }
+        r.enter = enter;
+        r.exit = exit;
+    }
+    r.ns = now_ns() - start;
+    return r;
+}
+
+// the state machine loop() used to run: a crossing counts when the second
+// sensor fires, then the sketch slept for the delay and missed everything
+static result replay_legacy(const trace* t)
+{
+    result r = { 0, 0, 0 };
+    uint64_t start = now_ns();
+    for (int p = 0; p < passes; p++) {
+        long enter = 0, exit = 0;
+        int entering = 0, exiting = 0;
+        uint32_t asleep_until = 0;
+        for (size_t i = 0; i < t->len; i++) {
+            const sample* s = &t->vals[i];
+            if ((int32_t)(s->ms - asleep_until) < 0)
+                continue;
+            int enter_sensed = s->cm[0] <= config.range_cm; // no echo read as 0, which counted as sensed
+            int exit_sensed = s->cm[1] <= config.range_cm;
+            if (!entering && !exiting) {
+                if (enter_sensed && !exit_sensed)
+                    entering = 1;
+                else if (exit_sensed && !enter_sensed)
+                    exiting = 1;
+            } else if (entering && exit_sensed) {
+                enter++;
+                entering = 0;
+                asleep_until = s->ms + config.timeout_ms;
+            } else if (exiting && enter_sensed) {
+                exit++;
+                exiting = 0;
+                asleep_until = s->ms + config.timeout_ms;
+            }
+        }
+        r.enter = enter;
+        r.exit = exit;
+    }
+    r.ns = now_ns() - start;
+    return r;
+}
+
+static long miscount(const trace* t, const result* r)
+{
+    if (t->expect_enter < 0)
+        return -1;
+    return labs(r->enter - t->expect_enter) + labs(r->exit - t->expect_exit);
+}
+
+static void print_result(const char* name, const trace* t, const result* r, int last)
+{
+    printf("  \"%s\": {\"enter\": %ld, \"exit\": %ld, \"miscount\": %ld, \"ns_per_sample\": %.1f}%s\n", name, r->enter, r->exit,
+        miscount(t, r), t->len ? r->ns / (double)(passes * t->len) : 0, last ? "" : ",");
+}
+
+static void report(const char* name, const trace* t)
+{
+    result r = replay(t);
+    result legacy = replay_legacy(t);
+    uint32_t span = t->len ? t->vals[t->len - 1].ms - t->vals[0].ms : 0;
+
+    printf("{\n");
+    printf("  \"trace\": \"%s\",\n", name);
+    printf("  \"samples\": %zu,\n", t->len);
+    printf("  \"duration_s\": %.1f,\n", span / 1000.0);
+    printf("  \"config\": {\"range_cm\": %d, \"debounce_ms\": %d, \"release_ms\": %d, \"timeout_ms\": %d},\n", config.range_cm,
+        config.debounce_ms, config.release_ms, config.timeout_ms);
+    if (t->expect_enter >= 0)
+        printf("  \"expected\": {\"enter\": %ld, \"exit\": %ld},\n", t->expect_enter, t->expect_exit);
+    print_result("detector", t, &r, 0);
+    print_result("legacy", t, &legacy, 1);
+    printf("}\n");
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "usage: %s [-r range-cm] [-d debounce-ms] [-R release-ms] [-T timeout-ms] [-n passes] trace...\n"
+        "       %s -g people [-s seed] [-o trace-file]\n"
+        "  -g without -o replays the generated trace instead of writing it\n",
+        prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    int c, people = 0;
+    unsigned seed = 1;
+    const char* out = NULL;
+
+    while ((c = getopt(argc, argv, "r:d:R:T:n:g:s:o:")) != -1) {
+        switch (c) {
+        case 'r':
+            config.range_cm = atoi(optarg);
+            break;
+        case 'd':
+            config.debounce_ms = atoi(optarg);
+            break;
+        case 'R':
+            config.release_ms = atoi(optarg);
+            break;
+        case 'T':
+            config.timeout_ms = atoi(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        case 'g':
+            people = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (passes <= 0 || config.range_cm <= 0 || (people <= 0 && optind == argc))
+        usage(argv[0]);
+
+    trace t;
+    if (people > 0) {
+        srandom(seed);
+        trace_generate(&t, people);
+        if (out)
+            return trace_write(out, &t) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        char name[64];
+        snprintf(name, sizeof(name), "synthetic:%d:%u", people, seed);
+        report(name, &t);
+        free(t.vals);
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (trace_load(argv[i], &t) == -1)
+            return EXIT_FAILURE;
+        report(argv[i], &t);
+        free(t.vals);
+    }
+    return EXIT_SUCCESS;
+}
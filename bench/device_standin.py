@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# An Arduino stand-in on a pseudo-terminal for testing the device channel.
+# Like the firmware it prints its total every few hundred milliseconds and
+# answers "@<id> <command>" with "ack <id>", or "nak <id> <reason>":
+#   reset               the total goes back to 0
+#   config r d total    the total becomes total; a range of 0 is refused
+# A resent id is acknowledged again without being applied twice. The
+# terminal is linked at the path given, whose name is the device's name.
+#
+# usage: device_standin.py link
+
+import os, select, sys, time, tty
+
+link = sys.argv[1]
+master, slave = os.openpty()
+tty.setraw(slave)
+if os.path.lexists(link):
+    os.unlink(link)
+os.symlink(os.ttyname(slave), link)
+print("linked %s" % link, flush=True)
+
+total = 0
+applied = set()
+line = b""
+next_print = 0.0
+while True:
+    now = time.monotonic()
+    if now >= next_print:
+        os.write(master, b"%d\r\n" % total)
+        next_print = now + 0.2
+    ready, _, _ = select.select([master], [], [], next_print - now)
+    if not ready:
+        continue
+    line += os.read(master, 256)
+    while b"\n" in line:
+        cmd, line = line.split(b"\n", 1)
+        cmd = cmd.strip().decode(errors="replace")
+        if not cmd.startswith("@"):
+            continue
+        ident, _, command = cmd[1:].partition(" ")
+        words = command.split()
+        if words[:1] == ["reset"]:
+            if ident not in applied:
+                total = 0
+        elif words[:1] == ["config"] and len(words) == 4:
+            if words[1] == "0":
+                os.write(master, b"nak %s range\r\n" % ident.encode())
+                continue
+            if ident not in applied:
+                total = int(words[3])
+        else:
+            os.write(master, b"nak %s unknown\r\n" % ident.encode())
+            continue
+        applied.add(ident)
+        os.write(master, b"ack %s\r\n" % ident.encode())
@@ -0,0 +1,155 @@
+#!/usr/bin/env bash
+# Tests for the device command channel against an Arduino stand-in on a
+# pseudo-terminal (bench/device_standin.py). Starts webserv with -s on the
+# stand-in, once plain and once with the shared cache (-c), and checks that
+#   - the device shows up on /device with the total it prints,
+#   - /device?cmd=config and /device?cmd=reset are acknowledged and change
+#     the total, and a refused command answers 409 with the reason,
+#   - the configuration page's handler reaches the device as well.
+#
+# Tunables (environment):
+#   DEVICE_TEST_PORT   port webserv listens on (default: 5430)
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+WEBSERV="$ROOT/webserv"
+PORT="${DEVICE_TEST_PORT:-5430}"
+CACHE_SIZE=2097152
+
+export WEBROOT_PATH="$ROOT"
+WORK="$(mktemp -d)"
+TTY="$WORK/ttyTEST0"
+server_pid=""
+device_pid=""
+failures=0
+
+stop_server() {
+    if [ -n "$server_pid" ]; then
+        kill -INT "$server_pid" 2>/dev/null || true
+        wait "$server_pid" 2>/dev/null || true
+        server_pid=""
+    fi
+}
+
+cleanup() {
+    stop_server
+    if [ -n "$device_pid" ]; then
+        kill "$device_pid" 2>/dev/null || true
+        wait "$device_pid" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+pass() {
+    echo "ok   $1"
+}
+
+fail() {
+    echo "FAIL $1" >&2
+    failures=$((failures + 1))
+}
+
+# wait up to $1 seconds for a command to succeed
+wait_for() {
+    local seconds="$1"
+    shift
+    for _ in $(seq $((seconds * 10))); do
+        if "$@" 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+# GET a path, "<status> <body>" on stdout
+get() {
+    local out
+    out="$(curl -s -w '\n%{http_code}' "http://127.0.0.1:$PORT$1")"
+    printf '%s %s\n' "${out##*$'\n'}" "$(printf '%s' "${out%$'\n'*}" | tr '\n' ' ' | sed 's/ *$//')"
+}
+
+# the status line lists the device with this total
+shows_total() {
+    get /device | grep -q "^200 ttyTEST0 connected pending=[0-9]* count=$1$"
+}
+
+start_server() {
+    : >"$WORK/webserv.log"
+    # shellcheck disable=SC2068
+    (cd "$ROOT" && exec "$WEBSERV" -p "$PORT" -s "$TTY" $@) >>"$WORK/webserv.log" 2>&1 &
+    server_pid=$!
+    if ! wait_for 5 grep -q "Listening to client requests" "$WORK/webserv.log"; then
+        echo "webserv did not start listening on port $PORT" >&2
+        exit 1
+    fi
+}
+
+# expect "<status> <body>" from a path
+check() {
+    local mode="$1" path="$2" want="$3" got
+    got="$(get "$path")"
+    if [ "$got" = "$want" ]; then
+        pass "$mode: $path answered $want"
+    else
+        fail "$mode: $path answered '$got', expected '$want'"
+    fi
+}
+
+run_checks() {
+    local mode="$1"
+
+    if wait_for 5 get /device >/dev/null && wait_for 5 shows_total '[0-9]*'; then
+        pass "$mode: device connected and its total read"
+    else
+        fail "$mode: device not listed on /device: $(get /device)"
+    fi
+
+    check "$mode" "/device?cmd=config&range=50&delay=500&total=7" "200 ok"
+    if wait_for 3 shows_total 7; then
+        pass "$mode: config set the total"
+    else
+        fail "$mode: total after config: $(get /device)"
+    fi
+
+    check "$mode" "/device?cmd=reset" "200 ok"
+    if wait_for 3 shows_total 0; then
+        pass "$mode: reset cleared the total"
+    else
+        fail "$mode: total after reset: $(get /device)"
+    fi
+
+    check "$mode" "/device?cmd=config&range=0&delay=500&total=1" "409 nak range"
+
+    local status
+    status="$(curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$PORT/cgi-bin/handle_arduino_config.cgi?range=40&delay=400&total=3")"
+    if [ "$status" = 200 ] && wait_for 3 shows_total 3; then
+        pass "$mode: configuration page reached the device"
+    else
+        fail "$mode: configuration page answered $status: $(get /device)"
+    fi
+}
+
+python3 "$ROOT/bench/device_standin.py" "$TTY" >"$WORK/device.out" 2>&1 &
+device_pid=$!
+if ! wait_for 5 grep -q linked "$WORK/device.out"; then
+    echo "device stand-in did not start" >&2
+    exit 1
+fi
+
+start_server
+run_checks fork
+stop_server
+
+start_server -c "$CACHE_SIZE"
+run_checks cached
+stop_server
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures device check(s) failed; webserv said:" >&2
+    cat "$WORK/webserv.log" >&2
+    exit 1
+fi
+echo "all device checks passed"
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+
+#include "cache.h"
+#include "file_cache.h"
+#include "http2.h"
+#include "metrics.h"
+#include "microbench.h"
+#include "router.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The cases `make microbench` runs: what every request goes through, from
+// reading it off the socket to sending the file back. The server's own
+// functions are linked in (webserv.c without its main), run against the
+// web root in WEBROOT_PATH, or the current directory when it isn't set.
+// Sockets are socketpairs, so no network stack is timed.
+
+#define BENCH_FILE "static/project.html"
+#define BENCH_REQUEST "GET /" BENCH_FILE "?name=Ada&cmd=stats HTTP/1.1\r\nHost: localhost\r\nUser-Agent: microbench\r\nAccept: */*\r\n\r\n"
+
+// webserv.c has no header of its own
+int receive_request(int fd, char* request, http2_start* h2);
+void parse_query_string(const char* request, char* query_string);
+char* is_supported_type(const char* ext);
+char* get_server_root_dir();
+int check_cache(Cache* cache, int client_fd, char* content_type, char* resource, char* query, char* short_file_path);
+
+typedef struct {
+    int fds[2]; // the server writes or reads fds[0], the client end is fds[1]
+    Cache* cache;
+    const file_cache_entry* file;
+    char path[1024]; // BENCH_FILE under the web root
+} fixture;
+
+static fixture fx = { { -1, -1 }, NULL, NULL, "" };
+
+// the server state every case needs, set up once
+static int server_init(void)
+{
+    static int done = 0;
+    if (done)
+        return done;
+    done = -1;
+    if (!getenv("WEBROOT_PATH")) {
+        char cwd[1024];
+        if (!getcwd(cwd, sizeof(cwd)) || setenv("WEBROOT_PATH", cwd, 1) == -1)
+            return -1;
+    }
+    if (metrics_init() == -1 || router_init(get_server_root_dir(), "/dev/null", 0) == -1 || file_cache_init(get_server_root_dir()) == -1)
+        return -1;
+    snprintf(fx.path, sizeof(fx.path), "%s%s", get_server_root_dir(), BENCH_FILE);
+    if (access(fx.path, R_OK) == -1) {
+        fprintf(stderr, "Error: cannot read %s: %s\n", fx.path, strerror(errno));
+        return -1;
+    }
+    return done = 1;
+}
+
+// read whatever the server side sent so the socket buffer never fills
+static void drain(int fd)
+{
+    char buf[16384];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+}
+
+static void* plain_setup(void)
+{
+    return server_init() == 1 ? &fx : NULL;
+}
+
+static void* socket_setup(void)
+{
+    if (server_init() != 1 || socketpair(AF_UNIX, SOCK_STREAM, 0, fx.fds) == -1)
+        return NULL;
+    return &fx;
+}
+
+static void socket_teardown(void* state)
+{
+    fixture* f = state;
+    close(f->fds[0]);
+    close(f->fds[1]);
+    f->fds[0] = f->fds[1] = -1;
+}
+
+static void* cache_setup(void)
+{
+    if (server_init() != 1 || !(fx.cache = initialize_cache(1 << 20)))
+        return NULL;
+    return &fx;
+}
+
+static void cache_teardown(void* state)
+{
+    fixture* f = state;
+    cleanup_cache(f->cache);
+    f->cache = NULL;
+}
+
+static void* sendfile_setup(void)
+{
+    if (!socket_setup())
+        return NULL;
+    if (!(fx.file = file_cache_get(BENCH_FILE))) {
+        socket_teardown(&fx);
+        return NULL;
+    }
+    return &fx;
+}
+
+static void* check_cache_setup(void)
+{
+    if (!socket_setup())
+        return NULL;
+    if (!cache_setup()) {
+        socket_teardown(&fx);
+        return NULL;
+    }
+    return &fx;
+}
+
+static void check_cache_teardown(void* state)
+{
+    cache_teardown(state);
+    socket_teardown(state);
+}
+
+static void run_hash(void* state, long iterations)
+{
+    (void)state;
+    static const char* keys[] = { "/srv/www/static/project.html", "/srv/www/static/attendance_plot.png", "/srv/www/cgi-bin/handle_plot.cgi",
+        "/srv/www/static/style.css" };
+    for (long i = 0; i < iterations; i++)
+        mb_keep(generate_simple_hash(keys[i & 3]));
+}
+
+// the entry's segment is attached on every lookup; the server detaches it
+// once the response is sent
+static void fetch_and_detach(Cache* cache, const char* path)
+{
+    CacheEntry* entry = fetch_file(cache, path, "");
+    if (entry && entry->shm_id != -1)
+        shmdt(entry->content);
+    mb_keep(entry);
+}
+
+static void run_fetch_hit(void* state, long iterations)
+{
+    fixture* f = state;
+    for (long i = 0; i < iterations; i++)
+        fetch_and_detach(f->cache, f->path);
+}
+
+// every fetch reads the file into a new segment
+static void run_fetch_miss(void* state, long iterations)
+{
+    fixture* f = state;
+    for (long i = 0; i < iterations; i++) {
+        CacheEntry* entry = cache_lookup(f->cache, cache_key(f->path, ""));
+        if (entry) {
+            if (entry->shm_id != -1)
+                shmdt(entry->content);
+            cache_evict(f->cache, entry);
+        }
+        fetch_and_detach(f->cache, f->path);
+    }
+}
+
+static void run_parse_query(void* state, long iterations)
+{
+    (void)state;
+    static const char line[] = "GET /" BENCH_FILE "?name=Ada&cmd=stats HTTP/1.1";
+    char request[sizeof(line)], query[sizeof(line)];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(request, line, sizeof(line)); // parsing cuts the request short
+        parse_query_string(request, query);
+        mb_keep(query);
+    }
+}
+
+static void run_mime_type(void* state, long iterations)
+{
+    (void)state;
+    static const char* exts[] = { "html", "css", "js", "png", "jpg", "txt", "json", "unknown" };
+    for (long i = 0; i < iterations; i++)
+        mb_keep(is_supported_type(exts[i & 7]));
+}
+
+static void run_receive(void* state, long iterations)
+{
+    fixture* f = state;
+    char request[512];
+    http2_start h2;
+    for (long i = 0; i < iterations; i++) {
+        if (write(f->fds[1], BENCH_REQUEST, sizeof(BENCH_REQUEST) - 1) != sizeof(BENCH_REQUEST) - 1)
+            return;
+        mb_keep(receive_request(f->fds[0], request, &h2));
+    }
+}
+
+static void run_sendfile(void* state, long iterations)
+{
+    fixture* f = state;
+    for (long i = 0; i < iterations; i++) {
+        mb_keep(file_cache_send(f->file, f->fds[0]));
+        drain(f->fds[1]);
+    }
+}
+
+// a cache hit answered whole, headers and all; check_cache closes the
+// client's descriptor when it's done, so it gets a copy
+static void run_check_cache(void* state, long iterations)
+{
+    fixture* f = state;
+    char content_type[] = "Content-Type: text/html\r\n\r\n";
+    char query[] = "";
+    char short_path[] = BENCH_FILE;
+    for (long i = 0; i < iterations; i++) {
+        int fd = dup(f->fds[0]);
+        if (fd == -1)
+            return;
+        if (check_cache(f->cache, fd, content_type, f->path, query, short_path) == -1)
+            close(fd);
+        drain(f->fds[1]);
+    }
+}
+
+const mb_case mb_cases[] = {
+    { "generate_simple_hash", NULL, run_hash, NULL },
+    { "fetch_file/hit", cache_setup, run_fetch_hit, cache_teardown },
+    { "fetch_file/miss", cache_setup, run_fetch_miss, cache_teardown },
+    { "parse_query_string", NULL, run_parse_query, NULL },
+    { "is_supported_type", plain_setup, run_mime_type, NULL },
+    { "receive_request", socket_setup, run_receive, socket_teardown },
+    { "file_cache_send", sendfile_setup, run_sendfile, socket_teardown },
+    { "check_cache/hit", check_cache_setup, run_check_cache, check_cache_teardown },
+    { NULL, NULL, NULL, NULL },
+};
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// HTTP load generator used by `make bench`. Runs either closed-loop (each
+// connection slot issues its next request as soon as the previous one
+// finishes) or open-loop (requests are scheduled at a fixed rate regardless
+// of how the server keeps up). The server closes the connection after every
+// response, so each request is one connect/send/read-until-EOF cycle.
+//
+// Output is a single JSON object on stdout.
+
+#define MAX_PATHS 16
+#define REQ_BUF_SIZE 1024
+#define RECV_BUF_SIZE 65536
+#define NSEC_PER_SEC 1000000000ULL
+
+typedef struct {
+    uint64_t* vals;
+    size_t len;
+    size_t cap;
+} sample_vec;
+
+typedef struct {
+    int id;
+    sample_vec raw; // service time: actual send -> last byte
+    sample_vec corrected; // response time: intended send -> last byte
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t status_2xx;
+    uint64_t status_other;
+} worker_state;
+
+struct {
+    struct sockaddr_in addr;
+    char* host;
+    int port;
+    int connections;
+    double duration; // seconds of measurement
+    double warmup; // seconds discarded before measurement
+    double rate; // requests/s for open loop, 0 for closed loop
+    char* paths[MAX_PATHS];
+    int npaths;
+    char requests[MAX_PATHS][REQ_BUF_SIZE];
+    size_t request_lens[MAX_PATHS];
+
+    uint64_t start_ns; // beginning of warmup
+    uint64_t measure_ns; // beginning of measurement window
+    uint64_t end_ns; // end of measurement window
+    uint64_t interval_ns; // open loop: ns between scheduled requests
+    uint64_t next_slot; // open loop: next schedule index (atomic)
+    uint64_t expected_ns; // closed loop: expected interval for CO correction
+} cfg;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts = { .tv_sec = t / NSEC_PER_SEC, .tv_nsec = t % NSEC_PER_SEC };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void vec_push(sample_vec* v, uint64_t val)
+{
+    if (v->len == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 4096;
+        v->vals = realloc(v->vals, v->cap * sizeof(uint64_t));
+        if (!v->vals) {
+            perror("Error: failed to grow sample buffer");
+            exit(EXIT_FAILURE);
+        }
+    }
+    v->vals[v->len++] = val;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// issue one request on a fresh connection, returns bytes received or -1
+static long do_request(int path_idx, int* status)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // the whole head in one go, Connection: close; the server reads all of it
+    // before answering, so nothing is left to turn its close() into a RST
+    const char* req = cfg.requests[path_idx];
+    size_t len = cfg.request_lens[path_idx], sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, req + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        sent += n;
+    }
+
+    char buf[RECV_BUF_SIZE];
+    long total = 0;
+    ssize_t n;
+    *status = 0;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        if (total == 0 && n >= 12 && strncmp(buf, "HTTP/1.", 7) == 0)
+            *status = atoi(buf + 9);
+        total += n;
+    }
+    close(fd);
+
+    if (n < 0 || total == 0)
+        return -1;
+    return total;
+}
+
+static void record(worker_state* w, uint64_t intended, uint64_t begin, uint64_t end, long bytes, int status)
+{
+    if (intended < cfg.measure_ns || intended >= cfg.end_ns)
+        return; // warmup or drain
+
+    w->requests++;
+    if (bytes < 0) {
+        w->errors++;
+        return;
+    }
+    w->bytes += bytes;
+    if (status >= 200 && status < 300)
+        w->status_2xx++;
+    else
+        w->status_other++;
+
+    vec_push(&w->raw, end - begin);
+    vec_push(&w->corrected, end - intended);
+
+    // closed loop: back-fill the requests a steady client would have issued
+    // while this one was stalled (HdrHistogram's expected-interval correction)
+    if (cfg.rate == 0 && cfg.expected_ns > 0) {
+        uint64_t lat = end - begin;
+        for (uint64_t missing = lat - cfg.expected_ns; lat > cfg.expected_ns && missing >= cfg.expected_ns; missing -= cfg.expected_ns)
+            vec_push(&w->corrected, missing);
+    }
+}
+
+static void* closed_loop_worker(void* arg)
+{
+    worker_state* w = arg;
+    uint64_t i = w->id;
+    for (;;) {
+        uint64_t begin = now_ns();
+        if (begin >= cfg.end_ns)
+            break;
+        int status;
+        long bytes = do_request(i++ % cfg.npaths, &status);
+        record(w, begin, begin, now_ns(), bytes, status);
+    }
+    return NULL;
+}
+
+static void* open_loop_worker(void* arg)
+{
+    worker_state* w = arg;
+    for (;;) {
+        uint64_t slot = __atomic_fetch_add(&cfg.next_slot, 1, __ATOMIC_RELAXED);
+        uint64_t intended = cfg.start_ns + slot * cfg.interval_ns;
+        if (intended >= cfg.end_ns)
+            break;
+        sleep_until(intended);
+
+        // latency is charged from the scheduled start, so a slow server cannot
+        // hide its queueing delay by slowing down the generator
+        uint64_t begin = now_ns();
+        int status;
+        long bytes = do_request(slot % cfg.npaths, &status);
+        record(w, intended, begin, now_ns(), bytes, status);
+    }
+    return NULL;
+}
+
+static uint64_t percentile(const sample_vec* v, double p)
+{
+    if (v->len == 0)
+        return 0;
+    size_t idx = (size_t)(p * (v->len - 1) + 0.5);
+    return v->vals[idx];
+}
+
+static void print_latency(const char* name, sample_vec* v, int trailing_comma)
+{
+    qsort(v->vals, v->len, sizeof(uint64_t), cmp_u64);
+    double sum = 0;
+    for (size_t i = 0; i < v->len; i++)
+        sum += v->vals[i];
+    printf("  \"%s\": {\"samples\": %zu, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+        name, v->len,
+        v->len ? sum / v->len / 1e3 : 0.0,
+        percentile(v, 0.50) / 1e3,
+        percentile(v, 0.99) / 1e3,
+        percentile(v, 0.999) / 1e3,
+        v->len ? v->vals[v->len - 1] / 1e3 : 0.0,
+        trailing_comma ? "," : "");
+}
+
+static void merge(sample_vec* dst, const sample_vec* src)
+{
+    for (size_t i = 0; i < src->len; i++)
+        vec_push(dst, src->vals[i]);
+}
+
+// estimate the per-connection request interval of an unloaded server, which is
+// the baseline used for closed-loop coordinated-omission correction
+static uint64_t calibrate_expected_interval(void)
+{
+    sample_vec v = { 0 };
+    for (int i = 0; i < 64; i++) {
+        int status;
+        uint64_t begin = now_ns();
+        if (do_request(i % cfg.npaths, &status) >= 0)
+            vec_push(&v, now_ns() - begin);
+    }
+    if (v.len == 0)
+        return 0;
+    qsort(v.vals, v.len, sizeof(uint64_t), cmp_u64);
+    uint64_t median = percentile(&v, 0.5);
+    free(v.vals);
+    return median;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+        "usage: %s -p port [-h host] [-c connections] [-d seconds] [-w warmup-seconds]\n"
+        "          [-r rate] -u path [-u path ...]\n"
+        "  -r 0 (default) runs closed loop, -r N runs open loop at N requests/s\n",
+        prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    int c;
+    cfg.host = "127.0.0.1";
+    cfg.connections = 1;
+    cfg.duration = 5;
+    cfg.warmup = 1;
+
+    while ((c = getopt(argc, argv, "h:p:c:d:w:r:u:")) != -1) {
+        switch (c) {
+        case 'h':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = atoi(optarg);
+            break;
+        case 'c':
+            cfg.connections = atoi(optarg);
+            break;
+        case 'd':
+            cfg.duration = atof(optarg);
+            break;
+        case 'w':
+            cfg.warmup = atof(optarg);
+            break;
+        case 'r':
+            cfg.rate = atof(optarg);
+            break;
+        case 'u':
+            if (cfg.npaths == MAX_PATHS)
+                usage(argv[0]);
+            cfg.paths[cfg.npaths++] = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (cfg.port <= 0 || cfg.npaths == 0 || cfg.connections <= 0 || cfg.duration <= 0)
+        usage(argv[0]);
+
+    struct hostent* server = gethostbyname(cfg.host);
+    if (!server) {
+        fprintf(stderr, "Error: cannot resolve host %s\n", cfg.host);
+        return EXIT_FAILURE;
+    }
+    cfg.addr.sin_family = AF_INET;
+    cfg.addr.sin_port = htons(cfg.port);
+    memcpy(&cfg.addr.sin_addr.s_addr, server->h_addr, server->h_length);
+
+    for (int i = 0; i < cfg.npaths; i++) {
+        int n = snprintf(cfg.requests[i], REQ_BUF_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", cfg.paths[i], cfg.host);
+        cfg.request_lens[i] = n;
+    }
+
+    if (cfg.rate == 0)
+        cfg.expected_ns = calibrate_expected_interval();
+    else
+        cfg.interval_ns = (uint64_t)(NSEC_PER_SEC / cfg.rate);
+
+    cfg.start_ns = now_ns();
+    cfg.measure_ns = cfg.start_ns + (uint64_t)(cfg.warmup * NSEC_PER_SEC);
+    cfg.end_ns = cfg.measure_ns + (uint64_t)(cfg.duration * NSEC_PER_SEC);
+
+    pthread_t* threads = calloc(cfg.connections, sizeof(pthread_t));
+    worker_state* workers = calloc(cfg.connections, sizeof(worker_state));
+    if (!threads || !workers) {
+        perror("Error: calloc failed");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < cfg.connections; i++) {
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, cfg.rate > 0 ? open_loop_worker : closed_loop_worker, &workers[i]) != 0) {
+            perror("Error: pthread_create failed");
+            return EXIT_FAILURE;
+        }
+    }
+
+    worker_state total = { 0 };
+    for (int i = 0; i < cfg.connections; i++) {
+        pthread_join(threads[i], NULL);
+        total.requests += workers[i].requests;
+        total.errors += workers[i].errors;
+        total.bytes += workers[i].bytes;
+        total.status_2xx += workers[i].status_2xx;
+        total.status_other += workers[i].status_other;
+        merge(&total.raw, &workers[i].raw);
+        merge(&total.corrected, &workers[i].corrected);
+    }
+
+    uint64_t completed = total.requests - total.errors;
+    printf("{\n");
+    printf("  \"loop\": \"%s\",\n", cfg.rate > 0 ? "open" : "closed");
+    printf("  \"connections\": %d,\n", cfg.connections);
+    printf("  \"target_rate\": %.1f,\n", cfg.rate);
+    printf("  \"duration_s\": %.2f,\n", cfg.duration);
+    printf("  \"paths\": [");
+    for (int i = 0; i < cfg.npaths; i++)
+        printf("%s\"%s\"", i ? ", " : "", cfg.paths[i]);
+    printf("],\n");
+    printf("  \"requests\": %lu,\n", (unsigned long)total.requests);
+    printf("  \"errors\": %lu,\n", (unsigned long)total.errors);
+    printf("  \"non_2xx\": %lu,\n", (unsigned long)total.status_other);
+    printf("  \"bytes\": %lu,\n", (unsigned long)total.bytes);
+    printf("  \"throughput_rps\": %.1f,\n", completed / cfg.duration);
+    printf("  \"expected_interval_us\": %.1f,\n", cfg.expected_ns / 1e3);
+    print_latency("latency", &total.raw, 1);
+    print_latency("latency_corrected", &total.corrected, 0);
+    printf("}\n");
+
+    return total.errors == total.requests ? EXIT_FAILURE : EXIT_SUCCESS;
+}
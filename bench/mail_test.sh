@@ -0,0 +1,186 @@
+#!/usr/bin/env bash
+# Tests for the outgoing mail queue against a local SMTP stand-in
+# (bench/smtp_standin.py). Starts webserv with -m pointing at the stand-in,
+# once plain and once with the shared cache (-c), queues messages through
+# the email handler and checks that
+#   - a message is delivered, plot attached, and leaves the spool,
+#   - a 4xx reply puts the job back with a backoff delay, and it is
+#     delivered once that delay has passed,
+#   - a 5xx reply moves the job to failed/ without retrying it.
+#
+# Tunables (environment):
+#   MAIL_TEST_PORT   port webserv listens on (default: 5420)
+#   MAIL_TEST_SMTP   port the stand-in listens on (default: 5425)
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+WEBSERV="$ROOT/webserv"
+PORT="${MAIL_TEST_PORT:-5420}"
+SMTP_PORT="${MAIL_TEST_SMTP:-5425}"
+SPOOL="/var/tmp/webserv-$PORT.mail"
+RETRY_BASE_S=30 # MAIL_RETRY_BASE_S
+CACHE_SIZE=2097152
+
+export WEBROOT_PATH="$ROOT"
+WORK="$(mktemp -d)"
+server_pid=""
+smtp_pid=""
+failures=0
+
+stop_server() {
+    if [ -n "$server_pid" ]; then
+        kill -INT "$server_pid" 2>/dev/null || true
+        wait "$server_pid" 2>/dev/null || true
+        server_pid=""
+    fi
+}
+
+cleanup() {
+    stop_server
+    if [ -n "$smtp_pid" ]; then
+        kill "$smtp_pid" 2>/dev/null || true
+        wait "$smtp_pid" 2>/dev/null || true
+    fi
+    rm -rf "$WORK" "$SPOOL"
+}
+trap cleanup EXIT
+
+pass() {
+    echo "ok   $1"
+}
+
+fail() {
+    echo "FAIL $1" >&2
+    failures=$((failures + 1))
+}
+
+# wait up to $1 seconds for a command to succeed
+wait_for() {
+    local seconds="$1"
+    shift
+    for _ in $(seq $((seconds * 10))); do
+        if "$@" 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+logged() {
+    grep -qx "$1 $2 [0-9]*" "$WORK/smtp.log"
+}
+
+# queue a message through the email handler, the HTTP status on stdout
+queue_mail() {
+    curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$PORT/cgi-bin/handle_email.cgi?email=$1&data=42"
+}
+
+# start webserv with a fresh spool and the extra arguments given
+start_server() {
+    rm -rf "$SPOOL"
+    : >"$WORK/webserv.log"
+    # shellcheck disable=SC2068
+    (cd "$ROOT" && exec "$WEBSERV" -p "$PORT" -m "127.0.0.1:$SMTP_PORT" $@) >>"$WORK/webserv.log" 2>&1 &
+    server_pid=$!
+    if ! wait_for 5 grep -q "Listening to client requests" "$WORK/webserv.log"; then
+        echo "webserv did not start listening on port $PORT" >&2
+        exit 1
+    fi
+}
+
+# every check against a running server; addresses are tagged with the
+# mode, the stand-in defers an address only the first time it sees it
+run_checks() {
+    local mode="$1"
+
+    # delivery
+    local ok="ok-$mode@example.com"
+    local status
+    status="$(queue_mail "$ok")"
+    if [ "$status" = 202 ] && wait_for 10 logged delivered "$ok"; then
+        pass "$mode: delivered after 202 Accepted"
+    else
+        fail "$mode: delivery (HTTP $status)"
+    fi
+    local msg
+    msg="$(grep -l "^To: <\?$ok" "$WORK"/out/*.eml 2>/dev/null | head -n1 || true)"
+    if [ -n "$msg" ] && grep -q "^Subject: Current Attendence Data" "$msg" \
+        && grep -q 'filename="attendance_plot.png"' "$msg"; then
+        pass "$mode: message has its subject and the plot attached"
+    else
+        fail "$mode: delivered message content"
+    fi
+    if wait_for 5 bash -c "[ -z \"\$(ls -A '$SPOOL/new')\" ]"; then
+        pass "$mode: sent job left the spool"
+    else
+        fail "$mode: sent job still in $SPOOL/new"
+    fi
+
+    # 4xx: back in new/ for a later attempt, then delivered
+    local defer="defer-$mode@example.com"
+    local job=""
+    queue_mail "$defer" >/dev/null
+    if wait_for 10 logged deferred "$defer" \
+        && wait_for 5 bash -c "ls '$SPOOL/new' | grep -q '^[0-9]*\.1\.'"; then
+        job="$(ls "$SPOOL/new" | grep '^[0-9]*\.1\.' | head -n1)"
+        local delay=$((${job%%.*} - $(date +%s)))
+        if [ "$delay" -ge $((RETRY_BASE_S - 5)) ] && [ "$delay" -le $((RETRY_BASE_S + RETRY_BASE_S / 4 + 1)) ]; then
+            pass "$mode: 4xx rescheduled with a ${delay}s backoff"
+        else
+            fail "$mode: 4xx backoff was ${delay}s, expected about ${RETRY_BASE_S}s"
+        fi
+    else
+        fail "$mode: 4xx did not put the job back in new/"
+    fi
+    if [ -n "$job" ]; then
+        # bring the retry forward instead of waiting it out
+        mv "$SPOOL/new/$job" "$SPOOL/new/$(date +%s).${job#*.}"
+        if wait_for 10 logged delivered "$defer"; then
+            pass "$mode: deferred message delivered on retry"
+        else
+            fail "$mode: deferred message not delivered on retry"
+        fi
+    fi
+
+    # 5xx: bounced into failed/, never tried again
+    local reject="reject-$mode@example.com"
+    queue_mail "$reject" >/dev/null
+    if wait_for 10 logged rejected "$reject" \
+        && wait_for 5 bash -c "[ -n \"\$(ls -A '$SPOOL/failed')\" ] && [ -z \"\$(ls -A '$SPOOL/new')\" ]"; then
+        pass "$mode: 5xx moved the job to failed/"
+    else
+        fail "$mode: 5xx did not move the job to failed/"
+    fi
+    sleep 1
+    if [ "$(grep -c "^rejected $reject " "$WORK/smtp.log")" -eq 1 ]; then
+        pass "$mode: rejected message not retried"
+    else
+        fail "$mode: rejected message was retried"
+    fi
+}
+
+mkdir "$WORK/out"
+touch "$WORK/smtp.log"
+python3 "$ROOT/bench/smtp_standin.py" "$SMTP_PORT" "$WORK/smtp.log" "$WORK/out" >"$WORK/smtp.out" 2>&1 &
+smtp_pid=$!
+if ! wait_for 5 grep -q listening "$WORK/smtp.out"; then
+    echo "SMTP stand-in did not start on port $SMTP_PORT" >&2
+    exit 1
+fi
+
+start_server
+run_checks fork
+stop_server
+
+start_server -c "$CACHE_SIZE"
+run_checks cached
+stop_server
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures mail queue check(s) failed; webserv said:" >&2
+    cat "$WORK/webserv.log" >&2
+    exit 1
+fi
+echo "all mail queue checks passed"
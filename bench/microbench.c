@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include "microbench.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// A small benchmark runner for the functions on every request's path,
+// used by `make microbench`. Each case is warmed up, its iteration count
+// calibrated so a sample takes about MB_SAMPLE_MS, then MB_SAMPLES samples
+// are taken; a case is summarized by its median time per operation and the
+// median absolute deviation. Cycles come from perf_event_open when the
+// kernel allows it, or the time stamp counter otherwise.
+//
+// With -b the samples are compared against a stored baseline with a
+// Mann-Whitney U test, which doesn't mind the long tail scheduling noise
+// gives timings. A case that got at least MB_REGRESSION_PCT slower with
+// p under MB_REGRESSION_P is a regression, and the run exits 1. -w stores
+// this run's samples as the new baseline.
+
+#define NSEC_PER_SEC 1000000000ULL
+#define BASELINE_LINE_MAX 4096
+
+typedef enum {
+    CYCLES_NONE,
+    CYCLES_PERF, // core cycles, this thread only
+    CYCLES_TSC // reference cycles, wall time
+} cycle_source;
+
+typedef struct {
+    char name[64];
+    int count;
+    double ns[MB_SAMPLES * 4];
+} baseline_case;
+
+static int perf_fd = -1;
+static cycle_source cycles_from = CYCLES_NONE;
+static int sample_count = MB_SAMPLES;
+static baseline_case* baseline = NULL;
+static int baseline_count = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void cycles_init(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd != -1) {
+        cycles_from = CYCLES_PERF;
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    cycles_from = CYCLES_TSC;
+#endif
+}
+
+static uint64_t cycles_now(void)
+{
+    uint64_t count = 0;
+    if (cycles_from == CYCLES_PERF && read(perf_fd, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (cycles_from == CYCLES_TSC)
+        count = __rdtsc();
+#endif
+    return count;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(const double* values, int n)
+{
+    double sorted[MB_SAMPLES * 4];
+    memcpy(sorted, values, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_double);
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+static double median_deviation(const double* values, int n, double m)
+{
+    double dev[MB_SAMPLES * 4];
+    for (int i = 0; i < n; i++)
+        dev[i] = fabs(values[i] - m);
+    return median(dev, n);
+}
+
+// two-sided p-value for a and b coming from the same distribution, from
+// the normal approximation of the U statistic; ties share their rank
+static double mann_whitney_p(const double* a, int na, const double* b, int nb)
+{
+    struct {
+        double v;
+        int from_a;
+    } all[MB_SAMPLES * 8];
+    int n = 0;
+    for (int i = 0; i < na; i++)
+        all[n].v = a[i], all[n++].from_a = 1;
+    for (int i = 0; i < nb; i++)
+        all[n].v = b[i], all[n++].from_a = 0;
+    for (int i = 1; i < n; i++) { // insertion sort, n is small
+        for (int j = i; j > 0 && all[j - 1].v > all[j].v; j--) {
+            __typeof__(all[0]) t = all[j];
+            all[j] = all[j - 1];
+            all[j - 1] = t;
+        }
+    }
+
+    double rank_a = 0;
+    for (int i = 0; i < n;) {
+        int j = i;
+        while (j < n && all[j].v == all[i].v)
+            j++;
+        double rank = (i + 1 + j) / 2.0;
+        for (int k = i; k < j; k++)
+            rank_a += all[k].from_a ? rank : 0;
+        i = j;
+    }
+    double u = rank_a - na * (na + 1) / 2.0;
+    double mu = na * nb / 2.0;
+    double sigma = sqrt(na * nb * (na + nb + 1) / 12.0);
+    return sigma > 0 ? erfc(fabs(u - mu) / sigma / sqrt(2.0)) : 1.0;
+}
+
+static int load_baseline(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open baseline %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[BASELINE_LINE_MAX];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        baseline_case* grown = realloc(baseline, (baseline_count + 1) * sizeof(baseline_case));
+        if (!grown) {
+            perror("Error: failed to read baseline");
+            fclose(f);
+            return -1;
+        }
+        baseline = grown;
+        baseline_case* b = &baseline[baseline_count];
+        char* save;
+        char* name = strtok_r(line, " \n", &save);
+        snprintf(b->name, sizeof(b->name), "%s", name);
+        b->count = 0;
+        for (char* v; b->count < MB_SAMPLES * 4 && (v = strtok_r(NULL, " \n", &save));)
+            b->ns[b->count++] = strtod(v, NULL);
+        if (b->count)
+            baseline_count++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static const baseline_case* find_baseline(const char* name)
+{
+    for (int i = 0; i < baseline_count; i++) {
+        if (strcmp(baseline[i].name, name) == 0)
+            return &baseline[i];
+    }
+    return NULL;
+}
+
+// run the case until it has been going for at least ms
+static long run_for(const mb_case* c, void* state, uint64_t ms)
+{
+    long iterations = 1, total = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        c->run(state, iterations);
+        total += iterations;
+        if (iterations < (1L << 30))
+            iterations *= 2;
+        elapsed = now_ns() - start;
+    } while (elapsed < ms * 1000000);
+    return (long)((double)total * ms * 1000000 / elapsed) + 1; // iterations that take about ms
+}
+
+// returns 1 for a regression, -1 when the case couldn't run
+static int bench_case(const mb_case* c, FILE* save)
+{
+    void* state = c->setup ? c->setup() : NULL;
+    if (c->setup && !state) {
+        printf("%-28s skipped, could not be set up here\n", c->name);
+        return -1;
+    }
+
+    run_for(c, state, MB_WARMUP_MS);
+    long iterations = run_for(c, state, MB_SAMPLE_MS);
+    double ns[MB_SAMPLES * 4], cycles[MB_SAMPLES * 4];
+    for (int i = 0; i < sample_count; i++) {
+        uint64_t c0 = cycles_now(), t0 = now_ns();
+        c->run(state, iterations);
+        uint64_t t1 = now_ns(), c1 = cycles_now();
+        ns[i] = (double)(t1 - t0) / iterations;
+        cycles[i] = (double)(c1 - c0) / iterations;
+    }
+    if (c->teardown)
+        c->teardown(state);
+
+    double m = median(ns, sample_count);
+    printf("%-28s %10.1f %8.1f", c->name, m, median_deviation(ns, sample_count, m));
+    if (cycles_from != CYCLES_NONE)
+        printf(" %11.1f", median(cycles, sample_count));
+    else
+        printf(" %11s", "-");
+
+    int regressed = 0;
+    const baseline_case* b = find_baseline(c->name);
+    if (b) {
+        double bm = median(b->ns, b->count);
+        double change = (m - bm) / bm * 100;
+        double p = mann_whitney_p(ns, sample_count, b->ns, b->count);
+        regressed = p < MB_REGRESSION_P && change >= MB_REGRESSION_PCT;
+        printf(" %10.1f %+8.1f%% %8.4f%s", bm, change, p, regressed ? "  REGRESSED" : p < MB_REGRESSION_P && change <= -MB_REGRESSION_PCT ? "  faster" : "");
+    }
+    putchar('\n');
+    fflush(stdout);
+
+    if (save) {
+        fprintf(save, "%s", c->name);
+        for (int i = 0; i < sample_count; i++)
+            fprintf(save, " %.3f", ns[i]);
+        fprintf(save, "\n");
+    }
+    return regressed;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: microbench [-b baseline] [-w new-baseline] [-f name-filter] [-s samples]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    const char *baseline_path = NULL, *save_path = NULL, *filter = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:f:s:")) != -1) {
+        switch (opt) {
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'w':
+            save_path = optarg;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 's':
+            sample_count = atoi(optarg);
+            if (sample_count < 5 || sample_count > MB_SAMPLES * 4)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (baseline_path && load_baseline(baseline_path) == -1)
+        return EXIT_FAILURE;
+
+    FILE* save = NULL;
+    if (save_path) {
+        save = fopen(save_path, "w");
+        if (!save) {
+            fprintf(stderr, "Error: cannot write baseline %s: %s\n", save_path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        fprintf(save, "# microbench baseline: case, then ns per operation for each sample\n");
+    }
+
+    // stay on one CPU, so a migration doesn't land in a sample
+    int cpu = sched_getcpu();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (cpu == -1 || sched_setaffinity(0, sizeof(set), &set) == -1)
+        perror("Warning: cannot pin to a CPU");
+    cycles_init();
+    const char* cycles_name[] = { "-", "perf_event cycles", "rdtsc reference cycles" };
+    printf("%d samples of about %dms per case, cycles from %s\n", sample_count, MB_SAMPLE_MS, cycles_name[cycles_from]);
+    printf("%-28s %10s %8s %11s", "case", "ns/op", "+-mad", "cycles/op");
+    if (baseline_path)
+        printf(" %10s %9s %8s", "baseline", "change", "p");
+    putchar('\n');
+
+    int regressions = 0;
+    for (const mb_case* c = mb_cases; c->name; c++) {
+        if (!filter || strstr(c->name, filter))
+            regressions += bench_case(c, save) == 1;
+    }
+
+    if (save && fclose(save) == EOF) {
+        perror("Error: failed to write baseline");
+        return EXIT_FAILURE;
+    }
+    if (regressions)
+        printf("%d case%s regressed against %s\n", regressions, regressions == 1 ? "" : "s", baseline_path);
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
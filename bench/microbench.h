@@ -0,0 +1,28 @@
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+#include <stdint.h>
+
+#define MB_WARMUP_MS 100 // run before measuring, to fill caches and settle the clock
+#define MB_SAMPLE_MS 10 // each sample runs about this long
+#define MB_SAMPLES 30
+#define MB_REGRESSION_P 0.01 // a slowdown must be this unlikely to be noise
+#define MB_REGRESSION_PCT 10.0 // and at least this large to fail the run
+
+// keep the compiler from dropping a result nobody reads
+#define mb_keep(x) __asm__ __volatile__("" : : "g"(x) : "memory")
+
+// A case runs its operation `iterations` times per call, so the loop is
+// the case's own and a function call isn't timed with every operation.
+// setup returns the state passed to run, or NULL when the case can't run
+// here; teardown gets it back.
+typedef struct {
+    const char* name;
+    void* (*setup)(void);
+    void (*run)(void* state, long iterations);
+    void (*teardown)(void* state);
+} mb_case;
+
+extern const mb_case mb_cases[]; // ends with a case without a name
+
+#endif /* MICROBENCH_H */
@@ -0,0 +1,141 @@
+#!/usr/bin/env bash
+# End-to-end benchmark for webserv. Starts the server in each mode against the
+# fixture tree in static/bench/, sweeps closed-loop concurrency levels, then
+# runs open-loop passes at fractions of the best closed-loop throughput.
+# Results are written as one JSON document (default: bench_results.json).
+#
+# Tunables (environment):
+#   BENCH_MODES        modes to run (default: "fork threaded cached")
+#   BENCH_CONCURRENCY  closed-loop connection counts (default: "1 4 16 64")
+#   BENCH_OPEN_LOAD    open-loop rates as % of peak throughput (default: "50 90")
+#   BENCH_DURATION     seconds measured per run (default: 5)
+#   BENCH_WARMUP       seconds discarded per run (default: 1)
+#   BENCH_PORT         port webserv listens on (default: 5410)
+#   BENCH_OUTPUT       output file (default: bench_results.json)
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+LOADGEN="$ROOT/bench/loadgen"
+WEBSERV="$ROOT/webserv"
+
+MODES="${BENCH_MODES:-fork threaded cached}"
+CONCURRENCY="${BENCH_CONCURRENCY:-1 4 16 64}"
+OPEN_LOAD="${BENCH_OPEN_LOAD:-50 90}"
+DURATION="${BENCH_DURATION:-5}"
+WARMUP="${BENCH_WARMUP:-1}"
+PORT="${BENCH_PORT:-5410}"
+OUTPUT="${BENCH_OUTPUT:-$ROOT/bench_results.json}"
+CACHE_SIZE=2097152
+
+FIXTURES=(/static/bench/small.html /static/bench/medium.html /static/bench/large.txt)
+
+export WEBROOT_PATH="$ROOT"
+server_pid=""
+SERVER_LOG="$(mktemp)"
+
+mode_args() {
+    case "$1" in
+    fork) echo "-p $PORT" ;;
+    threaded) echo "-p $PORT -t" ;;
+    cached) echo "-p $PORT -c $CACHE_SIZE" ;;
+    *)
+        echo "unknown bench mode: $1" >&2
+        exit 1
+        ;;
+    esac
+}
+
+stop_server() {
+    if [ -n "$server_pid" ]; then
+        kill -INT "$server_pid" 2>/dev/null || true
+        wait "$server_pid" 2>/dev/null || true
+        server_pid=""
+    fi
+}
+trap 'stop_server; rm -f "$SERVER_LOG"' EXIT
+
+# wait for the startup banner rather than probing the port: an empty probe
+# connection gets a 404 written to a closed socket, and the SIGPIPE from that
+# takes down the single-process threaded server
+start_server() {
+    # shellcheck disable=SC2046
+    (cd "$ROOT" && exec "$WEBSERV" $(mode_args "$1")) >"$SERVER_LOG" 2>&1 &
+    server_pid=$!
+    for _ in $(seq 50); do
+        if grep -q "Listening to client requests" "$SERVER_LOG"; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "webserv ($1) did not start listening on port $PORT" >&2
+    exit 1
+}
+
+# run loadgen and wrap its JSON with the mode and fixture set
+run_loadgen() {
+    local mode="$1"
+    shift
+    local url_args=()
+    for f in "${FIXTURES[@]}"; do
+        url_args+=(-u "$f")
+    done
+    local json
+    json="$("$LOADGEN" -p "$PORT" -d "$DURATION" -w "$WARMUP" "${url_args[@]}" "$@")"
+    printf '{"mode": "%s", "result": %s}' "$mode" "$json"
+}
+
+# pull throughput_rps out of a loadgen result without needing jq
+throughput_of() {
+    sed -n 's/.*"throughput_rps": \([0-9.]*\).*/\1/p' <<<"$1" | head -n1
+}
+
+{
+    printf '{\n'
+    printf '  "schema": 1,\n'
+    printf '  "revision": "%s",\n' "$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+    printf '  "timestamp": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf '  "host": {"cpus": %s, "kernel": "%s"},\n' "$(nproc)" "$(uname -r)"
+    printf '  "runs": [\n'
+} >"$OUTPUT"
+
+first=1
+emit() {
+    if [ $first -eq 0 ]; then
+        printf ',\n' >>"$OUTPUT"
+    fi
+    first=0
+    printf '    %s' "$(tr -d '\n' <<<"$1")" >>"$OUTPUT"
+}
+
+for mode in $MODES; do
+    echo "== $mode ==" >&2
+    start_server "$mode"
+
+    peak=0
+    for c in $CONCURRENCY; do
+        echo "   closed loop, $c connections" >&2
+        res="$(run_loadgen "$mode" -c "$c")"
+        emit "$res"
+        rps="$(throughput_of "$res")"
+        peak="$(awk -v a="$peak" -v b="$rps" 'BEGIN { print (b > a) ? b : a }')"
+    done
+
+    if [ "$(awk -v p="$peak" 'BEGIN { print (p > 0) }')" -eq 0 ]; then
+        echo "   no successful requests, skipping open loop" >&2
+        stop_server
+        continue
+    fi
+
+    max_c="$(tr ' ' '\n' <<<"$CONCURRENCY" | sort -n | tail -n1)"
+    for pct in $OPEN_LOAD; do
+        rate="$(awk -v p="$peak" -v f="$pct" 'BEGIN { r = p * f / 100; print (r < 1) ? 1 : r }')"
+        echo "   open loop, $pct% of peak ($rate req/s)" >&2
+        emit "$(run_loadgen "$mode" -c "$max_c" -r "$rate")"
+    done
+
+    stop_server
+done
+
+printf '\n  ]\n}\n' >>"$OUTPUT"
+echo "results written to $OUTPUT" >&2
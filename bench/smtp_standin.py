@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# A local SMTP relay for testing the mail queue. It advertises PIPELINING,
+# takes any sender, and answers recipients by their local part:
+#   defer...   451 the first time that address is seen, 250 afterwards
+#   reject...  550 every time
+#   anything else  250
+# Every transaction's outcome is appended to the log as one line,
+# "<delivered|deferred|rejected> <recipient> <message bytes>", and the
+# delivered messages are kept as <dir>/<n>.eml.
+#
+# usage: smtp_standin.py port log dir
+
+import os, socketserver, sys, threading
+
+port, log_path, out_dir = int(sys.argv[1]), sys.argv[2], sys.argv[3]
+lock = threading.Lock()
+seen = set()
+delivered = 0
+
+
+def record(outcome, rcpt, size=0):
+    with lock, open(log_path, "a") as log:
+        log.write("%s %s %d\n" % (outcome, rcpt, size))
+
+
+class Session(socketserver.StreamRequestHandler):
+    def reply(self, line):
+        self.wfile.write((line + "\r\n").encode())
+
+    def handle(self):
+        global delivered
+        self.reply("220 localhost SMTP stand-in")
+        rcpt = None
+        while True:
+            line = self.rfile.readline()
+            if not line:
+                return
+            cmd = line.decode(errors="replace").strip()
+            verb = cmd[:4].upper()
+            if verb in ("EHLO", "HELO"):
+                self.wfile.write(b"250-localhost\r\n250-PIPELINING\r\n250 8BITMIME\r\n")
+            elif verb == "MAIL":
+                rcpt = None
+                self.reply("250 sender ok")
+            elif verb == "RCPT":
+                addr = cmd[cmd.find("<") + 1:cmd.rfind(">")]
+                local = addr.split("@")[0]
+                with lock:
+                    first = addr not in seen
+                    seen.add(addr)
+                if local.startswith("reject"):
+                    record("rejected", addr)
+                    self.reply("550 no such user")
+                elif local.startswith("defer") and first:
+                    record("deferred", addr)
+                    self.reply("451 try again later")
+                else:
+                    rcpt = addr
+                    self.reply("250 recipient ok")
+            elif verb == "DATA":
+                if rcpt is None:
+                    self.reply("503 no valid recipients")
+                    continue
+                self.reply("354 end with <CRLF>.<CRLF>")
+                body = b""
+                while True:
+                    line = self.rfile.readline()
+                    if not line:
+                        return
+                    if line == b".\r\n":
+                        break
+                    body += line[1:] if line.startswith(b"..") else line
+                with lock:
+                    delivered += 1
+                    n = delivered
+                with open(os.path.join(out_dir, "%d.eml" % n), "wb") as f:
+                    f.write(body)
+                record("delivered", rcpt, len(body))
+                rcpt = None
+                self.reply("250 queued as %d" % n)
+            elif verb == "RSET":
+                rcpt = None
+                self.reply("250 ok")
+            elif verb == "NOOP":
+                self.reply("250 ok")
+            elif verb == "QUIT":
+                self.reply("221 bye")
+                return
+            else:
+                self.reply("500 unrecognised command")
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+server = Server(("127.0.0.1", port), Session)
+print("listening on %d" % port, flush=True)
+server.serve_forever()
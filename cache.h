@@ -41,7 +41,12 @@ typedef struct {
     long size;
     int is_used;
     unsigned int offset;
-    int shm_id;
+    int shm_id; // -1 while the content still lives in the snapshot image
+    char path[FILENAME_MAX_LENGTH]; // source file, empty for proxied entries
+    struct timespec mtime; // source file metadata, checked after a restart
+    ino_t ino;
+    int restored; // loaded from a snapshot and not yet revalidated
+    long image_offset; // where a restored entry's content sits in the image
 } CacheEntry;
 
 // Define cache structure
@@ -51,13 +56,20 @@ typedef struct {
     char* contents;
     int current_size;
     int size_limit;
+    long small_object_max; // larger files are left to the disk tier when it is enabled
+    unsigned long generation; // bumped on every insert or eviction, snapshots skip unchanged caches
     sem_t *mutex;
 } Cache;
 
 // Function prototypes
 unsigned long generate_simple_hash(const char* str);
 Cache* initialize_cache(size_t size_limit);
-CacheEntry* fetch_file(Cache* cache, const char* filename, char* query, char* short_file_path);
+unsigned long cache_key(const char* filename, const char* query);
+CacheEntry* cache_lookup(Cache* cache, unsigned long file_id);
+CacheEntry* cache_insert(Cache* cache, unsigned long file_id, const char* data, long size);
+void cache_detach(CacheEntry* entry);
+CacheEntry* fetch_file(Cache* cache, const char* filename, const char* query);
+void cache_evict(Cache* cache, CacheEntry* entry);
 void cleanup_cache(Cache* cache);
 
 #endif /* CACHE_H */
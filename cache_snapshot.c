@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+
+#include "cache_snapshot.h"
+#include "metrics.h"
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SNAPSHOT_MAGIC 0x57534353 // "WSCS"
+#define SNAPSHOT_VERSION 1
+
+// An image is this header, count records, then the contents back to back.
+// The checksum covers everything after the header.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size; // catches a layout change that forgot the version
+    uint32_t count;
+    uint64_t data_len;
+    uint64_t checksum;
+    int64_t created;
+} snapshot_header;
+
+typedef struct {
+    uint64_t file_id;
+    int64_t size;
+    int64_t offset; // into the data section
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    char path[FILENAME_MAX_LENGTH];
+} snapshot_record;
+
+static char snapshot_path[MAX_PATH_LEN];
+static char* image_data = NULL; // data section of the image mapped at startup
+static unsigned long saved_generation = 0;
+static time_t last_save = 0;
+
+static uint64_t checksum(const void* data, size_t len)
+{
+    const unsigned char* p = data;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i]; // FNV-1a
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static time_t now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// content of an entry that has not been copied out of the image
+char* cache_snapshot_content(const CacheEntry* entry)
+{
+    return image_data + entry->image_offset;
+}
+
+// check a restored entry against its file on first use, -1 if it changed
+int cache_snapshot_revalidate(CacheEntry* entry)
+{
+    struct stat st;
+    if (stat(entry->path, &st) == -1 || st.st_size != entry->size || st.st_ino != entry->ino
+        || st.st_mtim.tv_sec != entry->mtime.tv_sec || st.st_mtim.tv_nsec != entry->mtime.tv_nsec) {
+        metrics_counter_add(&metrics->cache_snapshot_stale, 1);
+        return -1;
+    }
+    entry->restored = 0;
+    return 0;
+}
+
+static const char* check_image(const char* image, size_t image_len)
+{
+    const snapshot_header* h = (const snapshot_header*)image;
+    if (image_len < sizeof(*h) || h->magic != SNAPSHOT_MAGIC)
+        return "not a cache snapshot";
+    if (h->version != SNAPSHOT_VERSION || h->record_size != sizeof(snapshot_record))
+        return "written by a different version";
+    if (image_len != sizeof(*h) + (uint64_t)h->count * sizeof(snapshot_record) + h->data_len)
+        return "truncated";
+    if (checksum(image + sizeof(*h), image_len - sizeof(*h)) != h->checksum)
+        return "checksum mismatch";
+    return NULL;
+}
+
+// map the image at path, if there is a valid one, and index its entries
+// without copying them; each one is checked against its file on first hit.
+// Call before forking so children share the mapping. Returns entries restored.
+int cache_snapshot_init(Cache* cache, const char* path)
+{
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s", path);
+    last_save = now_s();
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            perror("Error: failed to open cache snapshot");
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    char* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        perror("Error: failed to map cache snapshot");
+        return 0;
+    }
+
+    const char* problem = check_image(image, st.st_size);
+    if (problem) {
+        printf("Ignoring cache snapshot %s: %s.\n", path, problem);
+        munmap(image, st.st_size);
+        return 0;
+    }
+
+    const snapshot_header* h = (const snapshot_header*)image;
+    const snapshot_record* records = (const snapshot_record*)(image + sizeof(*h));
+    image_data = image + sizeof(*h) + h->count * sizeof(snapshot_record);
+
+    int restored = 0;
+    for (uint32_t i = 0; i < h->count && restored < MAX_CACHE_ENTRIES; i++) {
+        const snapshot_record* r = &records[i];
+        if (r->size > cache->small_object_max || cache->current_size + r->size > cache->size_limit)
+            continue; // the cache was shrunk since the snapshot
+
+        CacheEntry* e = &cache->entries[restored++];
+        memset(e, 0, sizeof(*e));
+        e->file_id = r->file_id;
+        e->size = r->size;
+        e->is_used = 1;
+        e->shm_id = -1;
+        memcpy(e->path, r->path, sizeof(e->path));
+        e->path[sizeof(e->path) - 1] = '\0';
+        e->mtime.tv_sec = r->mtime_sec;
+        e->mtime.tv_nsec = r->mtime_nsec;
+        e->ino = r->ino;
+        e->restored = 1;
+        e->image_offset = r->offset;
+        cache->current_size += r->size;
+    }
+
+    saved_generation = cache->generation;
+    metrics_counter_add(&metrics->cache_snapshot_restored, restored);
+    printf("Restored %d cache entries (%d bytes) from %s.\n", restored, cache->current_size, path);
+    return restored;
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// copy the cache into an image under the lock, then write it out and
+// rename it over the previous one so a crash mid-write leaves that intact.
+// Proxied entries are left out: there is no file to revalidate them against.
+int cache_snapshot_save(Cache* cache)
+{
+    if (!cache || !snapshot_path[0])
+        return -1;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CACHE_SNAPSHOT_LOCK_WAIT_S;
+    if (sem_timedwait(cache->mutex, &deadline) == -1)
+        return -1;
+    last_save = now_s();
+    if (cache->generation == saved_generation) {
+        sem_post(cache->mutex);
+        return 0;
+    }
+
+    uint32_t count = 0;
+    uint64_t data_len = 0;
+    for (int i = 0; i < MAX_CACHE_ENTRIES; i++) {
+        if (cache->entries[i].is_used && cache->entries[i].path[0]) {
+            count++;
+            data_len += cache->entries[i].size;
+        }
+    }
+
+    size_t image_len = sizeof(snapshot_header) + count * sizeof(snapshot_record) + data_len;
+    char* image = calloc(1, image_len);
+    if (!image) {
+        sem_post(cache->mutex);
+        perror("Error: failed to allocate cache snapshot");
+        return -1;
+    }
+    snapshot_header* h = (snapshot_header*)image;
+    snapshot_record* records = (snapshot_record*)(image + sizeof(*h));
+    char* data = image + sizeof(*h) + count * sizeof(snapshot_record);
+
+    uint32_t n = 0;
+    uint64_t offset = 0;
+    for (int i = 0; i < MAX_CACHE_ENTRIES && n < count; i++) {
+        CacheEntry* e = &cache->entries[i];
+        if (!e->is_used || !e->path[0])
+            continue;
+
+        char* content = e->shm_id == -1 ? cache_snapshot_content(e) : shmat(e->shm_id, NULL, SHM_RDONLY);
+        if (content == (void*)-1)
+            continue;
+        memcpy(data + offset, content, e->size);
+        if (e->shm_id != -1)
+            shmdt(content);
+
+        snapshot_record* r = &records[n++];
+        r->file_id = e->file_id;
+        r->size = e->size;
+        r->offset = offset;
+        r->mtime_sec = e->mtime.tv_sec;
+        r->mtime_nsec = e->mtime.tv_nsec;
+        r->ino = e->ino;
+        memcpy(r->path, e->path, sizeof(r->path));
+        offset += e->size;
+    }
+    unsigned long generation = cache->generation;
+    sem_post(cache->mutex);
+
+    // entries that failed to attach leave a gap at the end, trim it
+    image_len -= (count - n) * sizeof(snapshot_record) + (data_len - offset);
+    memmove(image + sizeof(*h) + n * sizeof(snapshot_record), data, offset);
+    h->magic = SNAPSHOT_MAGIC;
+    h->version = SNAPSHOT_VERSION;
+    h->record_size = sizeof(snapshot_record);
+    h->count = n;
+    h->data_len = offset;
+    h->created = time(NULL);
+    h->checksum = checksum(image + sizeof(*h), image_len - sizeof(*h));
+
+    char tmp_path[MAX_PATH_LEN + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+    int fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd == -1 || write_all(fd, image, image_len) == -1 || fsync(fd) == -1) {
+        perror("Error: failed to write cache snapshot");
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(image);
+        return -1;
+    }
+    close(fd);
+    free(image);
+
+    if (rename(tmp_path, snapshot_path) == -1) {
+        perror("Error: failed to replace cache snapshot");
+        unlink(tmp_path);
+        return -1;
+    }
+    saved_generation = generation;
+    metrics_counter_add(&metrics->cache_snapshot_saves, 1);
+    return 0;
+}
+
+// periodic snapshot, called from the accept loop
+void cache_snapshot_tick(Cache* cache)
+{
+    if (cache && now_s() - last_save >= CACHE_SNAPSHOT_INTERVAL_S)
+        cache_snapshot_save(cache);
+}
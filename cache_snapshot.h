@@ -0,0 +1,16 @@
+#ifndef CACHE_SNAPSHOT_H
+#define CACHE_SNAPSHOT_H
+
+#include "cache.h"
+
+#define CACHE_SNAPSHOT_PATH_FORMAT "/var/tmp/webserv-%d.snapshot" // one image per port
+#define CACHE_SNAPSHOT_INTERVAL_S 60 // how often the accept loop writes a changed cache out
+#define CACHE_SNAPSHOT_LOCK_WAIT_S 1 // give up on a snapshot rather than stall behind a stuck lock
+
+int cache_snapshot_init(Cache* cache, const char* path);
+int cache_snapshot_save(Cache* cache);
+void cache_snapshot_tick(Cache* cache);
+int cache_snapshot_revalidate(CacheEntry* entry);
+char* cache_snapshot_content(const CacheEntry* entry);
+
+#endif /* CACHE_SNAPSHOT_H */
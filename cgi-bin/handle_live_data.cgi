@@ -1,37 +1,38 @@
 #!/usr/bin/env python3
-import serial, os
-import matplotlib.pyplot as plt
+import os, socket
 from datetime import datetime
 
-def find_arduino_port():
-    for i in range(10):
-        try:
-            ard = serial.Serial(port=f"/dev/ttyACM{i}", baudrate=9600, timeout=0.1)
-            ard.close()
-            return i
-        except:
-            continue
-
-    return -1   
-
 def handle_serial_read():
-    arduino = serial.Serial(port=f"/dev/ttyACM{port_num}", baudrate=9600, timeout=0.1)
-
-    while True:
-        data = arduino.read_until().decode('utf-8').strip()
-        if data != "":
-            arduino.close()
-            return data
+    # webserv's device process owns the serial port and keeps the latest total
+    path = os.environ.get('WEBSERV_DEVICE_SOCKET')
+    if not path:
+        return None
+
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as conn:
+            conn.settimeout(3)
+            conn.connect(path)
+            conn.send(b"- count")
+            reply = conn.recv(128).decode('utf-8').split()
+    except OSError:
+        return None
+
+    return reply[2] if len(reply) == 3 and reply[0] == "ok" else None
         
-def handle_file_write(data):
-    is_fresh = False
-    
-    with open('static/live_data.txt', 'r') as file:
-        file_data = file.readlines()
-        last_data = file_data[-1].strip() if file_data else ""
+def last_line(path):
+    # only the end of the file, however long the session gets
+    try:
+        with open(path, 'rb') as file:
+            file.seek(0, os.SEEK_END)
+            file.seek(max(0, file.tell() - 64))
+            lines = file.read().decode('utf-8').splitlines()
+            return lines[-1].strip() if lines else ""
+    except OSError:
+        return ""
 
-        if last_data == "" or int(last_data) != int(data):
-            is_fresh = True
+def handle_file_write(data):
+    last_data = last_line('static/live_data.txt')
+    is_fresh = last_data == "" or int(last_data) != int(data)
 
     if is_fresh:
         # Write data to the data file, and the time associated with the data gathered in the time file
@@ -44,7 +45,11 @@ def handle_file_write(data):
         with open('static/live_time.txt', 'a+') as file:
             file.write(f"{current_time}\n")
 
+    return is_fresh
+
 def handle_plot():
+    import matplotlib.pyplot as plt
+
     x_vals = []
     y_vals = []
 
@@ -78,12 +83,12 @@ def handle_plot():
     plt.savefig('static/live_plot.png')
         
 if __name__ == "__main__":
-    port_num = find_arduino_port()
+    data = handle_serial_read()
 
-    if port_num == -1:
+    if data is None:
         print(f"Content-type: text/plain\n\nError: Cannot find Arduino on any ACM port.\n")
     else:
-        data = handle_serial_read()
-        handle_file_write(data)
-        handle_plot()
+        # the plot only changes with the data, polls in between reuse it
+        if handle_file_write(data) or not os.path.exists('static/live_plot.png'):
+            handle_plot()
         print(f"Content-type: text/plain\n\n{data}\n")
\ No newline at end of file
@@ -1,30 +1,63 @@
 #!/usr/bin/env python3
-import matplotlib.pyplot as plt
+import os
+from datetime import datetime
 
-x_vals = []
-y_vals = []
+def last_line(path):
+    # only the end of the file, however long the history gets
+    try:
+        with open(path, 'rb') as file:
+            file.seek(0, os.SEEK_END)
+            file.seek(max(0, file.tell() - 512))
+            lines = file.read().decode('utf-8').splitlines()
+            return lines[-1] if lines else ""
+    except OSError:
+        return ""
 
-with open('static/attendance_data.txt', 'r') as file:
-    x = 1
-    data = file.readline()
-    if data == "":
-        print(f"Content-type: text/plain\n\nNo data saved to be plotted! Please save data by clicking reset and clicking the yes button.\n")
-        
-    while data != "":
-        y = int(data.replace(data.lstrip('0123456789'), ''))
-        x_vals.append(x)
-        y_vals.append(y)
+def handle_plot():
+    # the history only grows when a session is saved, so the plot is redrawn then and reused otherwise
+    data_path, plot_path = 'static/attendance_data.txt', 'static/attendance_plot.png'
+    if os.path.exists(plot_path) and os.path.getmtime(plot_path) >= os.path.getmtime(data_path):
+        return
 
-        # read next line in file
+    import matplotlib.pyplot as plt
+
+    x_vals = []
+    y_vals = []
+
+    with open(data_path, 'r') as file:
+        x = 1
         data = file.readline()
-        x += 1
+        if data == "":
+            print(f"Content-type: text/plain\n\nNo data saved to be plotted! Please save data by clicking reset and clicking the yes button.\n")
+
+        while data != "":
+            y = int(data.replace(data.lstrip('0123456789'), ''))
+            x_vals.append(x)
+            y_vals.append(y)
+
+            # read next line in file
+            data = file.readline()
+            x += 1
 
-# Plot x and y values
-plt.plot(x_vals, y_vals)
-plt.xlabel('Data Session Number')
-plt.ylabel('Attendance Value')
-plt.title('Attendance Trends Per Data Session')
-plt.savefig('static/attendance_plot.png')
+    # Plot x and y values
+    plt.plot(x_vals, y_vals)
+    plt.xlabel('Data Session Number')
+    plt.ylabel('Attendance Value')
+    plt.title('Attendance Trends Per Data Session')
+    plt.savefig(plot_path)
+
+def session_summary():
+    # the statistics webserv saved with the last session, see attendance_sessions.txt
+    fields = last_line('static/attendance_sessions.txt').split()
+    if len(fields) != 8 or fields[0].startswith('#'):
+        return ""
+    started, ended, total, peak, peak_at, entries, exits, occupancy_s = map(int, fields)
+    mean = occupancy_s / (ended - started) if ended > started else float(total)
+    peak_time = datetime.fromtimestamp(peak_at).strftime("%H:%M")
+    return f"Last session: {total} at the end, peak {peak} at {peak_time}, {entries} entered, {exits} left, {mean:.1f} present on average"
+
+handle_plot()
+summary = session_summary()
 
 # Generate the HTML page
 html_content = f"""
@@ -41,6 +74,9 @@ html_content = f"""
                 color: red;
                 text-align: center;
             }}
+            p {{
+                text-align: center;
+            }}
             img {{
                 display: block;
                 margin: auto;
@@ -72,6 +108,7 @@ html_content = f"""
         <h1>Attendance Data Plot</h1>
         <br>
         <img src="/static/attendance_plot.png" alt="Histogram">
+        <p>{summary}</p>
         <form id="returnForm">
             <input type="button" id="return-btn" value="Return" onclick="window.location.href = '../cgi-bin/serial_com_html_res.cgi'">
         </form>
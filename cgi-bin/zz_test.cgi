@@ -0,0 +1,2 @@
+#!/bin/sh
+printf "Content-type: text/plain\r\n\r\nhi $QUERY_STRING\n"
@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+
+#include "device.h"
+#include "analytics.h"
+#include "metrics.h"
+#include "my_threads.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// The device process owns every serial port: it reads the totals the
+// firmware prints, and sends commands one at a time per device as
+// "@<id> <command>", resending until the firmware answers "ack <id>" or
+// "nak <id> <reason>". The firmware applies an id once, so a resend after a
+// lost ack is harmless. Handlers and scripts reach it over a seqpacket
+// socket: one connection per request, "<device|-> <command>" in and
+// "<status> <device> [detail]" back. Every total and acknowledged command
+// is also fed to the session analytics.
+
+// a command waiting for its ack, the caller's connection gets the reply
+typedef struct {
+    int client_fd;
+    unsigned id;
+    int attempts;
+    uint64_t deadline_ms;
+    char line[DEVICE_LINE_MAX];
+} device_cmd;
+
+typedef struct {
+    char path[DEVICE_PATH_MAX];
+    int fd;
+    unsigned next_id;
+    uint64_t next_open_ms;
+    size_t len; // bytes of the current line in buf
+    int overflow; // the current line didn't fit, drop it
+    char buf[DEVICE_LINE_MAX];
+    int head; // queue[head] is in flight
+    int queued;
+    device_cmd queue[DEVICE_QUEUE_MAX];
+} device_port;
+
+static device_status* status = NULL;
+static int port_count = 0;
+static device_port ports[DEVICE_MAX];
+static char command_socket[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static volatile sig_atomic_t device_stop = 0;
+
+static const char* result_names[] = { "ok", "nak", "timeout", "busy", "absent", "error" };
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+const char* device_result_name(device_result r)
+{
+    return result_names[r];
+}
+
+// the slot for name, or the first connected one when name is NULL or "-"
+static int find_slot(const char* name)
+{
+    for (int i = 0; i < port_count; i++) {
+        if (name && strcmp(name, "-") != 0) {
+            if (strcmp(status[i].name, name) == 0)
+                return i;
+        } else if (__atomic_load_n(&status[i].connected, __ATOMIC_ACQUIRE)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const device_status* device_slot(int i)
+{
+    return status && i >= 0 && i < port_count ? &status[i] : NULL;
+}
+
+// latest total printed by a connected device, -1 if there is none yet
+int device_count(const char* device, int64_t* count)
+{
+    int i = status ? find_slot(device) : -1;
+    if (i == -1 || !__atomic_load_n(&status[i].connected, __ATOMIC_ACQUIRE) || !__atomic_load_n(&status[i].updated_ms, __ATOMIC_ACQUIRE))
+        return -1;
+    *count = __atomic_load_n(&status[i].count, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// send a command and wait for the device process to answer, at most
+// DEVICE_COMMAND_TIMEOUT_MS; yields to other connections in threaded mode.
+// detail gets the firmware's reason for a nak, or the total for "count".
+device_result device_command(const char* device, const char* command, char* detail, size_t detail_len)
+{
+    if (detail_len)
+        detail[0] = '\0';
+    if (!status)
+        return DEVICE_ERROR;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Error: failed to create device socket");
+        return DEVICE_ERROR;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    memcpy(addr.sun_path, command_socket, sizeof(addr.sun_path));
+
+    char msg[DEVICE_LINE_MAX];
+    int len = snprintf(msg, sizeof(msg), "%s %s", device ? device : "-", command);
+    if (len >= (int)sizeof(msg) || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || send(fd, msg, len, MSG_NOSIGNAL) != len) {
+        close(fd);
+        return DEVICE_ERROR;
+    }
+
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, DEVICE_COMMAND_TIMEOUT_MS);
+    ssize_t n = fiber_recv(fd, msg, sizeof(msg) - 1, 0);
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, 0);
+    close(fd);
+    if (n <= 0) {
+        if (n == -1 && errno == ETIMEDOUT)
+            fiber_take_timeout(); // ours, not the connection's
+        return n == -1 && errno == ETIMEDOUT ? DEVICE_TIMEOUT : DEVICE_ERROR;
+    }
+    msg[n] = '\0';
+
+    // "<status> <device> [detail]"
+    char* name = strchr(msg, ' ');
+    if (name)
+        *name++ = '\0';
+    char* rest = name ? strchr(name, ' ') : NULL;
+    if (rest && detail_len) {
+        snprintf(detail, detail_len, "%s", rest + 1);
+        detail[strspn(detail, "abcdefghijklmnopqrstuvwxyz0123456789 _-")] = '\0'; // it ends up in pages
+    }
+    for (int r = DEVICE_OK; r <= DEVICE_ERROR; r++) {
+        if (strcmp(msg, result_names[r]) == 0)
+            return r;
+    }
+    return DEVICE_ERROR;
+}
+
+// answer a caller and hang up; it may have given up waiting already
+static void reply(int client_fd, device_result r, const char* name, const char* detail)
+{
+    char msg[DEVICE_LINE_MAX];
+    int len = snprintf(msg, sizeof(msg), "%s %s%s%s", result_names[r], name, detail ? " " : "", detail ? detail : "");
+    if (len >= (int)sizeof(msg))
+        len = sizeof(msg) - 1;
+    send(client_fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(client_fd);
+}
+
+static void port_transmit(device_port* p, device_cmd* cmd)
+{
+    size_t len = strlen(cmd->line);
+    if (write(p->fd, cmd->line, len) != (ssize_t)len)
+        perror("Error: short write to device"); // the next attempt sends it again
+    cmd->attempts++;
+    cmd->deadline_ms = now_ms() + DEVICE_ACK_TIMEOUT_MS;
+}
+
+// finish the command in flight and start the next one
+static void port_complete(device_port* p, device_result r, const char* detail)
+{
+    int slot = p - ports;
+    reply(p->queue[p->head].client_fd, r, status[slot].name, detail);
+    p->head = (p->head + 1) % DEVICE_QUEUE_MAX;
+    p->queued--;
+    __atomic_store_n(&status[slot].pending, p->queued, __ATOMIC_RELAXED);
+    if (p->queued)
+        port_transmit(p, &p->queue[p->head]);
+}
+
+static void port_close(device_port* p)
+{
+    int slot = p - ports;
+    close(p->fd);
+    p->fd = -1;
+    p->len = 0;
+    p->overflow = 0;
+    p->next_open_ms = now_ms() + DEVICE_SCAN_MS;
+    __atomic_store_n(&status[slot].connected, 0, __ATOMIC_RELEASE);
+    metrics_gauge_add(&metrics->device_connected, -1);
+    analytics_lost(slot);
+    while (p->queued) {
+        reply(p->queue[p->head].client_fd, DEVICE_ABSENT, status[slot].name, NULL);
+        p->head = (p->head + 1) % DEVICE_QUEUE_MAX;
+        p->queued--;
+    }
+    __atomic_store_n(&status[slot].pending, 0, __ATOMIC_RELAXED);
+    fprintf(stderr, "Device %s disconnected\n", p->path);
+}
+
+// raw 8N1 at 9600 baud, matching Serial.begin(9600); HUPCL off, so closing
+// the port doesn't pulse DTR and reboot the board a second time
+static void port_open(device_port* p)
+{
+    p->next_open_ms = now_ms() + DEVICE_SCAN_MS;
+    int fd = open(p->path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty) == 0) {
+        cfmakeraw(&tty);
+        tty.c_cflag &= ~(CSTOPB | CRTSCTS | HUPCL);
+        tty.c_cflag |= CREAD | CLOCAL;
+        cfsetispeed(&tty, B9600);
+        cfsetospeed(&tty, B9600);
+        tcsetattr(fd, TCSANOW, &tty);
+        tcflush(fd, TCIFLUSH); // totals printed before we looked are stale
+    }
+
+    int slot = p - ports;
+    p->fd = fd;
+    __atomic_store_n(&status[slot].updated_ms, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&status[slot].connected, 1, __ATOMIC_RELEASE);
+    metrics_gauge_add(&metrics->device_connected, 1);
+    fprintf(stderr, "Device %s connected\n", p->path);
+}
+
+// the firmware carried out a command: a reset ends the session, a config
+// sets the total without anybody crossing
+static void port_applied(device_port* p, const device_cmd* cmd)
+{
+    int slot = p - ports;
+    long long total;
+    const char* command = strchr(cmd->line, ' ') + 1; // after "\n@<id> "
+    if (strcmp(command, "reset\n") == 0)
+        analytics_close(slot);
+    else if (sscanf(command, "config %*d %*d %lld", &total) == 1)
+        analytics_set(slot, total);
+}
+
+// a total, or the firmware's answer to a command
+static void port_line(device_port* p, char* line)
+{
+    int slot = p - ports;
+    char* end;
+    long long total = strtoll(line, &end, 10);
+    if (end != line && *end == '\0') {
+        __atomic_store_n(&status[slot].count, total, __ATOMIC_RELAXED);
+        __atomic_store_n(&status[slot].updated_ms, now_ms(), __ATOMIC_RELEASE);
+        metrics_counter_add(&metrics->device_lines, 1);
+        analytics_observe(slot, total);
+        return;
+    }
+
+    unsigned id;
+    int reason = 0;
+    int acked = sscanf(line, "ack %u", &id) == 1;
+    if (!acked && sscanf(line, "nak %u %n", &id, &reason) < 1)
+        return;
+    if (!p->queued || p->queue[p->head].id != id)
+        return; // the ack for an attempt we already resent and got answered
+    if (acked) {
+        metrics_counter_add(&metrics->device_acks, 1);
+        port_applied(p, &p->queue[p->head]);
+        port_complete(p, DEVICE_OK, NULL);
+    } else {
+        metrics_counter_add(&metrics->device_naks, 1);
+        port_complete(p, DEVICE_NAK, reason ? line + reason : "refused");
+    }
+}
+
+static void port_read(device_port* p)
+{
+    char data[256];
+    for (;;) {
+        ssize_t n = read(p->fd, data, sizeof(data));
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            port_close(p); // unplugged
+            return;
+        }
+        if (n == -1)
+            return;
+        for (ssize_t i = 0; i < n; i++) {
+            if (data[i] == '\n') {
+                if (p->len && p->buf[p->len - 1] == '\r')
+                    p->len--;
+                p->buf[p->len] = '\0';
+                if (!p->overflow)
+                    port_line(p, p->buf);
+                p->len = 0;
+                p->overflow = 0;
+            } else if (p->len + 1 < sizeof(p->buf)) {
+                p->buf[p->len++] = data[i];
+            } else {
+                p->overflow = 1;
+            }
+        }
+    }
+}
+
+// "<device|-> <command>" from a caller; count, stats, last and save are
+// answered here, anything else is queued for the device
+static void handle_request(int client_fd, char* msg)
+{
+    char* command = strchr(msg, ' ');
+    if (!command || strpbrk(msg, "\r\n")) {
+        reply(client_fd, DEVICE_ERROR, "-", "malformed request");
+        return;
+    }
+    *command++ = '\0';
+
+    int slot = find_slot(msg);
+    device_port* p = slot == -1 ? NULL : &ports[slot];
+    if (!p || p->fd == -1) {
+        reply(client_fd, DEVICE_ABSENT, slot == -1 ? "-" : status[slot].name, NULL);
+        return;
+    }
+    if (strcmp(command, "count") == 0) {
+        char total[32];
+        snprintf(total, sizeof(total), "%lld", (long long)status[slot].count);
+        reply(client_fd, status[slot].updated_ms ? DEVICE_OK : DEVICE_ABSENT, status[slot].name, status[slot].updated_ms ? total : NULL);
+        return;
+    }
+    if (strcmp(command, "stats") == 0 || strcmp(command, "last") == 0) {
+        char line[ANALYTICS_LINE_MAX];
+        analytics_session s;
+        int found = command[0] == 's' ? status[slot].updated_ms && analytics_current(slot, &s) == 0 : analytics_last(slot, &s) == 0;
+        if (found)
+            analytics_format(&s, line, sizeof(line));
+        reply(client_fd, found ? DEVICE_OK : DEVICE_ABSENT, status[slot].name, found ? line : NULL);
+        return;
+    }
+    if (strcmp(command, "save") == 0) {
+        int saved = analytics_save(slot) == 0;
+        reply(client_fd, saved ? DEVICE_OK : DEVICE_ERROR, status[slot].name, saved ? NULL : "nothing to save");
+        return;
+    }
+    if (p->queued == DEVICE_QUEUE_MAX) {
+        reply(client_fd, DEVICE_BUSY, status[slot].name, NULL);
+        return;
+    }
+
+    // the leading newline ends whatever a cut-short earlier write left behind
+    device_cmd* cmd = &p->queue[(p->head + p->queued) % DEVICE_QUEUE_MAX];
+    cmd->client_fd = client_fd;
+    cmd->id = p->next_id++;
+    cmd->attempts = 0;
+    snprintf(cmd->line, sizeof(cmd->line), "\n@%u %s\n", cmd->id, command);
+    p->queued++;
+    __atomic_store_n(&status[slot].pending, p->queued, __ATOMIC_RELAXED);
+    metrics_counter_add(&metrics->device_commands, 1);
+    if (p->queued == 1)
+        port_transmit(p, cmd);
+}
+
+// resend commands whose ack is late, give up after DEVICE_ATTEMPTS;
+// returns the time until the next deadline
+static int expire_commands(uint64_t now)
+{
+    int timeout = DEVICE_SCAN_MS;
+    for (int i = 0; i < port_count; i++) {
+        device_port* p = &ports[i];
+        while (p->queued && p->queue[p->head].deadline_ms <= now) {
+            device_cmd* cmd = &p->queue[p->head];
+            if (cmd->attempts < DEVICE_ATTEMPTS) {
+                metrics_counter_add(&metrics->device_retries, 1);
+                port_transmit(p, cmd);
+                break;
+            }
+            metrics_counter_add(&metrics->device_timeouts, 1);
+            port_complete(p, DEVICE_TIMEOUT, NULL);
+        }
+        if (p->queued && p->queue[p->head].deadline_ms - now < (uint64_t)timeout)
+            timeout = p->queue[p->head].deadline_ms - now;
+    }
+    return timeout;
+}
+
+static void device_sigterm(int signum)
+{
+    (void)signum;
+    device_stop = 1;
+}
+
+// background process: watches the ports, reads totals and acks, and
+// serves the command socket
+static void run_device(int listen_fd)
+{
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, device_sigterm);
+    signal(SIGPIPE, SIG_IGN);
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // exit with the server
+
+    // ids start somewhere new every run, so a restarted server's first
+    // command is never taken for a resend of the last one
+    srandom(getpid() ^ time(NULL));
+    for (int i = 0; i < port_count; i++)
+        ports[i].next_id = 1 + random() % 100000; // the firmware starts at 0
+
+    int clients[DEVICE_CLIENTS_MAX];
+    int client_count = 0;
+    struct pollfd fds[1 + DEVICE_CLIENTS_MAX + DEVICE_MAX];
+    int fd_port[DEVICE_MAX];
+    while (!device_stop) {
+        uint64_t now = now_ms();
+        int timeout = expire_commands(now);
+        analytics_tick();
+        for (int i = 0; i < port_count; i++) {
+            if (ports[i].fd == -1 && ports[i].next_open_ms <= now)
+                port_open(&ports[i]);
+            if (ports[i].fd == -1 && ports[i].next_open_ms - now < (uint64_t)timeout)
+                timeout = ports[i].next_open_ms - now;
+        }
+
+        int n = 0;
+        fds[n++] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+        for (int i = 0; i < client_count; i++)
+            fds[n++] = (struct pollfd) { .fd = clients[i], .events = POLLIN };
+        int port_fds = 0;
+        for (int i = 0; i < port_count; i++) {
+            if (ports[i].fd != -1) {
+                fd_port[port_fds++] = i;
+                fds[n++] = (struct pollfd) { .fd = ports[i].fd, .events = POLLIN };
+            }
+        }
+        if (poll(fds, n, timeout) <= 0)
+            continue;
+
+        for (int i = 0; i < port_fds; i++) {
+            if (fds[1 + client_count + i].revents)
+                port_read(&ports[fd_port[i]]);
+        }
+
+        // requests arrive right behind the connect, so a caller rarely waits here
+        int kept = 0;
+        for (int i = 0; i < client_count; i++) {
+            if (!fds[1 + i].revents) {
+                clients[kept++] = clients[i];
+                continue;
+            }
+            char msg[DEVICE_LINE_MAX];
+            ssize_t len = recv(clients[i], msg, sizeof(msg) - 1, MSG_DONTWAIT);
+            if (len == -1 && errno == EAGAIN) {
+                clients[kept++] = clients[i];
+            } else if (len <= 0) {
+                close(clients[i]);
+            } else {
+                msg[len] = '\0';
+                handle_request(clients[i], msg);
+            }
+        }
+        client_count = kept;
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                if (client_count == DEVICE_CLIENTS_MAX)
+                    reply(fd, DEVICE_BUSY, "-", NULL);
+                else
+                    clients[client_count++] = fd;
+            }
+        }
+    }
+
+    for (int i = 0; i < port_count; i++) {
+        if (ports[i].fd != -1)
+            port_close(&ports[i]);
+    }
+    unlink(command_socket);
+    exit(EXIT_SUCCESS);
+}
+
+// map the shared status, bind the command socket and start the device
+// process, call before forking handlers; without paths, /dev/ttyACM0-9
+// are watched
+int device_init(const char* socket_path, char* const* paths, int path_count)
+{
+    if (path_count > DEVICE_MAX) {
+        fprintf(stderr, "Error: at most %d devices can be watched\n", DEVICE_MAX);
+        return -1;
+    }
+    if (strlen(socket_path) >= sizeof(command_socket)) {
+        fprintf(stderr, "Error: device socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    port_count = path_count ? path_count : DEVICE_MAX;
+    for (int i = 0; i < port_count; i++) {
+        device_port* p = &ports[i];
+        if (path_count && strlen(paths[i]) >= sizeof(p->path)) {
+            fprintf(stderr, "Error: device path %s is too long\n", paths[i]);
+            return -1;
+        }
+        if (path_count)
+            snprintf(p->path, sizeof(p->path), "%s", paths[i]);
+        else
+            snprintf(p->path, sizeof(p->path), DEVICE_SCAN_FORMAT, i);
+        p->fd = -1;
+    }
+
+    status = mmap(NULL, sizeof(device_status) * DEVICE_MAX, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (status == MAP_FAILED) {
+        perror("Error: failed to map device status");
+        status = NULL;
+        return -1;
+    }
+    for (int i = 0; i < port_count; i++) {
+        const char* base = strrchr(ports[i].path, '/');
+        snprintf(status[i].name, sizeof(status[i].name), "%.*s", DEVICE_NAME_MAX - 1, base ? base + 1 : ports[i].path);
+    }
+
+    // bound before the fork, so early requests wait in the backlog
+    snprintf(command_socket, sizeof(command_socket), "%s", socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    memcpy(addr.sun_path, command_socket, sizeof(addr.sun_path));
+    unlink(command_socket);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd, DEVICE_CLIENTS_MAX) == -1) {
+        perror("Error: failed to bind device socket");
+        if (listen_fd != -1)
+            close(listen_fd);
+        munmap(status, sizeof(device_status) * DEVICE_MAX);
+        status = NULL;
+        return -1;
+    }
+
+    fflush(stdout); // don't let the device process inherit buffered output
+    pid_t p = fork();
+    if (p < 0) {
+        perror("Error: cannot fork device process");
+        close(listen_fd);
+        munmap(status, sizeof(device_status) * DEVICE_MAX);
+        status = NULL;
+        return -1;
+    }
+    if (p == 0)
+        run_device(listen_fd);
+    close(listen_fd);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEVICE_SOCKET_PATH_FORMAT "/var/tmp/webserv-%d.device" // command socket, one per port
+#define DEVICE_SCAN_FORMAT "/dev/ttyACM%d" // looked at without -s, like the scripts did
+#define DEVICE_MAX 10 // serial ports watched at once
+#define DEVICE_NAME_MAX 32
+#define DEVICE_PATH_MAX 64
+#define DEVICE_SCAN_MS 1000 // retry ports that are absent or were unplugged this often
+#define DEVICE_ACK_TIMEOUT_MS 250 // per attempt; the firmware answers within one sensing loop
+#define DEVICE_ATTEMPTS 4 // sends of one command before it times out
+#define DEVICE_QUEUE_MAX 16 // commands waiting per device, more are refused as busy
+#define DEVICE_CLIENTS_MAX 64 // connections to the command socket waiting for their request
+#define DEVICE_LINE_MAX 256 // one command, reply or line from the device
+// the longest a caller waits: a full queue ahead of it, each command using every attempt
+#define DEVICE_COMMAND_TIMEOUT_MS (DEVICE_ACK_TIMEOUT_MS * DEVICE_ATTEMPTS * 2 + 500)
+
+typedef enum {
+    DEVICE_OK,
+    DEVICE_NAK, // the firmware refused the command, detail says why
+    DEVICE_TIMEOUT, // no ack after every attempt
+    DEVICE_BUSY, // the device's queue is full
+    DEVICE_ABSENT, // no such device is connected
+    DEVICE_ERROR // the device process could not be reached
+} device_result;
+
+// What the device process publishes for every port, in memory shared with
+// the handlers; one slot per configured path, fixed at init
+typedef struct {
+    char name[DEVICE_NAME_MAX]; // ttyACM0
+    int connected;
+    int64_t count; // last total the firmware printed
+    uint64_t updated_ms; // CLOCK_MONOTONIC time of that line, 0 before the first one
+    int pending; // commands queued or in flight
+} device_status;
+
+int device_init(const char* socket_path, char* const* paths, int path_count);
+device_result device_command(const char* device, const char* command, char* detail, size_t detail_len);
+int device_count(const char* device, int64_t* count);
+const device_status* device_slot(int i);
+const char* device_result_name(device_result r);
+
+#endif /* DEVICE_H */
@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+
+#include "dir_listing.h"
+#include "file_cache.h"
+#include "metrics.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DENTS_BUF_SIZE 32768
+#define ID_CACHE_SIZE 64
+#define LISTING_KEY_MAX 256
+
+// One rendered listing. Readers copy it out under a sequence lock, so a
+// child that is rewriting a slot never blocks the others.
+typedef struct {
+    uint32_t seq; // odd while the slot is being rewritten
+    uint32_t writing; // claimed by one renderer at a time
+    char key[LISTING_KEY_MAX];
+    int format;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t rendered_ms;
+    size_t len;
+    char body[DIR_LISTING_MAX_BYTES];
+} listing_slot;
+
+typedef struct {
+    char* name;
+    struct stat st;
+    int have_stat;
+} listing_entry;
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} strbuf;
+
+static listing_slot* slots = NULL;
+
+// uid/gid -> name, looked up through NSS once per process
+static struct {
+    unsigned id;
+    char name[32];
+} uid_names[ID_CACHE_SIZE], gid_names[ID_CACHE_SIZE];
+static int uid_count = 0, gid_count = 0;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const char* user_name(uid_t uid)
+{
+    for (int i = 0; i < uid_count; i++) {
+        if (uid_names[i].id == uid)
+            return uid_names[i].name;
+    }
+    int i = uid_count < ID_CACHE_SIZE ? uid_count++ : (int)(uid % ID_CACHE_SIZE);
+    struct passwd* pw = getpwuid(uid);
+    uid_names[i].id = uid;
+    if (pw)
+        snprintf(uid_names[i].name, sizeof(uid_names[i].name), "%s", pw->pw_name);
+    else
+        snprintf(uid_names[i].name, sizeof(uid_names[i].name), "%u", (unsigned)uid);
+    return uid_names[i].name;
+}
+
+static const char* group_name(gid_t gid)
+{
+    for (int i = 0; i < gid_count; i++) {
+        if (gid_names[i].id == gid)
+            return gid_names[i].name;
+    }
+    int i = gid_count < ID_CACHE_SIZE ? gid_count++ : (int)(gid % ID_CACHE_SIZE);
+    struct group* gr = getgrgid(gid);
+    gid_names[i].id = gid;
+    if (gr)
+        snprintf(gid_names[i].name, sizeof(gid_names[i].name), "%s", gr->gr_name);
+    else
+        snprintf(gid_names[i].name, sizeof(gid_names[i].name), "%u", (unsigned)gid);
+    return gid_names[i].name;
+}
+
+// format the mode as ls does, e.g. drwxr-xr-x
+static void mode_to_str(mode_t mode, char str[11])
+{
+    str[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-';
+    str[1] = (mode & S_IRUSR) ? 'r' : '-';
+    str[2] = (mode & S_IWUSR) ? 'w' : '-';
+    str[3] = (mode & S_IXUSR) ? 'x' : '-';
+    str[4] = (mode & S_IRGRP) ? 'r' : '-';
+    str[5] = (mode & S_IWGRP) ? 'w' : '-';
+    str[6] = (mode & S_IXGRP) ? 'x' : '-';
+    str[7] = (mode & S_IROTH) ? 'r' : '-';
+    str[8] = (mode & S_IWOTH) ? 'w' : '-';
+    str[9] = (mode & S_IXOTH) ? 'x' : '-';
+    str[10] = '\0';
+}
+
+static void sb_reserve(strbuf* sb, size_t extra)
+{
+    if (sb->len + extra + 1 <= sb->cap)
+        return;
+    size_t cap = sb->cap ? sb->cap : 4096;
+    while (cap < sb->len + extra + 1)
+        cap *= 2;
+    char* data = realloc(sb->data, cap);
+    if (!data) {
+        perror("Error: failed to grow directory listing");
+        exit(EXIT_FAILURE);
+    }
+    sb->data = data;
+    sb->cap = cap;
+}
+
+static void sb_append(strbuf* sb, const char* s, size_t n)
+{
+    sb_reserve(sb, n);
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+static void sb_printf(strbuf* sb, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n <= 0)
+        return;
+
+    sb_reserve(sb, n);
+    va_start(ap, fmt);
+    vsnprintf(sb->data + sb->len, n + 1, fmt, ap);
+    va_end(ap);
+    sb->len += n;
+}
+
+static void sb_html(strbuf* sb, const char* s)
+{
+    for (; *s; s++) {
+        switch (*s) {
+        case '<':
+            sb_append(sb, "&lt;", 4);
+            break;
+        case '>':
+            sb_append(sb, "&gt;", 4);
+            break;
+        case '&':
+            sb_append(sb, "&amp;", 5);
+            break;
+        case '"':
+            sb_append(sb, "&quot;", 6);
+            break;
+        default:
+            sb_append(sb, s, 1);
+        }
+    }
+}
+
+// percent-encode everything but unreserved characters and '/', for hrefs
+static void sb_url(strbuf* sb, const char* s)
+{
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-._~/", c))
+            sb_append(sb, (const char*)&c, 1);
+        else
+            sb_printf(sb, "%%%02X", c);
+    }
+}
+
+static void sb_json(strbuf* sb, const char* s)
+{
+    sb_append(sb, "\"", 1);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            sb_printf(sb, "\\%c", c);
+        else if (c < 0x20)
+            sb_printf(sb, "\\u%04x", c);
+        else
+            sb_append(sb, (const char*)&c, 1);
+    }
+    sb_append(sb, "\"", 1);
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    return strcmp(((const listing_entry*)a)->name, ((const listing_entry*)b)->name);
+}
+
+// read all names with getdents64 and stat them relative to the directory fd
+static listing_entry* read_entries(int dir_fd, int* count)
+{
+    char buf[DENTS_BUF_SIZE] __attribute__((aligned(8)));
+    listing_entry* entries = NULL;
+    int n = 0, cap = 0;
+    ssize_t nread;
+
+    while ((nread = getdents64(dir_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < nread;) {
+            struct dirent64* d = (struct dirent64*)(buf + off);
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                listing_entry* grown = realloc(entries, cap * sizeof(listing_entry));
+                if (!grown) {
+                    perror("Error: failed to allocate directory entries");
+                    exit(EXIT_FAILURE);
+                }
+                entries = grown;
+            }
+            entries[n].name = strdup(d->d_name);
+            entries[n].have_stat = fstatat(dir_fd, d->d_name, &entries[n].st, AT_SYMLINK_NOFOLLOW) == 0;
+            n++;
+        }
+    }
+    if (nread == -1)
+        perror("Error: failed to read directory");
+
+    qsort(entries, n, sizeof(listing_entry), compare_entries);
+    *count = n;
+    return entries;
+}
+
+static void render_html(strbuf* sb, const char* url_dir, listing_entry* entries, int count)
+{
+    sb_printf(sb, "<!DOCTYPE html>\n<html>\n<head><meta charset=\"utf-8\"><title>Index of ");
+    sb_html(sb, url_dir);
+    sb_printf(sb, "</title></head>\n<body>\n<h1>Index of ");
+    sb_html(sb, url_dir);
+    sb_printf(sb, "</h1>\n<table>\n<tr><th>Mode</th><th>Links</th><th>Owner</th><th>Group</th><th>Size</th><th>Modified</th><th>Name</th></tr>\n");
+    if (strcmp(url_dir, "/") != 0)
+        sb_printf(sb, "<tr><td></td><td></td><td></td><td></td><td></td><td></td><td><a href=\"../\">../</a></td></tr>\n");
+
+    for (int i = 0; i < count; i++) {
+        listing_entry* e = &entries[i];
+        int is_dir = e->have_stat && S_ISDIR(e->st.st_mode);
+        sb_append(sb, "<tr>", 4);
+        if (e->have_stat) {
+            char mode[11], mtime[32];
+            struct tm tm;
+            mode_to_str(e->st.st_mode, mode);
+            strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", localtime_r(&e->st.st_mtime, &tm));
+            sb_printf(sb, "<td>%s</td><td>%lu</td><td>", mode, (unsigned long)e->st.st_nlink);
+            sb_html(sb, user_name(e->st.st_uid));
+            sb_append(sb, "</td><td>", 9);
+            sb_html(sb, group_name(e->st.st_gid));
+            sb_printf(sb, "</td><td>%lld</td><td>%s</td>", (long long)e->st.st_size, mtime);
+        } else
+            sb_printf(sb, "<td>?</td><td></td><td></td><td></td><td></td><td></td>");
+
+        sb_append(sb, "<td><a href=\"", 13);
+        sb_url(sb, url_dir);
+        sb_url(sb, e->name);
+        if (is_dir)
+            sb_append(sb, "/", 1);
+        sb_append(sb, "\">", 2);
+        sb_html(sb, e->name);
+        if (is_dir)
+            sb_append(sb, "/", 1);
+        sb_append(sb, "</a></td></tr>\n", 15);
+    }
+    sb_printf(sb, "</table>\n</body>\n</html>\n");
+}
+
+static void render_json(strbuf* sb, const char* url_dir, listing_entry* entries, int count)
+{
+    sb_append(sb, "{\"path\":", 8);
+    sb_json(sb, url_dir);
+    sb_append(sb, ",\"entries\":[", 12);
+
+    for (int i = 0; i < count; i++) {
+        listing_entry* e = &entries[i];
+        if (i)
+            sb_append(sb, ",", 1);
+        sb_append(sb, "{\"name\":", 8);
+        sb_json(sb, e->name);
+        if (e->have_stat) {
+            char mode[11];
+            mode_to_str(e->st.st_mode, mode);
+            const char* type = S_ISDIR(e->st.st_mode) ? "dir" : S_ISREG(e->st.st_mode) ? "file" : S_ISLNK(e->st.st_mode) ? "link" : "other";
+            sb_printf(sb, ",\"type\":\"%s\",\"mode\":\"%s\",\"links\":%lu,\"owner\":", type, mode, (unsigned long)e->st.st_nlink);
+            sb_json(sb, user_name(e->st.st_uid));
+            sb_append(sb, ",\"group\":", 9);
+            sb_json(sb, group_name(e->st.st_gid));
+            sb_printf(sb, ",\"size\":%lld,\"mtime\":%lld", (long long)e->st.st_size, (long long)e->st.st_mtime);
+        }
+        sb_append(sb, "}", 1);
+    }
+    sb_append(sb, "]}\n", 3);
+}
+
+static uint32_t hash_key(const char* s, int format)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return (h ^ format) * 16777619u;
+}
+
+// copy a still-valid rendering out of its slot, NULL if absent or stale
+static char* slot_read(listing_slot* s, const char* key, listing_format format, const struct stat* st, size_t* len)
+{
+    uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return NULL;
+    if (s->format != (int)format || s->ino != st->st_ino || s->mtime.tv_sec != st->st_mtim.tv_sec
+        || s->mtime.tv_nsec != st->st_mtim.tv_nsec || now_ms() - s->rendered_ms >= DIR_LISTING_MAX_AGE_MS
+        || strncmp(s->key, key, sizeof(s->key)) != 0)
+        return NULL;
+
+    size_t n = s->len;
+    if (n > DIR_LISTING_MAX_BYTES)
+        return NULL;
+    char* body = malloc(n + 1);
+    if (!body)
+        return NULL;
+    memcpy(body, s->body, n);
+    body[n] = '\0';
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) { // rewritten while copying
+        free(body);
+        return NULL;
+    }
+    *len = n;
+    return body;
+}
+
+static void slot_write(listing_slot* s, const char* key, listing_format format, const struct stat* st, const strbuf* sb)
+{
+    if (sb->len > DIR_LISTING_MAX_BYTES)
+        return;
+    uint32_t idle = 0;
+    if (!__atomic_compare_exchange_n(&s->writing, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return; // someone else is refreshing it
+
+    __atomic_fetch_add(&s->seq, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    snprintf(s->key, sizeof(s->key), "%s", key);
+    s->format = format;
+    s->ino = st->st_ino;
+    s->mtime = st->st_mtim;
+    s->rendered_ms = now_ms();
+    s->len = sb->len;
+    memcpy(s->body, sb->data, sb->len);
+    __atomic_fetch_add(&s->seq, 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&s->writing, 0, __ATOMIC_RELEASE);
+}
+
+listing_format dir_listing_format(const char* query)
+{
+    for (const char* p = query; p && (p = strstr(p, "format=")) != NULL; p++) {
+        if ((p == query || p[-1] == '&') && strncmp(p + 7, "json", 4) == 0 && (p[11] == '\0' || p[11] == '&'))
+            return LISTING_JSON;
+    }
+    return LISTING_HTML;
+}
+
+// render the listing of a directory relative to the web root, served from
+// the shared cache while the directory's mtime is unchanged; returns a
+// malloc'd body or NULL if the directory cannot be opened
+char* dir_listing_render(const char* rel_dir, listing_format format, size_t* len)
+{
+    // "static/", "static/." and "static" all name the same directory
+    char key[LISTING_KEY_MAX];
+    snprintf(key, sizeof(key), "%s", rel_dir);
+    size_t klen = strlen(key);
+    if (klen >= 2 && strcmp(key + klen - 2, "/.") == 0)
+        key[klen -= 2] = '\0';
+    else if (strcmp(key, ".") == 0)
+        key[klen = 0] = '\0';
+    while (klen > 0 && key[klen - 1] == '/')
+        key[--klen] = '\0';
+
+    int dir_fd = file_cache_open(key[0] ? key : ".");
+    if (dir_fd == -1)
+        return NULL;
+    struct stat st;
+    if (fstat(dir_fd, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        close(dir_fd);
+        return NULL;
+    }
+
+    listing_slot* slot = slots ? &slots[hash_key(key, format) % DIR_LISTING_SLOTS] : NULL;
+    char* body = slot ? slot_read(slot, key, format, &st, len) : NULL;
+    if (body) {
+        metrics_counter_add(&metrics->dir_listing_hits, 1);
+        close(dir_fd);
+        return body;
+    }
+    metrics_counter_add(&metrics->dir_listing_misses, 1);
+
+    int count;
+    listing_entry* entries = read_entries(dir_fd, &count);
+    close(dir_fd);
+
+    char url_dir[LISTING_KEY_MAX + 2];
+    snprintf(url_dir, sizeof(url_dir), "/%s%s", key, key[0] ? "/" : "");
+
+    strbuf sb = { 0 };
+    if (format == LISTING_JSON)
+        render_json(&sb, url_dir, entries, count);
+    else
+        render_html(&sb, url_dir, entries, count);
+
+    for (int i = 0; i < count; i++)
+        free(entries[i].name);
+    free(entries);
+
+    if (slot)
+        slot_write(slot, key, format, &st, &sb);
+    *len = sb.len;
+    return sb.data;
+}
+
+// map the shared listing cache, call before forking
+int dir_listing_init(void)
+{
+    void* p = mmap(NULL, sizeof(listing_slot) * DIR_LISTING_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("Error: failed to map directory listing cache");
+        return -1;
+    }
+    slots = p;
+    return 0;
+}
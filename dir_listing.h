@@ -0,0 +1,19 @@
+#ifndef DIR_LISTING_H
+#define DIR_LISTING_H
+
+#include <stddef.h>
+
+#define DIR_LISTING_SLOTS 16 // rendered listings kept in shared memory
+#define DIR_LISTING_MAX_BYTES (256 * 1024) // larger listings are rendered every time
+#define DIR_LISTING_MAX_AGE_MS 2000 // re-render even if the directory mtime is unchanged, so entry sizes catch up
+
+typedef enum {
+    LISTING_HTML,
+    LISTING_JSON
+} listing_format;
+
+int dir_listing_init(void);
+listing_format dir_listing_format(const char* query);
+char* dir_listing_render(const char* rel_dir, listing_format format, size_t* len);
+
+#endif /* DIR_LISTING_H */
@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+
+#include "disk_cache.h"
+#include "metrics.h"
+#include "my_threads.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DISK_CACHE_MAGIC 0x57534443 // "WSDC"
+#define DISK_CACHE_VERSION 2
+#define PAGE_ALIGN(n) (((n) + 4095) & ~(long)4095)
+#define DOORKEEPER_WORDS (DISK_CACHE_DOORKEEPER_BITS / 32)
+#define COPY_CHUNK (1024 * 1024)
+#define DRAIN_POLL_MS 10 // how often a finished send checks what the client has yet to acknowledge
+
+typedef enum {
+    ENTRY_FREE,
+    ENTRY_FILLING, // space reserved, bytes being copied in
+    ENTRY_READY
+} entry_state;
+
+typedef struct {
+    unsigned long key;
+    int state;
+    uint32_t gen; // bumped on reuse so stale refs can tell
+    long offset; // into the data region
+    long size;
+    uint64_t ino; // the local file it was copied from, all zero for proxied objects
+    struct timespec mtime;
+    uint32_t readers;
+    time_t pinned_at;
+    uint64_t seq; // insertion order, oldest is evicted first
+} disk_entry;
+
+// Start of the tier file; the data region follows at a page boundary.
+// Space is handed out as a ring, so eviction is FIFO over insertions.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    sem_t mutex;
+    long capacity;
+    long head; // next write position in the data region
+    long used;
+    uint64_t next_seq;
+    uint32_t doorkeeper_adds;
+    uint32_t doorkeeper[DOORKEEPER_WORDS];
+    disk_entry entries[DISK_CACHE_ENTRIES];
+} disk_header;
+
+static disk_header* tier = NULL;
+static char* data_region = NULL;
+static int tier_fd = -1;
+static long data_offset = 0;
+
+static time_t now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+int disk_cache_enabled(void)
+{
+    return tier != NULL;
+}
+
+// largest object worth a slot, so one export cannot flush the whole tier
+long disk_cache_max_object(void)
+{
+    return tier ? tier->capacity / 4 : 0;
+}
+
+// two-bit Bloom filter of recent misses; only keys seen before get in
+static int admit(unsigned long key)
+{
+    uint32_t h1 = (uint32_t)(key * 0x9E3779B97F4A7C15ul >> 32) % DISK_CACHE_DOORKEEPER_BITS;
+    uint32_t h2 = (uint32_t)(key * 0xC2B2AE3D27D4EB4Ful >> 32) % DISK_CACHE_DOORKEEPER_BITS;
+    uint32_t b1 = 1u << (h1 % 32), b2 = 1u << (h2 % 32);
+
+    if ((tier->doorkeeper[h1 / 32] & b1) && (tier->doorkeeper[h2 / 32] & b2))
+        return 1;
+
+    // age the filter so it only remembers the recent past
+    if (++tier->doorkeeper_adds > DISK_CACHE_DOORKEEPER_BITS / 4) {
+        memset(tier->doorkeeper, 0, sizeof(tier->doorkeeper));
+        tier->doorkeeper_adds = 0;
+    }
+    tier->doorkeeper[h1 / 32] |= b1;
+    tier->doorkeeper[h2 / 32] |= b2;
+    return 0;
+}
+
+static int is_pinned(const disk_entry* e, time_t now)
+{
+    if (e->state == ENTRY_FILLING || e->readers > 0)
+        return now - e->pinned_at < DISK_CACHE_PIN_TIMEOUT_S;
+    return 0;
+}
+
+static void evict(disk_entry* e)
+{
+    if (e->state == ENTRY_READY) {
+        metrics_counter_add(&metrics->disk_cache_evictions, 1);
+        metrics_gauge_add(&metrics->disk_cache_bytes, -e->size);
+    }
+    tier->used -= e->size;
+    e->state = ENTRY_FREE;
+    e->readers = 0;
+    e->gen++;
+}
+
+static disk_entry* find_ready(unsigned long key)
+{
+    for (int i = 0; i < DISK_CACHE_ENTRIES; i++) {
+        if (tier->entries[i].state == ENTRY_READY && tier->entries[i].key == key)
+            return &tier->entries[i];
+    }
+    return NULL;
+}
+
+// whether an entry still holds the file as it is now
+static int same_source(const disk_entry* e, const struct stat* st)
+{
+    return e->size == st->st_size && e->ino == (uint64_t)st->st_ino
+        && e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void pin(disk_entry* e, disk_cache_ref* ref)
+{
+    e->readers++;
+    e->pinned_at = now_s();
+    ref->slot = e - tier->entries;
+    ref->gen = e->gen;
+    ref->offset = e->offset;
+    ref->size = e->size;
+}
+
+// claim space for size bytes at the ring head, evicting whatever overlaps;
+// fails if a reader still holds one of those entries. Caller holds the mutex.
+static disk_entry* reserve(unsigned long key, long size)
+{
+    time_t now = now_s();
+    long start = tier->head;
+    if (start + size > tier->capacity)
+        start = 0; // wrap, the tail end stays unused until the next lap
+
+    for (int i = 0; i < DISK_CACHE_ENTRIES; i++) {
+        disk_entry* e = &tier->entries[i];
+        if (e->state == ENTRY_FREE || e->offset >= start + size || e->offset + e->size <= start)
+            continue;
+        if (is_pinned(e, now))
+            return NULL;
+        evict(e);
+    }
+
+    disk_entry* slot = NULL;
+    for (int i = 0; i < DISK_CACHE_ENTRIES && !slot; i++) {
+        if (tier->entries[i].state == ENTRY_FREE)
+            slot = &tier->entries[i];
+    }
+    if (!slot) { // index full, drop the oldest unpinned entry
+        for (int i = 0; i < DISK_CACHE_ENTRIES; i++) {
+            disk_entry* e = &tier->entries[i];
+            if (!is_pinned(e, now) && (!slot || e->seq < slot->seq))
+                slot = e;
+        }
+        if (!slot)
+            return NULL;
+        evict(slot);
+    }
+
+    slot->key = key;
+    slot->state = ENTRY_FILLING;
+    slot->gen++;
+    slot->offset = start;
+    slot->size = size;
+    slot->ino = 0;
+    memset(&slot->mtime, 0, sizeof(slot->mtime));
+    slot->readers = 0;
+    slot->pinned_at = now;
+    slot->seq = tier->next_seq++;
+    tier->head = start + size;
+    tier->used += size;
+    return slot;
+}
+
+// pin a cached object for sending, 0 on a hit; a copy of a local file that
+// no longer matches source is a miss, and is dropped once nobody sends it
+int disk_cache_acquire(unsigned long key, const struct stat* source, disk_cache_ref* ref)
+{
+    if (!tier)
+        return -1;
+
+    sem_wait(&tier->mutex);
+    disk_entry* e = find_ready(key);
+    if (e && source && !same_source(e, source)) {
+        if (!is_pinned(e, now_s()))
+            evict(e);
+        e = NULL;
+    }
+    if (e)
+        pin(e, ref);
+    sem_post(&tier->mutex);
+
+    metrics_counter_add(e ? &metrics->disk_cache_hits : &metrics->disk_cache_misses, 1);
+    return e ? 0 : -1;
+}
+
+// admission and space reservation shared by both insert paths
+static disk_entry* begin_insert(unsigned long key, long size, uint32_t* gen)
+{
+    if (!tier || size <= 0 || size > disk_cache_max_object())
+        return NULL;
+
+    sem_wait(&tier->mutex);
+    disk_entry* e = NULL;
+    if (find_ready(key) == NULL) { // someone else may have inserted it meanwhile
+        if (!admit(key))
+            metrics_counter_add(&metrics->disk_cache_rejections, 1);
+        else
+            e = reserve(key, size);
+    }
+    if (e)
+        *gen = e->gen;
+    sem_post(&tier->mutex);
+    return e;
+}
+
+// make a filled entry visible, pinning it for the caller when ref is set
+static int publish(disk_entry* e, uint32_t gen, disk_cache_ref* ref)
+{
+    int ok = 0;
+    sem_wait(&tier->mutex);
+    if (e->gen == gen && e->state == ENTRY_FILLING) {
+        e->state = ENTRY_READY;
+        if (ref)
+            pin(e, ref);
+        ok = 1;
+        metrics_counter_add(&metrics->disk_cache_admissions, 1);
+        metrics_gauge_add(&metrics->disk_cache_bytes, e->size);
+    }
+    sem_post(&tier->mutex);
+    return ok ? 0 : -1;
+}
+
+static void abandon(disk_entry* e, uint32_t gen)
+{
+    sem_wait(&tier->mutex);
+    if (e->gen == gen && e->state == ENTRY_FILLING)
+        evict(e);
+    sem_post(&tier->mutex);
+}
+
+// copy a file into the tier (in-kernel with copy_file_range) and pin it,
+// remembering which version of the file it was; -1 if the object was not
+// admitted
+int disk_cache_insert_fd(unsigned long key, int src_fd, const struct stat* source, disk_cache_ref* ref)
+{
+    uint32_t gen;
+    long size = source->st_size;
+    disk_entry* e = begin_insert(key, size, &gen);
+    if (!e)
+        return -1;
+    e->ino = source->st_ino; // the entry is ours while it is filling
+    e->mtime = source->st_mtim;
+
+    loff_t src_off = 0, dst_off = data_offset + e->offset;
+    long copied = 0;
+    while (copied < size) {
+        ssize_t n = copy_file_range(src_fd, &src_off, tier_fd, &dst_off, size - copied, 0);
+        if (n <= 0) {
+            // not supported across these filesystems, copy through the mapping
+            n = pread(src_fd, data_region + e->offset + copied, size - copied < COPY_CHUNK ? size - copied : COPY_CHUNK, copied);
+            if (n <= 0) {
+                abandon(e, gen);
+                return -1;
+            }
+            src_off += n;
+            dst_off += n;
+        }
+        copied += n;
+    }
+    return publish(e, gen, ref);
+}
+
+// copy a response body already in memory, e.g. a large proxied object
+int disk_cache_insert_buf(unsigned long key, const char* data, long size)
+{
+    uint32_t gen;
+    disk_entry* e = begin_insert(key, size, &gen);
+    if (!e)
+        return -1;
+    memcpy(data_region + e->offset, data, size);
+    return publish(e, gen, NULL);
+}
+
+// a send that still makes progress keeps its pin however long it takes, the
+// timeout only frees entries whose holder died; -1 if the pin was lost
+static int refresh_pin(const disk_cache_ref* ref, time_t now)
+{
+    disk_entry* e = &tier->entries[ref->slot];
+    sem_wait(&tier->mutex);
+    int held = e->gen == ref->gen && e->readers > 0;
+    if (held)
+        e->pinned_at = now;
+    sem_post(&tier->mutex);
+    return held ? 0 : -1;
+}
+
+// sendfile queues the tier's pages on the socket, not copies of them, so a
+// pin has to last until the client acknowledged every byte. A client that
+// stops reading for half the pin timeout is reset when the caller closes,
+// rather than sent whatever reuses the space.
+static void drain(const disk_cache_ref* ref, int client_fd)
+{
+    int queued, last = -1;
+    time_t progress = now_s(), refreshed = progress;
+    while (ioctl(client_fd, SIOCOUTQ, &queued) == 0 && queued > 0) {
+        time_t now = now_s();
+        if (queued != last) {
+            last = queued;
+            progress = now;
+        } else if (now - progress >= DISK_CACHE_PIN_TIMEOUT_S / 2) {
+            struct linger reset = { 1, 0 };
+            setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            return;
+        }
+        if (now != refreshed) {
+            refreshed = now;
+            if (refresh_pin(ref, now) == -1)
+                return;
+        }
+        fiber_sleep(DRAIN_POLL_MS);
+    }
+}
+
+// zero-copy send of a pinned object straight from the tier file; returns
+// once the client has the bytes, so the pin can be released
+long disk_cache_send(const disk_cache_ref* ref, int client_fd)
+{
+    off_t offset = data_offset + ref->offset;
+    off_t end = offset + ref->size;
+    time_t refreshed = now_s();
+    while (offset < end) {
+        ssize_t n = sendfile(client_fd, tier_fd, &offset, end - offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && errno == EAGAIN && fiber_wait_fd(client_fd, FIBER_WRITE) == 0)
+                continue;
+            perror("Error: failed sendfile from disk cache\n");
+            break;
+        }
+        time_t now = now_s();
+        if (now != refreshed && offset < end) {
+            refreshed = now;
+            if (refresh_pin(ref, now) == -1) { // evicted anyway, the rest is another object's
+                fprintf(stderr, "Error: disk cache entry evicted while it was sent\n");
+                break;
+            }
+        }
+    }
+    drain(ref, client_fd);
+    return offset - (data_offset + ref->offset);
+}
+
+void disk_cache_release(disk_cache_ref* ref)
+{
+    sem_wait(&tier->mutex);
+    disk_entry* e = &tier->entries[ref->slot];
+    if (e->gen == ref->gen && e->readers > 0)
+        e->readers--;
+    sem_post(&tier->mutex);
+}
+
+// create and map the tier file with capacity bytes of data, call before forking
+int disk_cache_init(const char* path, long capacity)
+{
+    data_offset = PAGE_ALIGN((long)sizeof(disk_header));
+    tier_fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+    if (tier_fd == -1) {
+        perror("Error: failed to open disk cache file");
+        return -1;
+    }
+    if (ftruncate(tier_fd, 0) == -1 || ftruncate(tier_fd, data_offset + capacity) == -1) {
+        perror("Error: failed to size disk cache file");
+        close(tier_fd);
+        return -1;
+    }
+
+    void* p = mmap(NULL, data_offset + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, tier_fd, 0);
+    if (p == MAP_FAILED) {
+        perror("Error: failed to map disk cache file");
+        close(tier_fd);
+        return -1;
+    }
+
+    tier = p;
+    data_region = (char*)p + data_offset;
+    tier->magic = DISK_CACHE_MAGIC;
+    tier->version = DISK_CACHE_VERSION;
+    tier->capacity = capacity;
+    if (sem_init(&tier->mutex, 1, 1) == -1) {
+        perror("Error: failed to create disk cache mutex");
+        munmap(p, data_offset + capacity);
+        close(tier_fd);
+        tier = NULL;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define DISK_CACHE_PATH_FORMAT "/var/tmp/webserv-%d.dcache" // one tier file per port
+#define DISK_CACHE_SIZE_MIN (1024 * 1024) // 1MB
+#define DISK_CACHE_ENTRIES 1024
+#define DISK_CACHE_SMALL_OBJECT_MAX (64 * 1024) // smaller objects stay in the shared memory tier
+#define DISK_CACHE_PIN_TIMEOUT_S 60 // a pin not refreshed by its send this long (its holder died) no longer blocks eviction; above the idle timeout
+#define DISK_CACHE_DOORKEEPER_BITS 65536 // admission filter, objects are admitted on their second miss
+
+// a pinned entry: its bytes stay in place until disk_cache_release
+typedef struct {
+    int slot;
+    uint32_t gen;
+    long offset;
+    long size;
+} disk_cache_ref;
+
+int disk_cache_init(const char* path, long capacity);
+int disk_cache_enabled(void);
+long disk_cache_max_object(void);
+int disk_cache_acquire(unsigned long key, const struct stat* source, disk_cache_ref* ref);
+int disk_cache_insert_fd(unsigned long key, int src_fd, const struct stat* source, disk_cache_ref* ref);
+int disk_cache_insert_buf(unsigned long key, const char* data, long size);
+long disk_cache_send(const disk_cache_ref* ref, int client_fd);
+void disk_cache_release(disk_cache_ref* ref);
+
+#endif /* DISK_CACHE_H */
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+
+#include "file_cache.h"
+#include "metrics.h"
+#include "my_threads.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WATCHES 256
+#define INOTIFY_BUF_SIZE 4096
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF)
+
+static file_cache_entry entries[FILE_CACHE_SLOTS];
+static struct {
+    int wd;
+    char dir[FILE_CACHE_KEY_MAX];
+} watches[MAX_WATCHES];
+static int watch_count = 0;
+
+static int root_fd = -1;
+static int inotify_fd = -1;
+static pid_t owner_pid; // only the process that built the cache adds watches
+static int open_fds = 0;
+static int clock_hand = 0;
+static char root_path[1024];
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hash_path(const char* s)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// reject absolute paths and any ".." component
+static int is_contained(const char* rel)
+{
+    if (rel[0] == '/' || strlen(rel) >= FILE_CACHE_KEY_MAX)
+        return 0;
+    for (const char* p = rel; *p;) {
+        const char* end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == 2 && p[0] == '.' && p[1] == '.')
+            return 0;
+        if (!end)
+            break;
+        p = end + 1;
+    }
+    return 1;
+}
+
+// open a path one component at a time, refusing to follow any symlink, for
+// kernels without openat2; stricter than RESOLVE_BENEATH, which allows
+// links that stay below the root
+static int open_beneath(const char* rel_path)
+{
+    int dir_fd = root_fd;
+    const char* p = rel_path;
+    for (;;) {
+        size_t len = strcspn(p, "/");
+        const char* next = p + len;
+        while (*next == '/')
+            next++;
+
+        char name[FILE_CACHE_KEY_MAX];
+        memcpy(name, p, len);
+        name[len] = '\0';
+        int last = *next == '\0';
+        int fd = openat(dir_fd, len ? name : ".", O_RDONLY | O_CLOEXEC | O_NOFOLLOW | (last ? 0 : O_DIRECTORY));
+        if (dir_fd != root_fd) {
+            int saved = errno;
+            close(dir_fd);
+            errno = saved;
+        }
+        if (fd == -1 || last)
+            return fd;
+        dir_fd = fd;
+        p = next;
+    }
+}
+
+// open a path relative to the held root directory without letting it
+// escape the root, prefers openat2(RESOLVE_BENEATH) where the kernel has it
+int file_cache_open(const char* rel_path)
+{
+    if (root_fd == -1 || !is_contained(rel_path)) {
+        errno = EACCES;
+        return -1;
+    }
+    if (rel_path[0] == '\0')
+        rel_path = ".";
+
+#ifdef SYS_openat2
+    static int have_openat2 = 1;
+    if (have_openat2) {
+        struct open_how how = { .flags = O_RDONLY | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+        int fd = syscall(SYS_openat2, root_fd, rel_path, &how, sizeof(how));
+        if (fd != -1 || (errno != ENOSYS && errno != EPERM))
+            return fd;
+        have_openat2 = 0; // old kernel or seccomp filter, walk the path ourselves
+    }
+#endif
+    return open_beneath(rel_path);
+}
+
+static void drop_fd(file_cache_entry* e)
+{
+    if (e->fd >= 0) {
+        close(e->fd);
+        e->fd = -1;
+        open_fds--;
+    }
+}
+
+// keep the number of held descriptors bounded with a clock sweep
+static void make_room(void)
+{
+    while (open_fds >= FILE_CACHE_MAX_FDS) {
+        file_cache_entry* e = &entries[clock_hand];
+        clock_hand = (clock_hand + 1) & (FILE_CACHE_SLOTS - 1);
+        drop_fd(e);
+    }
+}
+
+static void watch_dir_of(file_cache_entry* e)
+{
+    e->dir_wd = -1;
+    if (inotify_fd == -1 || getpid() != owner_pid)
+        return;
+
+    char dir[FILE_CACHE_KEY_MAX];
+    snprintf(dir, sizeof(dir), "%s", e->rel_path);
+    char* slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+    else
+        dir[0] = '\0';
+
+    char abs_dir[sizeof(root_path) + FILE_CACHE_KEY_MAX];
+    snprintf(abs_dir, sizeof(abs_dir), "%s/%s", root_path, dir);
+    int wd = inotify_add_watch(inotify_fd, abs_dir, WATCH_MASK);
+    if (wd == -1)
+        return;
+
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            e->dir_wd = wd; // same directory already watched
+            return;
+        }
+    }
+    if (watch_count < MAX_WATCHES) { // otherwise its events can't be mapped back, the TTL applies
+        watches[watch_count].wd = wd;
+        snprintf(watches[watch_count].dir, sizeof(watches[watch_count].dir), "%s", dir);
+        watch_count++;
+        e->dir_wd = wd;
+    }
+}
+
+// which of two slots to give up first: one whose descriptor was already
+// closed, then the one used longest ago
+static int evicts_before(const file_cache_entry* a, const file_cache_entry* b)
+{
+    if ((a->fd < 0) != (b->fd < 0))
+        return a->fd < 0;
+    return a->used_ms < b->used_ms;
+}
+
+// the slot holding a path, NULL if it has none; *victim is then the slot it
+// should take, a free one or else the least recently used
+static file_cache_entry* find_slot(const char* rel_path, file_cache_entry** victim)
+{
+    uint32_t h = hash_path(rel_path);
+    file_cache_entry* free_slot = NULL;
+    file_cache_entry* lru = NULL;
+    for (int i = 0; i < FILE_CACHE_PROBE; i++) {
+        file_cache_entry* e = &entries[(h + i) & (FILE_CACHE_SLOTS - 1)];
+        if (e->rel_path[0] == '\0') {
+            if (!free_slot)
+                free_slot = e;
+        } else if (strcmp(e->rel_path, rel_path) == 0)
+            return e;
+        else if (!lru || evicts_before(e, lru))
+            lru = e;
+    }
+    if (victim)
+        *victim = free_slot ? free_slot : lru;
+    return NULL;
+}
+
+static int load_entry(file_cache_entry* e, const char* rel_path)
+{
+    make_room();
+    int fd = file_cache_open(rel_path);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (strcmp(e->rel_path, rel_path) != 0) { // a free or reused slot
+        drop_fd(e);
+        snprintf(e->rel_path, sizeof(e->rel_path), "%s", rel_path);
+        watch_dir_of(e);
+    }
+    e->st = st;
+    e->fd = fd;
+    e->loaded_ms = e->used_ms = now_ms();
+    open_fds++;
+    return 0;
+}
+
+// return the open file and its metadata, opening it on first use; NULL if
+// the path does not exist or escapes the root
+const file_cache_entry* file_cache_get(const char* rel_path)
+{
+    if (rel_path[0] == '\0')
+        rel_path = "."; // "" marks free slots
+    if (root_fd == -1 || !is_contained(rel_path))
+        return NULL;
+
+    file_cache_entry* victim;
+    file_cache_entry* e = find_slot(rel_path, &victim);
+    if (!e)
+        e = victim;
+    else if (e->fd >= 0) {
+        // a watched entry stays valid until file_cache_poll says otherwise
+        uint64_t now = now_ms();
+        e->used_ms = now;
+        if (e->dir_wd != -1 || now - e->loaded_ms < FILE_CACHE_TTL_MS) {
+            metrics_counter_add(&metrics->fd_cache_hits, 1);
+            return e;
+        }
+
+        // expired: one fstatat decides whether the held fd is still the file
+        struct stat st;
+        if (fstatat(root_fd, rel_path, &st, 0) == 0 && st.st_ino == e->st.st_ino
+            && st.st_dev == e->st.st_dev && st.st_size == e->st.st_size
+            && st.st_mtim.tv_sec == e->st.st_mtim.tv_sec && st.st_mtim.tv_nsec == e->st.st_mtim.tv_nsec) {
+            e->loaded_ms = now;
+            metrics_counter_add(&metrics->fd_cache_hits, 1);
+            return e;
+        }
+        drop_fd(e);
+        metrics_counter_add(&metrics->fd_cache_invalidations, 1);
+    }
+
+    metrics_counter_add(&metrics->fd_cache_misses, 1);
+    if (load_entry(e, rel_path) == -1)
+        return NULL;
+    return e;
+}
+
+static void invalidate_path(const char* rel_path)
+{
+    file_cache_entry* e = find_slot(rel_path, NULL);
+    if (e && e->fd >= 0) {
+        drop_fd(e);
+        metrics_counter_add(&metrics->fd_cache_invalidations, 1);
+    }
+}
+
+static void invalidate_all(void)
+{
+    for (int i = 0; i < FILE_CACHE_SLOTS; i++) {
+        if (entries[i].fd >= 0) {
+            drop_fd(&entries[i]);
+            metrics_counter_add(&metrics->fd_cache_invalidations, 1);
+        }
+    }
+}
+
+// drain pending inotify events and close descriptors of files that changed,
+// a single non-blocking read when nothing happened
+void file_cache_poll(void)
+{
+    if (inotify_fd == -1)
+        return;
+
+    char buf[INOTIFY_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len;) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                invalidate_all();
+                continue;
+            }
+
+            const char* dir = NULL;
+            for (int i = 0; i < watch_count; i++) {
+                if (watches[i].wd == ev->wd) {
+                    dir = watches[i].dir;
+                    break;
+                }
+            }
+            if (!dir)
+                continue;
+
+            if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                invalidate_all(); // directory itself went away
+                continue;
+            }
+            if (ev->len == 0)
+                continue;
+
+            char rel[FILE_CACHE_KEY_MAX];
+            if (dir[0] == '\0')
+                snprintf(rel, sizeof(rel), "%s", ev->name);
+            else if (snprintf(rel, sizeof(rel), "%s/%s", dir, ev->name) >= (int)sizeof(rel))
+                continue;
+            invalidate_path(rel);
+        }
+    }
+}
+
+// send the whole file without touching the shared file offset. A fiber
+// that has to wait lets others run, which may close or reuse the entry, so
+// it sends from a descriptor of its own and the size it started with.
+long file_cache_send(const file_cache_entry* e, int client_fd)
+{
+    off_t size = e->st.st_size;
+    int own = fiber_running();
+    int fd = own ? dup(e->fd) : e->fd;
+    if (fd == -1) {
+        perror("Error: failed to duplicate cached file\n");
+        return -1;
+    }
+
+    off_t offset = 0;
+    long sent = -1;
+    while (offset < size) {
+        ssize_t n = sendfile(client_fd, fd, &offset, size - offset);
+        if (n > 0)
+            continue;
+        if (n == 0)
+            break; // file shrank since it was cached
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN && fiber_wait_fd(client_fd, FIBER_WRITE) == 0)
+            continue; // threaded mode, the socket buffer is full
+        if (errno != EINVAL && errno != ENOSYS) {
+            perror("Error: failed sendfile\n");
+            goto done;
+        }
+
+        // sendfile unsupported for this pair, fall back to pread
+        char buffer[4096];
+        ssize_t r;
+        while ((r = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+            if (fiber_write_all(client_fd, buffer, r) != r) {
+                perror("Error: failed write\n");
+                goto done;
+            }
+            offset += r;
+        }
+        break;
+    }
+    sent = offset;
+
+done:
+    if (own)
+        close(fd);
+    return sent;
+}
+
+// take the cache over in a long-lived worker: the inherited inotify instance
+// is shared with the parent, so start a private one and rewatch held files
+void file_cache_adopt(void)
+{
+    if (root_fd == -1)
+        return;
+    if (inotify_fd != -1)
+        close(inotify_fd);
+
+    owner_pid = getpid();
+    watch_count = 0;
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (int i = 0; i < FILE_CACHE_SLOTS; i++) {
+        if (entries[i].rel_path[0])
+            watch_dir_of(&entries[i]);
+    }
+}
+
+// hold the web root open and start watching for changes, call before forking
+int file_cache_init(const char* root)
+{
+    snprintf(root_path, sizeof(root_path), "%s", root);
+    root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        perror("Error: failed to open web root");
+        return -1;
+    }
+
+    for (int i = 0; i < FILE_CACHE_SLOTS; i++) {
+        entries[i].fd = -1;
+        entries[i].dir_wd = -1;
+    }
+
+    owner_pid = getpid();
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1)
+        perror("Warning: inotify unavailable, file cache falls back to TTL revalidation");
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_SLOTS 1024 // hash table size, must be a power of two
+#define FILE_CACHE_PROBE 16 // slots a path may live in, the least recently used is reused
+#define FILE_CACHE_MAX_FDS 512 // open descriptors kept at most
+#define FILE_CACHE_TTL_MS 5000 // revalidate entries older than this
+#define FILE_CACHE_KEY_MAX 256
+
+// One open file with the metadata captured when it was opened. Readers must
+// use pread/sendfile with their own offset: in fork mode every child shares
+// the same open file description. In threaded mode another fiber may close
+// or reuse an entry whenever this one yields, so look it up again after
+// waiting; file_cache_send takes care of itself.
+typedef struct {
+    char rel_path[FILE_CACHE_KEY_MAX]; // relative to the web root, "" when free
+    int fd;
+    struct stat st;
+    uint64_t loaded_ms;
+    uint64_t used_ms;
+    int dir_wd; // inotify watch on the containing directory, -1 if none
+} file_cache_entry;
+
+int file_cache_init(const char* root);
+int file_cache_open(const char* rel_path);
+const file_cache_entry* file_cache_get(const char* rel_path);
+void file_cache_poll(void);
+void file_cache_adopt(void);
+long file_cache_send(const file_cache_entry* e, int client_fd);
+
+#endif /* FILE_CACHE_H */
@@ -0,0 +1,489 @@
+#include "hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_SLOTS (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_EOS 256
+
+typedef struct {
+    const char* name;
+    const char* value;
+} static_field;
+
+// RFC 7541 appendix A, index 1 first
+static const static_field static_table[HPACK_STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// code and bit length of every symbol, from RFC 7541 appendix B; 256 is EOS
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// decoding tree built from the codes on first use: children of node n are
+// tree[n][0] and tree[n][1], a negative child is the leaf for symbol -child-1
+static int16_t huffman_tree[HUFFMAN_SYMBOLS][2];
+static int huffman_nodes = 0;
+
+static void huffman_build(void)
+{
+    huffman_nodes = 1;
+    for (int sym = 0; sym < HUFFMAN_SYMBOLS; sym++) {
+        int node = 0;
+        for (int bit = huffman_lengths[sym] - 1; bit > 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if (!huffman_tree[node][b])
+                huffman_tree[node][b] = huffman_nodes++;
+            node = huffman_tree[node][b];
+        }
+        huffman_tree[node][huffman_codes[sym] & 1] = -sym - 1;
+    }
+}
+
+// decode a Huffman string into out; -1 on EOS, bad padding or no room
+static long huffman_decode(const uint8_t* in, size_t len, char* out, size_t cap)
+{
+    size_t n = 0;
+    int node = 0, depth = 0, ones = 1; // bits since the last symbol, and whether all were 1
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1;
+            int next = huffman_tree[node][b];
+            depth++;
+            ones &= b;
+            if (next < 0) {
+                if (-next - 1 == HUFFMAN_EOS || n == cap)
+                    return -1;
+                out[n++] = -next - 1;
+                node = depth = 0;
+                ones = 1;
+            } else
+                node = next;
+        }
+    }
+    // the last symbol is padded with at most 7 bits of EOS, i.e. ones
+    if (depth > 7 || !ones)
+        return -1;
+    return n;
+}
+
+static size_t huffman_length(const char* s, size_t len)
+{
+    uint64_t bits = 0;
+    for (size_t i = 0; i < len; i++)
+        bits += huffman_lengths[(uint8_t)s[i]];
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(const char* s, size_t len, uint8_t* out)
+{
+    uint64_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = s[i];
+        acc = (acc << huffman_lengths[c]) | huffman_codes[c];
+        bits += huffman_lengths[c];
+        while (bits >= 8) {
+            bits -= 8;
+            *out++ = acc >> bits;
+        }
+    }
+    if (bits) // pad with the most significant bits of EOS
+        *out = (acc << (8 - bits)) | (0xff >> bits);
+}
+
+void hpack_table_init(hpack_table* t, size_t limit)
+{
+    if (!huffman_nodes)
+        huffman_build();
+    memset(t, 0, sizeof(*t));
+    t->max_size = t->limit = limit;
+}
+
+static hpack_field* entry(hpack_table* t, int i) // 0 is the newest
+{
+    return &t->ring[(t->head - i + RING_SLOTS) % RING_SLOTS];
+}
+
+static void evict_to(hpack_table* t, size_t size)
+{
+    while (t->count && t->size > size) {
+        hpack_field* f = entry(t, t->count - 1);
+        t->size -= f->name_len + f->value_len + HPACK_ENTRY_OVERHEAD;
+        free(f->name);
+        f->name = f->value = NULL;
+        t->count--;
+    }
+}
+
+void hpack_table_free(hpack_table* t)
+{
+    evict_to(t, 0);
+}
+
+// a new entry evicts the oldest ones; one larger than the table empties it
+static void table_add(hpack_table* t, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (size > t->max_size) {
+        evict_to(t, 0);
+        return;
+    }
+    evict_to(t, t->max_size - size);
+
+    char* mem = malloc(name_len + value_len + 2);
+    if (!mem) {
+        perror("Error: failed to grow HPACK table");
+        evict_to(t, 0); // the peer's table now differs, nothing will be found in ours
+        return;
+    }
+    memcpy(mem, name, name_len);
+    mem[name_len] = '\0';
+    memcpy(mem + name_len + 1, value, value_len);
+    mem[name_len + 1 + value_len] = '\0';
+
+    t->head = (t->head + 1) % RING_SLOTS;
+    hpack_field* f = entry(t, 0);
+    f->name = mem;
+    f->value = mem + name_len + 1;
+    f->name_len = name_len;
+    f->value_len = value_len;
+    t->count++;
+    t->size += size;
+}
+
+// index into the static then the dynamic table, NULL past either
+static int lookup(hpack_table* t, uint64_t index, const char** name, size_t* name_len, const char** value, size_t* value_len)
+{
+    if (index >= 1 && index <= HPACK_STATIC_ENTRIES) {
+        *name = static_table[index - 1].name;
+        *value = static_table[index - 1].value;
+        *name_len = strlen(*name);
+        *value_len = strlen(*value);
+        return 0;
+    }
+    if (index <= HPACK_STATIC_ENTRIES || index - HPACK_STATIC_ENTRIES > (uint64_t)t->count)
+        return -1;
+    hpack_field* f = entry(t, index - HPACK_STATIC_ENTRIES - 1);
+    *name = f->name;
+    *value = f->value;
+    *name_len = f->name_len;
+    *value_len = f->value_len;
+    return 0;
+}
+
+// prefixed integer (RFC 7541 section 5.1), -1 if truncated or too large
+static int decode_int(const uint8_t** p, const uint8_t* end, int prefix_bits, uint64_t* value)
+{
+    uint64_t max = (1u << prefix_bits) - 1;
+    *value = *(*p)++ & max;
+    if (*value < max)
+        return 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (*p == end)
+            return -1;
+        uint8_t b = *(*p)++;
+        *value += (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+// string literal, copied or Huffman-decoded into out
+static long decode_string(const uint8_t** p, const uint8_t* end, char* out, size_t cap)
+{
+    if (*p == end)
+        return -1;
+    int huffman = **p & 0x80;
+    uint64_t len;
+    if (decode_int(p, end, 7, &len) == -1 || len > (uint64_t)(end - *p))
+        return -1;
+    const uint8_t* s = *p;
+    *p += len;
+    if (huffman)
+        return huffman_decode(s, len, out, cap);
+    if (len > cap)
+        return -1;
+    memcpy(out, s, len);
+    return len;
+}
+
+// decode one header block, handing each field to emit; -1 if it is
+// malformed, which leaves the table out of step and ends the connection
+int hpack_decode(hpack_table* t, const uint8_t* in, size_t len, hpack_emit emit, void* arg)
+{
+    char name[HPACK_FIELD_MAX], value[HPACK_FIELD_MAX];
+    const uint8_t* p = in;
+    const uint8_t* end = in + len;
+    int fields = 0;
+
+    while (p < end) {
+        uint8_t b = *p;
+        uint64_t index;
+        const char* n;
+        const char* v;
+        size_t n_len, v_len;
+
+        if (b & 0x80) { // indexed field
+            if (decode_int(&p, end, 7, &index) == -1 || lookup(t, index, &n, &n_len, &v, &v_len) == -1)
+                return -1;
+            emit(arg, n, n_len, v, v_len);
+            fields++;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) { // size update, only ahead of the fields
+            if (fields || decode_int(&p, end, 5, &index) == -1 || index > t->limit)
+                return -1;
+            t->max_size = index;
+            evict_to(t, index);
+            continue;
+        }
+
+        int indexing = (b & 0xc0) == 0x40;
+        if (decode_int(&p, end, indexing ? 6 : 4, &index) == -1)
+            return -1;
+        long name_len, value_len;
+        if (index) {
+            if (lookup(t, index, &n, &n_len, &v, &v_len) == -1 || n_len > sizeof(name))
+                return -1;
+            memcpy(name, n, n_len); // adding the field may evict the entry it names
+            name_len = n_len;
+        } else if ((name_len = decode_string(&p, end, name, sizeof(name))) == -1)
+            return -1;
+        if ((value_len = decode_string(&p, end, value, sizeof(value))) == -1)
+            return -1;
+
+        if (indexing)
+            table_add(t, name, name_len, value, value_len);
+        emit(arg, name, name_len, value, value_len);
+        fields++;
+    }
+    return 0;
+}
+
+// the peer's SETTINGS_HEADER_TABLE_SIZE changed; tables never grow past
+// HPACK_TABLE_SIZE, the ring is sized for it
+void hpack_encoder_limit(hpack_table* t, size_t limit)
+{
+    if (limit > HPACK_TABLE_SIZE)
+        limit = HPACK_TABLE_SIZE;
+    if (limit == t->max_size && !t->pending_update)
+        return;
+    if (!t->pending_update || limit < t->pending_min)
+        t->pending_min = limit;
+    t->pending_update = 1;
+    t->limit = t->max_size = limit;
+    evict_to(t, limit);
+}
+
+static size_t encode_int(uint8_t* out, size_t cap, uint8_t first, int prefix_bits, uint64_t value)
+{
+    uint64_t max = (1u << prefix_bits) - 1;
+    size_t n = 0;
+    if (cap == 0)
+        return 0;
+    if (value < max) {
+        out[n++] = first | value;
+        return n;
+    }
+    out[n++] = first | max;
+    value -= max;
+    while (value >= 0x80) {
+        if (n == cap)
+            return 0;
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n == cap)
+        return 0;
+    out[n++] = value;
+    return n;
+}
+
+// string literal, Huffman-coded when that is shorter
+static size_t encode_string(uint8_t* out, size_t cap, const char* s)
+{
+    size_t len = strlen(s);
+    size_t coded = huffman_length(s, len);
+    int huffman = coded < len;
+    size_t n = encode_int(out, cap, huffman ? 0x80 : 0, 7, huffman ? coded : len);
+    if (!n || cap - n < (huffman ? coded : len))
+        return 0;
+    if (huffman)
+        huffman_encode(s, len, out + n);
+    else
+        memcpy(out + n, s, len);
+    return n + (huffman ? coded : len);
+}
+
+// start a header block: signal table size changes since the last one
+size_t hpack_encode_begin(hpack_table* t, uint8_t* out, size_t cap)
+{
+    size_t n = 0;
+    if (!t->pending_update)
+        return 0;
+    if (t->pending_min < t->max_size)
+        n = encode_int(out, cap, 0x20, 5, t->pending_min);
+    size_t m = encode_int(out + n, cap - n, 0x20, 5, t->max_size);
+    if (!m)
+        return 0;
+    t->pending_update = 0;
+    return n + m;
+}
+
+// encode one field with a lower-case name, as an index where either table
+// has it; with index the field is added to the dynamic table for the next
+// block. Bytes written, 0 if it didn't fit.
+size_t hpack_encode(hpack_table* t, uint8_t* out, size_t cap, const char* name, const char* value, int index)
+{
+    size_t name_len = strlen(name), value_len = strlen(value);
+    uint64_t name_index = 0;
+    for (int i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        if (strcmp(static_table[i].name, name) != 0)
+            continue;
+        if (strcmp(static_table[i].value, value) == 0)
+            return encode_int(out, cap, 0x80, 7, i + 1);
+        if (!name_index)
+            name_index = i + 1;
+    }
+    for (int i = 0; i < t->count; i++) {
+        hpack_field* f = entry(t, i);
+        if (f->name_len != name_len || memcmp(f->name, name, name_len) != 0)
+            continue;
+        if (f->value_len == value_len && memcmp(f->value, value, value_len) == 0)
+            return encode_int(out, cap, 0x80, 7, HPACK_STATIC_ENTRIES + 1 + i);
+        if (!name_index)
+            name_index = HPACK_STATIC_ENTRIES + 1 + i;
+    }
+
+    size_t n = encode_int(out, cap, index ? 0x40 : 0, index ? 6 : 4, name_index);
+    if (!n)
+        return 0;
+    if (!name_index) {
+        size_t m = encode_string(out + n, cap - n, name);
+        if (!m)
+            return 0;
+        n += m;
+    }
+    size_t m = encode_string(out + n, cap - n, value);
+    if (!m)
+        return 0;
+    if (index)
+        table_add(t, name, name_len, value, value_len);
+    return n + m;
+}
@@ -0,0 +1,43 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_TABLE_SIZE 4096 // dynamic table size both ends start with, and the most we allow
+#define HPACK_ENTRY_OVERHEAD 32 // octets every entry costs on top of its name and value
+#define HPACK_FIELD_MAX 4096 // longest name or value decoded
+
+// one entry of a dynamic table, name and value in one allocation
+typedef struct {
+    char* name;
+    char* value;
+    size_t name_len;
+    size_t value_len;
+} hpack_field;
+
+// HPACK dynamic table (RFC 7541), one per direction of a connection. Entries
+// sit in a ring, the newest is index 62; a table of HPACK_TABLE_SIZE octets
+// can't hold more entries than the ring has slots.
+typedef struct {
+    hpack_field ring[HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD];
+    int head; // slot of the newest entry
+    int count;
+    size_t size;
+    size_t max_size; // current size limit, changed by size updates
+    size_t limit; // largest max_size allowed by SETTINGS_HEADER_TABLE_SIZE
+    size_t pending_min; // encoder: smallest limit since the last header block, 0 if unchanged
+    int pending_update; // encoder: the next header block starts with a size update
+} hpack_table;
+
+typedef void (*hpack_emit)(void* arg, const char* name, size_t name_len, const char* value, size_t value_len);
+
+void hpack_table_init(hpack_table* t, size_t limit);
+void hpack_table_free(hpack_table* t);
+int hpack_decode(hpack_table* t, const uint8_t* in, size_t len, hpack_emit emit, void* arg);
+void hpack_encoder_limit(hpack_table* t, size_t limit);
+size_t hpack_encode_begin(hpack_table* t, uint8_t* out, size_t cap);
+size_t hpack_encode(hpack_table* t, uint8_t* out, size_t cap, const char* name, const char* value, int index);
+
+#endif /* HPACK_H */
@@ -0,0 +1,957 @@
+#define _GNU_SOURCE
+
+#include "http2.h"
+#include "hpack.h"
+#include "metrics.h"
+#include "my_threads.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FRAME_HEADER 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define STRIDE 256 // virtual time a stream of weight 1 spends per byte sent
+#define ENCODE_MAX (3 * HTTP2_HEAD_MAX + 64) // worst case HPACK size of a response head
+#define EVENTS_MAX 32
+
+typedef enum {
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION
+} frame_type;
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+typedef enum {
+    ERR_NO_ERROR = 0x0,
+    ERR_PROTOCOL = 0x1,
+    ERR_INTERNAL = 0x2,
+    ERR_FLOW_CONTROL = 0x3,
+    ERR_STREAM_CLOSED = 0x5,
+    ERR_FRAME_SIZE = 0x6,
+    ERR_REFUSED_STREAM = 0x7,
+    ERR_COMPRESSION = 0x9,
+    ERR_ENHANCE_YOUR_CALM = 0xb
+} h2_error;
+
+typedef enum {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5
+} settings_id;
+
+// A stream's response comes from a handler running in its own fiber, which
+// writes it HTTP/1-style into a socketpair. The connection reads the head,
+// sends it as a HEADERS frame and then relays the body as DATA frames as
+// far as the flow-control windows allow.
+typedef struct {
+    uint32_t id;
+    int fd; // our end of the socketpair
+    int head_only; // HEAD request: the body is read and dropped
+    int headers_sent;
+    int readable; // fd has data or EOF we haven't read yet
+    int watched; // fd is in the connection's epoll set
+    int64_t window; // send window, negative after the peer shrinks it
+    uint32_t parent; // stream this one depends on, 0 for none
+    int weight;
+    uint64_t pass; // virtual time, the ready stream with the lowest goes next
+    size_t head_len; // bytes in head
+    size_t body_off; // once headers are sent, head[body_off..head_len] is body
+    char head[HTTP2_HEAD_MAX + 1];
+} h2_stream;
+
+typedef struct {
+    int fd;
+    int ep; // the client socket and every stream's socketpair
+    const http2_ops* ops;
+    hpack_table decoder;
+    hpack_table encoder;
+    h2_stream* streams[HTTP2_MAX_STREAMS];
+    int stream_count;
+    uint32_t last_id; // highest stream the client opened
+    int64_t window; // connection send window
+    uint32_t peer_window; // SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t peer_frame_max;
+    size_t preface; // bytes of the client preface matched so far
+    int closing; // GOAWAY sent or received: no new streams
+    int failed; // connection error: only the GOAWAY is still sent
+    int writable; // last write didn't block
+    uint64_t vtime; // pass of the stream last sent from
+    uint32_t block_stream; // stream whose header block is being continued, 0 if none
+    uint8_t block_flags;
+    uint32_t block_parent;
+    int block_weight;
+    int block_exclusive;
+    size_t block_len;
+    size_t in_len;
+    size_t out_len;
+    size_t out_sent;
+    uint8_t block[HTTP2_HEADER_BLOCK_MAX];
+    uint8_t in[FRAME_HEADER + HTTP2_FRAME_MAX];
+    uint8_t out[HTTP2_OUT_BUF];
+    uint8_t encoded[ENCODE_MAX];
+} h2_conn;
+
+// request fields taken from a decoded header block
+typedef struct {
+    char method[16];
+    char path[HTTP2_REQUEST_MAX - 32];
+    int bad;
+} h2_request;
+
+// handed to a new stream fiber, which copies them before it first waits
+static struct {
+    int fd;
+    char request[HTTP2_REQUEST_MAX];
+    const http2_ops* ops;
+} spawn;
+
+static uint32_t get32(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static size_t out_free(const h2_conn* c)
+{
+    return HTTP2_OUT_BUF - c->out_len;
+}
+
+static void frame_header(uint8_t* p, size_t len, frame_type type, uint8_t flags, uint32_t stream)
+{
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, stream & MAX_WINDOW);
+}
+
+// queue a frame; a peer that makes us queue more control frames than it
+// reads gets the connection closed
+static void queue_frame(h2_conn* c, frame_type type, uint8_t flags, uint32_t stream, const void* payload, size_t len)
+{
+    if (c->failed)
+        return;
+    if (out_free(c) < FRAME_HEADER + len) {
+        c->failed = c->closing = 1;
+        return;
+    }
+    frame_header(c->out + c->out_len, len, type, flags, stream);
+    if (len)
+        memcpy(c->out + c->out_len + FRAME_HEADER, payload, len);
+    c->out_len += FRAME_HEADER + len;
+}
+
+// connection error: tell the client why, then close once that is written
+static void conn_error(h2_conn* c, h2_error code)
+{
+    uint8_t payload[8];
+    put32(payload, c->last_id);
+    put32(payload + 4, code);
+    queue_frame(c, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->failed = c->closing = 1;
+}
+
+static void stream_error(h2_conn* c, uint32_t id, h2_error code)
+{
+    uint8_t payload[4];
+    put32(payload, code);
+    queue_frame(c, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static h2_stream* find_stream(h2_conn* c, uint32_t id)
+{
+    for (int i = 0; i < c->stream_count; i++) {
+        if (c->streams[i]->id == id)
+            return c->streams[i];
+    }
+    return NULL;
+}
+
+static void watch(h2_conn* c, h2_stream* s, int on)
+{
+    if (s->watched == on)
+        return;
+    struct epoll_event ev = { .events = on ? EPOLLIN : 0, .data.u64 = s->id };
+    epoll_ctl(c->ep, EPOLL_CTL_MOD, s->fd, &ev);
+    s->watched = on;
+}
+
+// the response is complete or the client cancelled it; a handler still
+// writing gets EPIPE. Streams that depended on it move up to its parent.
+static void close_stream(h2_conn* c, h2_stream* s)
+{
+    for (int i = 0; i < c->stream_count; i++) {
+        if (c->streams[i]->parent == s->id)
+            c->streams[i]->parent = s->parent;
+    }
+    for (int i = 0; i < c->stream_count; i++) {
+        if (c->streams[i] == s) {
+            c->streams[i] = c->streams[--c->stream_count];
+            break;
+        }
+    }
+    close(s->fd);
+    free(s);
+}
+
+static int depends_on(h2_conn* c, h2_stream* s, uint32_t ancestor)
+{
+    for (int depth = 0; s && depth < HTTP2_MAX_STREAMS; depth++) {
+        if (s->parent == ancestor)
+            return 1;
+        s = find_stream(c, s->parent);
+    }
+    return 0;
+}
+
+// RFC 7540 section 5.3.3: a stream moved below one of its own descendants
+// first hands that descendant its old place; exclusive adopts the siblings
+static void set_priority(h2_conn* c, h2_stream* s, uint32_t parent, int weight, int exclusive)
+{
+    h2_stream* p = find_stream(c, parent);
+    if (!p)
+        parent = 0; // closed or idle streams count as the root
+    else if (depends_on(c, p, s->id))
+        p->parent = s->parent;
+    if (exclusive) {
+        for (int i = 0; i < c->stream_count; i++) {
+            if (c->streams[i] != s && c->streams[i]->parent == parent)
+                c->streams[i]->parent = s->id;
+        }
+    }
+    s->parent = parent;
+    s->weight = weight;
+}
+
+static void stream_main(void* arg)
+{
+    (void)arg;
+    char request[HTTP2_REQUEST_MAX];
+    int fd = spawn.fd;
+    const http2_ops* ops = spawn.ops;
+    memcpy(request, spawn.request, sizeof(request));
+    ops->serve(fd, request);
+}
+
+// answer a stream without running a handler
+static void respond_status(h2_conn* c, uint32_t id, const char* status)
+{
+    size_t n = hpack_encode_begin(&c->encoder, c->encoded, sizeof(c->encoded));
+    n += hpack_encode(&c->encoder, c->encoded + n, sizeof(c->encoded) - n, ":status", status, 0);
+    queue_frame(c, FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, id, c->encoded, n);
+}
+
+static void open_stream(h2_conn* c, uint32_t id, const h2_request* req)
+{
+    if (c->closing)
+        return; // after GOAWAY, new streams are ignored
+    if (c->stream_count == HTTP2_MAX_STREAMS) {
+        stream_error(c, id, ERR_REFUSED_STREAM);
+        return;
+    }
+    if (req->bad || !req->method[0] || req->path[0] != '/') {
+        stream_error(c, id, ERR_PROTOCOL);
+        return;
+    }
+    int head_only = strcmp(req->method, "HEAD") == 0;
+    if (!head_only && strcmp(req->method, "GET") != 0) {
+        respond_status(c, id, "501");
+        return;
+    }
+
+    int sv[2];
+    h2_stream* s = calloc(1, sizeof(h2_stream));
+    if (!s || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("Error: failed to set up HTTP/2 stream");
+        free(s);
+        stream_error(c, id, ERR_REFUSED_STREAM);
+        return;
+    }
+    s->id = id;
+    s->fd = sv[0];
+    s->head_only = head_only;
+    s->window = c->peer_window;
+    s->weight = HTTP2_DEFAULT_WEIGHT;
+    s->pass = c->vtime;
+    s->watched = 1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = id };
+    epoll_ctl(c->ep, EPOLL_CTL_ADD, s->fd, &ev);
+    c->streams[c->stream_count++] = s;
+    metrics_counter_add(&metrics->http2_streams, 1);
+
+    // the handler runs right away, until it first has to wait
+    spawn.fd = sv[1];
+    spawn.ops = c->ops;
+    snprintf(spawn.request, sizeof(spawn.request), "GET %s HTTP/2.0", req->path);
+    create_thread(stream_main);
+}
+
+static void collect_field(void* arg, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    h2_request* req = arg;
+    char* dest = NULL;
+    size_t cap = 0;
+    if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+        dest = req->method;
+        cap = sizeof(req->method);
+    } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+        dest = req->path;
+        cap = sizeof(req->path);
+    }
+    if (!dest)
+        return;
+    if (value_len >= cap || memchr(value, ' ', value_len) || memchr(value, '\0', value_len)) {
+        req->bad = 1;
+        return;
+    }
+    memcpy(dest, value, value_len);
+    dest[value_len] = '\0';
+}
+
+// a complete header block: always decoded, since skipping one would leave
+// the dynamic table out of step with the client's
+static void end_header_block(h2_conn* c)
+{
+    uint32_t id = c->block_stream;
+    h2_request req = { .bad = 0 };
+    c->block_stream = 0;
+    if (hpack_decode(&c->decoder, c->block, c->block_len, collect_field, &req) == -1) {
+        conn_error(c, ERR_COMPRESSION);
+        return;
+    }
+    if (id <= c->last_id)
+        return; // trailers, or a stream we already answered
+    c->last_id = id;
+    open_stream(c, id, &req);
+    h2_stream* s = find_stream(c, id);
+    if (s && c->block_weight)
+        set_priority(c, s, c->block_parent, c->block_weight, c->block_exclusive);
+}
+
+static void append_block(h2_conn* c, const uint8_t* data, size_t len)
+{
+    if (c->block_len + len > sizeof(c->block)) {
+        conn_error(c, ERR_ENHANCE_YOUR_CALM);
+        return;
+    }
+    memcpy(c->block + c->block_len, data, len);
+    c->block_len += len;
+    if (c->block_flags & FLAG_END_HEADERS)
+        end_header_block(c);
+}
+
+// strip padding, -1 if it runs past the frame
+static long unpad(const uint8_t** p, size_t len, uint8_t flags)
+{
+    if (!(flags & FLAG_PADDED))
+        return len;
+    if (len < 1 || **p >= len)
+        return -1;
+    size_t pad = **p;
+    (*p)++;
+    return len - 1 - pad;
+}
+
+static void on_headers(h2_conn* c, uint32_t id, uint8_t flags, const uint8_t* p, size_t len)
+{
+    long n = unpad(&p, len, flags);
+    if (id == 0 || !(id & 1) || n < 0) {
+        conn_error(c, ERR_PROTOCOL);
+        return;
+    }
+    c->block_weight = 0;
+    if (flags & FLAG_PRIORITY) {
+        if (n < 5) {
+            conn_error(c, ERR_FRAME_SIZE);
+            return;
+        }
+        c->block_exclusive = p[0] >> 7;
+        c->block_parent = get32(p) & MAX_WINDOW;
+        c->block_weight = p[4] + 1;
+        if (c->block_parent == id) {
+            stream_error(c, id, ERR_PROTOCOL);
+            c->block_weight = 0;
+        }
+        p += 5;
+        n -= 5;
+    }
+    c->block_stream = id;
+    c->block_flags = flags;
+    c->block_len = 0;
+    append_block(c, p, n);
+}
+
+static void on_settings(h2_conn* c, uint8_t flags, const uint8_t* p, size_t len)
+{
+    if (flags & FLAG_ACK)
+        return;
+    if (len % 6) {
+        conn_error(c, ERR_FRAME_SIZE);
+        return;
+    }
+    for (size_t i = 0; i < len; i += 6) {
+        uint16_t id = p[i] << 8 | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpack_encoder_limit(&c->encoder, value);
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > MAX_WINDOW) {
+                conn_error(c, ERR_FLOW_CONTROL);
+                return;
+            }
+            for (int s = 0; s < c->stream_count; s++)
+                c->streams[s]->window += (int64_t)value - c->peer_window;
+            c->peer_window = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < 16384 || value > 16777215) {
+                conn_error(c, ERR_PROTOCOL);
+                return;
+            }
+            c->peer_frame_max = value;
+            break;
+        default:
+            break; // push is never used, and we open no streams to limit
+        }
+    }
+}
+
+static void on_window_update(h2_conn* c, uint32_t id, const uint8_t* p, size_t len)
+{
+    if (len != 4) {
+        conn_error(c, ERR_FRAME_SIZE);
+        return;
+    }
+    uint32_t increment = get32(p) & MAX_WINDOW;
+    int64_t* window = &c->window;
+    if (id) {
+        h2_stream* s = find_stream(c, id);
+        if (!s) {
+            if (id > c->last_id)
+                conn_error(c, ERR_PROTOCOL);
+            return;
+        }
+        window = &s->window;
+    }
+    if (increment == 0 || *window + increment > MAX_WINDOW) {
+        if (id)
+            stream_error(c, id, increment ? ERR_FLOW_CONTROL : ERR_PROTOCOL);
+        else
+            conn_error(c, increment ? ERR_FLOW_CONTROL : ERR_PROTOCOL);
+        return;
+    }
+    *window += increment;
+}
+
+// DATA from the client is a request body nobody reads; give the window back
+static void on_data(h2_conn* c, uint32_t id, const uint8_t* p, size_t len, uint8_t flags)
+{
+    if (id == 0 || id > c->last_id || unpad(&p, len, flags) < 0) {
+        conn_error(c, ERR_PROTOCOL);
+        return;
+    }
+    if (len == 0)
+        return;
+    uint8_t increment[4];
+    put32(increment, len);
+    queue_frame(c, FRAME_WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+    if (!(flags & FLAG_END_STREAM) && find_stream(c, id))
+        queue_frame(c, FRAME_WINDOW_UPDATE, 0, id, increment, sizeof(increment));
+}
+
+static void on_frame(h2_conn* c, frame_type type, uint8_t flags, uint32_t id, const uint8_t* p, size_t len)
+{
+    // nothing may come between the frames of a header block
+    if (c->block_stream && (type != FRAME_CONTINUATION || id != c->block_stream)) {
+        conn_error(c, ERR_PROTOCOL);
+        return;
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        on_data(c, id, p, len, flags);
+        break;
+    case FRAME_HEADERS:
+        on_headers(c, id, flags, p, len);
+        break;
+    case FRAME_CONTINUATION:
+        if (!c->block_stream) {
+            conn_error(c, ERR_PROTOCOL);
+            break;
+        }
+        c->block_flags |= flags & FLAG_END_HEADERS;
+        append_block(c, p, len);
+        break;
+    case FRAME_PRIORITY: {
+        if (id == 0 || len != 5) {
+            conn_error(c, len != 5 ? ERR_FRAME_SIZE : ERR_PROTOCOL);
+            break;
+        }
+        h2_stream* s = find_stream(c, id);
+        uint32_t parent = get32(p) & MAX_WINDOW;
+        if (parent == id)
+            stream_error(c, id, ERR_PROTOCOL);
+        else if (s)
+            set_priority(c, s, parent, p[4] + 1, p[0] >> 7);
+        break;
+    }
+    case FRAME_RST_STREAM: {
+        if (id == 0 || id > c->last_id || len != 4) {
+            conn_error(c, len != 4 ? ERR_FRAME_SIZE : ERR_PROTOCOL);
+            break;
+        }
+        h2_stream* s = find_stream(c, id);
+        if (s)
+            close_stream(c, s);
+        break;
+    }
+    case FRAME_SETTINGS:
+        if (id != 0) {
+            conn_error(c, ERR_PROTOCOL);
+            break;
+        }
+        on_settings(c, flags, p, len);
+        if (!(flags & FLAG_ACK) && !c->failed)
+            queue_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        break;
+    case FRAME_PUSH_PROMISE:
+        conn_error(c, ERR_PROTOCOL); // clients can't push
+        break;
+    case FRAME_PING:
+        if (id != 0 || len != 8) {
+            conn_error(c, len != 8 ? ERR_FRAME_SIZE : ERR_PROTOCOL);
+            break;
+        }
+        if (!(flags & FLAG_ACK))
+            queue_frame(c, FRAME_PING, FLAG_ACK, 0, p, len);
+        break;
+    case FRAME_GOAWAY:
+        c->closing = 1; // finish the streams already open, then close
+        break;
+    case FRAME_WINDOW_UPDATE:
+        on_window_update(c, id, p, len);
+        break;
+    default:
+        break; // unknown frame types are ignored
+    }
+}
+
+// match the client preface, then take every complete frame off the buffer
+static void process_input(h2_conn* c)
+{
+    size_t off = 0;
+    while (c->preface < sizeof(HTTP2_PREFACE) - 1 && off < c->in_len) {
+        if (c->in[off++] != (uint8_t)HTTP2_PREFACE[c->preface++]) {
+            c->failed = c->closing = 1; // not HTTP/2 at all, not worth a GOAWAY
+            return;
+        }
+    }
+
+    while (!c->failed && c->in_len - off >= FRAME_HEADER) {
+        const uint8_t* h = c->in + off;
+        size_t len = (size_t)h[0] << 16 | h[1] << 8 | h[2];
+        if (len > HTTP2_FRAME_MAX) {
+            conn_error(c, ERR_FRAME_SIZE);
+            return;
+        }
+        if (c->in_len - off < FRAME_HEADER + len)
+            break;
+        on_frame(c, h[3], h[4], get32(h + 5) & MAX_WINDOW, h + FRAME_HEADER, len);
+        off += FRAME_HEADER + len;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+}
+
+// -1 once the client has gone away
+static int read_client(h2_conn* c)
+{
+    ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    if (n > 0) {
+        c->in_len += n;
+        process_input(c);
+    }
+    return 0;
+}
+
+// -1 once the client has gone away
+static int flush(h2_conn* c)
+{
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return -1;
+            c->writable = 0;
+            break;
+        }
+        c->out_sent += n;
+    }
+    if (c->out_sent == c->out_len) {
+        c->out_len = c->out_sent = 0;
+        c->writable = 1;
+    } else if (c->out_sent > HTTP2_OUT_BUF / 2) {
+        memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+        c->out_len -= c->out_sent;
+        c->out_sent = 0;
+    }
+    return 0;
+}
+
+// end of the response head a handler wrote, and where its body starts;
+// handlers end lines with CRLF, CGI scripts sometimes with a bare LF
+static char* find_head_end(char* head, size_t* body)
+{
+    char* crlf = strstr(head, "\r\n\r\n");
+    char* lf = strstr(head, "\n\n");
+    if (lf && (!crlf || lf < crlf)) {
+        *body = lf + 2 - head;
+        return lf;
+    }
+    if (crlf)
+        *body = crlf + 4 - head;
+    return crlf;
+}
+
+static int hop_by_hop(const char* name)
+{
+    return strcmp(name, "connection") == 0 || strcmp(name, "keep-alive") == 0 || strcmp(name, "transfer-encoding") == 0
+        || strcmp(name, "upgrade") == 0 || strcmp(name, "proxy-connection") == 0;
+}
+
+// turn the HTTP/1 head into a header block: status line to :status, names
+// lower-cased, connection-specific fields dropped
+static size_t encode_head(h2_conn* c, char* head)
+{
+    char status[4] = "200";
+    char* line = head;
+    char* save = NULL;
+    size_t n = hpack_encode_begin(&c->encoder, c->encoded, sizeof(c->encoded));
+
+    if (strncmp(head, "HTTP/", 5) == 0) {
+        char* sp = strchr(head, ' ');
+        if (sp && isdigit((unsigned char)sp[1]) && isdigit((unsigned char)sp[2]) && isdigit((unsigned char)sp[3]))
+            memcpy(status, sp + 1, 3);
+        line = strchr(head, '\n');
+        line = line ? line + 1 : head + strlen(head);
+    }
+    n += hpack_encode(&c->encoder, c->encoded + n, sizeof(c->encoded) - n, ":status", status, 0);
+
+    for (char* l = strtok_r(line, "\n", &save); l; l = strtok_r(NULL, "\n", &save)) {
+        l[strcspn(l, "\r")] = '\0';
+        char* colon = strchr(l, ':');
+        if (!colon || colon == l)
+            continue;
+        *colon = '\0';
+        for (char* p = l; *p; p++)
+            *p = tolower((unsigned char)*p);
+        char* value = colon + 1;
+        while (*value == ' ' || *value == '\t')
+            value++;
+        if (hop_by_hop(l))
+            continue;
+        // lengths and dates change with every response, not worth a table entry
+        int index = strcmp(l, "content-length") != 0 && strcmp(l, "date") != 0;
+        n += hpack_encode(&c->encoder, c->encoded + n, sizeof(c->encoded) - n, l, value, index);
+    }
+    return n;
+}
+
+// send a header block, split into CONTINUATION frames as the peer requires
+static void queue_header_block(h2_conn* c, uint32_t id, size_t len)
+{
+    size_t off = 0;
+    do {
+        size_t chunk = len - off < c->peer_frame_max ? len - off : c->peer_frame_max;
+        uint8_t flags = off + chunk == len ? FLAG_END_HEADERS : 0;
+        queue_frame(c, off ? FRAME_CONTINUATION : FRAME_HEADERS, flags, id, c->encoded + off, chunk);
+        off += chunk;
+    } while (off < len);
+}
+
+// read more of a response head, sending it once complete
+static void relay_head(h2_conn* c, h2_stream* s)
+{
+    ssize_t n = read(s->fd, s->head + s->head_len, HTTP2_HEAD_MAX - s->head_len);
+    if (n == -1 && errno == EAGAIN) {
+        s->readable = 0;
+        watch(c, s, 1);
+        return;
+    }
+    if (n > 0) {
+        s->head_len += n;
+        s->head[s->head_len] = '\0';
+    }
+    size_t body;
+    char* end = find_head_end(s->head, &body);
+    if (!end) {
+        if (n <= 0 || s->head_len == HTTP2_HEAD_MAX) { // handler failed, or a head too large
+            stream_error(c, s->id, ERR_INTERNAL);
+            close_stream(c, s);
+        }
+        return;
+    }
+
+    *end = '\0';
+    queue_header_block(c, s->id, encode_head(c, s->head));
+    s->headers_sent = 1;
+    s->body_off = body;
+}
+
+// relay up to what the windows, the peer's frame size and our buffer allow
+static void relay_body(h2_conn* c, h2_stream* s)
+{
+    int64_t allow = out_free(c) - FRAME_HEADER;
+    if (!s->head_only) {
+        allow = s->window < allow ? s->window : allow;
+        allow = c->window < allow ? c->window : allow;
+        allow = c->peer_frame_max < allow ? c->peer_frame_max : allow;
+    }
+    uint8_t* payload = c->out + c->out_len + FRAME_HEADER;
+    ssize_t n;
+    if (s->body_off < s->head_len) {
+        n = s->head_len - s->body_off < (size_t)allow ? (ssize_t)(s->head_len - s->body_off) : allow;
+        memcpy(payload, s->head + s->body_off, n);
+        s->body_off += n;
+    } else if ((n = read(s->fd, payload, allow)) == -1) {
+        if (errno == EAGAIN) {
+            s->readable = 0;
+            watch(c, s, 1);
+            return;
+        }
+        n = 0; // the handler's end went away, end the stream with what we have
+    }
+
+    if (n == 0) {
+        queue_frame(c, FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0);
+        close_stream(c, s);
+        return;
+    }
+    if (s->head_only)
+        return;
+    frame_header(c->out + c->out_len, n, FRAME_DATA, 0, s->id);
+    c->out_len += FRAME_HEADER + n;
+    s->window -= n;
+    c->window -= n;
+    s->pass += (uint64_t)n * STRIDE / s->weight;
+    c->vtime = s->pass;
+}
+
+static int can_send(h2_conn* c, h2_stream* s)
+{
+    if (!s->readable)
+        return 0;
+    if (!s->headers_sent)
+        return out_free(c) >= ENCODE_MAX + 4 * FRAME_HEADER;
+    if (out_free(c) <= FRAME_HEADER)
+        return 0;
+    return s->head_only || (s->window > 0 && c->window > 0);
+}
+
+// The next stream to send from (RFC 7540 section 5.3): one whose ancestors
+// have nothing to send, and among those the lowest pass, which advances by
+// bytes sent over weight, so siblings share the connection by weight.
+static h2_stream* pick_stream(h2_conn* c)
+{
+    h2_stream* best = NULL;
+    for (int i = 0; i < c->stream_count; i++) {
+        h2_stream* s = c->streams[i];
+        if (!can_send(c, s))
+            continue;
+        int blocked = 0;
+        h2_stream* a = find_stream(c, s->parent);
+        for (int depth = 0; a && depth < HTTP2_MAX_STREAMS && !blocked; depth++) {
+            blocked = can_send(c, a);
+            a = find_stream(c, a->parent);
+        }
+        if (!blocked && (!best || s->pass < best->pass))
+            best = s;
+    }
+    return best;
+}
+
+// responses wait for the client's preface; after an upgrade some clients
+// only have room for a little data behind the 101 until they have sent it
+static void pump_streams(h2_conn* c)
+{
+    h2_stream* s;
+    if (c->preface < sizeof(HTTP2_PREFACE) - 1)
+        return;
+    while (!c->failed && (s = pick_stream(c)) != NULL) {
+        if (s->headers_sent)
+            relay_body(c, s);
+        else
+            relay_head(c, s);
+    }
+}
+
+static void queue_settings(h2_conn* c)
+{
+    uint8_t payload[6];
+    payload[0] = 0;
+    payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(payload + 2, HTTP2_MAX_STREAMS);
+    queue_frame(c, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+// the HTTP2-Settings header of an upgrade is a SETTINGS payload in base64url
+static void apply_upgrade_settings(h2_conn* c, const char* b64)
+{
+    uint8_t payload[HTTP2_SETTINGS_MAX];
+    size_t len = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (const char* p = b64; *p && *p != '='; p++) {
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        const char* at = strchr(alphabet, *p);
+        if (!at)
+            return;
+        acc = acc << 6 | (at - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            payload[len++] = acc >> bits;
+        }
+    }
+    on_settings(c, 0, payload, len - len % 6);
+}
+
+static void conn_free(h2_conn* c)
+{
+    while (c->stream_count)
+        close_stream(c, c->streams[0]);
+    hpack_table_free(&c->decoder);
+    hpack_table_free(&c->encoder);
+    close(c->ep);
+    free(c);
+}
+
+// Serve an HTTP/2 connection until it closes; needs the fiber scheduler.
+// Frames are read and written without blocking, the connection's fiber
+// waits on an epoll set holding the client socket and every stream's
+// socketpair, so streams progress independently of each other.
+int http2_serve(int client_fd, const http2_start* start, const http2_ops* ops)
+{
+    if (!fiber_running())
+        return -1;
+    h2_conn* c = calloc(1, sizeof(h2_conn));
+    if (!c || (c->ep = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("Error: failed to set up HTTP/2 connection");
+        free(c);
+        return -1;
+    }
+    c->fd = client_fd;
+    c->ops = ops;
+    c->window = DEFAULT_WINDOW;
+    c->peer_window = DEFAULT_WINDOW;
+    c->peer_frame_max = HTTP2_FRAME_MAX;
+    c->writable = 1;
+    hpack_table_init(&c->decoder, HPACK_TABLE_SIZE);
+    hpack_table_init(&c->encoder, HPACK_TABLE_SIZE);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+    epoll_ctl(c->ep, EPOLL_CTL_ADD, client_fd, &ev);
+    metrics_counter_add(&metrics->http2_connections, 1);
+
+    if (start->upgrade) {
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        memcpy(c->out, switching, sizeof(switching) - 1);
+        c->out_len = sizeof(switching) - 1;
+        queue_settings(c);
+        apply_upgrade_settings(c, start->settings);
+
+        // the upgraded request becomes stream 1, already half-closed by the client
+        h2_request req = { .bad = 0 };
+        char* path = strchr(start->request, ' ');
+        char* end = path ? strchr(path + 1, ' ') : NULL;
+        if (end && (size_t)(path - start->request) < sizeof(req.method) && (size_t)(end - path - 1) < sizeof(req.path)) {
+            memcpy(req.method, start->request, path - start->request);
+            memcpy(req.path, path + 1, end - path - 1);
+        }
+        c->last_id = 1;
+        open_stream(c, 1, &req);
+    } else {
+        c->preface = sizeof(HTTP2_PREFACE_HEAD) - 1; // read as an HTTP/1 request head
+        queue_settings(c);
+    }
+    memcpy(c->in, start->data, start->len < sizeof(c->in) ? start->len : sizeof(c->in));
+    c->in_len = start->len < sizeof(c->in) ? start->len : sizeof(c->in);
+    process_input(c);
+
+    struct epoll_event events[EVENTS_MAX];
+    for (;;) {
+        pump_streams(c);
+        if (flush(c) == -1)
+            break;
+        if (c->failed && c->out_len == 0)
+            break;
+        if (c->closing && c->stream_count == 0 && c->out_len == 0)
+            break;
+        if (c->writable && !c->failed && c->preface == sizeof(HTTP2_PREFACE) - 1 && pick_stream(c))
+            continue; // the buffer drained and there is more to send
+
+        ev.events = EPOLLIN | (c->out_len ? EPOLLOUT : 0);
+        epoll_ctl(c->ep, EPOLL_CTL_MOD, client_fd, &ev);
+        if (fiber_wait_fd(c->ep, FIBER_READ) == -1) {
+            conn_error(c, ERR_NO_ERROR); // idle too long, or the connection's time is up
+            flush(c);
+            break;
+        }
+
+        int n = epoll_wait(c->ep, events, EVENTS_MAX, 0);
+        int gone = 0;
+        for (int i = 0; i < n; i++) {
+            uint32_t id = events[i].data.u64;
+            if (id == 0) {
+                if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->failed && read_client(c) == -1)
+                    gone = 1;
+                continue;
+            }
+            h2_stream* s = find_stream(c, id);
+            if (s) {
+                s->readable = 1;
+                watch(c, s, 0);
+            }
+        }
+        if (gone)
+            break;
+    }
+
+    conn_free(c);
+    return 0;
+}
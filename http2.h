@@ -0,0 +1,36 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_HEAD "PRI * HTTP/2.0\r\n\r\n" // the part an HTTP/1 parser reads as a request head
+#define HTTP2_MAX_STREAMS 32 // SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define HTTP2_FRAME_MAX 16384 // largest frame we accept, the protocol's minimum
+#define HTTP2_HEADER_BLOCK_MAX 16384 // largest request header block, across CONTINUATION frames
+#define HTTP2_HEAD_MAX 8192 // largest response head a handler may write
+#define HTTP2_OUT_BUF (128 * 1024) // frames waiting to be written to the client
+#define HTTP2_START_MAX 8192 // bytes read past the HTTP/1 head before switching
+#define HTTP2_SETTINGS_MAX 256 // HTTP2-Settings header of an h2c upgrade
+#define HTTP2_REQUEST_MAX 512 // request line handed to the handlers, their buffer size
+#define HTTP2_DEFAULT_WEIGHT 16
+
+// how a connection turned into HTTP/2, and what was read from it already
+typedef struct {
+    int upgrade; // 1 after "Upgrade: h2c", 0 for prior knowledge
+    char request[HTTP2_REQUEST_MAX]; // request line of the upgrade, answered on stream 1
+    char settings[HTTP2_SETTINGS_MAX]; // its HTTP2-Settings, base64url
+    size_t len;
+    char data[HTTP2_START_MAX]; // bytes received after the HTTP/1 head
+} http2_start;
+
+typedef struct {
+    // serve one stream's request in a fiber of its own, given an HTTP/1
+    // request line; the response is written to fd the HTTP/1 way, then fd
+    // is closed
+    void (*serve)(int fd, char* request);
+} http2_ops;
+
+int http2_serve(int client_fd, const http2_start* start, const http2_ops* ops);
+
+#endif /* HTTP2_H */
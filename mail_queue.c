@@ -0,0 +1,787 @@
+#define _GNU_SOURCE
+
+#include "mail_queue.h"
+#include "metrics.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOB_NAME_MAX 128
+#define JOB_FILE_MAX (JOB_NAME_MAX + 32) // "<due>.<attempts>.<id>", as reschedule names it
+#define REPLY_MAX 512
+#define BASE64_LINE 57 // input bytes per 76-character base64 line
+
+// A job is one file: the envelope sender and recipient on a line each,
+// then the message as it goes on the wire. Enqueueing writes it to tmp/
+// and renames it into new/ as "<due>.<attempts>.<id>", so a job is either
+// complete or absent; retrying renames it to its next due time, giving up
+// moves it to failed/.
+typedef struct {
+    char name[JOB_NAME_MAX];
+    time_t due;
+    int attempts;
+    char id[JOB_NAME_MAX];
+} mail_job;
+
+typedef enum {
+    SEND_OK,
+    SEND_RETRY, // 4xx, or the connection broke
+    SEND_FAIL // 5xx, retrying won't help
+} send_result;
+
+// the relay connection, kept open between batches for MAIL_IDLE_MS
+typedef struct {
+    int fd;
+    int pipelining; // the relay advertised PIPELINING (RFC 2920)
+    uint64_t last_used_ms;
+    size_t len; // bytes of reply buffered in buf
+    char buf[REPLY_MAX * 4];
+} smtp_conn;
+
+static char spool[512];
+static char relay_host[256];
+static char relay_port[8];
+static volatile sig_atomic_t sender_stop = 0;
+static int64_t published_depth = 0;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// no CR, LF, spaces or angle brackets, which could break out of the
+// envelope or a header, and one @ with a dot somewhere after it
+int mail_address_valid(const char* address)
+{
+    size_t len = strlen(address);
+    const char* at = strchr(address, '@');
+    if (len == 0 || len > MAIL_ADDRESS_MAX || !at || at == address || strchr(at + 1, '@'))
+        return 0;
+    const char* dot = strrchr(at, '.');
+    if (!dot || dot == at + 1 || dot[1] == '\0')
+        return 0;
+    for (const char* p = address; *p; p++) {
+        if ((unsigned char)*p <= ' ' || *p == '<' || *p == '>' || *p == '"' || *p == ',' || *p == 0x7f)
+            return 0;
+    }
+    return 1;
+}
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} mail_buf;
+
+static int buf_add(mail_buf* b, const char* data, size_t len)
+{
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len)
+            cap *= 2;
+        if (cap > MAIL_MESSAGE_MAX + 4096)
+            return -1;
+        char* grown = realloc(b->data, cap);
+        if (!grown)
+            return -1;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int buf_printf(mail_buf* b, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int buf_printf(mail_buf* b, const char* fmt, ...)
+{
+    char line[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof(line))
+        return -1;
+    return buf_add(b, line, n);
+}
+
+// text with every line ending turned into CRLF
+static int buf_add_text(mail_buf* b, const char* text)
+{
+    for (const char* p = text; *p;) {
+        size_t n = strcspn(p, "\r\n");
+        if (buf_add(b, p, n) == -1 || buf_add(b, "\r\n", 2) == -1)
+            return -1;
+        p += n;
+        if (*p == '\r')
+            p++;
+        if (*p == '\n')
+            p++;
+    }
+    return 0;
+}
+
+static int buf_add_base64(mail_buf* b, const unsigned char* data, size_t len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char line[80];
+    for (size_t off = 0; off < len; off += BASE64_LINE) {
+        size_t chunk = len - off < BASE64_LINE ? len - off : BASE64_LINE;
+        size_t n = 0;
+        for (size_t i = 0; i < chunk; i += 3) {
+            const unsigned char* in = data + off + i;
+            uint32_t v = in[0] << 16 | (i + 1 < chunk ? in[1] << 8 : 0) | (i + 2 < chunk ? in[2] : 0);
+            line[n++] = alphabet[v >> 18 & 63];
+            line[n++] = alphabet[v >> 12 & 63];
+            line[n++] = i + 1 < chunk ? alphabet[v >> 6 & 63] : '=';
+            line[n++] = i + 2 < chunk ? alphabet[v & 63] : '=';
+        }
+        line[n++] = '\r';
+        line[n++] = '\n';
+        if (buf_add(b, line, n) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// the message as sent: headers, then the text alone or a multipart/mixed
+// body with the attachment in base64
+static int compose(mail_buf* b, const mail_message* msg, const char* id)
+{
+    char date[64];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S +0000", gmtime_r(&now, &tm));
+
+    if (buf_printf(b, "%s\n%s\n", msg->from, msg->to) == -1 // envelope
+        || buf_printf(b, "From: %s\r\nTo: %s\r\n", msg->from, msg->to) == -1
+        || buf_printf(b, "Subject: %s\r\nDate: %s\r\n", msg->subject, date) == -1
+        || buf_printf(b, "Message-ID: <%s@webserv>\r\nMIME-Version: 1.0\r\n", id) == -1)
+        return -1;
+
+    if (!msg->attachment) {
+        if (buf_printf(b, "Content-Type: text/plain; charset=utf-8\r\n\r\n") == -1)
+            return -1;
+        return buf_add_text(b, msg->text);
+    }
+
+    if (buf_printf(b, "Content-Type: multipart/mixed; boundary=\"webserv-%s\"\r\n\r\n", id) == -1
+        || buf_printf(b, "--webserv-%s\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n", id) == -1
+        || buf_add_text(b, msg->text) == -1
+        || buf_printf(b, "--webserv-%s\r\nContent-Type: %s; name=\"%s\"\r\n", id, msg->attachment_type, msg->attachment_name) == -1
+        || buf_printf(b, "Content-Disposition: attachment; filename=\"%s\"\r\n", msg->attachment_name) == -1
+        || buf_printf(b, "Content-Transfer-Encoding: base64\r\n\r\n") == -1
+        || buf_add_base64(b, msg->attachment, msg->attachment_len) == -1
+        || buf_printf(b, "--webserv-%s--\r\n", id) == -1)
+        return -1;
+    return 0;
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int sync_dir(const char* dir)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// compose the message and store it in the spool; 0 once it is on disk, so
+// it survives a crash or restart and will be sent
+int mail_queue_submit(const mail_message* msg)
+{
+    static unsigned counter = 0;
+    if (!spool[0] || !mail_address_valid(msg->from) || !mail_address_valid(msg->to)
+        || strpbrk(msg->subject, "\r\n") || (msg->attachment_name && strpbrk(msg->attachment_name, "\r\n\"")))
+        return -1;
+
+    char id[JOB_NAME_MAX];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(id, sizeof(id), "%ld%06ld-%d-%u", (long)ts.tv_sec, ts.tv_nsec / 1000, getpid(), counter++);
+
+    mail_buf b = { NULL, 0, 0 };
+    if (compose(&b, msg, id) == -1) {
+        fprintf(stderr, "Error: mail message too large\n");
+        free(b.data);
+        return -1;
+    }
+
+    char tmp_path[768], job_path[768], dir[600];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/tmp/%s", spool, id);
+    snprintf(job_path, sizeof(job_path), "%s/new/%ld.0.%s", spool, (long)ts.tv_sec, id);
+    snprintf(dir, sizeof(dir), "%s/new", spool);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("Error: failed to create mail job");
+        free(b.data);
+        return -1;
+    }
+    int rc = write_all(fd, b.data, b.len);
+    if (rc == 0)
+        rc = fsync(fd);
+    close(fd);
+    free(b.data);
+    if (rc == 0)
+        rc = rename(tmp_path, job_path);
+    if (rc == 0)
+        rc = sync_dir(dir);
+    if (rc == -1) {
+        perror("Error: failed to queue mail job");
+        unlink(tmp_path);
+        return -1;
+    }
+    metrics_counter_add(&metrics->mail_queued, 1);
+    return 0;
+}
+
+static int parse_job(const char* name, mail_job* job)
+{
+    long due;
+    int attempts, consumed = 0;
+    if (sscanf(name, "%ld.%d.%n", &due, &attempts, &consumed) != 2 || consumed == 0 || strlen(name) >= JOB_NAME_MAX)
+        return -1;
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    snprintf(job->id, sizeof(job->id), "%s", name + consumed);
+    job->due = due;
+    job->attempts = attempts;
+    return 0;
+}
+
+static int job_order(const void* a, const void* b)
+{
+    const mail_job* x = a;
+    const mail_job* y = b;
+    if (x->due != y->due)
+        return x->due < y->due ? -1 : 1;
+    return strcmp(x->id, y->id);
+}
+
+// the jobs due now, oldest first, up to MAIL_BATCH_MAX; *next_due is when
+// the earliest of the others is, 0 if none
+static int scan_due(mail_job* jobs, time_t* next_due)
+{
+    char dir[600];
+    snprintf(dir, sizeof(dir), "%s/new", spool);
+    DIR* d = opendir(dir);
+    if (!d) {
+        perror("Error: failed to read mail spool");
+        return 0;
+    }
+
+    time_t now = time(NULL);
+    int n = 0;
+    int64_t depth = 0;
+    mail_job job;
+    *next_due = 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.' || parse_job(e->d_name, &job) == -1)
+            continue;
+        depth++;
+        if (job.due > now) {
+            if (!*next_due || job.due < *next_due)
+                *next_due = job.due;
+            continue;
+        }
+        if (n < MAIL_BATCH_MAX) {
+            jobs[n++] = job;
+        } else { // keep the oldest MAIL_BATCH_MAX, the rest go in the next pass
+            qsort(jobs, n, sizeof(mail_job), job_order);
+            if (job_order(&job, &jobs[n - 1]) < 0)
+                jobs[n - 1] = job;
+            *next_due = now;
+        }
+    }
+    closedir(d);
+    qsort(jobs, n, sizeof(mail_job), job_order);
+
+    metrics_gauge_add(&metrics->mail_queue_depth, depth - published_depth);
+    published_depth = depth;
+    return n;
+}
+
+static void smtp_close(smtp_conn* c)
+{
+    if (c->fd != -1)
+        close(c->fd);
+    c->fd = -1;
+    c->len = 0;
+}
+
+static int smtp_write(smtp_conn* c, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(c->fd, data, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// read one reply, which may span several "NNN-" lines; its code, or -1 if
+// the connection broke. The last line's text is left in text.
+static int smtp_reply(smtp_conn* c, char* text, size_t text_len, int* pipelining)
+{
+    for (;;) {
+        char* eol = memchr(c->buf, '\n', c->len);
+        if (!eol) {
+            if (c->len == sizeof(c->buf))
+                return -1;
+            ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            c->len += n;
+            continue;
+        }
+
+        size_t line_len = eol - c->buf + 1;
+        int code = 0;
+        int last = line_len >= 4 && c->buf[3] != '-';
+        if (line_len < 4 || sscanf(c->buf, "%3d", &code) != 1)
+            return -1;
+        if (pipelining && line_len >= 14 && strncasecmp(c->buf + 4, "PIPELINING", 10) == 0)
+            *pipelining = 1;
+        if (text) {
+            size_t n = line_len - 1 < text_len - 1 ? line_len - 1 : text_len - 1;
+            memcpy(text, c->buf, n);
+            text[n] = '\0';
+            text[strcspn(text, "\r")] = '\0';
+        }
+        memmove(c->buf, c->buf + line_len, c->len - line_len);
+        c->len -= line_len;
+        if (last)
+            return code;
+    }
+}
+
+static int smtp_command(smtp_conn* c, const char* cmd, char* text, size_t text_len)
+{
+    if (smtp_write(c, cmd, strlen(cmd)) == -1)
+        return -1;
+    return smtp_reply(c, text, text_len, NULL);
+}
+
+// connect to the relay and introduce ourselves; 0 or -1
+static int smtp_open(smtp_conn* c)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* res = NULL;
+    int rc = getaddrinfo(relay_host, relay_port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "Error: cannot resolve mail relay %s: %s\n", relay_host, gai_strerror(rc));
+        return -1;
+    }
+
+    struct timeval timeout = { MAIL_IO_TIMEOUT_S, 0 };
+    for (struct addrinfo* ai = res; ai && c->fd == -1; ai = ai->ai_next) {
+        c->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (c->fd == -1)
+            continue;
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); // bounds connect() too
+        if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) == -1)
+            smtp_close(c);
+    }
+    freeaddrinfo(res);
+    if (c->fd == -1) {
+        fprintf(stderr, "Error: cannot connect to mail relay %s:%s: %s\n", relay_host, relay_port, strerror(errno));
+        return -1;
+    }
+
+    char host[256] = "localhost";
+    char cmd[300], text[REPLY_MAX];
+    gethostname(host, sizeof(host) - 1);
+    c->len = 0;
+    c->pipelining = 0;
+    int code = smtp_reply(c, text, sizeof(text), NULL);
+    if (code == 220) {
+        snprintf(cmd, sizeof(cmd), "EHLO %s\r\n", host);
+        if (smtp_write(c, cmd, strlen(cmd)) == 0)
+            code = smtp_reply(c, text, sizeof(text), &c->pipelining);
+        else
+            code = -1;
+        if (code >= 500) { // an old relay without ESMTP
+            snprintf(cmd, sizeof(cmd), "HELO %s\r\n", host);
+            code = smtp_command(c, cmd, text, sizeof(text));
+        }
+    }
+    if (code != 250) {
+        fprintf(stderr, "Error: mail relay %s refused the session: %s\n", relay_host, code == -1 ? "connection lost" : text);
+        smtp_close(c);
+        return -1;
+    }
+    metrics_counter_add(&metrics->mail_connections, 1);
+    return 0;
+}
+
+// the message with lines starting with a dot doubled (RFC 5321 4.5.2),
+// then the terminating dot
+static int smtp_data(smtp_conn* c, const char* msg, size_t len)
+{
+    char out[16384];
+    size_t n = 0;
+    int line_start = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (n + 8 > sizeof(out)) {
+            if (smtp_write(c, out, n) == -1)
+                return -1;
+            n = 0;
+        }
+        if (line_start && msg[i] == '.')
+            out[n++] = '.';
+        out[n++] = msg[i];
+        line_start = msg[i] == '\n';
+    }
+    if (!line_start) {
+        out[n++] = '\r';
+        out[n++] = '\n';
+    }
+    memcpy(out + n, ".\r\n", 3);
+    return smtp_write(c, out, n + 3);
+}
+
+static int classify(int code)
+{
+    return code >= 500 ? SEND_FAIL : SEND_RETRY;
+}
+
+// one transaction, a send_result or -1 if the connection broke; with
+// PIPELINING the envelope and DATA go out in one write and their replies
+// are read together
+static int smtp_send(smtp_conn* c, const char* from, const char* to, const char* msg, size_t len, char* text, size_t text_len)
+{
+    char mail[MAIL_ADDRESS_MAX + 16], rcpt[MAIL_ADDRESS_MAX + 16];
+    snprintf(mail, sizeof(mail), "MAIL FROM:<%s>\r\n", from);
+    snprintf(rcpt, sizeof(rcpt), "RCPT TO:<%s>\r\n", to);
+
+    int mail_code, rcpt_code, data_code;
+    if (c->pipelining) {
+        char batch[sizeof(mail) + sizeof(rcpt) + 8];
+        int n = snprintf(batch, sizeof(batch), "%s%sDATA\r\n", mail, rcpt);
+        if (smtp_write(c, batch, n) == -1)
+            return -1;
+        char rcpt_text[REPLY_MAX], data_text[REPLY_MAX];
+        mail_code = smtp_reply(c, text, text_len, NULL);
+        rcpt_code = mail_code == -1 ? -1 : smtp_reply(c, rcpt_text, sizeof(rcpt_text), NULL);
+        data_code = rcpt_code == -1 ? -1 : smtp_reply(c, data_text, sizeof(data_text), NULL);
+        if (mail_code == 250) // report the first reply that went wrong
+            snprintf(text, text_len, "%s", rcpt_code == 250 || rcpt_code == 251 ? data_text : rcpt_text);
+    } else {
+        mail_code = smtp_command(c, mail, text, text_len);
+        rcpt_code = mail_code == 250 ? smtp_command(c, rcpt, text, text_len) : 0;
+        data_code = rcpt_code == 250 || rcpt_code == 251 ? smtp_command(c, "DATA\r\n", text, text_len) : 0;
+    }
+    if (mail_code == -1 || rcpt_code == -1 || data_code == -1)
+        return -1;
+
+    if (mail_code != 250 || (rcpt_code != 250 && rcpt_code != 251)) {
+        if (data_code == 354 && smtp_command(c, ".\r\n", NULL, 0) == -1) // pipelined DATA accepted anyway
+            return -1;
+        if (smtp_command(c, "RSET\r\n", NULL, 0) == -1)
+            return -1;
+        return classify(mail_code != 250 ? mail_code : rcpt_code);
+    }
+    if (data_code != 354) {
+        if (smtp_command(c, "RSET\r\n", NULL, 0) == -1)
+            return -1;
+        return classify(data_code);
+    }
+
+    if (smtp_data(c, msg, len) == -1)
+        return -1;
+    int code = smtp_reply(c, text, text_len, NULL);
+    if (code == -1)
+        return -1;
+    return code == 250 ? SEND_OK : classify(code);
+}
+
+static void job_path(char* path, size_t len, const char* sub, const char* name)
+{
+    snprintf(path, len, "%s/%s/%.*s", spool, sub, JOB_FILE_MAX, name);
+}
+
+// put a job back for a later attempt, with exponential backoff and some
+// jitter so jobs that failed together don't all retry together
+static void reschedule(const mail_job* job)
+{
+    char from[768], to[768];
+    job_path(from, sizeof(from), "new", job->name);
+    int attempts = job->attempts + 1;
+    if (attempts >= MAIL_MAX_ATTEMPTS) {
+        fprintf(stderr, "Error: giving up on mail job %s after %d attempts\n", job->id, attempts);
+        job_path(to, sizeof(to), "failed", job->id);
+        rename(from, to);
+        metrics_counter_add(&metrics->mail_failed, 1);
+        return;
+    }
+    long delay = MAIL_RETRY_BASE_S;
+    for (int i = 1; i < attempts && delay < MAIL_RETRY_MAX_S; i++)
+        delay *= 2;
+    if (delay > MAIL_RETRY_MAX_S)
+        delay = MAIL_RETRY_MAX_S;
+    delay += random() % (delay / 4 + 1);
+
+    char name[JOB_FILE_MAX];
+    snprintf(name, sizeof(name), "%ld.%d.%s", (long)(time(NULL) + delay), attempts, job->id);
+    job_path(to, sizeof(to), "new", name);
+    rename(from, to);
+    metrics_counter_add(&metrics->mail_retries, 1);
+}
+
+// read a job's envelope and message; the buffer is malloc'd, NULL if the
+// job is unreadable
+static char* load_job(const mail_job* job, char** from, char** to, char** msg, size_t* len)
+{
+    char path[768];
+    job_path(path, sizeof(path), "new", job->name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    char* data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size <= MAIL_MESSAGE_MAX + 4096 && (data = malloc(st.st_size + 1)) != NULL) {
+        ssize_t n = read(fd, data, st.st_size);
+        if (n != st.st_size) {
+            free(data);
+            data = NULL;
+        } else {
+            data[n] = '\0';
+        }
+    }
+    close(fd);
+    if (!data)
+        return NULL;
+
+    char* eol1 = strchr(data, '\n');
+    char* eol2 = eol1 ? strchr(eol1 + 1, '\n') : NULL;
+    if (!eol2) {
+        free(data);
+        return NULL;
+    }
+    *eol1 = *eol2 = '\0';
+    *from = data;
+    *to = eol1 + 1;
+    *msg = eol2 + 1;
+    *len = st.st_size - (*msg - data);
+    return data;
+}
+
+// send a batch over one relay connection, reusing the open one if the
+// relay still answers; jobs left unsent by a failure are retried later
+static void send_batch(smtp_conn* c, mail_job* jobs, int n)
+{
+    char text[REPLY_MAX];
+    if (c->fd != -1 && smtp_command(c, "RSET\r\n", NULL, 0) != 250)
+        smtp_close(c); // the relay timed us out meanwhile
+    if (c->fd == -1 && smtp_open(c) == -1) {
+        for (int i = 0; i < n; i++)
+            reschedule(&jobs[i]);
+        return;
+    }
+    metrics_counter_add(&metrics->mail_batches, 1);
+
+    for (int i = 0; i < n; i++) {
+        char *from, *to, *msg;
+        size_t len;
+        char* data = load_job(&jobs[i], &from, &to, &msg, &len);
+        if (!data) {
+            fprintf(stderr, "Error: unreadable mail job %s\n", jobs[i].name);
+            char path[768], failed[768];
+            job_path(path, sizeof(path), "new", jobs[i].name);
+            job_path(failed, sizeof(failed), "failed", jobs[i].id);
+            rename(path, failed);
+            continue;
+        }
+
+        int result = c->fd == -1 ? -1 : smtp_send(c, from, to, msg, len, text, sizeof(text));
+        if (result == SEND_OK) {
+            char path[768];
+            job_path(path, sizeof(path), "new", jobs[i].name);
+            unlink(path);
+            metrics_counter_add(&metrics->mail_sent, 1);
+        } else if (result == SEND_FAIL) {
+            fprintf(stderr, "Error: mail to %s rejected: %s\n", to, text);
+            char path[768], failed[768];
+            job_path(path, sizeof(path), "new", jobs[i].name);
+            job_path(failed, sizeof(failed), "failed", jobs[i].id);
+            rename(path, failed);
+            metrics_counter_add(&metrics->mail_failed, 1);
+        } else {
+            if (result == -1) {
+                fprintf(stderr, "Error: lost mail relay connection sending to %s\n", to);
+                smtp_close(c);
+            } else {
+                fprintf(stderr, "Warning: mail to %s deferred: %s\n", to, text);
+            }
+            reschedule(&jobs[i]);
+        }
+        free(data);
+    }
+    c->last_used_ms = now_ms();
+}
+
+static void sender_sigterm(int signum)
+{
+    (void)signum;
+    sender_stop = 1;
+}
+
+// background process: sends what is due in batches, sleeps until the next
+// retry, the idle connection's end, or a new job shows up in new/
+static void run_sender(void)
+{
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, sender_sigterm);
+    signal(SIGPIPE, SIG_IGN);
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // exit with the server, the spool keeps the rest
+    srandom(getpid());
+
+    char dir[600];
+    snprintf(dir, sizeof(dir), "%s/new", spool);
+    int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify != -1 && inotify_add_watch(notify, dir, IN_MOVED_TO) == -1) {
+        close(notify);
+        notify = -1;
+    }
+
+    smtp_conn conn = { .fd = -1 };
+    mail_job jobs[MAIL_BATCH_MAX];
+    while (!sender_stop) {
+        time_t next_due = 0;
+        int n = scan_due(jobs, &next_due);
+        if (n > 0) {
+            send_batch(&conn, jobs, n);
+            continue;
+        }
+
+        // without inotify, look at the spool every second
+        int timeout = notify == -1 ? 1000 : -1;
+        if (next_due) {
+            long wait = (long)(next_due - time(NULL)) * 1000;
+            timeout = timeout == -1 || wait < timeout ? (int)(wait > 0 ? wait : 0) : timeout;
+        }
+        if (conn.fd != -1) {
+            uint64_t idle = now_ms() - conn.last_used_ms;
+            if (idle >= MAIL_IDLE_MS) {
+                smtp_command(&conn, "QUIT\r\n", NULL, 0);
+                smtp_close(&conn);
+            } else if (timeout == -1 || MAIL_IDLE_MS - idle < (uint64_t)timeout) {
+                timeout = MAIL_IDLE_MS - idle;
+            }
+        }
+
+        struct pollfd p = { .fd = notify, .events = POLLIN };
+        if (poll(&p, notify == -1 ? 0 : 1, timeout) > 0) {
+            char events[4096];
+            while (read(notify, events, sizeof(events)) > 0)
+                ;
+            poll(NULL, 0, MAIL_LINGER_MS); // let jobs arriving together go in one batch
+        }
+    }
+
+    if (conn.fd != -1) {
+        smtp_command(&conn, "QUIT\r\n", NULL, 0);
+        smtp_close(&conn);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+static int make_dir(const char* path)
+{
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        perror("Error: failed to create mail spool");
+        return -1;
+    }
+    return 0;
+}
+
+// set up the spool and start the sender, call before forking handlers;
+// relay is host[:port]. Jobs left from an earlier run are sent as well,
+// half-written ones (never acknowledged) are dropped.
+int mail_queue_init(const char* spool_dir, const char* relay)
+{
+    const char* colon = strrchr(relay, ':');
+    size_t host_len = colon ? (size_t)(colon - relay) : strlen(relay);
+    if (host_len == 0 || host_len >= sizeof(relay_host) || (colon && (atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535))) {
+        fprintf(stderr, "Error: mail relay must be host[:port]\n");
+        return -1;
+    }
+    memcpy(relay_host, relay, host_len);
+    relay_host[host_len] = '\0';
+    snprintf(relay_port, sizeof(relay_port), "%d", colon ? atoi(colon + 1) : 25);
+
+    char path[600];
+    snprintf(spool, sizeof(spool), "%s", spool_dir);
+    const char* subdirs[] = { "tmp", "new", "failed" };
+    if (make_dir(spool) == -1)
+        return -1;
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", spool, subdirs[i]);
+        if (make_dir(path) == -1)
+            return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/tmp", spool);
+    DIR* d = opendir(path);
+    struct dirent* e;
+    while (d && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.')
+            unlinkat(dirfd(d), e->d_name, 0);
+    }
+    if (d)
+        closedir(d);
+
+    fflush(stdout); // don't let the sender inherit buffered output
+    pid_t p = fork();
+    if (p < 0) {
+        perror("Error: cannot fork mail sender");
+        spool[0] = '\0';
+        return -1;
+    }
+    if (p == 0)
+        run_sender();
+    return 0;
+}
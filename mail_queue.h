@@ -0,0 +1,35 @@
+#ifndef MAIL_QUEUE_H
+#define MAIL_QUEUE_H
+
+#include <stddef.h>
+
+#define MAIL_SPOOL_PATH_FORMAT "/var/tmp/webserv-%d.mail" // spool directory, one per port
+#define MAIL_RELAY_DEFAULT "localhost:25" // SMTP relay used without -m
+#define MAIL_FROM_DEFAULT "attendance-tracker@localhost.localdomain"
+#define MAIL_BATCH_MAX 32 // messages sent per pass over the spool
+#define MAIL_LINGER_MS 100 // wait after a new job for others to join its batch
+#define MAIL_IDLE_MS 15000 // keep an idle relay connection this long for the next batch
+#define MAIL_IO_TIMEOUT_S 30 // for any single SMTP read or write
+#define MAIL_RETRY_BASE_S 30 // first retry delay, doubled every attempt
+#define MAIL_RETRY_MAX_S 3600
+#define MAIL_MAX_ATTEMPTS 10 // then the job is moved to failed/
+#define MAIL_ADDRESS_MAX 254
+#define MAIL_MESSAGE_MAX (8 * 1024 * 1024) // composed message, attachment included
+
+// one message to queue; the attachment is optional
+typedef struct {
+    const char* from;
+    const char* to;
+    const char* subject;
+    const char* text;
+    const char* attachment_name;
+    const char* attachment_type;
+    const void* attachment;
+    size_t attachment_len;
+} mail_message;
+
+int mail_queue_init(const char* spool_dir, const char* relay);
+int mail_address_valid(const char* address);
+int mail_queue_submit(const mail_message* msg);
+
+#endif /* MAIL_QUEUE_H */
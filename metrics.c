@@ -0,0 +1,521 @@
+#include "metrics.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define LIVE_DATA_FILE "static/live_data.txt"
+#define RENDER_BUF_SIZE 65536
+
+metrics_registry* metrics = NULL;
+
+static const char* route_names[ROUTE_COUNT] = { "static", "cached", "cgi", "dir", "proxy", "metrics", "plugin", "unknown" };
+static const char* phase_names[PHASE_COUNT] = { "parse", "resolve", "cache_lookup", "send", "cgi", "queue", "total" };
+static const char* status_names[STATUS_COUNT] = { "200", "404", "408", "501", "503", "other" };
+static const char* timeout_names[TIMEOUT_COUNT] = { "header", "body", "idle", "request", "cgi" };
+static const char* shed_names[SHED_COUNT] = { "queue_full", "queue_delay" };
+
+// map the registry into memory shared by every process forked after this call
+int metrics_init(void)
+{
+    metrics = mmap(NULL, sizeof(metrics_registry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("Error: failed to map metrics registry");
+        metrics = NULL;
+        return -1;
+    }
+    memset(metrics, 0, sizeof(metrics_registry));
+    return 0;
+}
+
+uint64_t metrics_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_counter_add(uint64_t* counter, uint64_t delta)
+{
+    if (metrics)
+        __atomic_fetch_add(counter, delta, __ATOMIC_RELAXED);
+}
+
+void metrics_gauge_add(int64_t* gauge, int64_t delta)
+{
+    if (metrics)
+        __atomic_fetch_add(gauge, delta, __ATOMIC_RELAXED);
+}
+
+// log-linear bucket index for a value in microseconds
+static int hist_bucket(uint64_t v)
+{
+    if (v < HIST_SUB_BUCKETS)
+        return (int)v;
+
+    int msb = 63 - __builtin_clzll(v);
+    if (msb > HIST_MAX_MSB)
+        return HIST_BUCKETS - 1;
+
+    int sub = (int)((v >> (msb - HIST_SUB_BUCKET_BITS)) & (HIST_SUB_BUCKETS - 1));
+    return (msb - HIST_SUB_BUCKET_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// smallest value that no longer falls into bucket i
+static uint64_t hist_bucket_upper(int i)
+{
+    if (i < HIST_SUB_BUCKETS)
+        return (uint64_t)i + 1;
+
+    int msb = i / HIST_SUB_BUCKETS + HIST_SUB_BUCKET_BITS - 1;
+    uint64_t sub = i % HIST_SUB_BUCKETS;
+    return (1ULL << msb) + ((sub + 1) << (msb - HIST_SUB_BUCKET_BITS));
+}
+
+void metrics_observe(metrics_phase phase, uint64_t usec)
+{
+    if (!metrics)
+        return;
+
+    metrics_histogram* h = &metrics->phase_latency[phase];
+    __atomic_fetch_add(&h->buckets[hist_bucket(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, usec, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+static void request_reset(metrics_request* req, int stream)
+{
+    req->route = ROUTE_UNKNOWN;
+    req->status = 0;
+    req->bytes = 0;
+    req->finished = 0;
+    req->stream = stream;
+    req->path[0] = '\0';
+    req->start_us = metrics_now_us();
+}
+
+void metrics_request_begin(metrics_request* req)
+{
+    request_reset(req, 0);
+    if (metrics) {
+        metrics_counter_add(&metrics->connections_total, 1);
+        metrics_gauge_add(&metrics->connections_in_flight, 1);
+    }
+}
+
+static metrics_status status_index(int status)
+{
+    switch (status) {
+    case 200:
+        return STATUS_200;
+    case 404:
+        return STATUS_404;
+    case 408:
+        return STATUS_408;
+    case 501:
+        return STATUS_501;
+    case 503:
+        return STATUS_503;
+    default:
+        return STATUS_OTHER;
+    }
+}
+
+// record the request outcome, safe to call more than once (e.g. before exec)
+void metrics_request_end(metrics_request* req)
+{
+    if (!metrics || req->finished)
+        return;
+    req->finished = 1;
+
+    metrics_counter_add(&metrics->requests[req->route][status_index(req->status)], 1);
+    metrics_observe(PHASE_TOTAL, metrics_now_us() - req->start_us);
+    if (!req->stream)
+        metrics_gauge_add(&metrics->connections_in_flight, -1);
+}
+
+// a request arriving on an HTTP/2 stream, not a connection of its own
+void metrics_stream_begin(metrics_request* req)
+{
+    request_reset(req, 1);
+}
+
+// a connection that turned into HTTP/2 ends without being a request itself,
+// its streams were counted instead
+void metrics_connection_end(metrics_request* req)
+{
+    if (!metrics || req->finished)
+        return;
+    req->finished = 1;
+    metrics_gauge_add(&metrics->connections_in_flight, -1);
+}
+
+typedef struct {
+    char* buf;
+    size_t len;
+    size_t cap;
+} render_buf;
+
+static void emit(render_buf* out, const char* fmt, ...)
+{
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(out->buf + out->len, out->cap - out->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < out->cap - out->len) {
+            out->len += n;
+            return;
+        }
+        char* grown = realloc(out->buf, out->cap * 2);
+        if (!grown)
+            return;
+        out->buf = grown;
+        out->cap *= 2;
+    }
+}
+
+static uint64_t load(const uint64_t* v)
+{
+    return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+// value at quantile q, reported as the upper edge of the bucket it falls in
+static double hist_quantile(const uint64_t* buckets, uint64_t count, double q)
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * count + 0.5), seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return hist_bucket_upper(i) / 1e6;
+    }
+    return hist_bucket_upper(HIST_BUCKETS - 1) / 1e6;
+}
+
+static void render_histograms(render_buf* out)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t snap[PHASE_COUNT][HIST_BUCKETS];
+    uint64_t counts[PHASE_COUNT];
+
+    // snapshot so the exported buckets and count agree with each other
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        counts[p] = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            snap[p][i] = load(&metrics->phase_latency[p].buckets[i]);
+            counts[p] += snap[p][i];
+        }
+    }
+
+    emit(out, "# HELP webserv_request_phase_seconds Time spent in each request phase.\n");
+    emit(out, "# TYPE webserv_request_phase_seconds histogram\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        // export cumulative counts at power-of-two edges; the finer
+        // sub-buckets feed the quantile gauges below
+        uint64_t cumulative = 0;
+        int next = 0;
+        for (int msb = 0; msb <= HIST_MAX_MSB; msb++) {
+            uint64_t edge = 1ULL << msb;
+            while (next < HIST_BUCKETS && hist_bucket_upper(next) <= edge)
+                cumulative += snap[p][next++];
+            emit(out, "webserv_request_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",
+                phase_names[p], edge / 1e6, (unsigned long)cumulative);
+        }
+        emit(out, "webserv_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", phase_names[p], (unsigned long)counts[p]);
+        emit(out, "webserv_request_phase_seconds_sum{phase=\"%s\"} %g\n", phase_names[p], load(&metrics->phase_latency[p].sum_us) / 1e6);
+        emit(out, "webserv_request_phase_seconds_count{phase=\"%s\"} %lu\n", phase_names[p], (unsigned long)counts[p]);
+    }
+
+    emit(out, "# HELP webserv_request_phase_quantile_seconds Latency quantiles from the log-linear phase histograms.\n");
+    emit(out, "# TYPE webserv_request_phase_quantile_seconds gauge\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            emit(out, "webserv_request_phase_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %g\n",
+                phase_names[p], quantiles[q], hist_quantile(snap[p], counts[p], quantiles[q]));
+    }
+}
+
+// seconds since the serial reader last appended a sample to the live data file
+static double serial_ingest_lag(void)
+{
+    char path[1024];
+    const char* root = getenv("WEBROOT_PATH");
+    snprintf(path, sizeof(path), "%s/%s", root ? root : ".", LIVE_DATA_FILE);
+
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size == 0)
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec - st.st_mtim.tv_sec) + (now.tv_nsec - st.st_mtim.tv_nsec) / 1e9;
+}
+
+// render the registry in Prometheus text exposition format, caller frees
+char* metrics_render(long cache_bytes, long cache_limit, int cache_entries, size_t* len)
+{
+    render_buf out = { malloc(RENDER_BUF_SIZE), 0, RENDER_BUF_SIZE };
+    if (!out.buf)
+        return NULL;
+    out.buf[0] = '\0';
+
+    if (!metrics) {
+        *len = 0;
+        return out.buf;
+    }
+
+    emit(&out, "# HELP webserv_requests_total Requests handled, by route class and status.\n");
+    emit(&out, "# TYPE webserv_requests_total counter\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        for (int s = 0; s < STATUS_COUNT; s++) {
+            uint64_t v = load(&metrics->requests[r][s]);
+            if (v)
+                emit(&out, "webserv_requests_total{route=\"%s\",status=\"%s\"} %lu\n", route_names[r], status_names[s], (unsigned long)v);
+        }
+    }
+
+    render_histograms(&out);
+
+    emit(&out, "# HELP webserv_connections_total Connections accepted.\n");
+    emit(&out, "# TYPE webserv_connections_total counter\n");
+    emit(&out, "webserv_connections_total %lu\n", (unsigned long)load(&metrics->connections_total));
+    emit(&out, "# HELP webserv_worker_restarts_total Prefork workers that exited and were replaced.\n");
+    emit(&out, "# TYPE webserv_worker_restarts_total counter\n");
+    emit(&out, "webserv_worker_restarts_total %lu\n", (unsigned long)load(&metrics->worker_restarts));
+    emit(&out, "# HELP webserv_uring_enter_calls_total io_uring_enter calls made by the io_uring loop.\n");
+    emit(&out, "# TYPE webserv_uring_enter_calls_total counter\n");
+    emit(&out, "webserv_uring_enter_calls_total %lu\n", (unsigned long)load(&metrics->uring_enter_calls));
+    emit(&out, "# HELP webserv_uring_static_requests_total Static responses sent entirely through io_uring.\n");
+    emit(&out, "# TYPE webserv_uring_static_requests_total counter\n");
+    emit(&out, "webserv_uring_static_requests_total %lu\n", (unsigned long)load(&metrics->uring_static_requests));
+    emit(&out, "# HELP webserv_uring_fallbacks_total Requests the io_uring loop handed to the regular handlers.\n");
+    emit(&out, "# TYPE webserv_uring_fallbacks_total counter\n");
+    emit(&out, "webserv_uring_fallbacks_total %lu\n", (unsigned long)load(&metrics->uring_fallbacks));
+    emit(&out, "# HELP webserv_http2_connections_total Connections served over HTTP/2.\n");
+    emit(&out, "# TYPE webserv_http2_connections_total counter\n");
+    emit(&out, "webserv_http2_connections_total %lu\n", (unsigned long)load(&metrics->http2_connections));
+    emit(&out, "# HELP webserv_http2_streams_total Requests received on HTTP/2 streams.\n");
+    emit(&out, "# TYPE webserv_http2_streams_total counter\n");
+    emit(&out, "webserv_http2_streams_total %lu\n", (unsigned long)load(&metrics->http2_streams));
+    emit(&out, "# HELP webserv_fiber_switches_total Context switches between threaded-mode fibers.\n");
+    emit(&out, "# TYPE webserv_fiber_switches_total counter\n");
+    emit(&out, "webserv_fiber_switches_total %lu\n", (unsigned long)load(&metrics->fiber_switches));
+    emit(&out, "# HELP webserv_connections_in_flight Connections currently being handled.\n");
+    emit(&out, "# TYPE webserv_connections_in_flight gauge\n");
+    emit(&out, "webserv_connections_in_flight %ld\n", (long)__atomic_load_n(&metrics->connections_in_flight, __ATOMIC_RELAXED));
+    emit(&out, "# HELP webserv_fibers_active Threaded-mode fibers currently holding a stack.\n");
+    emit(&out, "# TYPE webserv_fibers_active gauge\n");
+    emit(&out, "webserv_fibers_active %ld\n", (long)__atomic_load_n(&metrics->fibers_active, __ATOMIC_RELAXED));
+    emit(&out, "# HELP webserv_timeouts_total Connections cut short by a deadline.\n");
+    emit(&out, "# TYPE webserv_timeouts_total counter\n");
+    for (int t = 0; t < TIMEOUT_COUNT; t++)
+        emit(&out, "webserv_timeouts_total{deadline=\"%s\"} %lu\n", timeout_names[t], (unsigned long)load(&metrics->timeouts[t]));
+
+    emit(&out, "# HELP webserv_admission_limit Requests a route class serves at once, 0 for no limit.\n");
+    emit(&out, "# TYPE webserv_admission_limit gauge\n");
+    for (int c = 0; c < CLASS_COUNT; c++)
+        emit(&out, "webserv_admission_limit{class=\"%s\"} %d\n", admission_class_name(c), admission_get_limits(c)->limit);
+    emit(&out, "# HELP webserv_admission_in_flight Requests holding a slot of their route class.\n");
+    emit(&out, "# TYPE webserv_admission_in_flight gauge\n");
+    for (int c = 0; c < CLASS_COUNT; c++)
+        emit(&out, "webserv_admission_in_flight{class=\"%s\"} %ld\n", admission_class_name(c), (long)__atomic_load_n(&metrics->admission_in_flight[c], __ATOMIC_RELAXED));
+    emit(&out, "# HELP webserv_admission_queue_depth Requests waiting for a slot of their route class.\n");
+    emit(&out, "# TYPE webserv_admission_queue_depth gauge\n");
+    for (int c = 0; c < CLASS_COUNT; c++)
+        emit(&out, "webserv_admission_queue_depth{class=\"%s\"} %ld\n", admission_class_name(c), (long)__atomic_load_n(&metrics->admission_queued[c], __ATOMIC_RELAXED));
+    emit(&out, "# HELP webserv_admission_queued_total Requests that had to wait for a slot.\n");
+    emit(&out, "# TYPE webserv_admission_queued_total counter\n");
+    for (int c = 0; c < CLASS_COUNT; c++)
+        emit(&out, "webserv_admission_queued_total{class=\"%s\"} %lu\n", admission_class_name(c), (unsigned long)load(&metrics->admission_waits[c]));
+    emit(&out, "# HELP webserv_admission_shed_total Requests answered with 503 instead of being served.\n");
+    emit(&out, "# TYPE webserv_admission_shed_total counter\n");
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        for (int r = 0; r < SHED_COUNT; r++)
+            emit(&out, "webserv_admission_shed_total{class=\"%s\",reason=\"%s\"} %lu\n", admission_class_name(c), shed_names[r], (unsigned long)load(&metrics->admission_shed[c][r]));
+    }
+
+    emit(&out, "# HELP webserv_cache_hits_total Cache lookups served from the cache.\n");
+    emit(&out, "# TYPE webserv_cache_hits_total counter\n");
+    emit(&out, "webserv_cache_hits_total %lu\n", (unsigned long)load(&metrics->cache_hits));
+    emit(&out, "# HELP webserv_cache_misses_total Cache lookups that had to load the resource.\n");
+    emit(&out, "# TYPE webserv_cache_misses_total counter\n");
+    emit(&out, "webserv_cache_misses_total %lu\n", (unsigned long)load(&metrics->cache_misses));
+    emit(&out, "# HELP webserv_cache_evictions_total Entries evicted to make room.\n");
+    emit(&out, "# TYPE webserv_cache_evictions_total counter\n");
+    emit(&out, "webserv_cache_evictions_total %lu\n", (unsigned long)load(&metrics->cache_evictions));
+    emit(&out, "# HELP webserv_cache_inserted_bytes_total Bytes added to the cache.\n");
+    emit(&out, "# TYPE webserv_cache_inserted_bytes_total counter\n");
+    emit(&out, "webserv_cache_inserted_bytes_total %lu\n", (unsigned long)load(&metrics->cache_bytes_inserted));
+    emit(&out, "# HELP webserv_cache_evicted_bytes_total Bytes removed from the cache by eviction.\n");
+    emit(&out, "# TYPE webserv_cache_evicted_bytes_total counter\n");
+    emit(&out, "webserv_cache_evicted_bytes_total %lu\n", (unsigned long)load(&metrics->cache_bytes_evicted));
+    emit(&out, "# HELP webserv_cache_snapshot_restored_total Cache entries restored from a snapshot at startup.\n");
+    emit(&out, "# TYPE webserv_cache_snapshot_restored_total counter\n");
+    emit(&out, "webserv_cache_snapshot_restored_total %lu\n", (unsigned long)load(&metrics->cache_snapshot_restored));
+    emit(&out, "# HELP webserv_cache_snapshot_stale_total Restored entries dropped because their file changed.\n");
+    emit(&out, "# TYPE webserv_cache_snapshot_stale_total counter\n");
+    emit(&out, "webserv_cache_snapshot_stale_total %lu\n", (unsigned long)load(&metrics->cache_snapshot_stale));
+    emit(&out, "# HELP webserv_cache_snapshot_saves_total Cache snapshots written.\n");
+    emit(&out, "# TYPE webserv_cache_snapshot_saves_total counter\n");
+    emit(&out, "webserv_cache_snapshot_saves_total %lu\n", (unsigned long)load(&metrics->cache_snapshot_saves));
+    if (cache_limit > 0) {
+        emit(&out, "# HELP webserv_cache_bytes Bytes currently held in the cache.\n");
+        emit(&out, "# TYPE webserv_cache_bytes gauge\n");
+        emit(&out, "webserv_cache_bytes %ld\n", cache_bytes);
+        emit(&out, "# HELP webserv_cache_limit_bytes Configured cache size.\n");
+        emit(&out, "# TYPE webserv_cache_limit_bytes gauge\n");
+        emit(&out, "webserv_cache_limit_bytes %ld\n", cache_limit);
+        emit(&out, "# HELP webserv_cache_entries Entries currently held in the cache.\n");
+        emit(&out, "# TYPE webserv_cache_entries gauge\n");
+        emit(&out, "webserv_cache_entries %d\n", cache_entries);
+    }
+
+    emit(&out, "# HELP webserv_fd_cache_hits_total Static lookups answered from an already open descriptor.\n");
+    emit(&out, "# TYPE webserv_fd_cache_hits_total counter\n");
+    emit(&out, "webserv_fd_cache_hits_total %lu\n", (unsigned long)load(&metrics->fd_cache_hits));
+    emit(&out, "# HELP webserv_fd_cache_misses_total Static lookups that had to open the file.\n");
+    emit(&out, "# TYPE webserv_fd_cache_misses_total counter\n");
+    emit(&out, "webserv_fd_cache_misses_total %lu\n", (unsigned long)load(&metrics->fd_cache_misses));
+    emit(&out, "# HELP webserv_fd_cache_invalidations_total Held descriptors dropped after a change on disk.\n");
+    emit(&out, "# TYPE webserv_fd_cache_invalidations_total counter\n");
+    emit(&out, "webserv_fd_cache_invalidations_total %lu\n", (unsigned long)load(&metrics->fd_cache_invalidations));
+
+    emit(&out, "# HELP webserv_dir_listing_hits_total Directory listings served from the rendered-listing cache.\n");
+    emit(&out, "# TYPE webserv_dir_listing_hits_total counter\n");
+    emit(&out, "webserv_dir_listing_hits_total %lu\n", (unsigned long)load(&metrics->dir_listing_hits));
+    emit(&out, "# HELP webserv_dir_listing_misses_total Directory listings that had to be rendered.\n");
+    emit(&out, "# TYPE webserv_dir_listing_misses_total counter\n");
+    emit(&out, "webserv_dir_listing_misses_total %lu\n", (unsigned long)load(&metrics->dir_listing_misses));
+
+    emit(&out, "# HELP webserv_upstream_connections_opened_total Proxy connections opened to upstream servers.\n");
+    emit(&out, "# TYPE webserv_upstream_connections_opened_total counter\n");
+    emit(&out, "webserv_upstream_connections_opened_total %lu\n", (unsigned long)load(&metrics->upstream_connections_opened));
+    emit(&out, "# HELP webserv_upstream_connections_reused_total Proxy requests sent over a pooled keep-alive connection.\n");
+    emit(&out, "# TYPE webserv_upstream_connections_reused_total counter\n");
+    emit(&out, "webserv_upstream_connections_reused_total %lu\n", (unsigned long)load(&metrics->upstream_connections_reused));
+    emit(&out, "# HELP webserv_upstream_dns_hits_total Upstream host lookups answered by the resolver cache.\n");
+    emit(&out, "# TYPE webserv_upstream_dns_hits_total counter\n");
+    emit(&out, "webserv_upstream_dns_hits_total %lu\n", (unsigned long)load(&metrics->upstream_dns_hits));
+    emit(&out, "# HELP webserv_upstream_dns_misses_total Upstream host lookups that went to the resolver.\n");
+    emit(&out, "# TYPE webserv_upstream_dns_misses_total counter\n");
+    emit(&out, "webserv_upstream_dns_misses_total %lu\n", (unsigned long)load(&metrics->upstream_dns_misses));
+
+    emit(&out, "# HELP webserv_disk_cache_hits_total Objects sent from the disk tier.\n");
+    emit(&out, "# TYPE webserv_disk_cache_hits_total counter\n");
+    emit(&out, "webserv_disk_cache_hits_total %lu\n", (unsigned long)load(&metrics->disk_cache_hits));
+    emit(&out, "# HELP webserv_disk_cache_misses_total Disk tier lookups that found nothing.\n");
+    emit(&out, "# TYPE webserv_disk_cache_misses_total counter\n");
+    emit(&out, "webserv_disk_cache_misses_total %lu\n", (unsigned long)load(&metrics->disk_cache_misses));
+    emit(&out, "# HELP webserv_disk_cache_admissions_total Objects written into the disk tier.\n");
+    emit(&out, "# TYPE webserv_disk_cache_admissions_total counter\n");
+    emit(&out, "webserv_disk_cache_admissions_total %lu\n", (unsigned long)load(&metrics->disk_cache_admissions));
+    emit(&out, "# HELP webserv_disk_cache_rejections_total Misses kept out of the disk tier by the admission filter.\n");
+    emit(&out, "# TYPE webserv_disk_cache_rejections_total counter\n");
+    emit(&out, "webserv_disk_cache_rejections_total %lu\n", (unsigned long)load(&metrics->disk_cache_rejections));
+    emit(&out, "# HELP webserv_disk_cache_evictions_total Objects evicted from the disk tier.\n");
+    emit(&out, "# TYPE webserv_disk_cache_evictions_total counter\n");
+    emit(&out, "webserv_disk_cache_evictions_total %lu\n", (unsigned long)load(&metrics->disk_cache_evictions));
+    emit(&out, "# HELP webserv_disk_cache_bytes Bytes currently held in the disk tier.\n");
+    emit(&out, "# TYPE webserv_disk_cache_bytes gauge\n");
+    emit(&out, "webserv_disk_cache_bytes %ld\n", (long)__atomic_load_n(&metrics->disk_cache_bytes, __ATOMIC_RELAXED));
+
+    emit(&out, "# HELP webserv_mail_queued_total Emails accepted into the spool.\n");
+    emit(&out, "# TYPE webserv_mail_queued_total counter\n");
+    emit(&out, "webserv_mail_queued_total %lu\n", (unsigned long)load(&metrics->mail_queued));
+    emit(&out, "# HELP webserv_mail_sent_total Emails the relay accepted.\n");
+    emit(&out, "# TYPE webserv_mail_sent_total counter\n");
+    emit(&out, "webserv_mail_sent_total %lu\n", (unsigned long)load(&metrics->mail_sent));
+    emit(&out, "# HELP webserv_mail_retries_total Delivery attempts deferred to a later retry.\n");
+    emit(&out, "# TYPE webserv_mail_retries_total counter\n");
+    emit(&out, "webserv_mail_retries_total %lu\n", (unsigned long)load(&metrics->mail_retries));
+    emit(&out, "# HELP webserv_mail_failed_total Emails rejected by the relay or given up on.\n");
+    emit(&out, "# TYPE webserv_mail_failed_total counter\n");
+    emit(&out, "webserv_mail_failed_total %lu\n", (unsigned long)load(&metrics->mail_failed));
+    emit(&out, "# HELP webserv_mail_connections_total SMTP sessions opened to the relay.\n");
+    emit(&out, "# TYPE webserv_mail_connections_total counter\n");
+    emit(&out, "webserv_mail_connections_total %lu\n", (unsigned long)load(&metrics->mail_connections));
+    emit(&out, "# HELP webserv_mail_batches_total Batches of queued emails sent over one session.\n");
+    emit(&out, "# TYPE webserv_mail_batches_total counter\n");
+    emit(&out, "webserv_mail_batches_total %lu\n", (unsigned long)load(&metrics->mail_batches));
+    emit(&out, "# HELP webserv_mail_queue_depth Emails waiting in the spool.\n");
+    emit(&out, "# TYPE webserv_mail_queue_depth gauge\n");
+    emit(&out, "webserv_mail_queue_depth %ld\n", (long)__atomic_load_n(&metrics->mail_queue_depth, __ATOMIC_RELAXED));
+    emit(&out, "# HELP webserv_device_commands_total Commands queued for the Arduino.\n");
+    emit(&out, "# TYPE webserv_device_commands_total counter\n");
+    emit(&out, "webserv_device_commands_total %lu\n", (unsigned long)load(&metrics->device_commands));
+    emit(&out, "# HELP webserv_device_acks_total Commands the firmware acknowledged.\n");
+    emit(&out, "# TYPE webserv_device_acks_total counter\n");
+    emit(&out, "webserv_device_acks_total %lu\n", (unsigned long)load(&metrics->device_acks));
+    emit(&out, "# HELP webserv_device_naks_total Commands the firmware refused.\n");
+    emit(&out, "# TYPE webserv_device_naks_total counter\n");
+    emit(&out, "webserv_device_naks_total %lu\n", (unsigned long)load(&metrics->device_naks));
+    emit(&out, "# HELP webserv_device_retries_total Commands sent again after their ack was late.\n");
+    emit(&out, "# TYPE webserv_device_retries_total counter\n");
+    emit(&out, "webserv_device_retries_total %lu\n", (unsigned long)load(&metrics->device_retries));
+    emit(&out, "# HELP webserv_device_timeouts_total Commands given up on without an answer.\n");
+    emit(&out, "# TYPE webserv_device_timeouts_total counter\n");
+    emit(&out, "webserv_device_timeouts_total %lu\n", (unsigned long)load(&metrics->device_timeouts));
+    emit(&out, "# HELP webserv_device_lines_total Totals read from the Arduino.\n");
+    emit(&out, "# TYPE webserv_device_lines_total counter\n");
+    emit(&out, "webserv_device_lines_total %lu\n", (unsigned long)load(&metrics->device_lines));
+    emit(&out, "# HELP webserv_device_connected Serial devices currently open.\n");
+    emit(&out, "# TYPE webserv_device_connected gauge\n");
+    emit(&out, "webserv_device_connected %ld\n", (long)__atomic_load_n(&metrics->device_connected, __ATOMIC_RELAXED));
+    emit(&out, "# HELP webserv_tls_handshakes_total TLS handshakes completed.\n");
+    emit(&out, "# TYPE webserv_tls_handshakes_total counter\n");
+    emit(&out, "webserv_tls_handshakes_total %lu\n", (unsigned long)load(&metrics->tls_handshakes));
+    emit(&out, "# HELP webserv_tls_resumed_total TLS handshakes that resumed a session from a ticket.\n");
+    emit(&out, "# TYPE webserv_tls_resumed_total counter\n");
+    emit(&out, "webserv_tls_resumed_total %lu\n", (unsigned long)load(&metrics->tls_resumed));
+    emit(&out, "# HELP webserv_tls_failures_total TLS handshakes that failed or timed out.\n");
+    emit(&out, "# TYPE webserv_tls_failures_total counter\n");
+    emit(&out, "webserv_tls_failures_total %lu\n", (unsigned long)load(&metrics->tls_failures));
+    emit(&out, "# HELP webserv_tls_kernel_send_total TLS connections the kernel encrypts, so files go out with sendfile.\n");
+    emit(&out, "# TYPE webserv_tls_kernel_send_total counter\n");
+    emit(&out, "webserv_tls_kernel_send_total %lu\n", (unsigned long)load(&metrics->tls_kernel_send));
+    emit(&out, "# HELP webserv_tls_kernel_recv_total TLS connections the kernel also decrypts.\n");
+    emit(&out, "# TYPE webserv_tls_kernel_recv_total counter\n");
+    emit(&out, "webserv_tls_kernel_recv_total %lu\n", (unsigned long)load(&metrics->tls_kernel_recv));
+    emit(&out, "# HELP webserv_tls_relayed_total TLS connections without kTLS, relayed through OpenSSL by a helper process.\n");
+    emit(&out, "# TYPE webserv_tls_relayed_total counter\n");
+    emit(&out, "webserv_tls_relayed_total %lu\n", (unsigned long)load(&metrics->tls_relayed));
+
+    emit(&out, "# HELP webserv_singleflight_leaders_total Coalescable requests that did the work themselves.\n");
+    emit(&out, "# TYPE webserv_singleflight_leaders_total counter\n");
+    emit(&out, "webserv_singleflight_leaders_total %lu\n", (unsigned long)load(&metrics->singleflight_leaders));
+    emit(&out, "# HELP webserv_singleflight_shared_total Requests answered with a response produced by another request.\n");
+    emit(&out, "# TYPE webserv_singleflight_shared_total counter\n");
+    emit(&out, "webserv_singleflight_shared_total %lu\n", (unsigned long)load(&metrics->singleflight_shared));
+    emit(&out, "# HELP webserv_singleflight_bypassed_total Coalescable requests that could not join or lead a flight.\n");
+    emit(&out, "# TYPE webserv_singleflight_bypassed_total counter\n");
+    emit(&out, "webserv_singleflight_bypassed_total %lu\n", (unsigned long)load(&metrics->singleflight_bypassed));
+    emit(&out, "# HELP webserv_singleflight_stale_total Shared responses sent past their TTL while a refresh ran.\n");
+    emit(&out, "# TYPE webserv_singleflight_stale_total counter\n");
+    emit(&out, "webserv_singleflight_stale_total %lu\n", (unsigned long)load(&metrics->singleflight_stale));
+    emit(&out, "# HELP webserv_singleflight_refreshes_total Background runs started to replace a stale response.\n");
+    emit(&out, "# TYPE webserv_singleflight_refreshes_total counter\n");
+    emit(&out, "webserv_singleflight_refreshes_total %lu\n", (unsigned long)load(&metrics->singleflight_refreshes));
+
+    emit(&out, "# HELP webserv_access_log_dropped_total Access log records dropped because the ring was full.\n");
+    emit(&out, "# TYPE webserv_access_log_dropped_total counter\n");
+    emit(&out, "webserv_access_log_dropped_total %lu\n", (unsigned long)load(&metrics->access_log_dropped));
+
+    double lag = serial_ingest_lag();
+    if (lag >= 0) {
+        emit(&out, "# HELP webserv_serial_ingest_lag_seconds Time since the last live sample was read from the Arduino.\n");
+        emit(&out, "# TYPE webserv_serial_ingest_lag_seconds gauge\n");
+        emit(&out, "webserv_serial_ingest_lag_seconds %g\n", lag);
+    }
+
+    *len = out.len;
+    return out.buf;
+}
@@ -0,0 +1,165 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "admission.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear histogram: values below HIST_SUB_BUCKETS get their own bucket,
+// every power of two above that is split into HIST_SUB_BUCKETS linear steps.
+// Values are recorded in microseconds, so the top bucket covers ~67 seconds.
+#define HIST_SUB_BUCKET_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_MAX_MSB 26
+#define HIST_BUCKETS ((HIST_MAX_MSB - HIST_SUB_BUCKET_BITS + 2) * HIST_SUB_BUCKETS)
+
+// Route classes used to label request counters
+typedef enum {
+    ROUTE_STATIC,
+    ROUTE_CACHED,
+    ROUTE_CGI,
+    ROUTE_DIR,
+    ROUTE_PROXY,
+    ROUTE_METRICS,
+    ROUTE_PLUGIN,
+    ROUTE_UNKNOWN,
+    ROUTE_COUNT
+} metrics_route;
+
+// Request phases with their own latency histogram
+typedef enum {
+    PHASE_PARSE,
+    PHASE_RESOLVE,
+    PHASE_CACHE_LOOKUP,
+    PHASE_SEND,
+    PHASE_CGI,
+    PHASE_QUEUE,
+    PHASE_TOTAL,
+    PHASE_COUNT
+} metrics_phase;
+
+// Status codes tracked individually, anything else is counted as "other"
+typedef enum {
+    STATUS_200,
+    STATUS_404,
+    STATUS_408,
+    STATUS_501,
+    STATUS_503,
+    STATUS_OTHER,
+    STATUS_COUNT
+} metrics_status;
+
+// Connection deadlines, counted when one cuts a connection short
+typedef enum {
+    TIMEOUT_HEADER,
+    TIMEOUT_BODY,
+    TIMEOUT_IDLE,
+    TIMEOUT_REQUEST,
+    TIMEOUT_CGI,
+    TIMEOUT_COUNT
+} metrics_timeout;
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+} metrics_histogram;
+
+// Registry lives in an anonymous shared mapping created before the first
+// fork, so every child and worker updates the same counters with atomics
+typedef struct {
+    uint64_t requests[ROUTE_COUNT][STATUS_COUNT];
+    metrics_histogram phase_latency[PHASE_COUNT];
+    uint64_t connections_total;
+    uint64_t worker_restarts;
+    uint64_t uring_enter_calls;
+    uint64_t uring_static_requests;
+    uint64_t uring_fallbacks;
+    uint64_t fiber_switches;
+    uint64_t http2_connections;
+    uint64_t http2_streams;
+    int64_t connections_in_flight;
+    uint64_t timeouts[TIMEOUT_COUNT];
+    int64_t fibers_active;
+    int64_t admission_in_flight[CLASS_COUNT];
+    int64_t admission_queued[CLASS_COUNT];
+    uint64_t admission_waits[CLASS_COUNT];
+    uint64_t admission_shed[CLASS_COUNT][SHED_COUNT];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+    uint64_t cache_bytes_inserted;
+    uint64_t cache_bytes_evicted;
+    uint64_t cache_snapshot_restored;
+    uint64_t cache_snapshot_stale;
+    uint64_t cache_snapshot_saves;
+    uint64_t access_log_dropped;
+    uint64_t fd_cache_hits;
+    uint64_t fd_cache_misses;
+    uint64_t fd_cache_invalidations;
+    uint64_t dir_listing_hits;
+    uint64_t dir_listing_misses;
+    uint64_t upstream_connections_opened;
+    uint64_t upstream_connections_reused;
+    uint64_t upstream_dns_hits;
+    uint64_t upstream_dns_misses;
+    uint64_t singleflight_leaders;
+    uint64_t singleflight_shared;
+    uint64_t singleflight_bypassed;
+    uint64_t singleflight_stale;
+    uint64_t singleflight_refreshes;
+    uint64_t disk_cache_hits;
+    uint64_t disk_cache_misses;
+    uint64_t disk_cache_admissions;
+    uint64_t disk_cache_rejections;
+    uint64_t disk_cache_evictions;
+    int64_t disk_cache_bytes;
+    uint64_t mail_queued;
+    uint64_t mail_sent;
+    uint64_t mail_retries;
+    uint64_t mail_failed;
+    uint64_t mail_connections;
+    uint64_t mail_batches;
+    int64_t mail_queue_depth;
+    uint64_t device_commands;
+    uint64_t device_acks;
+    uint64_t device_naks;
+    uint64_t device_retries;
+    uint64_t device_timeouts;
+    uint64_t device_lines;
+    int64_t device_connected;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+    uint64_t tls_failures;
+    uint64_t tls_kernel_send;
+    uint64_t tls_kernel_recv;
+    uint64_t tls_relayed;
+} metrics_registry;
+
+#define REQUEST_PATH_MAX 128
+
+// Per-request bookkeeping filled in as the handler runs
+typedef struct {
+    metrics_route route;
+    int status;
+    uint64_t bytes; // body bytes sent
+    uint64_t start_us;
+    int finished;
+    int stream; // an HTTP/2 stream, its connection is counted on its own
+    char path[REQUEST_PATH_MAX];
+} metrics_request;
+
+extern metrics_registry* metrics;
+
+int metrics_init(void);
+uint64_t metrics_now_us(void);
+void metrics_counter_add(uint64_t* counter, uint64_t delta);
+void metrics_gauge_add(int64_t* gauge, int64_t delta);
+void metrics_observe(metrics_phase phase, uint64_t usec);
+void metrics_request_begin(metrics_request* req);
+void metrics_request_end(metrics_request* req);
+void metrics_stream_begin(metrics_request* req);
+void metrics_connection_end(metrics_request* req);
+char* metrics_render(long cache_bytes, long cache_limit, int cache_entries, size_t* len);
+
+#endif /* METRICS_H */
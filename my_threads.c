@@ -1,51 +1,541 @@
+#define _GNU_SOURCE
+
 #include "my_threads.h"
-#include <setjmp.h>
+#include "metrics.h"
+#include "timer_wheel.h"
+#include <errno.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/ucontext.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#ifndef __x86_64__
+#include <ucontext.h>
+#endif
+
+// A fiber is a connection handler with its own stack. Fibers only switch
+// when one has to wait for a descriptor, so handlers stay plain sequential
+// code. Everything here belongs to one process: prefork workers each run
+// their own scheduler. Waits run into the fiber's deadlines, which the
+// scheduler keeps in a timer wheel; without a scheduler they become poll
+// timeouts, so forked children get the same deadlines.
+typedef struct fiber {
+#ifdef __x86_64__
+    void* sp; // saved stack pointer, the callee-saved registers are on the stack
+#else
+    ucontext_t ctx;
+#endif
+    void (*func)(void*);
+    char* map; // guard page plus stack, NULL for the main fiber
+    struct fiber* next; // run queue or pool link
+    int registered_fd; // descriptor this fiber last added to epoll
+    uint64_t timeouts[FIBER_TIMEOUT_COUNT]; // absolute ms, except IDLE which is an interval
+    int waiting_on; // the deadline the current wait would run into
+    int expired; // the deadline that last cut a wait short, -1 if none
+    int timed_out;
+    timer_node timer;
+    char locals[FIBER_LOCALS_SIZE];
+} fiber;
+
+typedef struct {
+    void* addr;
+    size_t size;
+} fiber_local_var;
+
+static fiber main_fiber = { .registered_fd = -1, .expired = -1 };
+static fiber* current = &main_fiber;
+static fiber* zombie = NULL; // finished fiber, released once we are off its stack
+static fiber* ready_head = NULL;
+static fiber* ready_tail = NULL;
+static fiber* pool = NULL;
+static int pool_count = 0;
+static int epfd = -1; // -1 until fiber_init, waits then poll instead
+static size_t page_size;
+static timer_wheel wheel;
+
+static fiber_local_var locals[FIBER_LOCALS_MAX];
+static int local_count = 0;
+static size_t locals_size = 0;
+
+#ifdef __x86_64__
+// save the callee-saved registers on this stack, park it in *from and
+// resume the stack in to; a fresh stack "returns" into fiber_entry
+void fiber_switch_context(void** from, void* to);
+__asm__(".text\n"
+        ".type fiber_switch_context, @function\n"
+        "fiber_switch_context:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size fiber_switch_context, .-fiber_switch_context\n");
+#endif
+
+static void push_ready(fiber* f)
+{
+    f->next = NULL;
+    if (ready_tail)
+        ready_tail->next = f;
+    else
+        ready_head = f;
+    ready_tail = f;
+}
+
+static fiber* pop_ready(void)
+{
+    fiber* f = ready_head;
+    if (f) {
+        ready_head = f->next;
+        if (!ready_head)
+            ready_tail = NULL;
+    }
+    return f;
+}
+
+static void save_locals(fiber* f)
+{
+    char* p = f->locals;
+    for (int i = 0; i < local_count; i++) {
+        memcpy(p, locals[i].addr, locals[i].size);
+        p += locals[i].size;
+    }
+}
+
+static void restore_locals(const fiber* f)
+{
+    const char* p = f->locals;
+    for (int i = 0; i < local_count; i++) {
+        memcpy(locals[i].addr, p, locals[i].size);
+        p += locals[i].size;
+    }
+}
+
+// keep the stack for the next fiber, or unmap it if the pool is full
+static void release(fiber* f)
+{
+    metrics_gauge_add(&metrics->fibers_active, -1);
+    if (pool_count < FIBER_POOL_MAX) {
+        f->next = pool;
+        pool = f;
+        pool_count++;
+        return;
+    }
+    munmap(f->map, FIBER_STACK_SIZE + page_size);
+}
+
+// runs first thing on whichever stack we land on
+static void after_switch(void)
+{
+    if (zombie) {
+        release(zombie);
+        zombie = NULL;
+    }
+}
+
+static void switch_to(fiber* next)
+{
+    fiber* prev = current;
+    save_locals(prev);
+    restore_locals(next);
+    current = next;
+    metrics_counter_add(&metrics->fiber_switches, 1);
+#ifdef __x86_64__
+    fiber_switch_context(&prev->sp, next->sp);
+#else
+    swapcontext(&prev->ctx, &next->ctx);
+#endif
+    after_switch();
+}
+
+// wait for descriptors, or the next deadline, until a fiber is runnable
+static void poll_events(void)
+{
+    struct epoll_event events[FIBER_EVENTS_MAX];
+    int n = epoll_wait(epfd, events, FIBER_EVENTS_MAX, timer_wheel_timeout(&wheel, timer_now_ms()));
+    if (n == -1 && errno != EINTR)
+        perror("Error: epoll_wait failed");
+    for (int i = 0; i < n; i++) {
+        fiber* f = events[i].data.ptr;
+        timer_cancel(&wheel, &f->timer); // woken in time
+        push_ready(f);
+    }
+    timer_wheel_advance(&wheel, timer_now_ms());
+}
+
+// a waiting fiber ran out of time: drop its registration and wake it
+static void wait_expired(void* arg)
+{
+    fiber* f = arg;
+    f->timed_out = 1;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, f->registered_fd, NULL);
+    f->registered_fd = -1;
+    push_ready(f);
+}
+
+// hand the CPU to the next runnable fiber, returns when this one is resumed
+static void schedule(void)
+{
+    fiber* next;
+    while (!(next = pop_ready()))
+        poll_events();
+    if (next != current)
+        switch_to(next);
+}
 
-#define FIBER_STACK 1024 * 64 // 64 KB stack
+static void fiber_entry(void)
+{
+    after_switch();
+    current->func(NULL);
+
+    // never resumed: the next fiber to run gives the stack back
+    zombie = current;
+    schedule();
+    abort();
+}
+
+static fiber* fiber_alloc(void (*func)(void*))
+{
+    fiber* f = pool;
+    if (f) {
+        pool = f->next;
+        pool_count--;
+    } else {
+        char* map = mmap(NULL, FIBER_STACK_SIZE + page_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (map == MAP_FAILED) {
+            perror("Error: failed to map fiber stack");
+            return NULL;
+        }
+        // an overflow faults on the guard page instead of running into the neighbour
+        if (mprotect(map, page_size, PROT_NONE) == -1) {
+            perror("Error: failed to protect fiber stack");
+            munmap(map, FIBER_STACK_SIZE + page_size);
+            return NULL;
+        }
+        // the fiber itself lives at the top of its own mapping
+        uintptr_t top = (uintptr_t)map + FIBER_STACK_SIZE + page_size - sizeof(fiber);
+        f = (fiber*)(top & ~(uintptr_t)15);
+        f->map = map;
+    }
+
+    f->func = func;
+    f->next = NULL;
+    f->registered_fd = -1;
+    memset(f->timeouts, 0, sizeof(f->timeouts));
+    f->expired = -1;
+    f->timed_out = 0;
+    f->timer.next = NULL;
+    metrics_gauge_add(&metrics->fibers_active, 1);
 
-jmp_buf child, parent;
+    char* stack_top = (char*)((uintptr_t)f & ~(uintptr_t)15);
+#ifdef __x86_64__
+    // six registers for the switch to pop, then the "return address";
+    // fiber_entry starts with the stack aligned as if it had been called
+    void** sp = (void**)(stack_top - 64);
+    memset(sp, 0, 64);
+    sp[6] = (void*)fiber_entry;
+    f->sp = sp;
+#else
+    getcontext(&f->ctx);
+    f->ctx.uc_stack.ss_sp = f->map + page_size;
+    f->ctx.uc_stack.ss_size = stack_top - (f->map + page_size);
+    f->ctx.uc_link = NULL;
+    makecontext(&f->ctx, fiber_entry, 0);
+#endif
+    return f;
+}
 
-/* The child thread will execute this function. */
-void thread_func(void (*func)(void*))
+// start the scheduler in this process, the caller becomes the main fiber
+int fiber_init(void)
 {
-    func(NULL); // run the function passed in
+    if (epfd != -1)
+        return 0;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("Error: failed to create epoll instance");
+        return -1;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+    timer_wheel_init(&wheel, timer_now_ms());
+    signal(SIGPIPE, SIG_IGN); // a client hanging up must not take every fiber with it
+    return 0;
+}
 
-    // going back to the parent once everything is done
-    if (setjmp(child))
-        longjmp(parent, 1);
+// whether this process runs a scheduler, i.e. waits can yield
+int fiber_running(void)
+{
+    return epfd != -1;
+}
+
+// in a process forked off a fiber: leave the scheduler to the parent, waits
+// block from here on
+void fiber_detach(void)
+{
+    if (epfd == -1)
+        return;
+    close(epfd);
+    epfd = -1;
+}
 
-    longjmp(parent, 1);
+// give each fiber its own copy of a global, e.g. the current request
+int fiber_local(void* addr, size_t size)
+{
+    if (local_count == FIBER_LOCALS_MAX || locals_size + size > FIBER_LOCALS_SIZE) {
+        fprintf(stderr, "Error: too many fiber-local variables\n");
+        return -1;
+    }
+    locals[local_count].addr = addr;
+    locals[local_count].size = size;
+    local_count++;
+    locals_size += size;
+    return 0;
 }
 
+// run func in a new fiber right away; it inherits the caller's fiber-locals
+// and the caller continues once the new fiber first has to wait
 void create_thread(void (*func)(void*))
 {
-    stack_t stack;
+    if (epfd == -1) { // no scheduler in this process, just call it
+        func(NULL);
+        return;
+    }
+
+    fiber* f = fiber_alloc(func);
+    if (!f) {
+        func(NULL);
+        return;
+    }
+    save_locals(current);
+    memcpy(f->locals, current->locals, locals_size);
+    push_ready(current);
+    switch_to(f);
+}
+
+// let the other runnable fibers go first
+void fiber_yield(void)
+{
+    if (epfd == -1)
+        return;
+    push_ready(current);
+    schedule();
+}
+
+static void sleep_done(void* arg)
+{
+    push_ready(arg);
+}
+
+// pause this fiber for about ms, the others keep running; without a
+// scheduler the whole process sleeps
+void fiber_sleep(int ms)
+{
+    if (epfd == -1) {
+        poll(NULL, 0, ms);
+        return;
+    }
+    timer_add(&wheel, &current->timer, timer_now_ms() + ms, sleep_done, current);
+    schedule();
+}
+
+// set one of the current fiber's deadlines to timeout_ms from now, 0 clears it
+void fiber_set_timeout(fiber_timeout which, int timeout_ms)
+{
+    if (which == FIBER_TIMEOUT_IDLE || timeout_ms == 0)
+        current->timeouts[which] = timeout_ms;
+    else
+        current->timeouts[which] = timer_now_ms() + timeout_ms;
+}
+
+// the deadline that cut the last wait short, or -1; clears it
+int fiber_take_timeout(void)
+{
+    int which = current->expired;
+    current->expired = -1;
+    return which;
+}
+
+// the earliest deadline a wait starting now runs into, 0 if none
+static uint64_t wait_deadline(fiber* f, uint64_t now)
+{
+    uint64_t deadline = 0;
+    for (int i = 0; i < FIBER_TIMEOUT_COUNT; i++) {
+        uint64_t d = f->timeouts[i];
+        if (d && i == FIBER_TIMEOUT_IDLE)
+            d += now;
+        if (d && (!deadline || d < deadline)) {
+            deadline = d;
+            f->waiting_on = i;
+        }
+    }
+    return deadline;
+}
+
+static int timed_out(fiber* f)
+{
+    f->expired = f->waiting_on;
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+// without a scheduler: block in poll, bounded by the deadlines
+static int poll_fd(int fd, short events)
+{
+    struct pollfd p = { .fd = fd, .events = events };
+    for (;;) {
+        uint64_t now = timer_now_ms();
+        uint64_t deadline = wait_deadline(current, now);
+        if (deadline && deadline <= now)
+            return timed_out(current);
+        int n = poll(&p, 1, deadline ? (int)(deadline - now) : -1);
+        if (n > 0)
+            return 0;
+        if (n == 0)
+            return timed_out(current);
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+// park this fiber until fd is readable or writable, or fail with ETIMEDOUT
+// once one of its deadlines passes
+int fiber_wait_fd(int fd, fiber_io io)
+{
+    if (epfd == -1)
+        return poll_fd(fd, io == FIBER_READ ? POLLIN : POLLOUT);
+
+    uint64_t now = timer_now_ms();
+    uint64_t deadline = wait_deadline(current, now);
+    if (deadline && deadline <= now)
+        return timed_out(current);
 
-    // Create the new stack
-    stack.ss_flags = 0;
-    stack.ss_size = FIBER_STACK;
+    // one-shot, so a registration never wakes a fiber that moved on
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (io == FIBER_READ ? EPOLLIN | EPOLLRDHUP : EPOLLOUT) | EPOLLONESHOT;
+    ev.data.ptr = current;
+
+    int op = current->registered_fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    int rc = epoll_ctl(epfd, op, fd, &ev);
+    if (rc == -1 && errno == EEXIST) // left behind by an earlier fiber using this fd number
+        rc = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    else if (rc == -1 && errno == ENOENT) // closed and reopened since
+        rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    if (rc == -1) {
+        perror("Error: failed to register fd with epoll");
+        return -1;
+    }
+    current->registered_fd = fd;
+    if (deadline)
+        timer_add(&wheel, &current->timer, deadline, wait_expired, current);
+
+    schedule();
+    if (current->timed_out) {
+        current->timed_out = 0;
+        return timed_out(current);
+    }
+    return 0;
+}
 
-    if ((stack.ss_sp = malloc(FIBER_STACK)) == 0) {
-        perror("Error: malloc could not allocate stack.\n");
-        exit(EXIT_FAILURE);
+// wait for a child to exit, yielding in threaded mode; a child still running
+// at the deadline is killed, with its process group if it leads one. Its
+// wait status, or -1 if it was killed.
+int fiber_wait_child(pid_t pid)
+{
+    int status = 0, killed = 0;
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd != -1) { // readable once the child exits
+        if (fiber_wait_fd(pidfd, FIBER_READ) == -1) {
+            // not reaped yet, so the pid can't have been reused
+            if (kill(-pid, SIGKILL) == -1)
+                syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0);
+            killed = 1;
+        }
+        close(pidfd);
     }
+    // may already have been collected by a SIGCHLD handler
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    return killed ? -1 : status;
+}
 
-    sigaltstack(&stack, 0);
+// accept a non-blocking connection, waiting in the scheduler while none is pending
+int fiber_accept(int listen_fd, struct sockaddr* addr, socklen_t* addr_len)
+{
+    for (;;) {
+        socklen_t len = *addr_len;
+        int fd = accept4(listen_fd, addr, &len, (epfd != -1 ? SOCK_NONBLOCK : 0) | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            *addr_len = len;
+            return fd;
+        }
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if (errno == EAGAIN && fiber_wait_fd(listen_fd, FIBER_READ) == 0)
+            continue;
+        return -1;
+    }
+}
 
-    if (setjmp(child))
-        thread_func(func);
+ssize_t fiber_recv(int fd, void* buf, size_t len, int flags)
+{
+    for (;;) {
+        ssize_t n = recv(fd, buf, len, flags);
+        if (n >= 0)
+            return n;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN && fiber_wait_fd(fd, FIBER_READ) == 0)
+            continue;
+        return -1;
+    }
+}
 
-    // Execute the child context
-    if (setjmp(parent)) {
-        if (setjmp(parent) == 0)
-            longjmp(child, 1);
-    } else
-        longjmp(child, 1);
+ssize_t fiber_read(int fd, void* buf, size_t len)
+{
+    for (;;) {
+        ssize_t n = read(fd, buf, len);
+        if (n >= 0)
+            return n;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN && fiber_wait_fd(fd, FIBER_READ) == 0)
+            continue;
+        return -1;
+    }
+}
 
-    free(stack.ss_sp); // free the stack
-}
\ No newline at end of file
+// write all of buf, yielding whenever the socket buffer is full; len or -1
+ssize_t fiber_write_all(int fd, const void* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char*)buf + done, len - done);
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN && fiber_wait_fd(fd, FIBER_WRITE) == 0)
+            continue;
+        return -1;
+    }
+    return done;
+}
@@ -1,7 +1,44 @@
 #ifndef MY_THREADS_H
 #define MY_THREADS_H
 
-void thread_func(void (*func)(void*));
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define FIBER_STACK_SIZE (256 * 1024) // usable stack per fiber, a guard page sits below it
+#define FIBER_POOL_MAX 256 // stacks kept mapped for reuse once their fiber finishes
+#define FIBER_LOCALS_MAX 8 // globals swapped in and out on every switch
+#define FIBER_LOCALS_SIZE 512 // their combined size
+#define FIBER_EVENTS_MAX 64 // readiness events taken per epoll_wait
+
+typedef enum {
+    FIBER_READ,
+    FIBER_WRITE
+} fiber_io;
+
+// deadlines a wait can run into; TOTAL and PHASE are absolute once set,
+// IDLE bounds each single wait for the descriptor
+typedef enum {
+    FIBER_TIMEOUT_TOTAL,
+    FIBER_TIMEOUT_PHASE,
+    FIBER_TIMEOUT_IDLE,
+    FIBER_TIMEOUT_COUNT
+} fiber_timeout;
+
+int fiber_init(void);
+int fiber_running(void);
+void fiber_detach(void);
+int fiber_local(void* addr, size_t size);
 void create_thread(void (*func)(void*));
+void fiber_yield(void);
+void fiber_sleep(int ms);
+void fiber_set_timeout(fiber_timeout which, int timeout_ms);
+int fiber_take_timeout(void);
+int fiber_wait_fd(int fd, fiber_io io);
+int fiber_wait_child(pid_t pid);
+int fiber_accept(int listen_fd, struct sockaddr* addr, socklen_t* addr_len);
+ssize_t fiber_recv(int fd, void* buf, size_t len, int flags);
+ssize_t fiber_read(int fd, void* buf, size_t len);
+ssize_t fiber_write_all(int fd, const void* buf, size_t len);
 
-#endif
\ No newline at end of file
+#endif
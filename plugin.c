@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+
+#include "plugin.h"
+#include "analytics.h"
+#include "device.h"
+#include "my_threads.h"
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Plugins are loaded while the route config is read and never unloaded, so
+// every process forked afterwards has them mapped already. A request's
+// response buffer and the start of its arena live on plugin_serve's stack,
+// which in threaded mode is the fiber's own.
+
+typedef struct arena_block {
+    struct arena_block* next;
+    _Alignas(max_align_t) char data[];
+} arena_block;
+
+struct webserv_response {
+    int fd;
+    int status; // 0 until begin
+    int failed; // the client is gone, everything else is dropped
+    uint64_t bytes; // body bytes sent
+    size_t out_len;
+    size_t head_len; // bytes at the start of out that are the head
+    char* base; // the arena block being handed out
+    size_t cap;
+    size_t used;
+    size_t allocated; // over all blocks, bounded by PLUGIN_ARENA_MAX
+    arena_block* blocks;
+    _Alignas(max_align_t) char arena[PLUGIN_ARENA_INLINE];
+    char out[PLUGIN_OUT_BUFFER];
+};
+
+static const webserv_endpoint* endpoints[PLUGIN_ENDPOINTS_MAX];
+static int endpoint_count = 0;
+static int plugin_count = 0;
+
+static const struct {
+    int status;
+    const char* text;
+} reasons[] = {
+    { 200, "OK" },
+    { 201, "Created" },
+    { 204, "No Content" },
+    { 301, "Moved Permanently" },
+    { 302, "Found" },
+    { 304, "Not Modified" },
+    { 400, "Bad Request" },
+    { 403, "Forbidden" },
+    { 404, "Not Found" },
+    { 409, "Conflict" },
+    { 500, "Internal Server Error" },
+    { 503, "Service Unavailable" },
+    { 504, "Gateway Timeout" },
+    { 0, "" } // End of array marker
+};
+
+static const char* reason(int status)
+{
+    int i = 0;
+    while (reasons[i].status && reasons[i].status != status)
+        i++;
+    return reasons[i].text;
+}
+
+static int flush(webserv_response* res)
+{
+    if (res->failed)
+        return -1;
+    if (res->out_len && fiber_write_all(res->fd, res->out, res->out_len) != (ssize_t)res->out_len) {
+        res->failed = 1;
+        return -1;
+    }
+    res->bytes += res->out_len - res->head_len;
+    res->out_len = res->head_len = 0;
+    return 0;
+}
+
+static int res_begin(webserv_response* res, int status, const char* content_type)
+{
+    if (res->status || res->failed || status < 100 || status > 999)
+        return -1;
+    int n = snprintf(res->out, sizeof(res->out), "HTTP/1.1 %d %s\r\nServer: Web Server in C\r\nContent-Type: %s\r\nConnection: close\r\n\r\n",
+        status, reason(status), content_type ? content_type : "text/plain");
+    if (n < 0 || (size_t)n >= sizeof(res->out))
+        return -1;
+    res->status = status;
+    res->out_len = res->head_len = n;
+    return 0;
+}
+
+static int res_write(webserv_response* res, const void* data, size_t len)
+{
+    if (!res->status || res->failed)
+        return -1;
+    if (res->out_len + len > sizeof(res->out) && flush(res) == -1)
+        return -1;
+    if (len > sizeof(res->out)) { // too big to collect, straight out
+        if (fiber_write_all(res->fd, data, len) != (ssize_t)len) {
+            res->failed = 1;
+            return -1;
+        }
+        res->bytes += len;
+        return 0;
+    }
+    memcpy(res->out + res->out_len, data, len);
+    res->out_len += len;
+    return 0;
+}
+
+static void* res_alloc(webserv_response* res, size_t size)
+{
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    if (size > PLUGIN_ARENA_MAX - res->allocated)
+        return NULL;
+    if (size > res->cap - res->used) {
+        size_t block = size > PLUGIN_ARENA_INLINE * 4 ? size : PLUGIN_ARENA_INLINE * 4;
+        arena_block* b = malloc(sizeof(arena_block) + block);
+        if (!b)
+            return NULL;
+        b->next = res->blocks;
+        res->blocks = b;
+        res->base = b->data;
+        res->cap = block;
+        res->used = 0;
+    }
+    void* p = res->base + res->used;
+    res->used += size;
+    res->allocated += size;
+    return p;
+}
+
+static int res_printf(webserv_response* res, const char* format, ...)
+{
+    if (!res->status || res->failed)
+        return -1;
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(res->out + res->out_len, sizeof(res->out) - res->out_len, format, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+    if (res->out_len + n < sizeof(res->out)) {
+        res->out_len += n;
+        return 0;
+    }
+
+    // didn't fit in what is left of the buffer: format it in the arena
+    char* text = res_alloc(res, n + 1);
+    if (!text)
+        return -1;
+    va_start(ap, format);
+    vsnprintf(text, n + 1, format, ap);
+    va_end(ap);
+    return res_write(res, text, n);
+}
+
+// a device's open session, what its "stats" command answers; the first
+// connected device for NULL
+static int host_device_session(const char* device, webserv_session* out)
+{
+    const device_status* d;
+    int i = 0;
+    for (; (d = device_slot(i)) != NULL; i++) {
+        if (device ? strcmp(d->name, device) == 0 : __atomic_load_n(&d->connected, __ATOMIC_ACQUIRE))
+            break;
+    }
+    analytics_session s;
+    if (!d || !__atomic_load_n(&d->connected, __ATOMIC_ACQUIRE) || !__atomic_load_n(&d->updated_ms, __ATOMIC_ACQUIRE)
+        || analytics_current(i, &s) == -1)
+        return -1;
+
+    double minutes = s.window_ms / 60000.0;
+    memset(out, 0, sizeof(*out));
+    snprintf(out->device, sizeof(out->device), "%s", d->name);
+    out->occupancy = s.occupancy;
+    out->peak = s.peak;
+    out->peak_at = s.peak_ms / 1000;
+    out->entries = s.entries;
+    out->exits = s.exits;
+    out->entries_per_min = minutes > 0 ? s.window_entries / minutes : 0;
+    out->exits_per_min = minutes > 0 ? s.window_exits / minutes : 0;
+    out->started = s.started_ms / 1000;
+    return 0;
+}
+
+static const webserv_host host = {
+    .abi = WEBSERV_PLUGIN_ABI,
+    .size = sizeof(webserv_host),
+    .begin = res_begin,
+    .write = res_write,
+    .printf = res_printf,
+    .alloc = res_alloc,
+    .device_count = device_count,
+    .device_session = host_device_session,
+};
+
+// load a shared object and register its endpoints by name; -1 if it is
+// not a plugin for this ABI, one of its names is taken, or it refuses
+int plugin_load(const char* path)
+{
+    if (plugin_count == PLUGIN_MAX) {
+        fprintf(stderr, "Error: too many plugins loaded!\n");
+        return -1;
+    }
+    void* lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!lib) {
+        fprintf(stderr, "Error: cannot load plugin: %s\n", dlerror());
+        return -1;
+    }
+    const webserv_plugin* p = dlsym(lib, WEBSERV_PLUGIN_SYMBOL);
+    if (!p || p->abi != WEBSERV_PLUGIN_ABI || !p->name || !p->endpoints) {
+        fprintf(stderr, "Error: %s is not a plugin for webserv plugin ABI %d\n", path, WEBSERV_PLUGIN_ABI);
+        dlclose(lib);
+        return -1;
+    }
+
+    int count = 0;
+    for (const webserv_endpoint* e = p->endpoints; e->name; e++, count++) {
+        if (!e->handle || plugin_find(e->name) || endpoint_count + count == PLUGIN_ENDPOINTS_MAX) {
+            fprintf(stderr, "Error: plugin %s: cannot register endpoint '%s'\n", p->name, e->name);
+            dlclose(lib);
+            return -1;
+        }
+    }
+    if (p->init && p->init(&host) == -1) {
+        fprintf(stderr, "Error: plugin %s failed to start\n", p->name);
+        dlclose(lib);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+        endpoints[endpoint_count++] = &p->endpoints[i];
+    plugin_count++;
+    return 0;
+}
+
+const webserv_endpoint* plugin_find(const char* name)
+{
+    for (int i = 0; i < endpoint_count; i++) {
+        if (strcmp(endpoints[i]->name, name) == 0)
+            return endpoints[i];
+    }
+    return NULL;
+}
+
+// run an endpoint for a request on client_fd: the body bytes sent, and the
+// status answered in *status. A handler that fails or sends nothing gets
+// a 500 sent for it.
+uint64_t plugin_serve(const webserv_endpoint* endpoint, int client_fd, const char* path, const char* query, const char* remote_addr, int* status)
+{
+    webserv_response res;
+    res.fd = client_fd;
+    res.status = res.failed = 0;
+    res.bytes = 0;
+    res.out_len = res.head_len = 0;
+    res.base = res.arena;
+    res.cap = sizeof(res.arena);
+    res.used = res.allocated = 0;
+    res.blocks = NULL;
+    webserv_request req = { "GET", path, query ? query : "", remote_addr, &res };
+
+    if (endpoint->handle(&host, &req) == -1 && res.status && !res.failed && res.out_len == res.head_len) {
+        res.status = 0; // only a head so far, it can still be taken back
+        res.out_len = res.head_len = 0;
+    }
+    if (!res.status && res_begin(&res, 500, "text/plain") == 0)
+        res_write(&res, "Internal Server Error\n", 22);
+    flush(&res);
+
+    while (res.blocks) {
+        arena_block* next = res.blocks->next;
+        free(res.blocks);
+        res.blocks = next;
+    }
+    *status = res.status;
+    return res.bytes;
+}
@@ -0,0 +1,17 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include "plugin_api.h"
+#include <stdint.h>
+
+#define PLUGIN_MAX 16 // shared objects loaded at once
+#define PLUGIN_ENDPOINTS_MAX 64 // endpoints over all of them
+#define PLUGIN_OUT_BUFFER 16384 // response bytes collected before a write
+#define PLUGIN_ARENA_INLINE 4096 // per-request arena kept on the stack, more is malloc()ed
+#define PLUGIN_ARENA_MAX (1024 * 1024) // what one request may allocate in total
+
+int plugin_load(const char* path);
+const webserv_endpoint* plugin_find(const char* name);
+uint64_t plugin_serve(const webserv_endpoint* endpoint, int client_fd, const char* path, const char* query, const char* remote_addr, int* status);
+
+#endif /* PLUGIN_H */
@@ -0,0 +1,83 @@
+#ifndef PLUGIN_API_H
+#define PLUGIN_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The interface between webserv and handler plugins: shared objects named
+// in routes.conf, loaded once at startup and called in-process for the
+// routes that use their endpoints. A plugin includes only this header and
+// is built with -shared -fPIC. It reaches the server through the host table
+// it is handed, never by symbol, so it links against nothing of webserv's.
+//
+// WEBSERV_PLUGIN_ABI changes only when something here changes
+// incompatibly, and a plugin built for another one is refused. Members are
+// only ever added at the end of webserv_host, whose size says how many the
+// running server has.
+
+#define WEBSERV_PLUGIN_ABI 1
+#define WEBSERV_PLUGIN_SYMBOL "webserv_plugin_entry" // the one symbol looked up in the object
+#define WEBSERV_DEVICE_NAME_MAX 32
+
+typedef struct webserv_response webserv_response; // the server's, one per request
+
+// the request as a handler sees it, valid until it returns
+typedef struct {
+    const char* method;
+    const char* path; // without the query
+    const char* query; // after the '?', "" when there is none
+    const char* remote_addr;
+    webserv_response* res;
+} webserv_request;
+
+// a device's open counting session, as the device process keeps it
+typedef struct {
+    char device[WEBSERV_DEVICE_NAME_MAX];
+    int64_t occupancy; // the latest count
+    int64_t peak;
+    int64_t peak_at; // seconds since the epoch
+    int64_t entries;
+    int64_t exits;
+    double entries_per_min; // over the last few minutes
+    double exits_per_min;
+    int64_t started; // seconds since the epoch
+} webserv_session;
+
+typedef struct {
+    uint32_t abi;
+    uint32_t size; // sizeof(webserv_host) in the running server
+
+    // the status line and headers, then the body in any number of pieces;
+    // output is buffered until the handler returns or the buffer fills.
+    // -1 once the client is gone.
+    int (*begin)(webserv_response* res, int status, const char* content_type);
+    int (*write)(webserv_response* res, const void* data, size_t len);
+    int (*printf)(webserv_response* res, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+    // memory that lives until the handler returns, NULL when it runs out
+    void* (*alloc)(webserv_response* res, size_t size);
+
+    // shared state read in place, no round trip to the device process;
+    // device NULL is the first one connected. -1 without a connected
+    // device that has counted yet.
+    int (*device_count)(const char* device, int64_t* count);
+    int (*device_session)(const char* device, webserv_session* session);
+} webserv_host;
+
+typedef struct {
+    const char* name; // what a route names after "plugin"
+    // 0 when done; -1 has the server answer 500 if nothing was sent yet.
+    // Runs in the process serving the connection: in threaded mode that is
+    // shared with other requests, so it must not block for long.
+    int (*handle)(const webserv_host* host, const webserv_request* req);
+} webserv_endpoint;
+
+// what a plugin exports as WEBSERV_PLUGIN_SYMBOL
+typedef struct {
+    uint32_t abi; // WEBSERV_PLUGIN_ABI
+    const char* name;
+    int (*init)(const webserv_host* host); // at startup, before any fork; NULL or 0 to load, -1 refuses
+    const webserv_endpoint* endpoints; // ended by one with a NULL name
+} webserv_plugin;
+
+#endif /* PLUGIN_API_H */
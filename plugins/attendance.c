@@ -0,0 +1,153 @@
+#include "plugin_api.h"
+#include <stdio.h>
+#include <time.h>
+
+// The attendance page, served in-process by webserv in place of the old
+// serial_com_html_res.cgi: the numbers come straight from the session the
+// device process keeps in shared memory, so a hit costs a few
+// microseconds rather than a fork, an exec and a round trip to the device.
+
+static const char* format_html_res = "<html>\n"
+                                     "<head>\n"
+                                     "    <title>Attendance Data</title>\n"
+                                     "    <style>\n"
+                                     "        body {\n"
+                                     "            font-family: Arial, sans-serif;\n"
+                                     "            margin: 0;\n"
+                                     "            padding: 0;\n"
+                                     "            background-color: #f4f4f4;\n"
+                                     "            color: #333;\n"
+                                     "            display: flex;\n"
+                                     "            align-items: center;\n"
+                                     "            justify-content: center;\n"
+                                     "        }\n"
+                                     "        h1 {\n"
+                                     "            color: #333;\n"
+                                     "            text-align: center;\n"
+                                     "            font-size: 50px;\n"
+                                     "        }\n"
+                                     "        #data {\n"
+                                     "            font-size: 70px !important;\n"
+                                     "            margin: 40px;\n"
+                                     "        }\n"
+                                     "        #summary {\n"
+                                     "            text-align: center;\n"
+                                     "            font-size: 20px;\n"
+                                     "            color: #666;\n"
+                                     "        }\n"
+                                     "        form {\n"
+                                     "            text-align: center;\n"
+                                     "            margin-top: 20px;\n"
+                                     "        }\n"
+                                     "        input[type='button'] {\n"
+                                     "            padding: 14px 28px;\n"
+                                     "            color: white;\n"
+                                     "            border: none;\n"
+                                     "            border-radius: 5px;\n"
+                                     "            cursor: pointer;\n"
+                                     "            font-size: 20px;\n"
+                                     "            margin: 12px;\n"
+                                     "        }\n"
+                                     "        input[value='Update Data'] {\n"
+                                     "            background-color: #4CAF50;\n"
+                                     "        }\n"
+                                     "        input[value='Update Data']:hover {\n"
+                                     "            background-color: #45a049;\n"
+                                     "        }\n"
+                                     "        input[value='Live Mode'] {\n"
+                                     "            background-color: #3498DB;\n"
+                                     "        }\n"
+                                     "        input[value='Live Mode']:hover {\n"
+                                     "            background-color: #2E86C1;\n"
+                                     "        }\n"
+                                     "        input[value='Plot Data'] {\n"
+                                     "            background-color: #FFBF00;\n"
+                                     "        }\n"
+                                     "        input[value='Plot Data']:hover {\n"
+                                     "            background-color: #E49B0F;\n"
+                                     "        }\n"
+                                     "        input[value='Reset Data'] {\n"
+                                     "            background-color: #EC5800;\n"
+                                     "        }\n"
+                                     "        input[value='Reset Data']:hover {\n"
+                                     "            background-color: #ba1f00;\n"
+                                     "        }\n"
+                                     "        input[value='Email'] {\n"
+                                     "            background-color: #0047AB;\n"
+                                     "        }\n"
+                                     "        input[value='Email']:hover {\n"
+                                     "            background-color: #003682;\n"
+                                     "        }\n"
+                                     "        input[value='Exit'] {\n"
+                                     "            background-color: #8B0000;\n"
+                                     "        }\n"
+                                     "        input[value='Exit']:hover {\n"
+                                     "            background-color: #5e0000;\n"
+                                     "        }\n"
+                                     "        input[type='email'] {\n"
+                                     "            padding: 12px;\n"
+                                     "            border: 2px solid #ccc;\n"
+                                     "            border-radius: 5px;\n"
+                                     "            width: 300px;\n"
+                                     "            margin-bottom: 4px;\n"
+                                     "            font-size: 20px;\n"
+                                     "        }\n"
+                                     "        input[type='email']:hover {\n"
+                                     "            background-color : #c6c6c6;\n"
+                                     "        }\n"
+                                     "    </style>\n"
+                                     "</head>\n"
+                                     "<body>\n"
+                                     "    <div>\n"
+                                     "        <h1>Current Attendance:</h1>\n"
+                                     "        <h1 id='data'>%s</h1>\n"
+                                     "        <p id='summary'>%s</p>\n"
+                                     "        <form>\n"
+                                     "            <input type='button' value='Update Data' onClick=\"window.location.href='serial_com_html_res.cgi'\">\n"
+                                     "            <input type='button' value='Live Mode' onClick=\"window.location.href='../static/live-mode.html'\">\n"
+                                     "            <input type='button' value='Plot Data' onClick=\"window.location.href='handle_plot.cgi?data=%d'\">\n"
+                                     "            <input type='button' value='Reset Data' onClick=\"window.location.href='../static/reset_page.html'\">\n"
+                                     "            <input type='button' value='Exit' onClick=\"window.location.href='../static/project.html'\">\n"
+                                     "        </form>\n"
+                                     "        <form>\n"
+                                     "            <input type='email' id='emailInput' placeholder='Enter your email'>\n"
+                                     "            <input type='button' value='Email' id='email-btn' onClick=\"window.location.href='handle_email.cgi'\">\n"
+                                     "        </form>\n"
+                                     "    </div>\n"
+                                     "</body>\n"
+                                     "<script>\n"
+                                     "document.getElementById('email-btn').addEventListener('click', function(e) {\n"
+                                     "e.preventDefault();\n"
+                                     "const email = document.getElementById('emailInput').value.trim();\n"
+                                     "window.location.href = '../cgi-bin/handle_email.cgi?email=' + email + '&data=' + %s;\n"
+                                     "});\n"
+                                     "</script>\n"
+                                     "</html>\n";
+
+// GET: the current count and a summary of the open session
+static int attendance_page(const webserv_host* host, const webserv_request* req)
+{
+    webserv_session s;
+    if (host->device_session(NULL, &s) == -1) {
+        host->begin(req->res, 503, "text/plain");
+        return host->printf(req->res, "Error: Cannot find Arduino on any ACM port.\n");
+    }
+
+    char count[32], summary[256], peak_at[16] = "";
+    time_t at = (time_t)s.peak_at;
+    snprintf(count, sizeof(count), "%lld", (long long)s.occupancy);
+    strftime(peak_at, sizeof(peak_at), "%H:%M", localtime(&at));
+    snprintf(summary, sizeof(summary), "Peak %lld at %s &middot; %lld entered, %lld left &middot; %.1f per minute in, %.1f out lately",
+        (long long)s.peak, peak_at, (long long)s.entries, (long long)s.exits, s.entries_per_min, s.exits_per_min);
+
+    if (host->begin(req->res, 200, "text/html") == -1)
+        return -1;
+    return host->printf(req->res, format_html_res, count, summary, (int)s.occupancy, count);
+}
+
+static const webserv_endpoint endpoints[] = {
+    { "attendance", attendance_page },
+    { NULL, NULL }
+};
+
+const webserv_plugin webserv_plugin_entry = { WEBSERV_PLUGIN_ABI, "attendance", NULL, endpoints };
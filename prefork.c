@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+
+#include "prefork.h"
+#include "metrics.h"
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    pid_t pid;
+    time_t started;
+} worker_slot;
+
+static worker_slot workers[PREFORK_MAX_WORKERS];
+static int worker_count = 0;
+static pid_t master_pid;
+static int reserved_fd = -1;
+
+static int bind_port(int port, int reuse_port)
+{
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error: failed to open socket");
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0
+        || (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
+        perror("Error: failed to set socket options with setsockopt");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Error: failed to bind server to port");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// bound and listening TCP socket on port; with reuse_port every worker gets
+// its own socket and the kernel spreads connections across them
+int prefork_listen(int port, int reuse_port)
+{
+    int fd = bind_port(port, reuse_port);
+    if (fd != -1 && listen(fd, SOMAXCONN) < 0) {
+        perror("Error: cannot listen to client requests");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// SIGCHLD handler that collects every exited child so none linger as zombies
+void prefork_reap(int signum)
+{
+    (void)signum;
+    int saved_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+    errno = saved_errno;
+}
+
+// pin a worker to the index-th CPU this process may run on
+static void pin_to_cpu(int index)
+{
+    cpu_set_t allowed, mine;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        return;
+    int target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0, seen = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || seen++ != target)
+            continue;
+        CPU_ZERO(&mine);
+        CPU_SET(cpu, &mine);
+        if (sched_setaffinity(0, sizeof(mine), &mine) == -1)
+            perror("Warning: failed to pin worker to a CPU");
+        return;
+    }
+}
+
+static void run_worker(int index, int port, const prefork_ops* ops)
+{
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &chld, NULL); // the master waits for it synchronously
+    signal(SIGINT, SIG_IGN); // the master handles Ctrl-C and stops the workers
+    signal(SIGTERM, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // don't outlive a master that was killed
+    if (getppid() != master_pid)
+        exit(EXIT_FAILURE); // the master died before the flag was set
+
+    close(reserved_fd);
+    pin_to_cpu(index);
+    int listen_fd = prefork_listen(port, 1);
+    if (listen_fd == -1)
+        exit(EXIT_FAILURE);
+    if (ops->worker_init)
+        ops->worker_init(index);
+    if (ops->serve)
+        ops->serve(listen_fd);
+
+    for (;;) {
+        struct sockaddr_in client;
+        socklen_t client_len = sizeof(client);
+        int fd = accept(listen_fd, (struct sockaddr*)&client, &client_len);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue; // transient, the next accept may work
+            perror("Error: failed to accept client request");
+            exit(EXIT_FAILURE);
+        }
+        ops->handle(fd, &client);
+    }
+}
+
+static pid_t spawn_worker(int index, int port, const prefork_ops* ops)
+{
+    fflush(stdout); // don't let the worker inherit buffered output
+    pid_t p = fork();
+    if (p < 0) {
+        perror("Error: cannot fork worker");
+        workers[index].pid = -1; // retried on the next tick
+        return -1;
+    }
+    if (p == 0)
+        run_worker(index, port, ops);
+
+    workers[index].pid = p;
+    workers[index].started = time(NULL);
+    return p;
+}
+
+// start count workers on port and supervise them: a worker that exits for
+// any reason is replaced in the same slot. Only returns, with -1, if the
+// port is taken.
+int prefork_run(int count, int port, const prefork_ops* ops)
+{
+    // the master holds the port without listening, so a conflict shows up
+    // here instead of as workers failing in a restart loop, and no
+    // connection is ever queued on a socket nobody accepts from
+    reserved_fd = bind_port(port, 1);
+    if (reserved_fd == -1)
+        return -1;
+
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+
+    master_pid = getpid();
+    worker_count = count;
+    for (int i = 0; i < count; i++)
+        spawn_worker(i, port, ops);
+
+    for (;;) {
+        struct timespec wait = { .tv_sec = PREFORK_TICK_S, .tv_nsec = 0 };
+        sigtimedwait(&chld, NULL, &wait);
+        if (ops->tick)
+            ops->tick();
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            int i;
+            for (i = 0; i < worker_count && workers[i].pid != pid; i++)
+                ;
+            if (i == worker_count)
+                continue; // some other child, e.g. the access log flusher
+
+            if (WIFSIGNALED(status))
+                printf("Worker %d (pid %d) killed by signal %d, restarting.\n", i, (int)pid, WTERMSIG(status));
+            else
+                printf("Worker %d (pid %d) exited with status %d, restarting.\n", i, (int)pid, WEXITSTATUS(status));
+            fflush(stdout);
+            metrics_counter_add(&metrics->worker_restarts, 1);
+
+            if (time(NULL) - workers[i].started < PREFORK_RESTART_BACKOFF_S)
+                sleep(PREFORK_RESTART_BACKOFF_S); // crashing on startup, don't spin
+            workers[i].pid = -1;
+            spawn_worker(i, port, ops);
+        }
+
+        // retry slots whose fork failed earlier
+        for (int i = 0; i < worker_count; i++) {
+            if (workers[i].pid == -1)
+                spawn_worker(i, port, ops);
+        }
+    }
+}
+
+// terminate all workers, called by the master on shutdown
+void prefork_stop(void)
+{
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i].pid > 0)
+            kill(workers[i].pid, SIGTERM);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <netinet/in.h>
+
+#define PREFORK_MAX_WORKERS 64
+#define PREFORK_RESTART_BACKOFF_S 1 // a worker that dies this soon after starting is restarted after a pause
+#define PREFORK_TICK_S 1 // how often the master wakes up for housekeeping
+
+typedef struct {
+    void (*worker_init)(int index); // runs in each new worker before it accepts
+    int (*serve)(int listen_fd); // event loop to run instead of the accept loop, returns if unusable; may be NULL
+    void (*handle)(int client_fd, const struct sockaddr_in* client); // one connection, in the worker
+    void (*tick)(void); // periodic work in the master, may be NULL
+} prefork_ops;
+
+int prefork_listen(int port, int reuse_port);
+void prefork_reap(int signum);
+int prefork_run(int count, int port, const prefork_ops* ops);
+void prefork_stop(void);
+
+#endif /* PREFORK_H */
@@ -0,0 +1,501 @@
+#include "router.h"
+#include "plugin.h"
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MAX_NATIVE_HANDLERS 16
+#define CONFIG_LINE_LEN 512
+#define ROUTE_PATH_LEN 1024
+#define MAX_ROUTES 4096
+
+// Byte-wise trie with first-child/next-sibling links. A node carries the
+// exact route for the key ending there and/or a prefix route that applies
+// to every key passing through it.
+typedef struct trie_node {
+    char c;
+    struct trie_node* child;
+    struct trie_node* sibling;
+    route* exact;
+    route* prefix;
+    const char* value; // used by the extension -> MIME trie
+} trie_node;
+
+typedef struct {
+    char* ext;
+    char* mediatype;
+} extn;
+
+// Media types
+static extn extensions[] = {
+    { "gif", "image/gif" },
+    { "gz", "image/gz" },
+    { "htm", "text/html" },
+    { "html", "text/html" },
+    { "ico", "image/ico" },
+    { "jpeg", "image/jpeg" },
+    { "jpg", "image/jpg" },
+    { "pdf", "application/pdf" },
+    { "php", "text/html" },
+    { "png", "image/png" },
+    { "rar", "application/octet-stream" },
+    { "tar", "image/tar" },
+    { "txt", "text/plain" },
+    { "zip", "application/octet-stream" }, // Note: Duplicate MIME type entries for 'zip'
+    { "cgi", "application/x-httpd-cgi" },
+    { 0, 0 } // End of array marker
+};
+
+// used when the web root has no routes.conf
+static const char* default_config[] = {
+    "plugin plugins/attendance.so",
+    "exact /metrics native metrics",
+    "exact /cgi-bin/handle_email.cgi native email",
+    "exact /cgi-bin/handle_reset.cgi native reset",
+    "exact /cgi-bin/handle_arduino_config.cgi native configure",
+    "exact /device native device",
+    "exact /cgi-bin/serial_com_html_res.cgi plugin attendance",
+    "prefix /cgi-bin/ cgi",
+    "prefix /static/ static",
+    "prefix / static",
+    NULL
+};
+
+static struct {
+    char* name;
+    native_handler fn;
+} natives[MAX_NATIVE_HANDLERS];
+static int native_count = 0;
+
+static route* all_routes[MAX_ROUTES];
+static int route_count = 0;
+static trie_node routes_root;
+static trie_node mime_root;
+static char* web_root;
+static int cache_enabled;
+
+static trie_node* trie_insert(trie_node* node, const char* key)
+{
+    for (; *key; key++) {
+        trie_node* next = node->child;
+        while (next && next->c != *key)
+            next = next->sibling;
+
+        if (!next) {
+            next = calloc(1, sizeof(trie_node));
+            if (!next) {
+                perror("Error: failed to allocate route trie node");
+                exit(EXIT_FAILURE);
+            }
+            next->c = *key;
+            next->sibling = node->child;
+            node->child = next;
+        }
+        node = next;
+    }
+    return node;
+}
+
+const char* router_mime_type(const char* ext)
+{
+    trie_node* node = &mime_root;
+    for (; node && *ext; ext++) {
+        node = node->child;
+        while (node && node->c != *ext)
+            node = node->sibling;
+    }
+    return node ? node->value : NULL;
+}
+
+// walk the trie once, remembering the deepest prefix route on the way
+const route* router_lookup(const char* path)
+{
+    trie_node* node = &routes_root;
+    const route* best = node->prefix;
+
+    for (const char* p = path; *p; p++) {
+        node = node->child;
+        while (node && node->c != *p)
+            node = node->sibling;
+        if (!node)
+            return best;
+        if (node->prefix)
+            best = node->prefix;
+    }
+    return node->exact ? node->exact : best;
+}
+
+// call fn on every route, e.g. to warm per-route state at startup
+void router_visit(void (*fn)(const route*))
+{
+    for (int i = 0; i < route_count; i++)
+        fn(all_routes[i]);
+}
+
+int router_register_native(const char* name, native_handler fn)
+{
+    if (native_count == MAX_NATIVE_HANDLERS) {
+        fprintf(stderr, "Error: too many native handlers registered!\n");
+        return -1;
+    }
+    natives[native_count].name = strdup(name);
+    natives[native_count].fn = fn;
+    native_count++;
+    return 0;
+}
+
+static native_handler find_native(const char* name)
+{
+    for (int i = 0; i < native_count; i++) {
+        if (strcmp(natives[i].name, name) == 0)
+            return natives[i].fn;
+    }
+    return NULL;
+}
+
+static admission_class default_class(route_handler handler)
+{
+    switch (handler) {
+    case HANDLER_CACHED_STATIC:
+        return CLASS_CACHED;
+    case HANDLER_CGI:
+        return CLASS_CGI;
+    case HANDLER_NATIVE:
+    case HANDLER_PLUGIN:
+        return CLASS_NONE;
+    default:
+        return CLASS_STATIC;
+    }
+}
+
+static route* new_route(route_handler handler, int exact, const char* url_path)
+{
+    route* r = calloc(1, sizeof(route));
+    if (!r) {
+        perror("Error: failed to allocate route");
+        exit(EXIT_FAILURE);
+    }
+
+    char fs_path[ROUTE_PATH_LEN];
+    const char* rel = url_path[0] == '/' ? url_path + 1 : url_path;
+    snprintf(fs_path, sizeof(fs_path), "%s%s", web_root, rel);
+
+    r->handler = handler;
+    r->exact = exact;
+    r->fs_path = strdup(fs_path);
+    r->rel_path = strdup(*rel ? rel : ".");
+    r->coalesce_ms = -1;
+    r->admission = default_class(handler);
+    if (route_count < MAX_ROUTES)
+        all_routes[route_count++] = r;
+    return r;
+}
+
+static void add_exact(const char* url_path, route* r)
+{
+    trie_node* node = trie_insert(&routes_root, url_path);
+    if (!node->exact) // first definition wins, explicit config comes before scans
+        node->exact = r;
+}
+
+// register every file below a prefix directory as an exact route with its
+// handler and MIME type resolved now rather than per request; files handled
+// like the prefix route inherit its options
+static void scan_dir(const char* url_dir, int depth, const route* prefix)
+{
+    int static_caching = prefix->handler == HANDLER_CACHED_STATIC;
+    char fs_dir[ROUTE_PATH_LEN];
+    snprintf(fs_dir, sizeof(fs_dir), "%s%s", web_root, url_dir + 1);
+
+    DIR* dir = opendir(fs_dir);
+    if (!dir)
+        return;
+
+    // a directory answers both with and without the trailing slash
+    route* listing = new_route(HANDLER_DIR, 1, url_dir);
+    add_exact(url_dir, listing);
+    if (strlen(url_dir) > 1) {
+        char bare[ROUTE_PATH_LEN];
+        snprintf(bare, sizeof(bare), "%s", url_dir);
+        bare[strlen(bare) - 1] = '\0';
+        add_exact(bare, listing);
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char url_path[ROUTE_PATH_LEN], fs_path[ROUTE_PATH_LEN];
+        if (snprintf(url_path, sizeof(url_path), "%s%s", url_dir, entry->d_name) >= (int)sizeof(url_path)
+            || snprintf(fs_path, sizeof(fs_path), "%s/%s", fs_dir, entry->d_name) >= (int)sizeof(fs_path))
+            continue; // too long to route
+
+        struct stat st;
+        if (stat(fs_path, &st) != 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (depth > 0) {
+                strncat(url_path, "/", sizeof(url_path) - strlen(url_path) - 1);
+                scan_dir(url_path, depth - 1, prefix);
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+            continue;
+
+        char* ext = strrchr(entry->d_name, '.');
+        const char* mime = ext ? router_mime_type(ext + 1) : NULL;
+        if (!mime)
+            continue; // unsupported types fall through to the prefix route's 404
+
+        route_handler handler;
+        if (strcmp(ext, ".cgi") == 0)
+            handler = HANDLER_CGI;
+        else
+            handler = static_caching ? HANDLER_CACHED_STATIC : HANDLER_STATIC;
+
+        route* r = new_route(handler, 1, url_path);
+        r->mime_type = mime;
+        if ((handler == HANDLER_CGI) == (prefix->handler == HANDLER_CGI)) {
+            r->coalesce_ms = prefix->coalesce_ms;
+            r->stale_ms = prefix->stale_ms;
+            r->admission = prefix->admission;
+        }
+        add_exact(url_path, r);
+    }
+
+    closedir(dir);
+}
+
+// a number of milliseconds, with or without the "ms" suffix; -1 if it isn't one
+static long parse_ms(const char* s)
+{
+    char* unit;
+    long ms = strtol(s, &unit, 10);
+    if (unit == s || ms < 0 || ms > INT_MAX || (*unit && strcmp(unit, "ms") != 0))
+        return -1;
+    return ms;
+}
+
+// "class=name" moves a route to another admission class; 1 if arg was one
+static int parse_class_option(const char* arg, int lineno, admission_class* cls)
+{
+    if (strncmp(arg, "class=", 6) != 0)
+        return 0;
+    *cls = admission_class_named(arg + 6);
+    if (*cls == CLASS_NONE) {
+        fprintf(stderr, "Error: %s line %d: unknown route class '%s'\n", ROUTES_CONFIG_FILE, lineno, arg + 6);
+        return -1;
+    }
+    return 1;
+}
+
+// parse the rest of a "limit class N [queue=N] [wait=Nms]" line
+static int parse_limit_line(const char* name, const char* count, int lineno)
+{
+    admission_class cls = admission_class_named(name);
+    if (cls == CLASS_NONE) {
+        fprintf(stderr, "Error: %s line %d: unknown route class '%s'\n", ROUTES_CONFIG_FILE, lineno, name);
+        return -1;
+    }
+    admission_limits limits = *admission_get_limits(cls);
+    char* end;
+    limits.limit = strtol(count, &end, 10);
+    if (end == count || *end) {
+        fprintf(stderr, "Error: %s line %d: bad concurrency limit '%s'\n", ROUTES_CONFIG_FILE, lineno, count);
+        return -1;
+    }
+
+    char* arg;
+    while ((arg = strtok(NULL, " \t\r\n")) != NULL) {
+        if (strncmp(arg, "queue=", 6) == 0) {
+            limits.queue = strtol(arg + 6, &end, 10);
+            if (end == arg + 6 || *end)
+                limits.queue = -1;
+        } else if (strncmp(arg, "wait=", 5) == 0)
+            limits.target_ms = parse_ms(arg + 5);
+        else
+            fprintf(stderr, "Warning: %s line %d: ignoring unknown option '%s'\n", ROUTES_CONFIG_FILE, lineno, arg);
+    }
+
+    if (admission_configure(cls, &limits) == -1) {
+        fprintf(stderr, "Error: %s line %d: limits out of range (at most %d in flight and %d queued)\n",
+            ROUTES_CONFIG_FILE, lineno, ADMISSION_LIMIT_MAX, ADMISSION_QUEUE_MAX);
+        return -1;
+    }
+    return 0;
+}
+
+// parse one "kind path handler [args...]", "limit class N [args...]" or
+// "plugin file.so" line from the route config
+static int parse_route_line(char* line, int lineno)
+{
+    char* hash = strchr(line, '#');
+    if (hash)
+        *hash = '\0';
+
+    char* kind = strtok(line, " \t\r\n");
+    if (!kind)
+        return 0; // blank or comment
+    char* path = strtok(NULL, " \t\r\n");
+    char* handler = strtok(NULL, " \t\r\n");
+    if (strcmp(kind, "limit") == 0) {
+        if (!path || !handler) {
+            fprintf(stderr, "Error: %s line %d: expected \"limit class N\"\n", ROUTES_CONFIG_FILE, lineno);
+            return -1;
+        }
+        return parse_limit_line(path, handler, lineno);
+    }
+    if (strcmp(kind, "plugin") == 0) {
+        if (!path || handler) {
+            fprintf(stderr, "Error: %s line %d: expected \"plugin file.so\"\n", ROUTES_CONFIG_FILE, lineno);
+            return -1;
+        }
+        char so_path[ROUTE_PATH_LEN];
+        snprintf(so_path, sizeof(so_path), "%s%s", path[0] == '/' ? "" : web_root, path);
+        return plugin_load(so_path);
+    }
+    if (!path || !handler || path[0] != '/') {
+        fprintf(stderr, "Error: %s line %d: expected \"exact|prefix /path handler\"\n", ROUTES_CONFIG_FILE, lineno);
+        return -1;
+    }
+
+    int exact = strcmp(kind, "exact") == 0;
+    if (!exact && strcmp(kind, "prefix") != 0) {
+        fprintf(stderr, "Error: %s line %d: unknown route kind '%s'\n", ROUTES_CONFIG_FILE, lineno, kind);
+        return -1;
+    }
+
+    route* r;
+    char* arg;
+    if (strcmp(handler, "native") == 0) {
+        char* name = strtok(NULL, " \t\r\n");
+        native_handler fn = name ? find_native(name) : NULL;
+        if (!fn) {
+            fprintf(stderr, "Error: %s line %d: unknown native handler '%s'\n", ROUTES_CONFIG_FILE, lineno, name ? name : "");
+            return -1;
+        }
+        r = new_route(HANDLER_NATIVE, exact, path);
+        r->native = fn;
+    } else if (strcmp(handler, "plugin") == 0) {
+        char* name = strtok(NULL, " \t\r\n");
+        const webserv_endpoint* endpoint = name ? plugin_find(name) : NULL;
+        if (!endpoint) {
+            fprintf(stderr, "Error: %s line %d: no loaded plugin has an endpoint '%s'\n", ROUTES_CONFIG_FILE, lineno, name ? name : "");
+            return -1;
+        }
+        r = new_route(HANDLER_PLUGIN, exact, path);
+        r->plugin = endpoint;
+    } else if (strcmp(handler, "cgi") == 0) {
+        r = new_route(HANDLER_CGI, exact, path);
+        r->mime_type = router_mime_type("cgi");
+        while ((arg = strtok(NULL, " \t\r\n")) != NULL) {
+            int is_class = parse_class_option(arg, lineno, &r->admission);
+            if (is_class == -1)
+                return -1;
+            if (is_class)
+                continue;
+            if (strcmp(arg, "coalesce") == 0)
+                r->coalesce_ms = 0;
+            else if (strncmp(arg, "coalesce=", 9) == 0) {
+                r->coalesce_ms = parse_ms(arg + 9);
+                if (r->coalesce_ms == -1) {
+                    fprintf(stderr, "Error: %s line %d: bad coalesce window '%s'\n", ROUTES_CONFIG_FILE, lineno, arg + 9);
+                    return -1;
+                }
+            } else if (strncmp(arg, "stale=", 6) == 0) {
+                r->stale_ms = parse_ms(arg + 6);
+                if (r->stale_ms == -1) {
+                    fprintf(stderr, "Error: %s line %d: bad stale window '%s'\n", ROUTES_CONFIG_FILE, lineno, arg + 6);
+                    return -1;
+                }
+            } else
+                fprintf(stderr, "Warning: %s line %d: ignoring unknown option '%s'\n", ROUTES_CONFIG_FILE, lineno, arg);
+        }
+        if (r->stale_ms > 0 && r->coalesce_ms <= 0) {
+            fprintf(stderr, "Error: %s line %d: stale= needs a coalesce=Nms to go stale after\n", ROUTES_CONFIG_FILE, lineno);
+            return -1;
+        }
+    } else if (strcmp(handler, "static") == 0) {
+        int caching = cache_enabled;
+        admission_class cls = CLASS_NONE;
+        while ((arg = strtok(NULL, " \t\r\n")) != NULL) {
+            int is_class = parse_class_option(arg, lineno, &cls);
+            if (is_class == -1)
+                return -1;
+            if (is_class)
+                continue;
+            if (strcmp(arg, "nocache") == 0)
+                caching = 0;
+            else
+                fprintf(stderr, "Warning: %s line %d: ignoring unknown option '%s'\n", ROUTES_CONFIG_FILE, lineno, arg);
+        }
+        r = new_route(caching ? HANDLER_CACHED_STATIC : HANDLER_STATIC, exact, path);
+        if (cls != CLASS_NONE)
+            r->admission = cls;
+        if (exact) {
+            char* ext = strrchr(path, '.');
+            r->mime_type = ext ? router_mime_type(ext + 1) : NULL;
+        } else if (path[strlen(path) - 1] == '/')
+            scan_dir(path, ROUTE_SCAN_DEPTH, r);
+    } else {
+        fprintf(stderr, "Error: %s line %d: unknown handler '%s'\n", ROUTES_CONFIG_FILE, lineno, handler);
+        return -1;
+    }
+
+    if (exact)
+        add_exact(path, r);
+    else {
+        trie_node* node = trie_insert(&routes_root, path);
+        if (!node->prefix)
+            node->prefix = r;
+    }
+
+    // files under a CGI prefix are scanned too, so scripts get exact routes
+    if (!exact && r->handler == HANDLER_CGI && path[strlen(path) - 1] == '/')
+        scan_dir(path, ROUTE_SCAN_DEPTH, r);
+
+    return 0;
+}
+
+// build the route and MIME tries, call once at startup before forking
+int router_init(const char* root, const char* config_path, int cached)
+{
+    web_root = strdup(root);
+    cache_enabled = cached;
+
+    for (int i = 0; extensions[i].ext; ++i) {
+        trie_node* node = trie_insert(&mime_root, extensions[i].ext);
+        if (!node->value)
+            node->value = extensions[i].mediatype;
+    }
+
+    char line[CONFIG_LINE_LEN];
+    int lineno = 0;
+    FILE* f = fopen(config_path, "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (parse_route_line(line, ++lineno) == -1) {
+                fclose(f);
+                return -1;
+            }
+        }
+        fclose(f);
+    } else {
+        for (int i = 0; default_config[i]; i++) {
+            snprintf(line, sizeof(line), "%s", default_config[i]);
+            if (parse_route_line(line, ++lineno) == -1)
+                return -1;
+        }
+    }
+
+    // everything else resolves through the root prefix
+    if (!routes_root.prefix)
+        routes_root.prefix = new_route(cached ? HANDLER_CACHED_STATIC : HANDLER_STATIC, 0, "/");
+    return 0;
+}
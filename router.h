@@ -0,0 +1,40 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "admission.h"
+#include "plugin_api.h"
+
+#define ROUTES_CONFIG_FILE "routes.conf"
+#define ROUTE_SCAN_DEPTH 8 // how deep prefix directories are walked at startup
+
+typedef enum {
+    HANDLER_STATIC, // serve file from disk
+    HANDLER_CACHED_STATIC, // serve file through the shared cache (-c)
+    HANDLER_CGI, // execute script
+    HANDLER_DIR, // directory listing
+    HANDLER_NATIVE, // function compiled into the server
+    HANDLER_PLUGIN // endpoint of a shared object loaded at startup
+} route_handler;
+
+typedef void (*native_handler)(int client_fd, char* query);
+
+typedef struct {
+    route_handler handler;
+    int exact; // 1 for a known file/dir, 0 for a prefix fallback
+    const char* mime_type; // precomputed for exact file routes
+    char* fs_path; // absolute path on disk
+    char* rel_path; // path relative to the web root, no leading '/'
+    native_handler native;
+    const webserv_endpoint* plugin;
+    int coalesce_ms; // CGI single-flight: -1 off, else how long a finished response is reused
+    int stale_ms; // and how long after that it is still sent while it is refreshed in the background
+    admission_class admission; // concurrency limit and queue the route is served under
+} route;
+
+int router_register_native(const char* name, native_handler fn);
+int router_init(const char* root, const char* config_path, int cached);
+const route* router_lookup(const char* path);
+void router_visit(void (*fn)(const route*));
+const char* router_mime_type(const char* ext);
+
+#endif /* ROUTER_H */
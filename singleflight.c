@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+
+#include "singleflight.h"
+#include "metrics.h"
+#include "my_threads.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAIT_SLICE_MS 100 // how often a waiting follower checks that the leader is alive
+#define FIBER_SLICE_MS 10 // a fiber can't sleep on the futex, it looks at the slot this often
+#define MAX_QUERY_PARAMS 32
+
+typedef enum {
+    SLOT_IDLE,
+    SLOT_RUNNING,
+    SLOT_DONE
+} slot_state;
+
+// One key in flight or recently finished. Followers sleep on gen, which
+// changes whenever the slot changes state.
+typedef struct {
+    uint32_t lock;
+    uint32_t gen;
+    int state;
+    pid_t leader;
+    int ttl_ms;
+    int stale_ms; // after ttl_ms, still sent for this long while one refresh runs
+    pid_t refresher; // process running the script again for a stale response, 0 if none
+    uint64_t refresh_ms;
+    uint64_t done_ms;
+    long len;
+    int status;
+    char result[64]; // shm_open name of the recorded response
+    char key[SINGLEFLIGHT_KEY_MAX];
+} sf_slot;
+
+static sf_slot* slots = NULL;
+static uint32_t result_counter = 0;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hash_key(const char* s)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void slot_lock(sf_slot* s)
+{
+    while (__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void slot_unlock(sf_slot* s)
+{
+    __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+// shared (not private) futex ops: the slots are mapped in several processes
+static void futex_wait(uint32_t* addr, uint32_t val, int timeout_ms)
+{
+    struct timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake_all(uint32_t* addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int leader_alive(pid_t pid)
+{
+    if (pid == getpid())
+        return fiber_running(); // another fiber may be on it, otherwise it was left behind
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static int refresh_running(const sf_slot* s)
+{
+    return s->refresher && now_ms() - s->refresh_ms < SINGLEFLIGHT_WAIT_MS && leader_alive(s->refresher);
+}
+
+static int compare_params(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// build "kind path?sorted&query" so parameter order does not split flights;
+// -1 if it does not fit, since a truncated key could merge distinct requests
+int singleflight_key(char* key, size_t key_len, const char* kind, const char* path, const char* query)
+{
+    char copy[SINGLEFLIGHT_KEY_MAX];
+    char* params[MAX_QUERY_PARAMS];
+    int count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", query ? query : "");
+    for (char* save = NULL, *p = strtok_r(copy, "&", &save); p && count < MAX_QUERY_PARAMS; p = strtok_r(NULL, "&", &save))
+        params[count++] = p;
+    qsort(params, count, sizeof(char*), compare_params);
+
+    if (strlen(query ? query : "") >= sizeof(copy) || count == MAX_QUERY_PARAMS)
+        return -1;
+
+    size_t used = snprintf(key, key_len, "%s %s", kind, path);
+    for (int i = 0; i < count && used < key_len; i++)
+        used += snprintf(key + used, key_len - used, "%c%s", i == 0 ? '?' : '&', params[i]);
+    return used < key_len ? 0 : -1;
+}
+
+// join a flight for key: share a finished or in-flight response if there is
+// one, otherwise become its leader. ttl_ms keeps a finished response
+// shareable for that long after it completes (0 = only while in flight);
+// for stale_ms after that it is still shared, and the first call to find
+// it stale gets refresh set and runs the script again in the background.
+// With share_only the call never waits or leads, it bypasses instead.
+singleflight_role singleflight_begin(const char* key, int ttl_ms, int stale_ms, int share_only, singleflight_call* call)
+{
+    memset(call, 0, sizeof(*call));
+    call->slot = -1;
+    call->fd = -1;
+    if (!slots || strlen(key) >= SINGLEFLIGHT_KEY_MAX) {
+        metrics_counter_add(&metrics->singleflight_bypassed, 1);
+        return SF_BYPASS;
+    }
+
+    int index = hash_key(key) % SINGLEFLIGHT_SLOTS;
+    sf_slot* s = &slots[index];
+    uint64_t deadline = now_ms() + SINGLEFLIGHT_WAIT_MS;
+    uint32_t waited_gen = 0;
+    int waited = 0;
+
+    for (;;) {
+        slot_lock(s);
+        int same = strcmp(s->key, key) == 0;
+
+        // finished: either the flight we waited for, or still within its TTL,
+        // or stale but within the window a refresh gets to replace it
+        uint64_t age = same && s->state == SLOT_DONE ? now_ms() - s->done_ms : 0;
+        int fresh = (waited && s->gen == waited_gen + 1) || age < (uint64_t)s->ttl_ms;
+        int stale = !fresh && age < (uint64_t)s->ttl_ms + s->stale_ms;
+        if (same && s->state == SLOT_DONE && (fresh || stale)) {
+            char name[sizeof(s->result)];
+            memcpy(name, s->result, sizeof(name));
+            call->len = s->len;
+            call->status = s->status;
+            if (stale && !refresh_running(s)) {
+                s->refresher = getpid();
+                s->refresh_ms = now_ms();
+                call->refresh = 1;
+                call->slot = index;
+                call->gen = s->gen;
+            }
+            slot_unlock(s);
+
+            call->fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+            if (call->fd == -1) { // replaced by a newer flight in the meantime
+                singleflight_finish(call, 0, 0);
+                metrics_counter_add(&metrics->singleflight_bypassed, 1);
+                return SF_BYPASS;
+            }
+            metrics_counter_add(&metrics->singleflight_shared, 1);
+            if (stale)
+                metrics_counter_add(&metrics->singleflight_stale, 1);
+            return SF_SHARED;
+        }
+
+        if (share_only) {
+            slot_unlock(s);
+            return SF_BYPASS;
+        }
+
+        if (s->state == SLOT_RUNNING && leader_alive(s->leader)) {
+            if (!same || now_ms() >= deadline) { // slot busy with another key, or leader too slow
+                slot_unlock(s);
+                metrics_counter_add(&metrics->singleflight_bypassed, 1);
+                return SF_BYPASS;
+            }
+            waited_gen = s->gen;
+            waited = 1;
+            slot_unlock(s);
+            if (fiber_running()) // the futex would stall every connection of this process
+                fiber_sleep(FIBER_SLICE_MS);
+            else
+                futex_wait(&s->gen, waited_gen, WAIT_SLICE_MS);
+            continue;
+        }
+
+        // idle, expired, or the leader died: take the slot over
+        if (s->result[0])
+            shm_unlink(s->result);
+        snprintf(s->key, sizeof(s->key), "%s", key);
+        snprintf(s->result, sizeof(s->result), "/webserv_sf_%d_%u", (int)getpid(), result_counter++);
+        s->state = SLOT_RUNNING;
+        s->leader = getpid();
+        s->ttl_ms = ttl_ms;
+        s->stale_ms = stale_ms;
+        s->refresher = 0;
+        s->len = 0;
+        call->gen = __atomic_add_fetch(&s->gen, 1, __ATOMIC_RELEASE);
+        call->slot = index;
+        char name[sizeof(s->result)];
+        memcpy(name, s->result, sizeof(name));
+        slot_unlock(s);
+        futex_wake_all(&s->gen); // followers of a dead leader retry now
+
+        call->fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+        if (call->fd == -1) {
+            perror("Error: failed to create single-flight result");
+            singleflight_finish(call, 0, 0);
+            metrics_counter_add(&metrics->singleflight_bypassed, 1);
+            return SF_BYPASS;
+        }
+        metrics_counter_add(&metrics->singleflight_leaders, 1);
+        return SF_LEADER;
+    }
+}
+
+// start the background run a stale response asked for (call->refresh),
+// before the stale one is sent. Returns 0 in the new process, which holds
+// none of the caller's descriptors and records the response again with
+// singleflight_write and singleflight_finish; the child's pid in the
+// caller, or -1 if it could not be started.
+pid_t singleflight_refresh(singleflight_call* call)
+{
+    sf_slot* s = &slots[call->slot];
+    pid_t parent = getpid();
+    pid_t p = fork();
+    if (p == 0) {
+        close_range(3, ~0U, 0); // the caller's connections stay the caller's
+        slot_lock(s);
+        if (s->gen == call->gen && s->refresher == parent)
+            s->refresher = getpid();
+        slot_unlock(s);
+        snprintf(call->result, sizeof(call->result), "/webserv_sf_%d_%u", (int)getpid(), result_counter++);
+        call->fd = shm_open(call->result, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+        if (call->fd == -1) {
+            perror("Error: failed to create single-flight result");
+            call->result[0] = '\0';
+            call->failed = 1;
+        }
+        call->len = 0;
+        metrics_counter_add(&metrics->singleflight_refreshes, 1);
+        return 0;
+    }
+
+    if (p == -1)
+        perror("Error: cannot fork single-flight refresh");
+    slot_lock(s);
+    if (s->gen == call->gen && s->refresher == parent)
+        s->refresher = p > 0 ? p : 0;
+    slot_unlock(s);
+    call->refresh = 0;
+    call->slot = -1;
+    return p;
+}
+
+// record part of the leader's response
+void singleflight_write(singleflight_call* call, const void* data, size_t len)
+{
+    if (call->slot < 0 || call->failed)
+        return;
+    if (call->len + (long)len > SINGLEFLIGHT_MAX_RESULT) {
+        call->failed = 1;
+        return;
+    }
+
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(call->fd, (const char*)data + done, len - done);
+        if (n <= 0) {
+            perror("Error: failed to record single-flight result");
+            call->failed = 1;
+            return;
+        }
+        done += n;
+    }
+    call->len += len;
+}
+
+// publish the recorded response to followers, or abandon the flight so one
+// of them retries the work; a refresh replaces the stale response, or
+// leaves it for the next request past its TTL to try again
+void singleflight_finish(singleflight_call* call, int ok, int status)
+{
+    if (call->slot < 0)
+        return;
+
+    sf_slot* s = &slots[call->slot];
+    slot_lock(s);
+    if (call->refresh) { // swap the new response in, unless the slot moved on
+        int replaced = ok && !call->failed && s->gen == call->gen && s->refresher == getpid() && s->state == SLOT_DONE;
+        if (replaced) {
+            shm_unlink(s->result);
+            memcpy(s->result, call->result, sizeof(s->result));
+            s->done_ms = now_ms();
+            s->len = call->len;
+            s->status = status;
+        } else if (call->result[0]) {
+            shm_unlink(call->result);
+        }
+        if (s->refresher == getpid())
+            s->refresher = 0;
+    } else if (s->gen == call->gen && s->leader == getpid() && s->state == SLOT_RUNNING) {
+        if (ok && !call->failed) {
+            s->state = SLOT_DONE;
+            s->done_ms = now_ms();
+            s->len = call->len;
+            s->status = status;
+        } else {
+            s->state = SLOT_IDLE;
+            shm_unlink(s->result);
+            s->result[0] = '\0';
+        }
+        __atomic_add_fetch(&s->gen, 1, __ATOMIC_RELEASE);
+    }
+    slot_unlock(s);
+    futex_wake_all(&s->gen);
+
+    if (call->fd != -1)
+        close(call->fd);
+    call->fd = -1;
+    call->slot = -1;
+}
+
+// send a response recorded by another process
+long singleflight_send(singleflight_call* call, int client_fd)
+{
+    off_t offset = 0;
+    while (offset < call->len) {
+        ssize_t n = sendfile(client_fd, call->fd, &offset, call->len - offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && errno == EAGAIN && fiber_wait_fd(client_fd, FIBER_WRITE) == 0)
+                continue;
+            perror("Error: failed to send single-flight result");
+            break;
+        }
+    }
+    close(call->fd);
+    call->fd = -1;
+    return offset;
+}
+
+// remove recorded responses, called when the server shuts down
+void singleflight_cleanup(void)
+{
+    if (!slots)
+        return;
+    for (int i = 0; i < SINGLEFLIGHT_SLOTS; i++) {
+        if (slots[i].result[0])
+            shm_unlink(slots[i].result);
+    }
+}
+
+// map the shared flight table, call before forking
+int singleflight_init(void)
+{
+    void* p = mmap(NULL, sizeof(sf_slot) * SINGLEFLIGHT_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("Error: failed to map single-flight table");
+        return -1;
+    }
+    slots = p;
+    return 0;
+}
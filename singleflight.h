@@ -0,0 +1,39 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SINGLEFLIGHT_SLOTS 64 // requests that can be in flight at once, coalesced per key
+#define SINGLEFLIGHT_KEY_MAX 512
+#define SINGLEFLIGHT_WAIT_MS 30000 // followers give up and do the work themselves after this
+#define SINGLEFLIGHT_MAX_RESULT (16 * 1024 * 1024) // larger responses are not shared
+
+typedef enum {
+    SF_BYPASS, // no coalescing possible, do the work without recording it
+    SF_LEADER, // do the work and record the response with singleflight_write
+    SF_SHARED // another process produced the response, send it with singleflight_send
+} singleflight_role;
+
+typedef struct {
+    int slot;
+    uint32_t gen;
+    int fd; // result file being written (leader) or read (shared)
+    long len;
+    int status; // status the leader recorded, for metrics and logging
+    int failed;
+    int refresh; // the response is stale and this call runs the script again, see singleflight_refresh
+    char result[64]; // the refresh's new record
+} singleflight_call;
+
+int singleflight_init(void);
+int singleflight_key(char* key, size_t key_len, const char* kind, const char* path, const char* query);
+singleflight_role singleflight_begin(const char* key, int ttl_ms, int stale_ms, int share_only, singleflight_call* call);
+pid_t singleflight_refresh(singleflight_call* call);
+void singleflight_write(singleflight_call* call, const void* data, size_t len);
+void singleflight_finish(singleflight_call* call, int ok, int status);
+long singleflight_send(singleflight_call* call, int client_fd);
+void singleflight_cleanup(void);
+
+#endif /* SINGLEFLIGHT_H */
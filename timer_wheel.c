@@ -0,0 +1,160 @@
+#include "timer_wheel.h"
+#include <stddef.h>
+#include <time.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SPAN(level) ((uint64_t)1 << (TIMER_WHEEL_BITS * ((level) + 1)))
+
+uint64_t timer_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(timer_wheel* w, uint64_t now)
+{
+    w->now = now;
+    w->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        w->occupied[level] = 0;
+    for (int i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++)
+        w->slots[i].next = w->slots[i].prev = &w->slots[i];
+}
+
+// file a timer by how far its deadline is from base, a tick not yet processed
+static void place(timer_wheel* w, timer_node* t, uint64_t base)
+{
+    uint64_t when = t->expires < base ? base : t->expires;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && when - base >= LEVEL_SPAN(level))
+        level++;
+    if (when - base >= LEVEL_SPAN(level)) // beyond the wheel, parked in the top level
+        when = base + LEVEL_SPAN(level) - 1;
+
+    int index = (when >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    timer_node* head = &w->slots[level * TIMER_WHEEL_SLOTS + index];
+    t->slot = level * TIMER_WHEEL_SLOTS + index;
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    w->occupied[level] |= (uint64_t)1 << index;
+}
+
+static void unlink_timer(timer_wheel* w, timer_node* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    timer_node* head = &w->slots[t->slot];
+    if (head->next == head)
+        w->occupied[t->slot / TIMER_WHEEL_SLOTS] &= ~((uint64_t)1 << (t->slot & SLOT_MASK));
+    t->next = t->prev = NULL;
+}
+
+// a deadline already in the past fires on the next advance
+void timer_add(timer_wheel* w, timer_node* t, uint64_t expires, void (*fire)(void*), void* arg)
+{
+    t->expires = expires;
+    t->fire = fire;
+    t->arg = arg;
+    place(w, t, w->now + 1);
+    w->count++;
+}
+
+// safe to call on a timer that already fired or was never added
+void timer_cancel(timer_wheel* w, timer_node* t)
+{
+    if (!t->next)
+        return;
+    unlink_timer(w, t);
+    w->count--;
+}
+
+// ms until the wheel next has work to do (a slot to fire or to cascade),
+// -1 with no timers; meant as the epoll_wait timeout
+int timer_wheel_timeout(const timer_wheel* w, uint64_t now)
+{
+    if (w->count == 0)
+        return -1;
+
+    // per level, the first occupied slot from the next one it reaches
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t bits = w->occupied[level];
+        if (!bits)
+            continue;
+        int bits_below = TIMER_WHEEL_BITS * level;
+        uint64_t block = (w->now >> bits_below) + 1;
+        int shift = block & SLOT_MASK;
+        uint64_t rotated = shift ? (bits >> shift) | (bits << (TIMER_WHEEL_SLOTS - shift)) : bits;
+        uint64_t due = (block + __builtin_ctzll(rotated)) << bits_below;
+        if (due < next)
+            next = due;
+    }
+    return next <= now ? 0 : next - now > 86400000 ? 86400000 : (int)(next - now);
+}
+
+// move every timer in a slot down to where its deadline now belongs
+static void cascade(timer_wheel* w, int level, uint64_t tick)
+{
+    int index = (tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    timer_node* head = &w->slots[level * TIMER_WHEEL_SLOTS + index];
+    timer_node list = { .next = head->next, .prev = head->prev };
+    if (head->next == head)
+        return;
+
+    // detach the whole list first, re-placing may land timers in this slot again
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->next = head->prev = head;
+    w->occupied[level] &= ~((uint64_t)1 << index);
+    while (list.next != &list) {
+        timer_node* t = list.next;
+        list.next = t->next;
+        t->next->prev = &list;
+        place(w, t, tick);
+    }
+}
+
+// run every timer due by now; callbacks may add or cancel timers
+void timer_wheel_advance(timer_wheel* w, uint64_t now)
+{
+    if (w->count == 0) {
+        if (now > w->now)
+            w->now = now;
+        return;
+    }
+
+    while (w->now < now) {
+        if (!w->occupied[0]) { // nothing can fire before the next cascade
+            uint64_t boundary = w->now | SLOT_MASK;
+            if (boundary >= now) {
+                w->now = now;
+                break;
+            }
+            w->now = boundary;
+        }
+
+        uint64_t tick = ++w->now;
+        if ((tick & SLOT_MASK) == 0) {
+            // highest level first, so its timers can fall through the lower ones this tick
+            int top = 1;
+            while (top < TIMER_WHEEL_LEVELS - 1 && (tick & (LEVEL_SPAN(top) - 1)) == 0)
+                top++;
+            for (int level = top; level >= 1; level--)
+                cascade(w, level, tick);
+        }
+
+        int index = tick & SLOT_MASK;
+        timer_node* head = &w->slots[index];
+        while (head->next != head) {
+            timer_node* t = head->next;
+            unlink_timer(w, t);
+            w->count--;
+            t->fire(t->arg);
+        }
+        if (w->count == 0 && w->now < now)
+            w->now = now; // nothing left to step through
+    }
+}
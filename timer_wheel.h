@@ -0,0 +1,38 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timer wheel with 1ms ticks: each level has 64 slots, so the
+// levels span 64ms, ~4s, ~4.4min and ~4.7h. Adding and cancelling a timer
+// is O(1); timers move down a level at most once per level on the way to
+// firing. Later deadlines wait in the top level and are re-placed.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// embedded in whatever owns the deadline
+typedef struct timer_node {
+    struct timer_node* next;
+    struct timer_node* prev;
+    uint64_t expires; // ms on the monotonic clock
+    int slot; // level * TIMER_WHEEL_SLOTS + index while pending
+    void (*fire)(void* arg);
+    void* arg;
+} timer_node;
+
+typedef struct {
+    uint64_t now; // last tick processed
+    int count;
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; // a bit per non-empty slot
+    timer_node slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS]; // list heads
+} timer_wheel;
+
+uint64_t timer_now_ms(void);
+void timer_wheel_init(timer_wheel* w, uint64_t now);
+void timer_add(timer_wheel* w, timer_node* t, uint64_t expires, void (*fire)(void*), void* arg);
+void timer_cancel(timer_wheel* w, timer_node* t);
+int timer_wheel_timeout(const timer_wheel* w, uint64_t now);
+void timer_wheel_advance(timer_wheel* w, uint64_t now);
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+
+#include "tls.h"
+#include "metrics.h"
+#include "my_threads.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// TLS is terminated in the process serving the connection. After the
+// handshake OpenSSL hands the session's keys to the kernel when it can
+// (SSL_OP_ENABLE_KTLS, the tls module loaded, a cipher the kernel has), and
+// the socket is then written to, and sendfile()d to, like a plaintext one.
+// OpenSSL 3.0 only moves TLS 1.3 sessions' sending side, so reads may still
+// go through SSL_read: tls_recv does that for the request. When the kernel
+// can't send for the session, or it negotiated h2 and the kernel can't
+// receive for it, a relay process moves the records through OpenSSL
+// instead, and the handler talks plaintext to it over a socketpair.
+
+struct tls_conn {
+    SSL* ssl;
+    int fd; // the TCP socket itself
+    int kernel_rx; // records are decrypted by the kernel too
+};
+
+static SSL_CTX* ctx = NULL;
+
+static void log_ssl_error(const char* what)
+{
+    fprintf(stderr, "Error: %s\n", what);
+    ERR_print_errors_fp(stderr);
+}
+
+// h2 if the client offers it, http/1.1 otherwise
+static int select_alpn(SSL* ssl, const unsigned char** out, unsigned char* out_len, const unsigned char* in, unsigned int in_len, void* arg)
+{
+    (void)ssl;
+    (void)arg;
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_len, protos, sizeof(protos) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// whether the client and we agreed on HTTP/2
+static int negotiated_h2(const SSL* ssl)
+{
+    const unsigned char* proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+// load the certificate chain and key; key_path may be NULL when the key is
+// in the certificate's file
+int tls_init(const char* cert_path, const char* key_path)
+{
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        log_ssl_error("failed to create TLS context");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+
+    // connections are spread over processes that share no session cache, so
+    // resumption is by stateless tickets only; their keys are made here, once,
+    // and every child and worker inherits them
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"webserv", 7);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key_path ? key_path : cert_path, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        log_ssl_error("failed to load TLS certificate and key");
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int tls_enabled(void)
+{
+    return ctx != NULL;
+}
+
+// wait for what OpenSSL needs from the socket; -1 if it failed or a
+// deadline passed
+static int wait_ssl(SSL* ssl, int ret, int fd)
+{
+    int err = SSL_get_error(ssl, ret);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+        return -1;
+    return fiber_wait_fd(fd, err == SSL_ERROR_WANT_READ ? FIBER_READ : FIBER_WRITE);
+}
+
+// the relay's side: the client's records decrypted into local, what the
+// handler writes to local encrypted back out, until the handler is done.
+// Both sockets are non-blocking; an SSL call that has to wait says which
+// way, and a retried SSL_write gets the same buffer again.
+static void relay_run(SSL* ssl, int fd, int local)
+{
+    char in[TLS_RECORD_MAX], out[TLS_RECORD_MAX];
+    size_t in_len = 0, in_off = 0, out_len = 0, out_off = 0;
+    int client_open = 1, local_open = 1;
+
+    for (;;) {
+        short client_events = 0, local_events = 0;
+        int progress = 0;
+
+        if (client_open && in_off == in_len) {
+            ERR_clear_error();
+            int n = SSL_read(ssl, in, sizeof(in));
+            if (n > 0) {
+                in_len = n;
+                in_off = 0;
+                progress = 1;
+            } else {
+                int err = SSL_get_error(ssl, n);
+                if (err == SSL_ERROR_WANT_READ)
+                    client_events |= POLLIN;
+                else if (err == SSL_ERROR_WANT_WRITE)
+                    client_events |= POLLOUT;
+                else { // close_notify or a dropped connection, the handler sees EOF
+                    client_open = 0;
+                    shutdown(local, SHUT_WR);
+                }
+            }
+        }
+        if (in_off < in_len) {
+            ssize_t n = send(local, in + in_off, in_len - in_off, MSG_NOSIGNAL);
+            if (n > 0) {
+                in_off += n;
+                progress = 1;
+            } else if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+                local_events |= POLLOUT;
+            } else { // the handler stopped reading
+                in_off = in_len;
+                client_open = 0;
+            }
+        }
+
+        if (local_open && out_off == out_len) {
+            ssize_t n = read(local, out, sizeof(out));
+            if (n > 0) {
+                out_len = n;
+                out_off = 0;
+                progress = 1;
+            } else if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+                local_events |= POLLIN;
+            } else {
+                local_open = 0;
+            }
+        }
+        if (out_off < out_len) {
+            ERR_clear_error();
+            int n = SSL_write(ssl, out + out_off, out_len - out_off);
+            if (n > 0) {
+                out_off += n;
+                progress = 1;
+            } else {
+                int err = SSL_get_error(ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE)
+                    client_events |= POLLOUT;
+                else if (err == SSL_ERROR_WANT_READ)
+                    client_events |= POLLIN;
+                else
+                    return; // the client is gone
+            }
+        }
+
+        if (!local_open && out_off == out_len)
+            break;
+        if (progress)
+            continue;
+        struct pollfd p[2] = { { fd, client_events, 0 }, { local, local_events, 0 } };
+        int n = poll(p, 2, TLS_RELAY_IDLE_MS);
+        if (n == 0 || (n == -1 && errno != EINTR))
+            return;
+    }
+    ERR_clear_error();
+    SSL_shutdown(ssl);
+}
+
+// no kTLS for this session: fork the relay, give the handler the other end
+static int relay(SSL* ssl, int fd)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        perror("Error: failed to create TLS relay socket");
+        return -1;
+    }
+    pid_t p = fork();
+    if (p == -1) {
+        perror("Error: cannot fork TLS relay");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (p == 0) {
+        // hold no other connection open, in threaded mode there are many
+        int keep_lo = fd < pair[1] ? fd : pair[1], keep_hi = fd < pair[1] ? pair[1] : fd;
+        close_range(3, keep_lo - 1, 0);
+        close_range(keep_lo + 1, keep_hi - 1, 0);
+        close_range(keep_hi + 1, ~0U, 0);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_IGN);
+        fcntl(pair[1], F_SETFL, fcntl(pair[1], F_GETFL) | O_NONBLOCK);
+        relay_run(ssl, fd, pair[1]);
+        _exit(EXIT_SUCCESS);
+    }
+    close(pair[1]);
+    fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+    metrics_counter_add(&metrics->tls_relayed, 1);
+    return pair[0];
+}
+
+// handshake on a new connection's non-blocking socket, within its
+// deadlines. Returns the descriptor to serve it on, which is the socket
+// again (a duplicate) when the kernel sends for the session and *conn is
+// set, or a socketpair to a relay with *conn left NULL. -1 once fd is
+// closed after a failed handshake.
+int tls_accept(int fd, tls_conn** conn)
+{
+    *conn = NULL;
+    SSL* ssl = SSL_new(ctx);
+    if (!ssl || SSL_set_fd(ssl, fd) != 1)
+        goto fail;
+
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, TLS_HANDSHAKE_TIMEOUT_MS);
+    int r;
+    do {
+        ERR_clear_error();
+        r = SSL_accept(ssl);
+    } while (r != 1 && wait_ssl(ssl, r, fd) == 0);
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, 0);
+    if (r != 1)
+        goto fail;
+
+    metrics_counter_add(&metrics->tls_handshakes, 1);
+    if (SSL_session_reused(ssl))
+        metrics_counter_add(&metrics->tls_resumed, 1);
+
+    // HTTP/2 reads frames from the socket itself, so a session the kernel
+    // can't decrypt goes through the relay even if the kernel could send
+    if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) || (negotiated_h2(ssl) && !BIO_get_ktls_recv(SSL_get_rbio(ssl)))) {
+        int local = relay(ssl, fd);
+        SSL_free(ssl); // the relay has its own copy
+        close(fd);
+        return local;
+    }
+
+    tls_conn* c = malloc(sizeof(tls_conn));
+    int handler_fd = c ? dup(fd) : -1;
+    if (handler_fd == -1) {
+        perror("Error: failed to set up TLS connection");
+        free(c);
+        goto fail;
+    }
+    c->ssl = ssl;
+    c->fd = fd;
+    c->kernel_rx = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    fcntl(fd, F_SETFD, FD_CLOEXEC); // CGI scripts get the handler's copy
+    metrics_counter_add(&metrics->tls_kernel_send, 1);
+    if (c->kernel_rx)
+        metrics_counter_add(&metrics->tls_kernel_recv, 1);
+    *conn = c;
+    return handler_fd;
+
+fail:
+    metrics_counter_add(&metrics->tls_failures, 1);
+    ERR_clear_error();
+    SSL_free(ssl);
+    close(fd);
+    return -1;
+}
+
+// receive from a client, decrypting in OpenSSL when the kernel only sends
+// for the session; as fiber_recv otherwise
+ssize_t tls_recv(tls_conn* conn, int fd, void* buf, size_t len)
+{
+    if (!conn || conn->kernel_rx)
+        return fiber_recv(fd, buf, len, 0);
+    for (;;) {
+        ERR_clear_error();
+        int n = SSL_read(conn->ssl, buf, len < INT_MAX ? (int)len : INT_MAX);
+        if (n > 0)
+            return n;
+        if (SSL_get_error(conn->ssl, n) == SSL_ERROR_ZERO_RETURN)
+            return 0;
+        // the handler's copy has the same readiness, and is what it waits on
+        if (wait_ssl(conn->ssl, n, fd) == -1) {
+            if (errno != ETIMEDOUT)
+                errno = ECONNRESET;
+            return -1;
+        }
+    }
+}
+
+// whether the socket can be read as plaintext; HTTP/2 needs it to be
+int tls_kernel_reads(const tls_conn* conn)
+{
+    return !conn || conn->kernel_rx;
+}
+
+// forget the session without ending it, another process carries on with
+// the connection
+void tls_detach(tls_conn** conn)
+{
+    tls_conn* c = *conn;
+    if (!c)
+        return;
+    SSL_free(c->ssl);
+    close(c->fd);
+    free(c);
+    *conn = NULL;
+}
+
+// end the session once the handler has closed its copy of the socket
+void tls_finish(tls_conn** conn)
+{
+    tls_conn* c = *conn;
+    if (!c)
+        return;
+    ERR_clear_error();
+    SSL_shutdown(c->ssl); // our close_notify, the client's isn't waited for
+    tls_detach(conn);
+}
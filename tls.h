@@ -0,0 +1,25 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+#define TLS_RELAY_IDLE_MS 60000 // a relayed connection quiet both ways this long is dropped
+#define TLS_RECORD_MAX 16384 // plaintext in one TLS record
+
+// A connection whose records the kernel encrypts (kTLS). The handler gets a
+// duplicate of the socket and writes, sends files and runs CGI scripts on
+// it as on plaintext; the original stays here so the session can be closed
+// with a close_notify once the handler is done with its copy.
+typedef struct tls_conn tls_conn;
+
+int tls_init(const char* cert_path, const char* key_path);
+int tls_enabled(void);
+int tls_accept(int fd, tls_conn** conn);
+ssize_t tls_recv(tls_conn* conn, int fd, void* buf, size_t len);
+int tls_kernel_reads(const tls_conn* conn);
+void tls_detach(tls_conn** conn);
+void tls_finish(tls_conn** conn);
+
+#endif /* TLS_H */
@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+
+#include "upstream.h"
+#include "metrics.h"
+#include "my_threads.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUEST_MAX 2048
+#define LINE_MAX_LEN 4096
+#define EXCHANGE_RETRY -2 // reused connection died before answering
+#define DNS_POLL_MS 5 // how often a fiber checks on a lookup in progress
+
+// Resolved address of one host. The table lives in shared memory so a
+// lookup done by one child serves every later child until it expires.
+typedef struct {
+    char host[UPSTREAM_HOST_MAX];
+    int ok;
+    time_t expires;
+    socklen_t addr_len;
+    struct sockaddr_storage addr;
+} dns_entry;
+
+typedef struct {
+    uint32_t lock;
+    dns_entry entries[UPSTREAM_DNS_SLOTS];
+} dns_table;
+
+// idle keep-alive connection, owned by this process. Only the long-lived
+// modes (-t, -w, -u) get to reuse one: a child forked per connection
+// starts with the parent's empty pool and exits after a single request.
+typedef struct {
+    int used;
+    char host[UPSTREAM_HOST_MAX];
+    int port;
+    int fd;
+    time_t idle_since;
+} pooled_conn;
+
+typedef struct {
+    int fd;
+    size_t start;
+    size_t end;
+    char buf[UPSTREAM_BUF_SIZE];
+} reader;
+
+static dns_table* dns = NULL;
+static pooled_conn pool[UPSTREAM_POOL_SIZE];
+
+static time_t now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static uint32_t hash_host(const char* s)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void dns_lock(void)
+{
+    while (__atomic_exchange_n(&dns->lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void dns_unlock(void)
+{
+    __atomic_store_n(&dns->lock, 0, __ATOMIC_RELEASE);
+}
+
+// returns 1 on a fresh hit (with *ok set), 0 on a miss
+static int dns_cache_get(const char* host, struct sockaddr_storage* addr, socklen_t* addr_len, int* ok)
+{
+    if (!dns)
+        return 0;
+
+    int hit = 0;
+    dns_entry* e = &dns->entries[hash_host(host) % UPSTREAM_DNS_SLOTS];
+    dns_lock();
+    if (strcmp(e->host, host) == 0 && e->expires > now_s()) {
+        *ok = e->ok;
+        *addr = e->addr;
+        *addr_len = e->addr_len;
+        hit = 1;
+    }
+    dns_unlock();
+    return hit;
+}
+
+static void dns_cache_put(const char* host, const struct sockaddr_storage* addr, socklen_t addr_len, int ok)
+{
+    if (!dns)
+        return;
+
+    dns_entry* e = &dns->entries[hash_host(host) % UPSTREAM_DNS_SLOTS];
+    dns_lock();
+    snprintf(e->host, sizeof(e->host), "%s", host);
+    e->ok = ok;
+    e->expires = now_s() + (ok ? UPSTREAM_DNS_TTL_S : UPSTREAM_DNS_NEGATIVE_TTL_S);
+    if (ok) {
+        e->addr = *addr;
+        e->addr_len = addr_len;
+    }
+    dns_unlock();
+}
+
+// wait for the upstream socket at most timeout_ms; in threaded mode the
+// other fibers run meanwhile. -1 with ETIMEDOUT once it passes.
+static int wait_upstream(int fd, fiber_io io, int timeout_ms)
+{
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, timeout_ms);
+    int rc = fiber_wait_fd(fd, io);
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, 0);
+    if (rc == -1 && errno == ETIMEDOUT)
+        fiber_take_timeout(); // ours, not the connection's
+    return rc;
+}
+
+// getaddrinfo_a with a deadline, so a dead resolver costs at most the
+// timeout; a fiber sleeps between checks instead of stalling the others
+static int lookup_host(const char* host, struct sockaddr_storage* addr, socklen_t* addr_len)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct gaicb* req = calloc(1, sizeof(struct gaicb));
+    char* name = strdup(host);
+    if (!req || !name) {
+        free(req);
+        free(name);
+        return -1;
+    }
+    req->ar_name = name;
+    req->ar_request = &hints;
+
+    struct gaicb* list[1] = { req };
+    if (getaddrinfo_a(GAI_NOWAIT, list, 1, NULL) != 0) {
+        free(name);
+        free(req);
+        return -1;
+    }
+
+    struct timespec deadline, now, left;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += UPSTREAM_DNS_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (UPSTREAM_DNS_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc;
+    while ((rc = gai_error(req)) == EAI_INPROGRESS) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left.tv_sec = deadline.tv_sec - now.tv_sec;
+        left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (left.tv_nsec < 0) {
+            left.tv_sec--;
+            left.tv_nsec += 1000000000L;
+        }
+        if (left.tv_sec < 0)
+            break;
+        if (fiber_running())
+            fiber_sleep(DNS_POLL_MS);
+        else
+            gai_suspend((const struct gaicb* const*)list, 1, &left);
+    }
+
+    if (rc == EAI_INPROGRESS) {
+        fprintf(stderr, "Error: DNS lookup for %s timed out\n", host);
+        // the request memory must outlive a lookup that could not be cancelled
+        if (gai_cancel(req) == EAI_CANCELED) {
+            free(name);
+            free(req);
+        }
+        return -1;
+    }
+
+    int result = -1;
+    if (rc == 0 && req->ar_result) {
+        memcpy(addr, req->ar_result->ai_addr, req->ar_result->ai_addrlen);
+        *addr_len = req->ar_result->ai_addrlen;
+        result = 0;
+    } else
+        fprintf(stderr, "Error: cannot resolve %s: %s\n", host, gai_strerror(rc));
+
+    if (req->ar_result)
+        freeaddrinfo(req->ar_result);
+    free(name);
+    free(req);
+    return result;
+}
+
+static int resolve(const char* host, int port, struct sockaddr_storage* addr, socklen_t* addr_len)
+{
+    int ok;
+    if (dns_cache_get(host, addr, addr_len, &ok))
+        metrics_counter_add(&metrics->upstream_dns_hits, 1);
+    else {
+        metrics_counter_add(&metrics->upstream_dns_misses, 1);
+        ok = lookup_host(host, addr, addr_len) == 0;
+        dns_cache_put(host, addr, *addr_len, ok);
+    }
+    if (!ok)
+        return -1;
+
+    if (addr->ss_family == AF_INET)
+        ((struct sockaddr_in*)addr)->sin_port = htons(port);
+    else if (addr->ss_family == AF_INET6)
+        ((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+    return 0;
+}
+
+static int open_connection(const char* host, int port)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (resolve(host, port, &addr, &addr_len) == -1)
+        return -1;
+
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Error: failed to open upstream socket");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, addr_len) == -1) {
+        if (errno != EINPROGRESS) {
+            perror("Error: failed to connect upstream");
+            close(fd);
+            return -1;
+        }
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (wait_upstream(fd, FIBER_WRITE, UPSTREAM_CONNECT_TIMEOUT_MS) == -1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err) {
+            fprintf(stderr, "Error: failed to connect to %s:%d: %s\n", host, port, err ? strerror(err) : "timed out");
+            close(fd);
+            return -1;
+        }
+    }
+
+    // stays non-blocking: every wait goes through wait_upstream
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// an idle connection with nothing to read is still usable; EOF or stray
+// bytes mean the upstream closed it or broke framing
+static int still_open(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static int pool_take(const char* host, int port)
+{
+    time_t now = now_s();
+    for (int i = 0; i < UPSTREAM_POOL_SIZE; i++) {
+        pooled_conn* c = &pool[i];
+        if (!c->used || c->port != port || strcmp(c->host, host) != 0)
+            continue;
+        c->used = 0;
+        if (now - c->idle_since < UPSTREAM_IDLE_TIMEOUT_S && still_open(c->fd))
+            return c->fd;
+        close(c->fd);
+    }
+    return -1;
+}
+
+static void pool_put(const char* host, int port, int fd)
+{
+    int same_host = 0, free_slot = -1, oldest = 0;
+    for (int i = 0; i < UPSTREAM_POOL_SIZE; i++) {
+        pooled_conn* c = &pool[i];
+        if (!c->used) {
+            if (free_slot == -1)
+                free_slot = i;
+            continue;
+        }
+        if (c->port == port && strcmp(c->host, host) == 0)
+            same_host++;
+        if (c->idle_since < pool[oldest].idle_since || !pool[oldest].used)
+            oldest = i;
+    }
+    if (same_host >= UPSTREAM_POOL_PER_HOST) {
+        close(fd);
+        return;
+    }
+    if (free_slot == -1) {
+        close(pool[oldest].fd);
+        free_slot = oldest;
+    }
+
+    pooled_conn* c = &pool[free_slot];
+    c->used = 1;
+    snprintf(c->host, sizeof(c->host), "%s", host);
+    c->port = port;
+    c->fd = fd;
+    c->idle_since = now_s();
+}
+
+static ssize_t rd_fill(reader* r)
+{
+    if (r->start == r->end)
+        r->start = r->end = 0;
+    else if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->end == sizeof(r->buf))
+        return -1;
+
+    ssize_t n;
+    for (;;) {
+        n = read(r->fd, r->buf + r->end, sizeof(r->buf) - r->end);
+        if (n >= 0 || (errno != EINTR && errno != EAGAIN))
+            break;
+        if (errno == EAGAIN && wait_upstream(r->fd, FIBER_READ, UPSTREAM_IO_TIMEOUT_S * 1000) == -1)
+            break;
+    }
+    if (n > 0)
+        r->end += n;
+    return n;
+}
+
+// read one CRLF terminated line without the line ending, -1 on EOF/error
+static int rd_line(reader* r, char* line, size_t max)
+{
+    for (;;) {
+        char* nl = memchr(r->buf + r->start, '\n', r->end - r->start);
+        if (nl) {
+            size_t len = nl - (r->buf + r->start);
+            if (len > 0 && nl[-1] == '\r')
+                len--;
+            if (len >= max)
+                len = max - 1;
+            memcpy(line, r->buf + r->start, len);
+            line[len] = '\0';
+            r->start = nl + 1 - r->buf;
+            return len;
+        }
+        if (rd_fill(r) <= 0)
+            return -1;
+    }
+}
+
+// pass n body bytes to the handler, or everything until EOF when n < 0
+static int rd_body(reader* r, long n, const upstream_handler* handler)
+{
+    while (n != 0) {
+        if (r->start == r->end) {
+            ssize_t got = rd_fill(r);
+            if (got == 0 && n < 0)
+                return 0;
+            if (got <= 0)
+                return -1;
+        }
+        size_t k = r->end - r->start;
+        if (n > 0 && (size_t)n < k)
+            k = n;
+        if (handler->body(handler->ctx, r->buf + r->start, k) == -1)
+            return -1;
+        r->start += k;
+        if (n > 0)
+            n -= k;
+    }
+    return 0;
+}
+
+static int read_chunked(reader* r, const upstream_handler* handler)
+{
+    char line[LINE_MAX_LEN];
+    for (;;) {
+        if (rd_line(r, line, sizeof(line)) == -1)
+            return -1;
+        char* end;
+        long size = strtol(line, &end, 16);
+        if (end == line || size < 0)
+            return -1;
+        if (size == 0)
+            break;
+        if (rd_body(r, size, handler) == -1 || rd_line(r, line, sizeof(line)) != 0)
+            return -1;
+    }
+    // skip trailers up to the terminating empty line
+    int len;
+    while ((len = rd_line(r, line, sizeof(line))) > 0)
+        ;
+    return len == 0 ? 0 : -1;
+}
+
+// send one request and stream the response; *keep_alive is set if the
+// connection can carry another request afterwards
+static int exchange(reader* r, const char* request, size_t request_len, upstream_response* resp, const upstream_handler* handler, int* keep_alive)
+{
+    *keep_alive = 0;
+    for (size_t sent = 0; sent < request_len;) {
+        ssize_t n = send(r->fd, request + sent, request_len - sent, MSG_NOSIGNAL);
+        if (n == -1 && (errno == EINTR || (errno == EAGAIN && wait_upstream(r->fd, FIBER_WRITE, UPSTREAM_IO_TIMEOUT_S * 1000) == 0)))
+            continue;
+        if (n <= 0)
+            return EXCHANGE_RETRY;
+        sent += n;
+    }
+
+    char line[LINE_MAX_LEN];
+    int minor = 1, chunked = 0, conn_close = 0, conn_keep_alive = 0;
+    memset(resp, 0, sizeof(*resp));
+    do { // skip interim 1xx responses
+        if (rd_line(r, line, sizeof(line)) == -1)
+            return EXCHANGE_RETRY;
+        if (sscanf(line, "HTTP/1.%d %d %63[^\r\n]", &minor, &resp->status, resp->reason) < 2) {
+            fprintf(stderr, "Error: malformed upstream status line\n");
+            return -1;
+        }
+
+        resp->content_length = -1;
+        int len;
+        while ((len = rd_line(r, line, sizeof(line))) > 0) {
+            char* value = strchr(line, ':');
+            if (!value)
+                continue;
+            *value++ = '\0';
+            value += strspn(value, " \t");
+
+            if (strcasecmp(line, "Content-Length") == 0)
+                resp->content_length = strtol(value, NULL, 10);
+            else if (strcasecmp(line, "Transfer-Encoding") == 0)
+                chunked = strcasestr(value, "chunked") != NULL;
+            else if (strcasecmp(line, "Connection") == 0) {
+                conn_close = strcasestr(value, "close") != NULL;
+                conn_keep_alive = strcasestr(value, "keep-alive") != NULL;
+            } else if (strcasecmp(line, "Content-Type") == 0)
+                snprintf(resp->content_type, sizeof(resp->content_type), "%s", value);
+        }
+        if (len == -1)
+            return -1;
+    } while (resp->status >= 100 && resp->status < 200);
+
+    if (handler->headers(handler->ctx, resp) == -1)
+        return resp->status;
+
+    int rc;
+    int delimited = 1;
+    if (resp->status == 204 || resp->status == 304)
+        rc = 0;
+    else if (chunked)
+        rc = read_chunked(r, handler);
+    else if (resp->content_length >= 0)
+        rc = rd_body(r, resp->content_length, handler);
+    else {
+        rc = rd_body(r, -1, handler); // body ends when the upstream closes
+        delimited = 0;
+    }
+
+    resp->complete = rc == 0;
+    int persistent = minor >= 1 ? !conn_close : conn_keep_alive;
+    *keep_alive = resp->complete && delimited && persistent && r->start == r->end;
+    return resp->status;
+}
+
+// pull the host and optional port out of a "server=host[:port]" parameter
+int upstream_parse_target(const char* query, char* host, size_t host_len, int* port)
+{
+    const char* p = query;
+    while (p && strncmp(p, "server=", 7) != 0) {
+        p = strchr(p, '&');
+        if (p)
+            p++;
+    }
+    if (!p)
+        return -1;
+    p += 7;
+
+    size_t len = strcspn(p, ":&");
+    if (len == 0 || len >= host_len)
+        return -1;
+    memcpy(host, p, len);
+    host[len] = '\0';
+
+    *port = 80; // default when no port is given
+    if (p[len] == ':') {
+        *port = atoi(p + len + 1);
+        if (*port <= 0 || *port > 65535)
+            return -1;
+    }
+    return 0;
+}
+
+// GET path from host:port over a pooled keep-alive connection; returns the
+// upstream status once headers were passed on, -1 if nothing was received
+int upstream_get(const char* host, int port, const char* path, upstream_response* resp, const upstream_handler* handler)
+{
+    char request[REQUEST_MAX];
+    int request_len;
+    if (port == 80)
+        request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", path, host);
+    else
+        request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: keep-alive\r\n\r\n", path, host, port);
+    if (request_len >= (int)sizeof(request))
+        return -1;
+
+    reader* r = malloc(sizeof(reader));
+    if (!r) {
+        perror("Error: failed to allocate upstream buffer");
+        return -1;
+    }
+
+    int rc = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused = 1;
+        int fd = pool_take(host, port);
+        if (fd == -1) {
+            reused = 0;
+            if ((fd = open_connection(host, port)) == -1)
+                break;
+            metrics_counter_add(&metrics->upstream_connections_opened, 1);
+        } else
+            metrics_counter_add(&metrics->upstream_connections_reused, 1);
+
+        r->fd = fd;
+        r->start = r->end = 0;
+        int keep_alive;
+        rc = exchange(r, request, request_len, resp, handler, &keep_alive);
+        if (keep_alive)
+            pool_put(host, port, fd);
+        else
+            close(fd);
+
+        if (rc != EXCHANGE_RETRY)
+            break;
+        rc = -1;
+        if (!reused)
+            break; // a fresh connection failing is a real error
+    }
+
+    free(r);
+    return rc;
+}
+
+// map the shared resolver cache, call before forking
+int upstream_init(void)
+{
+    void* p = mmap(NULL, sizeof(dns_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("Error: failed to map resolver cache");
+        return -1;
+    }
+    dns = p;
+    return 0;
+}
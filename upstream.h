@@ -0,0 +1,38 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stddef.h>
+
+#define UPSTREAM_HOST_MAX 256
+#define UPSTREAM_BUF_SIZE 16384
+#define UPSTREAM_DNS_SLOTS 64 // resolver cache entries shared by all processes
+#define UPSTREAM_DNS_TTL_S 60
+#define UPSTREAM_DNS_NEGATIVE_TTL_S 5 // remember failed lookups briefly
+#define UPSTREAM_DNS_TIMEOUT_MS 2000
+#define UPSTREAM_CONNECT_TIMEOUT_MS 3000
+#define UPSTREAM_IO_TIMEOUT_S 10 // for any single read or write
+#define UPSTREAM_POOL_SIZE 16 // idle keep-alive connections kept per long-lived process
+#define UPSTREAM_POOL_PER_HOST 4
+#define UPSTREAM_IDLE_TIMEOUT_S 30
+
+typedef struct {
+    int status;
+    char reason[64];
+    char content_type[128]; // empty if the upstream sent none
+    long content_length; // -1 when chunked or delimited by close
+    int complete; // body was received in full
+} upstream_response;
+
+// headers() runs once the status line and headers are parsed, body() for
+// every piece of the decoded body; either may return -1 to abort
+typedef struct {
+    int (*headers)(void* ctx, const upstream_response* resp);
+    int (*body)(void* ctx, const char* data, size_t len);
+    void* ctx;
+} upstream_handler;
+
+int upstream_init(void);
+int upstream_parse_target(const char* query, char* host, size_t host_len, int* port);
+int upstream_get(const char* host, int port, const char* path, upstream_response* resp, const upstream_handler* handler);
+
+#endif /* UPSTREAM_H */
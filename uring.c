@@ -0,0 +1,682 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "access_log.h"
+#include "timer_wheel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CQ_ENTRIES 4096
+
+typedef enum {
+    OP_IGNORE, // cleanup whose completion nobody waits for
+    OP_ACCEPT,
+    OP_RECV,
+    OP_FILE_UPDATE, // register the file being sent in the connection's fixed slot
+    OP_HEADER,
+    OP_SPLICE_IN, // file -> pipe
+    OP_SPLICE_OUT, // pipe -> socket
+    OP_TICK // wakes the loop to check deadlines
+} op_kind;
+
+#define USER_DATA(kind, index) ((uint64_t)(kind) << 32 | (uint32_t)(index))
+#define OP_OF(user_data) ((op_kind)((user_data) >> 32))
+#define INDEX_OF(user_data) ((int)(uint32_t)(user_data))
+
+typedef enum {
+    CONN_FREE,
+    CONN_READING,
+    CONN_SENDING
+} conn_state;
+
+// A connection owned by the loop. Its index is also its slot in the
+// registered file table, so the file being sent stays referenced by the
+// ring even if the fd cache closes its descriptor mid-transfer.
+typedef struct {
+    conn_state state;
+    int fd;
+    int pending; // ops submitted whose completion has not arrived yet
+    int failed; // also set once a deadline passed while reading
+    uint64_t accepted_ms;
+    timer_node deadline;
+    int pipe[2];
+    int update_fd; // read by the FILES_UPDATE op when it runs
+    size_t header_len;
+    long size;
+    long offset; // body bytes sent
+    long in_pipe; // body bytes read into the pipe but not sent yet
+    size_t request_len;
+    uring_static_response resp;
+    metrics_request req;
+    char request[URING_REQUEST_MAX + 1];
+} connection;
+
+static struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned local_tail; // sqes prepared but not yet published to the kernel
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* rings;
+    size_t rings_len;
+    size_t sqes_len;
+    unsigned features;
+} ring = { .fd = -1 };
+
+static struct io_uring_buf_ring* buf_ring = NULL;
+static char* buf_memory = NULL;
+static connection conns[URING_MAX_CONNS];
+static int free_conns[URING_MAX_CONNS];
+static int free_count = 0;
+static int listen_sock = -1;
+static const uring_ops* handlers;
+static const int no_file = -1; // FILES_UPDATE value that empties a slot
+static timer_wheel wheel;
+static struct __kernel_timespec tick_ts;
+static int tick_armed = 0;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_exit(void)
+{
+    if (ring.sqes)
+        munmap(ring.sqes, ring.sqes_len);
+    if (ring.rings)
+        munmap(ring.rings, ring.rings_len);
+    if (ring.fd != -1)
+        close(ring.fd);
+    if (buf_ring)
+        munmap(buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(buf_memory);
+    ring.fd = -1;
+    ring.sqes = NULL;
+    ring.rings = NULL;
+    buf_ring = NULL;
+    buf_memory = NULL;
+}
+
+static int ring_init(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    p.cq_entries = CQ_ENTRIES;
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring.fd == -1 && errno == EINVAL) { // kernel predates the optional flags
+        memset(&p, 0, sizeof(p));
+        ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (ring.fd == -1)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    ring.features = p.features;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.rings_len = sq_len > cq_len ? sq_len : cq_len;
+    ring.rings = mmap(NULL, ring.rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.rings == MAP_FAILED) {
+        ring.rings = NULL;
+        return -1;
+    }
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        return -1;
+    }
+
+    char* base = ring.rings;
+    ring.sq_head = (unsigned*)(base + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(base + p.sq_off.tail);
+    ring.sq_array = (unsigned*)(base + p.sq_off.array);
+    ring.sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    ring.local_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned*)(base + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(base + p.cq_off.tail);
+    ring.cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+    return 0;
+}
+
+// every opcode the loop submits must be known to this kernel
+static int probe_ops(void)
+{
+    static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SPLICE, IORING_OP_FILES_UPDATE, IORING_OP_CLOSE, IORING_OP_TIMEOUT };
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, len);
+    if (!probe)
+        return -1;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1) {
+        free(probe);
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            errno = ENOSYS;
+            return -1;
+        }
+    }
+    free(probe);
+    return 0;
+}
+
+static void recycle_buffer(unsigned bid)
+{
+    unsigned short tail = buf_ring->tail;
+    struct io_uring_buf* b = &buf_ring->bufs[tail & (URING_BUF_COUNT - 1)];
+    b->addr = (uint64_t)(uintptr_t)(buf_memory + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// receive buffers the kernel picks from, so idle connections hold none
+static int buffers_init(void)
+{
+    buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        buf_ring = NULL;
+        return -1;
+    }
+    buf_memory = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!buf_memory)
+        return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = 0;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++)
+        recycle_buffer(i);
+    return 0;
+}
+
+// an empty fixed file table, one slot per connection
+static int files_init(void)
+{
+    static int fds[URING_MAX_CONNS];
+    for (int i = 0; i < URING_MAX_CONNS; i++)
+        fds[i] = -1;
+    return sys_io_uring_register(ring.fd, IORING_REGISTER_FILES, fds, URING_MAX_CONNS);
+}
+
+// publish prepared sqes and optionally wait for a completion; a signal
+// ends the wait with EINTR, so the loop's tick can act on it. Everything
+// the kernel hasn't consumed yet is submitted, including sqes a call cut
+// short by a signal left behind.
+static int submit(unsigned wait_nr)
+{
+    __atomic_store_n(ring.sq_tail, ring.local_tail, __ATOMIC_RELEASE);
+    metrics_counter_add(&metrics->uring_enter_calls, 1);
+
+    int ret;
+    for (;;) {
+        unsigned to_submit = ring.local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        ret = sys_io_uring_enter(ring.fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (ret != -1 || errno != EINTR || wait_nr)
+            break;
+    }
+    return ret;
+}
+
+// make room for a chain of n sqes so it is never split across submissions
+static void reserve(unsigned n)
+{
+    unsigned used = ring.local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sq_entries - used < n)
+        submit(0);
+}
+
+static struct io_uring_sqe* get_sqe(uint64_t user_data)
+{
+    unsigned index = ring.local_tail & ring.sq_mask;
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring.sq_array[index] = index;
+    ring.local_tail++;
+    return sqe;
+}
+
+static unsigned skip_success(void)
+{
+    return ring.features & IORING_FEAT_CQE_SKIP ? IOSQE_CQE_SKIP_SUCCESS : 0;
+}
+
+static void arm_accept(void)
+{
+    reserve(1);
+    struct io_uring_sqe* sqe = get_sqe(USER_DATA(OP_ACCEPT, 0));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void arm_recv(connection* c)
+{
+    reserve(1);
+    struct io_uring_sqe* sqe = get_sqe(USER_DATA(OP_RECV, c - conns));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = URING_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    c->pending++;
+}
+
+static void splice_in(connection* c, unsigned flags)
+{
+    long chunk = c->size - c->offset < URING_SPLICE_CHUNK ? c->size - c->offset : URING_SPLICE_CHUNK;
+    struct io_uring_sqe* sqe = get_sqe(USER_DATA(OP_SPLICE_IN, c - conns));
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = c->pipe[1];
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = c - conns; // fixed slot holding the file
+    sqe->splice_off_in = c->offset;
+    sqe->len = chunk;
+    sqe->splice_flags = SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE;
+    sqe->flags = flags;
+    c->pending++;
+}
+
+static void splice_out(connection* c)
+{
+    reserve(1);
+    struct io_uring_sqe* sqe = get_sqe(USER_DATA(OP_SPLICE_OUT, c - conns));
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = c->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = c->pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = c->in_pipe;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    c->pending++;
+}
+
+static void peer_of(int fd, struct sockaddr_in* client)
+{
+    socklen_t len = sizeof(*client);
+    if (getpeername(fd, (struct sockaddr*)client, &len) == -1)
+        memset(client, 0, sizeof(*client));
+}
+
+// wake the loop in time for the next deadline, or URING_TICK_MS from now if
+// that is sooner, while there are any
+static void arm_tick(void)
+{
+    int ms = timer_wheel_timeout(&wheel, timer_now_ms());
+    if (tick_armed || ms == -1)
+        return;
+    if (ms > URING_TICK_MS)
+        ms = URING_TICK_MS;
+    tick_ts.tv_sec = ms / 1000;
+    tick_ts.tv_nsec = (long long)(ms % 1000) * 1000000;
+    reserve(1);
+    struct io_uring_sqe* sqe = get_sqe(USER_DATA(OP_TICK, 0));
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&tick_ts;
+    sqe->len = 1;
+    tick_armed = 1;
+}
+
+// a connection too slow to send its headers gets the 408 the other modes
+// answer with; shutting the socket down makes its pending op fail, and that
+// completion closes it
+static void deadline_passed(void* arg)
+{
+    connection* c = arg;
+    if (c->state == CONN_READING) {
+        static const char timeout_res[] = "HTTP/1.1 408 Request Timeout\r\nConnection: close\r\n\r\n";
+        struct sockaddr_in client;
+        peer_of(c->fd, &client);
+        metrics_counter_add(&metrics->timeouts[TIMEOUT_HEADER], 1);
+        metrics_request_begin(&c->req);
+        c->req.status = 408;
+        c->req.start_us -= (timer_now_ms() - c->accepted_ms) * 1000;
+        send(c->fd, timeout_res, sizeof(timeout_res) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        metrics_request_end(&c->req);
+        access_log_write(&client, "", 408, 0, metrics_now_us() - c->req.start_us);
+        c->failed = 1;
+    } else
+        metrics_counter_add(&metrics->timeouts[timer_now_ms() - c->accepted_ms >= (uint64_t)handlers->total_timeout_ms ? TIMEOUT_REQUEST : TIMEOUT_IDLE], 1);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+// the headers are due header_timeout_ms after the connection was accepted,
+// then every step of the response within idle_timeout_ms of the last one,
+// and all of it within total_timeout_ms
+static void arm_deadline(connection* c)
+{
+    uint64_t expires = c->state == CONN_READING ? c->accepted_ms + handlers->header_timeout_ms : timer_now_ms() + handlers->idle_timeout_ms;
+    if (expires > c->accepted_ms + handlers->total_timeout_ms)
+        expires = c->accepted_ms + handlers->total_timeout_ms;
+    timer_cancel(&wheel, &c->deadline);
+    timer_add(&wheel, &c->deadline, expires, deadline_passed, c);
+}
+
+static connection* conn_alloc(int fd)
+{
+    if (free_count == 0)
+        return NULL;
+    connection* c = &conns[free_conns[--free_count]];
+    c->state = CONN_READING;
+    c->fd = fd;
+    c->pending = 0;
+    c->failed = 0;
+    c->request_len = 0;
+    c->accepted_ms = timer_now_ms();
+    arm_deadline(c);
+    return c;
+}
+
+// close the socket through the ring and drop the connection's file slot
+static void conn_close(connection* c)
+{
+    reserve(2);
+    struct io_uring_sqe* sqe = get_sqe(USER_DATA(OP_IGNORE, 0));
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = c->fd;
+    sqe->flags = skip_success();
+    if (c->state == CONN_SENDING) {
+        sqe = get_sqe(USER_DATA(OP_IGNORE, 0));
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)&no_file;
+        sqe->len = 1;
+        sqe->off = c - conns;
+        sqe->flags = skip_success();
+    }
+    if (c->in_pipe > 0) { // a failed transfer left data behind, start over with a fresh pipe
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+        c->pipe[0] = c->pipe[1] = -1;
+    }
+    c->in_pipe = 0;
+    c->state = CONN_FREE;
+    timer_cancel(&wheel, &c->deadline);
+    free_conns[free_count++] = c - conns;
+}
+
+static void finish_static(connection* c)
+{
+    struct sockaddr_in client;
+    peer_of(c->fd, &client);
+    c->req.bytes = c->offset;
+    metrics_request_end(&c->req);
+    access_log_write(&client, c->req.path, c->req.status, c->req.bytes, metrics_now_us() - c->req.start_us);
+    metrics_counter_add(&metrics->uring_static_requests, 1);
+    conn_close(c);
+}
+
+// header and first chunk go out as one linked chain: register the file in
+// the connection's slot, send the header, splice the file into the pipe
+static void start_static(connection* c)
+{
+    if (c->resp.size > 0 && c->pipe[0] == -1 && pipe2(c->pipe, O_CLOEXEC) == -1) {
+        perror("Error: failed to create splice pipe");
+        conn_close(c);
+        return;
+    }
+
+    metrics_request_begin(&c->req);
+    c->req.route = ROUTE_STATIC;
+    c->req.status = 200;
+    snprintf(c->req.path, sizeof(c->req.path), "%s", c->resp.path);
+    c->state = CONN_SENDING;
+    c->size = c->resp.size;
+    c->offset = 0;
+    c->in_pipe = 0;
+    c->update_fd = c->resp.file_fd;
+    c->header_len = strlen(c->resp.header);
+    arm_deadline(c);
+
+    reserve(3);
+    struct io_uring_sqe* sqe = get_sqe(USER_DATA(OP_FILE_UPDATE, c - conns));
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&c->update_fd;
+    sqe->len = 1;
+    sqe->off = c - conns;
+    sqe->flags = IOSQE_IO_LINK;
+    c->pending++;
+
+    sqe = get_sqe(USER_DATA(OP_HEADER, c - conns));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)c->resp.header;
+    sqe->len = c->header_len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | (c->size > 0 ? MSG_MORE : 0);
+    c->pending++;
+
+    if (c->size > 0) {
+        sqe->flags = IOSQE_IO_LINK;
+        splice_in(c, 0);
+    }
+}
+
+// hand the connection to the regular blocking handler, with everything
+// received so far
+static void fallback(connection* c)
+{
+    char request[URING_REQUEST_MAX + 1];
+    size_t len = c->request_len;
+    memcpy(request, c->request, len + 1);
+    int fd = c->fd;
+    c->state = CONN_FREE;
+    timer_cancel(&wheel, &c->deadline); // the handler sets its own
+    free_conns[free_count++] = c - conns;
+
+    struct sockaddr_in client;
+    peer_of(fd, &client);
+    metrics_counter_add(&metrics->uring_fallbacks, 1);
+    handlers->handle(fd, request, len, &client);
+}
+
+static void on_recv(connection* c, int res, unsigned flags)
+{
+    c->pending--;
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (res > 0 && c->failed) { // what was still buffered when the deadline passed
+        recycle_buffer(bid);
+        res = 0;
+    }
+    if (res <= 0) {
+        if (res == -ENOBUFS && !c->failed) // every buffer is in use, try again once some are back
+            arm_recv(c);
+        else
+            conn_close(c);
+        return;
+    }
+
+    size_t n = (size_t)res < URING_REQUEST_MAX - c->request_len ? (size_t)res : URING_REQUEST_MAX - c->request_len;
+    size_t scan_from = c->request_len > 3 ? c->request_len - 3 : 0;
+    memcpy(c->request + c->request_len, buf_memory + (size_t)bid * URING_BUF_SIZE, n);
+    recycle_buffer(bid);
+    c->request_len += n;
+    c->request[c->request_len] = '\0';
+
+    // wait for the whole header block, so closing after the response doesn't
+    // reset it over unread headers; oversized headers go ahead as they are
+    if (!strstr(c->request + scan_from, "\r\n\r\n") && c->request_len < URING_REQUEST_MAX) {
+        arm_recv(c);
+        return;
+    }
+    char* eol = strstr(c->request, "\r\n");
+    if (!eol) {
+        conn_close(c); // no request line fits, not worth answering
+        return;
+    }
+
+    char line[URING_REQUEST_MAX + 1];
+    memcpy(line, c->request, eol - c->request);
+    line[eol - c->request] = '\0';
+    if (handlers->route_static(line, &c->resp) == 0)
+        start_static(c);
+    else
+        fallback(c);
+}
+
+static void on_step(connection* c, op_kind op, int res)
+{
+    c->pending--;
+    if (res < 0 || (op == OP_HEADER && (size_t)res != c->header_len) || (op == OP_SPLICE_IN && res == 0))
+        c->failed = 1; // a failed link cancels the rest of its chain
+    else if (op == OP_SPLICE_IN)
+        c->in_pipe += res;
+    else if (op == OP_SPLICE_OUT) {
+        c->in_pipe -= res;
+        c->offset += res;
+    }
+    if (c->pending > 0)
+        return;
+    if (!c->failed)
+        arm_deadline(c); // it made progress
+
+    if (c->failed)
+        finish_static(c);
+    else if (c->in_pipe > 0)
+        splice_out(c);
+    else if (c->offset < c->size) {
+        reserve(1);
+        splice_in(c, 0);
+    } else
+        finish_static(c);
+}
+
+// in a child forked from a handler: let go of the ring and of every
+// descriptor the loop owns except keep_fd, so other connections still close
+// when the loop is done with them
+void uring_detach(int keep_fd)
+{
+    for (int i = 0; i < URING_MAX_CONNS; i++) {
+        connection* c = &conns[i];
+        if (c->state != CONN_FREE && c->fd != keep_fd)
+            close(c->fd);
+        if (c->pipe[0] != -1) {
+            close(c->pipe[0]);
+            close(c->pipe[1]);
+        }
+    }
+    if (listen_sock != -1)
+        close(listen_sock);
+    ring_exit();
+}
+
+// run the event loop on listen_fd. Static files are served entirely through
+// the ring: multishot accept, receives into provided buffers, and a linked
+// file-update/send/splice chain per response. Everything else is handed to
+// ops->handle. Returns -1 if io_uring is unusable here, otherwise never.
+int uring_serve(int listen_fd, const uring_ops* ops)
+{
+    if (ring_init() == -1 || probe_ops() == -1 || buffers_init() == -1 || files_init() == -1) {
+        perror("Warning: io_uring unavailable, using the accept loop");
+        ring_exit();
+        return -1;
+    }
+
+    listen_sock = listen_fd;
+    handlers = ops;
+    timer_wheel_init(&wheel, timer_now_ms());
+    for (int i = URING_MAX_CONNS - 1; i >= 0; i--) {
+        conns[i].state = CONN_FREE;
+        conns[i].pipe[0] = conns[i].pipe[1] = -1;
+        free_conns[free_count++] = i;
+    }
+    signal(SIGPIPE, SIG_IGN); // a client hanging up mid-splice must not kill the loop
+    arm_accept();
+
+    int accepted = 0;
+    for (;;) {
+        if (submit(1) == -1 && errno != EBUSY && errno != EINTR) {
+            perror("Error: io_uring_enter failed");
+            continue;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & ring.cq_mask];
+            op_kind op = OP_OF(cqe->user_data);
+            connection* c = &conns[INDEX_OF(cqe->user_data)];
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            switch (op) {
+            case OP_IGNORE:
+                break;
+            case OP_ACCEPT:
+                if (res == -EINVAL && !accepted) { // no multishot accept on this kernel
+                    fprintf(stderr, "Warning: io_uring multishot accept unsupported, using the accept loop\n");
+                    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+                    ring_exit();
+                    return -1;
+                }
+                if (res >= 0) {
+                    accepted = 1;
+                    connection* nc = conn_alloc(res);
+                    if (nc)
+                        arm_recv(nc);
+                    else
+                        close(res); // at the connection limit
+                }
+                if (!(flags & IORING_CQE_F_MORE))
+                    arm_accept();
+                break;
+            case OP_RECV:
+                on_recv(c, res, flags);
+                break;
+            case OP_TICK:
+                tick_armed = 0;
+                break;
+            default:
+                on_step(c, op, res);
+                break;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        timer_wheel_advance(&wheel, timer_now_ms());
+        arm_tick();
+        if (ops->tick)
+            ops->tick();
+    }
+}
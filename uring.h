@@ -0,0 +1,40 @@
+#ifndef URING_H
+#define URING_H
+
+#include "metrics.h"
+#include <netinet/in.h>
+
+#define URING_ENTRIES 256 // submission queue size
+#define URING_MAX_CONNS 1024 // connections the loop tracks at once, also the registered file table size
+#define URING_BUF_COUNT 256 // provided receive buffers, must be a power of two
+#define URING_BUF_SIZE 2048
+#define URING_REQUEST_MAX 2048 // bytes buffered while looking for the end of the headers
+#define URING_SPLICE_CHUNK 65536 // one pipe's worth per splice
+#define URING_TICK_MS 500 // connection deadlines are checked at least this often
+
+// a static response the loop can send on its own: a header and a whole file
+typedef struct {
+    int file_fd; // owned by the caller (the fd cache), registered with the ring for the transfer
+    long size;
+    char header[256];
+    char path[REQUEST_PATH_MAX]; // for metrics and the access log
+} uring_static_response;
+
+typedef struct {
+    // decide from a copy of the request line whether the loop can serve it,
+    // 0 after filling resp, -1 to hand the connection to handle()
+    int (*route_static)(char* request, uring_static_response* resp);
+    // serve a connection the blocking way, given everything received so far
+    // (len bytes, NUL-terminated, starting with the request line); closes client_fd
+    void (*handle)(int client_fd, char* request, size_t len, const struct sockaddr_in* client);
+    // housekeeping after each batch of completions, may be NULL
+    void (*tick)(void);
+    int header_timeout_ms; // from accepting a connection to its last header, answered with 408
+    int idle_timeout_ms; // for each step of a response to make progress
+    int total_timeout_ms; // for the whole connection
+} uring_ops;
+
+int uring_serve(int listen_fd, const uring_ops* ops);
+void uring_detach(int keep_fd);
+
+#endif /* URING_H */
@@ -1,26 +1,42 @@
-#define _XOPEN_SOURCE 500 // required for sigaltstack and stack_t
+#define _XOPEN_SOURCE 500 // XSI extensions such as SA_RESTART
 
+#include "access_log.h"
+#include "admission.h"
+#include "analytics.h"
 #include "cache.h"
+#include "cache_snapshot.h"
+#include "device.h"
+#include "dir_listing.h"
+#include "disk_cache.h"
+#include "file_cache.h"
+#include "http2.h"
+#include "mail_queue.h"
+#include "metrics.h"
 #include "my_threads.h"
+#include "plugin.h"
+#include "prefork.h"
+#include "router.h"
+#include "singleflight.h"
+#include "tls.h"
+#include "upstream.h"
+#include "uring.h"
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <grp.h>
 #include <netinet/in.h>
-#include <pwd.h>
-#include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h> // Needed for sendfile on macOS
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -29,45 +45,44 @@
 #define EOL_SIZE 2
 #define MAX_PATH_LEN 500
 #define DEF_BUF_SIZE 512
-
-typedef struct {
-    char* ext;
-    char* mediatype;
-} extn;
-
-int sockfd, newsockfd;
+#define REQUEST_HEADER_MAX 8192 // request line plus headers
+#define HEADER_TIMEOUT_MS 10000 // to receive the request line and headers
+#define BODY_TIMEOUT_MS 30000 // to receive a request body, which is discarded
+#define IDLE_TIMEOUT_MS 30000 // for any single read or write to make progress
+#define REQUEST_TIMEOUT_MS 300000 // for the whole connection
+#define CGI_TIMEOUT_MS 30000 // before a CGI script is killed
+#define SIGINT_CHECK_MS 1000 // how often an idle threaded accept wakes up to notice Ctrl-C
+
+int sockfd = -1, newsockfd = -1;
+struct sockaddr_in client_addr;
 volatile sig_atomic_t sigint_received = 0;
 int is_cached;
 Cache* global_cache;
+metrics_request cur_req; // metrics for the request handled by this process/thread
+admission_ticket cur_ticket = { CLASS_NONE, -1 }; // route class slot held by that request
+tls_conn* cur_tls; // the connection's TLS session while the kernel carries it, NULL otherwise
+char device_socket_env[128]; // where CGI scripts reach the device process
 
-// Media types
-extn extensions[] = {
-    { "gif", "image/gif" },
-    { "gz", "image/gz" },
-    { "htm", "text/html" },
-    { "html", "text/html" },
-    { "ico", "image/ico" },
-    { "jpeg", "image/jpeg" },
-    { "jpg", "image/jpg" },
-    { "pdf", "application/pdf" },
-    { "php", "text/html" },
-    { "png", "image/png" },
-    { "rar", "application/octet-stream" },
-    { "tar", "image/tar" },
-    { "txt", "text/plain" },
-    { "zip", "application/octet-stream" }, // Note: Duplicate MIME type entries for 'zip'
-    { "cgi", "application/x-httpd-cgi" },
-    { 0, 0 } // End of array marker
-};
-
+// only flags Ctrl-C: the cleanup allocates, writes and takes the cache
+// lock, none of which is safe in a signal handler
 void sigint_handler(int signum)
 {
-    if (signum == SIGINT) {
-        printf("Exiting process and closing socket file descriptor %i.\n", sockfd);
-        close(sockfd);
-        close(newsockfd); // Parent doesn't need this socket
-        exit(EXIT_SUCCESS);
-    }
+    if (signum == SIGINT)
+        sigint_received = 1;
+}
+
+// after Ctrl-C, called from the serving loop between connections: stop
+// the workers, save the cache so the next start comes up warm, and exit
+void exit_on_sigint(void)
+{
+    if (!sigint_received)
+        return;
+    printf("Exiting process and closing socket file descriptor %i.\n", sockfd);
+    singleflight_cleanup();
+    prefork_stop();
+    cache_snapshot_save(global_cache);
+    close(sockfd);
+    exit(EXIT_SUCCESS);
 }
 
 // error wrapper which prints error and exits
@@ -77,6 +92,34 @@ void error(const char* msg)
     exit(EXIT_FAILURE);
 }
 
+// count a deadline that cut the current request short; phase names the
+// step that was running, for when its own deadline is the one that passed
+void count_timeout(metrics_timeout phase)
+{
+    int which = fiber_take_timeout();
+    if (which == -1)
+        return;
+    if (which == FIBER_TIMEOUT_TOTAL)
+        phase = TIMEOUT_REQUEST;
+    else if (which == FIBER_TIMEOUT_IDLE)
+        phase = TIMEOUT_IDLE;
+    metrics_counter_add(&metrics->timeouts[phase], 1);
+}
+
+// record metrics and queue the access log line for the current request
+void finish_request()
+{
+    admission_release(&cur_ticket);
+    if (cur_req.finished)
+        return;
+
+    count_timeout(TIMEOUT_IDLE); // a response write that stalled
+
+    uint64_t latency = metrics_now_us() - cur_req.start_us;
+    metrics_request_end(&cur_req);
+    access_log_write(&client_addr, cur_req.path, cur_req.status, cur_req.bytes, latency);
+}
+
 // get file size using lseek and returns file size in bytes, or -1 on error
 int get_file_size(int fd)
 {
@@ -98,54 +141,205 @@ int get_file_size(int fd)
 // send HTTP response over socked fd, print error on fail
 void send_http_res(int fd, char* msg)
 {
-    if (send(fd, msg, strlen(msg), 0) == -1) // Attempt to send the message
+    if (fiber_write_all(fd, msg, strlen(msg)) == -1) // Attempt to send the message
         perror("Error: failed to send HTTP response!\n");
 }
 
-// recieve data from socket in 1 byte increments until EOL sequence
-int recieve_until_EOL(int fd, char* buffer)
+// switch a client socket between deadline-aware non-blocking I/O and the
+// blocking I/O a CGI script writing to it expects
+void set_nonblocking(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1 && !!(flags & O_NONBLOCK) != on)
+        fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+// deadlines for a new connection: the whole request and every single wait
+void begin_deadlines(int fd)
+{
+    set_nonblocking(fd, 1);
+    fiber_set_timeout(FIBER_TIMEOUT_TOTAL, REQUEST_TIMEOUT_MS);
+    fiber_set_timeout(FIBER_TIMEOUT_IDLE, IDLE_TIMEOUT_MS);
+}
+
+// 408: the client was too slow to send its request
+void send_408(int fd)
+{
+    cur_req.status = 408;
+    send_http_res(fd, "HTTP/1.1 408 Request Timeout\r\nConnection: close\r\n\r\n");
+}
+
+// 503: the request's route class is overloaded, try again shortly
+void send_503(int fd)
+{
+    char res[128];
+    snprintf(res, sizeof(res), "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+        ADMISSION_RETRY_AFTER_S);
+    cur_req.status = 503;
+    send_http_res(fd, res);
+}
+
+// hold a slot of the route class for the rest of the request, waiting in
+// its queue if this process can; -1 after answering 503 when the class is
+// overloaded. In-process requests only wait when they run in a fiber.
+int admit(int client_fd, admission_class cls, int threaded)
+{
+    if (admission_acquire(cls, !threaded || fiber_running(), &cur_ticket) == 0)
+        return 0;
+    cur_req.route = cls == CLASS_STATIC ? ROUTE_STATIC : cls == CLASS_CACHED ? ROUTE_CACHED : ROUTE_CGI;
+    send_503(client_fd);
+    return -1;
+}
+
+// value of a request header, case-insensitively, NULL if absent
+static const char* find_header(const char* headers, const char* name)
+{
+    size_t len = strlen(name);
+    for (const char* p = strstr(headers, EOL); p && p[EOL_SIZE] != '\r'; p = strstr(p + EOL_SIZE, EOL)) {
+        if (strncasecmp(p + EOL_SIZE, name, len) == 0 && p[EOL_SIZE + len] == ':')
+            return p + EOL_SIZE + len + 1;
+    }
+    return NULL;
+}
+
+// whether a received head asks for HTTP/2, either by starting with the
+// connection preface or with an h2c upgrade of a request without a body;
+// fills h2 with what the connection needs to switch
+static int wants_http2(const char* head, size_t len, http2_start* h2)
 {
-    char* p = buffer; // used to traverse the buffer
-    int eol_matched = 0; // tracks number of consecutive EOL chars matched
+    const char* end = strstr(head, EOL EOL);
+    if (!end)
+        return 0;
+    end += 2 * EOL_SIZE;
 
-    while (recv(fd, p, 1, 0) > 0) { // recieve 1 byte at a time
-        if (*p == EOL[eol_matched]) { // check if current byte is EOL char
-            eol_matched++;
-            if (eol_matched == EOL_SIZE) { // check if full EOL sequence matched
-                *(p + 1 - EOL_SIZE) = '\0'; // terminate string before EOL sequence
-                return strlen(buffer); // return length of received string
+    if (strncmp(head, HTTP2_PREFACE_HEAD, strlen(HTTP2_PREFACE_HEAD)) == 0) {
+        h2->upgrade = 0;
+    } else {
+        const char* upgrade = find_header(head, "Upgrade");
+        const char* settings = find_header(head, "HTTP2-Settings");
+        const char* length = find_header(head, "Content-Length");
+        if (!upgrade || !settings || (length && strtol(length, NULL, 10) > 0))
+            return 0;
+        while (*upgrade == ' ')
+            upgrade++;
+        if (strncasecmp(upgrade, "h2c", 3) != 0 || (upgrade[3] != '\r' && upgrade[3] != ' ' && upgrade[3] != ','))
+            return 0;
+
+        const char* eol = strstr(head, EOL);
+        if (eol - head >= HTTP2_REQUEST_MAX)
+            return 0;
+        while (*settings == ' ')
+            settings++;
+        size_t settings_len = strcspn(settings, " \r");
+        if (settings_len >= HTTP2_SETTINGS_MAX)
+            return 0;
+        h2->upgrade = 1;
+        memcpy(h2->request, head, eol - head);
+        h2->request[eol - head] = '\0';
+        memcpy(h2->settings, settings, settings_len);
+        h2->settings[settings_len] = '\0';
+    }
+
+    h2->len = head + len - end < HTTP2_START_MAX ? (size_t)(head + len - end) : HTTP2_START_MAX;
+    memcpy(h2->data, end, h2->len);
+    return 1;
+}
+
+// receive the request line and headers within the header deadline, and
+// read past any body so closing the socket doesn't reset the response;
+// leaves the request line in request (DEF_BUF_SIZE bytes). Its length, 0 if
+// the client went away or sent too much, -1 after answering a timeout, -2
+// if the client switches to HTTP/2 (filling h2).
+int receive_request(int fd, char* request, http2_start* h2)
+{
+    char head[REQUEST_HEADER_MAX + 1];
+    size_t len = 0;
+    char* end = NULL;
+
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, HEADER_TIMEOUT_MS);
+    while (!end) {
+        if (len == REQUEST_HEADER_MAX)
+            return 0;
+        ssize_t n = tls_recv(cur_tls, fd, head + len, REQUEST_HEADER_MAX - len);
+        if (n <= 0) {
+            if (n == -1 && errno == ETIMEDOUT) {
+                count_timeout(TIMEOUT_HEADER);
+                send_408(fd);
+                return -1;
             }
-        } else
-            eol_matched = 0; // reset EOL match counter if no match
-        p++; // move to next byte in buffer
+            return 0;
+        }
+        size_t scan = len >= 3 ? len - 3 : 0; // the terminator may straddle reads
+        len += n;
+        head[len] = '\0';
+        end = strstr(head + scan, EOL EOL);
     }
+    if (wants_http2(head, len, h2)) {
+        fiber_set_timeout(FIBER_TIMEOUT_PHASE, 0);
+        return -2;
+    }
+
+    char* eol = strstr(head, EOL);
+    if (eol - head >= DEF_BUF_SIZE)
+        return 0;
+    memcpy(request, head, eol - head);
+    request[eol - head] = '\0';
+
+    // a GET has no use for a body, but it still has to be read off the socket
+    const char* length = find_header(head, "Content-Length");
+    long remaining = length ? strtol(length, NULL, 10) - (long)(head + len - (end + 2 * EOL_SIZE)) : 0;
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, BODY_TIMEOUT_MS);
+    while (remaining > 0) {
+        ssize_t n = tls_recv(cur_tls, fd, head, remaining < REQUEST_HEADER_MAX ? remaining : REQUEST_HEADER_MAX);
+        if (n <= 0) {
+            if (n == -1 && errno == ETIMEDOUT) {
+                count_timeout(TIMEOUT_BODY);
+                send_408(fd);
+                return -1;
+            }
+            return 0;
+        }
+        remaining -= n;
+    }
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, 0);
+    return eol - head;
+}
 
-    return 0; // return 0 if the connection is closed before EOL encountered
+// wait for a CGI script, killing it once the runtime deadline set when it
+// was forked passes; its wait status, -1 if it was killed
+int wait_cgi(pid_t pid)
+{
+    int wstatus = fiber_wait_child(pid);
+    if (wstatus == -1) {
+        count_timeout(TIMEOUT_CGI);
+        fprintf(stderr, "Error: CGI script timed out and was killed\n");
+    }
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, 0);
+    return wstatus;
 }
 
-// returns server root directory formatted as a string
+// returns server root directory formatted as a string, resolved once
 char* get_server_root_dir()
 {
+    static char fullPath[1024];
+    if (fullPath[0] != '\0')
+        return fullPath;
+
     char* basePath = getenv("WEBROOT_PATH");
     if (!basePath) { // ensure that WEBROOT_PATH is set
         fprintf(stderr, "The environment variable WEBROOT_PATH is not set.\n");
         exit(EXIT_FAILURE);
     }
 
-    static char fullPath[1024];
     snprintf(fullPath, sizeof(fullPath), "%s/", basePath);
-    return strdup(fullPath);
+    return fullPath;
 }
 
-void handle_cgi_script_req(char* script_path, char* query_str, int client_fd)
-{
-    // send initial HTTP 200 OK header to the client
-    send_http_res(client_fd, "HTTP/1.1 200 OK\nServer: Web Server in C\nConnection: close\n");
-
-    // redirect STDOUT to the client file descriptor to capture output from php-cgi
-    if (dup2(client_fd, STDOUT_FILENO) == -1)
-        error("Error: failed to redirect STDOUT!\n");
+static const char cgi_header[] = "HTTP/1.1 200 OK\nServer: Web Server in C\nConnection: close\n";
 
+// replace a forked process with the script, its output going to STDOUT
+static void exec_cgi(char* script_path, char* query_str)
+{
     // prepare environment for the CGI script
     char script_env[DEF_BUF_SIZE];
     char query_env[DEF_BUF_SIZE];
@@ -160,6 +354,7 @@ void handle_cgi_script_req(char* script_path, char* query_str, int client_fd)
         "REDIRECT_STATUS=true",
         "SERVER_PROTOCOL=HTTP/1.1",
         "REMOTE_HOST=127.0.0.1",
+        device_socket_env,
         NULL
     };
 
@@ -175,10 +370,180 @@ void handle_cgi_script_req(char* script_path, char* query_str, int client_fd)
     exit(EXIT_SUCCESS);
 }
 
-void handle_cgi_script_req_threaded(char* script_path, char* query_str, int client_fd)
+// run a script with its output going only to the single-flight record;
+// whether it succeeded
+static int record_cgi(char* script_path, char* query_str, singleflight_call* flight)
+{
+    int out[2];
+    if (pipe(out) == -1) {
+        perror("Error: failed to create CGI pipe");
+        return 0;
+    }
+    singleflight_write(flight, cgi_header, strlen(cgi_header));
+    uint64_t cgi_start = metrics_now_us();
+    pid_t p = fork();
+    if (p == 0) {
+        setpgid(0, 0); // so a timeout also ends whatever the script started
+        if (dup2(out[1], STDOUT_FILENO) == -1)
+            error("Error: failed to redirect STDOUT!\n");
+        close(out[0]);
+        close(out[1]);
+        exec_cgi(script_path, query_str);
+    }
+    close(out[1]);
+    if (p < 0) {
+        perror("Error: cannot fork to run CGI script!\n");
+        close(out[0]);
+        return 0;
+    }
+
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, CGI_TIMEOUT_MS);
+    char buffer[BUFFER_SIZE];
+    ssize_t n;
+    while ((n = fiber_read(out[0], buffer, sizeof(buffer))) > 0)
+        singleflight_write(flight, buffer, n);
+    close(out[0]);
+    int wstatus = wait_cgi(p);
+    metrics_observe(PHASE_CGI, metrics_now_us() - cgi_start);
+    return wstatus != -1 && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+}
+
+// run a script again for a response that went stale, in the process
+// singleflight_refresh started. Nobody waits on it: the output only
+// replaces the recorded response once the script has succeeded.
+static void refresh_cgi(char* script_path, char* query_str, admission_class cls, singleflight_call* flight)
+{
+    signal(SIGINT, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL); // the script is waited for here
+    fiber_detach();
+    fiber_set_timeout(FIBER_TIMEOUT_TOTAL, 0); // the request's deadlines aren't this run's
+    fiber_set_timeout(FIBER_TIMEOUT_IDLE, 0);
+
+    // it counts against the script's class like any other run of it
+    admission_ticket ticket;
+    int ok = admission_acquire(cls, 1, &ticket) == 0 && record_cgi(script_path, query_str, flight);
+    admission_release(&ticket);
+    singleflight_finish(flight, ok, 200);
+}
+
+// answer with a recorded run of a script; the request that first finds it
+// stale also starts the one background run that replaces it, and is still
+// sent the stale response straight away
+static void send_shared_cgi(char* script_path, char* query_str, int client_fd, admission_class cls, singleflight_call* flight)
+{
+    if (flight->refresh && singleflight_refresh(flight) == 0) {
+        refresh_cgi(script_path, query_str, cls, flight);
+        _exit(EXIT_SUCCESS);
+    }
+    cur_req.route = ROUTE_CGI;
+    cur_req.status = flight->status;
+    cur_req.bytes = singleflight_send(flight, client_fd);
+}
+
+// copy a coalesced CGI's output to the client and the single-flight record;
+// keeps recording if the client hangs up so waiting requests still get it
+static void relay_cgi_output(int pipe_fd, int client_fd, singleflight_call* flight)
+{
+    char buffer[BUFFER_SIZE];
+    ssize_t n;
+    int client_ok = 1;
+    while ((n = fiber_read(pipe_fd, buffer, sizeof(buffer))) > 0) {
+        singleflight_write(flight, buffer, n);
+        if (client_ok && fiber_write_all(client_fd, buffer, n) != n)
+            client_ok = 0;
+        else if (client_ok)
+            cur_req.bytes += n;
+    }
+}
+
+void handle_cgi_script_req(char* script_path, char* query_str, int client_fd, int coalesce_ms, int stale_ms, admission_class cls)
+{
+    // identical requests to a coalesced script share one run
+    singleflight_call flight;
+    singleflight_role role = SF_BYPASS;
+    char key[SINGLEFLIGHT_KEY_MAX];
+    if (coalesce_ms >= 0 && singleflight_key(key, sizeof(key), "cgi", script_path, query_str) == 0)
+        role = singleflight_begin(key, coalesce_ms, stale_ms, 0, &flight);
+
+    cur_req.route = ROUTE_CGI;
+    if (role == SF_SHARED) {
+        send_shared_cgi(script_path, query_str, client_fd, cls, &flight);
+        return;
+    }
+
+    // only runs of the script count against its class, shared responses don't
+    if (admit(client_fd, cls, 0) == -1) {
+        if (role == SF_LEADER)
+            singleflight_finish(&flight, 0, 0);
+        return;
+    }
+
+    // send initial HTTP 200 OK header to the client
+    send_http_res(client_fd, (char*)cgi_header);
+    cur_req.status = 200;
+
+    // the leader reads the script's output through a pipe to record it
+    int out[2];
+    if (role == SF_LEADER) {
+        singleflight_write(&flight, cgi_header, strlen(cgi_header));
+        if (pipe(out) == -1) {
+            perror("Error: failed to create CGI pipe");
+            singleflight_finish(&flight, 0, 0);
+            role = SF_BYPASS;
+        }
+    }
+
+    // run the script in a grandchild so this process can time it
+    if (role != SF_LEADER)
+        set_nonblocking(client_fd, 0); // the script writes to the socket itself
+    uint64_t cgi_start = metrics_now_us();
+    pid_t p = fork();
+    if (p < 0) {
+        perror("Error: cannot fork to run CGI script!\n");
+        if (role == SF_LEADER) {
+            close(out[0]);
+            close(out[1]);
+            singleflight_finish(&flight, 0, 0);
+        }
+        return;
+    }
+
+    if (p > 0) {
+        fiber_set_timeout(FIBER_TIMEOUT_PHASE, CGI_TIMEOUT_MS);
+        if (role == SF_LEADER) {
+            close(out[1]);
+            set_nonblocking(out[0], 1);
+            relay_cgi_output(out[0], client_fd, &flight);
+            close(out[0]);
+        }
+        int wstatus = wait_cgi(p);
+        metrics_observe(PHASE_CGI, metrics_now_us() - cgi_start);
+        if (role == SF_LEADER) // only a clean run is worth sharing
+            singleflight_finish(&flight, wstatus != -1 && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0, 200);
+        return;
+    }
+
+    setpgid(0, 0); // so a timeout also ends whatever the script started
+
+    // redirect STDOUT to the client file descriptor (or the leader's pipe) to capture output from php-cgi
+    if (dup2(role == SF_LEADER ? out[1] : client_fd, STDOUT_FILENO) == -1)
+        error("Error: failed to redirect STDOUT!\n");
+    if (role == SF_LEADER) {
+        close(out[0]);
+        close(out[1]);
+    }
+    exec_cgi(script_path, query_str);
+}
+
+void handle_cgi_script_req_threaded(char* script_path, char* query_str, int client_fd, admission_class cls)
 {
+    if (admit(client_fd, cls, 1) == -1)
+        return;
+
     // send initial HTTP 200 OK header to the client
-    send_http_res(client_fd, "HTTP/1.1 200 OK\nServer: Web Server in C\nConnection: close\n");
+    send_http_res(client_fd, (char*)cgi_header);
+    cur_req.route = ROUTE_CGI;
+    cur_req.status = 200;
 
     // prepare environment for the CGI script
     char script_env[DEF_BUF_SIZE];
@@ -194,6 +559,7 @@ void handle_cgi_script_req_threaded(char* script_path, char* query_str, int clie
         "REDIRECT_STATUS=true",
         "SERVER_PROTOCOL=HTTP/1.1",
         "REMOTE_HOST=127.0.0.1",
+        device_socket_env,
         NULL
     };
 
@@ -204,7 +570,11 @@ void handle_cgi_script_req_threaded(char* script_path, char* query_str, int clie
         }
     }
 
+    // the script writes to the socket directly and expects it to block
+    set_nonblocking(client_fd, 0);
+
     // Execute the CGI script
+    uint64_t cgi_start = metrics_now_us();
     int p = fork();
 
     if (p < 0) { // if failed to fork, close sockets and exit
@@ -213,6 +583,9 @@ void handle_cgi_script_req_threaded(char* script_path, char* query_str, int clie
     }
 
     if (p == 0) { // Handle child process
+        signal(SIGPIPE, SIG_DFL); // ignored by the fiber scheduler and the io_uring loop
+        setpgid(0, 0); // so a timeout also ends whatever the script started
+        alarm(CGI_TIMEOUT_MS / 1000 + 1); // survives exec, ends the script when nobody waits on it
         // redirect STDOUT to the client file descriptor to capture output
         if (dup2(client_fd, STDOUT_FILENO) == -1)
             error("Error: failed to redirect STDOUT!\n");
@@ -224,37 +597,18 @@ void handle_cgi_script_req_threaded(char* script_path, char* query_str, int clie
         exit(EXIT_SUCCESS); // Terminate child process
     }
 
-    close(client_fd);
-}
-
-// arranges resource locations, checks media type, serves files in web root, and sends HTTP error codes
-int transfer_file(int src_fd, int dest_fd)
-{
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read, bytes_written, total_bytes_written = 0;
-    while ((bytes_read = read(src_fd, buffer, BUFFER_SIZE)) > 0) {
-        bytes_written = write(dest_fd, buffer, bytes_read);
-        if (bytes_written <= 0) {
-            perror("Error: failed write\n");
-            return -1; // Exit on write error
-        }
-        total_bytes_written += bytes_written;
-    }
-    if (bytes_read == -1) {
-        perror("Error: failed read\n");
-        return -1; // Exit on read error
+    if (!fiber_running()) { // the io_uring loop and prefork workers can't wait, SIGALRM ends it
+        admission_hand_off(&cur_ticket, p); // the script keeps the slot while it runs
+        return;
     }
-    return total_bytes_written; // Return total bytes written
+    fiber_set_timeout(FIBER_TIMEOUT_PHASE, CGI_TIMEOUT_MS);
+    wait_cgi(p); // yields to the other connections meanwhile
+    metrics_observe(PHASE_CGI, metrics_now_us() - cgi_start);
 }
 
-// parse the HTTP request
-char* parse_HTTP_req(int fd, char* request)
+// pick the resource out of a request line that was already received
+char* parse_request_line(char* request)
 {
-    if (recieve_until_EOL(fd, request) == 0) {
-        printf("Receive Failed\n");
-        return NULL;
-    }
-
     char* ptr = strstr(request, " HTTP/");
     if (!ptr) {
         printf("NOT HTTP!\n");
@@ -282,19 +636,10 @@ char* resolve_req_resource(char* request, char* resource)
     return resource;
 }
 
-// Open Requested File
-int open_req_file(char* resource)
-{
-    int fd = open(resource, O_RDONLY);
-    if (fd == -1)
-        perror("File open error");
-
-    return fd;
-}
-
 // 404: Not found response
 void send_404(int fd)
 {
+    cur_req.status = 404;
     send_http_res(fd, "HTTP/1.1 404 Not Found\r\n");
     send_http_res(fd, "Server: Web Server in C\r\n\r\n");
     send_http_res(fd, "<html><head><title>404 Not Found</title></head><body><h2>Error 404: Not Found</h2></body></html>");
@@ -303,6 +648,7 @@ void send_404(int fd)
 // 501 response
 void send_501(int fd)
 {
+    cur_req.status = 501;
     send_http_res(fd, "HTTP/1.1 501 Not Implemented\r\n");
     send_http_res(fd, "Server: Web Server in C\r\n\r\n");
     send_http_res(fd, "<html><head><title>501 Not Implemented</title></head><body><h1>Error 501: Not Implemented</h1></body></html>");
@@ -311,225 +657,828 @@ void send_501(int fd)
 // get and return MIME type for requested file
 char* is_supported_type(const char* ext)
 {
-    for (int i = 0; extensions[i].ext; ++i) {
-        if (strcmp(ext, extensions[i].ext) == 0)
-            return extensions[i].mediatype;
+    return (char*)router_mime_type(ext);
+}
+
+// send a listing rendered in-process; ?format=json selects JSON over HTML
+void generate_dir_listing(const char* rel_dir, char* query, int client_fd)
+{
+    listing_format format = dir_listing_format(query);
+    size_t len;
+    char* body = dir_listing_render(rel_dir, format, &len);
+    if (!body) {
+        send_404(client_fd); // Send 404 if directory cannot be opened
+        return;
     }
-    return NULL;
+
+    send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
+    send_http_res(client_fd, format == LISTING_JSON ? "Content-Type: application/json\r\n\r\n" : "Content-Type: text/html\r\n\r\n");
+    cur_req.route = ROUTE_DIR;
+    cur_req.status = 200;
+
+    if (fiber_write_all(client_fd, body, len) == (ssize_t)len)
+        cur_req.bytes = len;
+    else
+        perror("Error: failed write\n");
+    free(body);
 }
 
-void generate_dir_listing(const char* directory, int client_fd)
+// function which parses the query string and removes it from the initial request
+void parse_query_string(const char* request, char* query_string)
 {
-    if (dup2(client_fd, STDOUT_FILENO) == -1)
-        error("Error: failed to redirect STDOUT!\n");
+    char* query_start = strchr(request, '?'); // find ? char indicating start of query string
+
+    // handle case where query string is present
+    if (query_start != NULL) {
+        strcpy(query_string, query_start + 1); // Copy the query string into query_string
+        *query_start = '\0'; // Remove the query string from the original request
+    } else
+        strcpy(query_string, "");
+}
+
+// serve the metrics registry in Prometheus text format
+void send_metrics(int client_fd, char* query)
+{
+    (void)query;
+    size_t len;
+    long cache_bytes = 0, cache_limit = 0;
+    int cache_entries = 0;
+
+    if (is_cached == 1) {
+        sem_wait(global_cache->mutex);
+        cache_bytes = global_cache->current_size;
+        cache_limit = global_cache->size_limit;
+        for (int i = 0; i < MAX_CACHE_ENTRIES; i++)
+            cache_entries += global_cache->entries[i].is_used;
+        sem_post(global_cache->mutex);
+    }
+
+    // this scrape is counted when it finishes, so it shows up in the next one
+    char* body = metrics_render(cache_bytes, cache_limit, cache_entries, &len);
+    if (!body) {
+        send_404(client_fd);
+        return;
+    }
 
     send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
-    send_http_res(client_fd, "Content-Type: text/plain\r\n\r\n");
+    send_http_res(client_fd, "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+    if (fiber_write_all(client_fd, body, len) == -1)
+        perror("Error: failed to send metrics!\n");
+    cur_req.route = ROUTE_METRICS;
+    cur_req.status = 200;
+    cur_req.bytes = len;
+    free(body);
+}
 
-    execlp("ls", "ls", "-a", "-l", directory, NULL);
-    exit(EXIT_SUCCESS);
+// copy the value of name=... from a query string, %XX and + decoded;
+// -1 if it is absent or too long
+static int query_value(const char* query, const char* name, char* out, size_t out_len)
+{
+    size_t name_len = strlen(name);
+    const char* p = query;
+    while (p && !(strncmp(p, name, name_len) == 0 && p[name_len] == '=')) {
+        p = strchr(p, '&');
+        if (p)
+            p++;
+    }
+    if (!p)
+        return -1;
+
+    size_t n = 0;
+    for (p += name_len + 1; *p && *p != '&'; p++) {
+        if (n + 1 == out_len)
+            return -1;
+        if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            char hex[3] = { p[1], p[2], '\0' };
+            out[n++] = (char)strtol(hex, NULL, 16);
+            p += 2;
+        } else {
+            out[n++] = *p == '+' ? ' ' : *p;
+        }
+    }
+    out[n] = '\0';
+    return 0;
 }
 
-// function to format the mode as a null terminated string
-void mode_to_str(mode_t mode, char str[])
+// the page shown after the email, reset and configure buttons, in the
+// style of the other pages
+static void send_result_page(int client_fd, const char* status, const char* image, const char* message, const char* button)
 {
-    str[0] = (S_ISDIR(mode)) ? 'd' : '-';
-    str[1] = (mode & S_IRUSR) ? 'r' : '-';
-    str[2] = (mode & S_IWUSR) ? 'w' : '-';
-    str[3] = (mode & S_IXUSR) ? 'x' : '-';
-    str[4] = (mode & S_IRGRP) ? 'r' : '-';
-    str[5] = (mode & S_IWGRP) ? 'w' : '-';
-    str[6] = (mode & S_IXGRP) ? 'x' : '-';
-    str[7] = (mode & S_IROTH) ? 'r' : '-';
-    str[8] = (mode & S_IWOTH) ? 'w' : '-';
-    str[9] = (mode & S_IXOTH) ? 'x' : '-';
-    str[10] = '\0'; // Null-terminate the string
+    char page[2048];
+    int len = snprintf(page, sizeof(page),
+        "<!DOCTYPE html>\n<html lang=\"en\">\n<head>\n<meta charset=\"UTF-8\">\n"
+        "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n<title>Document</title>\n<style>\n"
+        "#return-btn { border-radius: 3px; border: none; font-size: 22px; height: 40px; margin-left: 20px; background-color: #b8a79d;"
+        " padding-left: 20px; padding-right: 20px; cursor: pointer; }\n"
+        "#return-btn:hover { background-color: #746862; color: white; }\n"
+        "body { display: flex; align-items: center; justify-content: center; }\n.content { display: grid; }\n"
+        "img, h1, form { align-self: center; justify-self: center; margin: 24px; }\nimg { margin-top: 100px; }\n</style>\n</head>\n"
+        "<body>\n<div class=\"content\">\n<img src=\"../static/%s\" alt=\"status image\" width=\"300px\" height=\"300px\">\n<h1>%s</h1>\n"
+        "<form id=\"returnForm\">\n<input type=\"button\" id=\"return-btn\" value=\"%s\""
+        " onclick=\"window.location.href = '../cgi-bin/serial_com_html_res.cgi'\">\n</form>\n</div>\n</body>\n</html>\n",
+        image, message, button);
+
+    char head[128];
+    snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: text/html\r\nContent-Length: %d\r\n\r\n", status, len);
+    send_http_res(client_fd, head);
+    if (fiber_write_all(client_fd, page, len) == len)
+        cur_req.bytes = len;
+    cur_req.status = atoi(status);
 }
 
-// function to generate directory listing upon request
-void generate_dir_listing_threaded(const char* directory, int client_fd)
+// ?email=address&data=total: queue the current attendance plot for that
+// address and answer 202 once the job is on disk; the mail sender delivers
+// it in the background
+void send_email(int client_fd, char* query)
 {
-    DIR* dir;
-    struct dirent* entry;
-    struct stat file_stat;
+    char email[MAIL_ADDRESS_MAX + 1], data[32], message[512];
+    if (query_value(query, "email", email, sizeof(email)) == -1 || !mail_address_valid(email)) {
+        send_result_page(client_fd, "400 Bad Request", "xmark.png", "Error: Invalid Email Address Inputted", "Return");
+        return;
+    }
+    // the total is echoed into the page, so only a number is accepted
+    if (query_value(query, "data", data, sizeof(data)) == -1 || !data[0] || strspn(data, "0123456789-.") != strlen(data)) {
+        send_result_page(client_fd, "400 Bad Request", "xmark.png", "Error: Invalid Attendance Data", "Return");
+        return;
+    }
 
-    // try to open the directory for reading
-    if ((dir = opendir(directory)) == NULL) {
-        perror("Error: failed to open directory!\n");
-        send_404(client_fd); // Send 404 if directory cannot be opened
+    // the plot as it is now, not when the message finally goes out
+    char* plot = NULL;
+    const file_cache_entry* file = file_cache_get("static/attendance_plot.png");
+    if (file && S_ISREG(file->st.st_mode) && (plot = malloc(file->st.st_size)) != NULL
+        && pread(file->fd, plot, file->st.st_size, 0) != file->st.st_size) {
+        free(plot);
+        plot = NULL;
+    }
+
+    char text[128];
+    snprintf(text, sizeof(text), "Current attendance data: %s. View attachment to see plotted samples.", data);
+    mail_message msg = {
+        .from = MAIL_FROM_DEFAULT,
+        .to = email,
+        .subject = "Current Attendence Data",
+        .text = text,
+        .attachment_name = "attendance_plot.png",
+        .attachment_type = "image/png",
+        .attachment = plot,
+        .attachment_len = plot ? file->st.st_size : 0,
+    };
+    int queued = mail_queue_submit(&msg);
+    free(plot);
+    if (queued == -1) {
+        send_503(client_fd);
         return;
     }
 
-    // Send HTTP response headers
-    send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
-    send_http_res(client_fd, "Content-Type: text/plain\r\n\r\n");
+    snprintf(message, sizeof(message), "Data value %s will be sent to %s!", data, email);
+    send_result_page(client_fd, "202 Accepted", "checkmark.png", message, "Return");
+}
+
+// the page for a command the Arduino didn't carry out
+static void send_device_failure(int client_fd, device_result r, const char* detail)
+{
+    char message[256];
+    switch (r) {
+    case DEVICE_NAK:
+        snprintf(message, sizeof(message), "Error: The Arduino Refused the Command (%s)", detail);
+        send_result_page(client_fd, "400 Bad Request", "xmark.png", message, "Return");
+        break;
+    case DEVICE_TIMEOUT:
+        send_result_page(client_fd, "504 Gateway Timeout", "xmark.png", "Error: The Arduino Did Not Answer", "Return");
+        break;
+    case DEVICE_ABSENT:
+        send_result_page(client_fd, "503 Service Unavailable", "xmark.png", "Error: Cannot Find Arduino on Any ACM Port", "Return");
+        break;
+    default:
+        send_result_page(client_fd, "503 Service Unavailable", "xmark.png", "Error: The Arduino Is Busy, Try Again", "Return");
+        break;
+    }
+}
 
-    // read dir entries and send formatted directory listing
-    while ((entry = readdir(dir)) != NULL) {
-        char filepath[MAX_PATH_LEN];
-        snprintf(filepath, sizeof(filepath), "%s/%s", directory, entry->d_name);
+// ?opt=True|False: reset the counter and start a new live session; with
+// True the session that ended is added to the attendance history. Files
+// are only touched once the firmware acknowledged the reset.
+void reset_device(int client_fd, char* query)
+{
+    char opt[8] = "", detail[DEVICE_LINE_MAX], path[MAX_PATH_LEN];
+    query_value(query, "opt", opt, sizeof(opt));
 
-        if (stat(filepath, &file_stat) == -1) { // stat the current file
-            fprintf(stderr, "Error: failed to get stats for %s!\n", filepath);
-            continue; // Skip to the next entry
+    device_result r = device_command(NULL, "reset", detail, sizeof(detail));
+    if (r != DEVICE_OK) {
+        send_device_failure(client_fd, r, detail);
+        return;
+    }
+
+    // the device process closed the session on the ack and writes it out
+    if (strcmp(opt, "True") == 0 && device_command(NULL, "save", detail, sizeof(detail)) != DEVICE_OK)
+        fprintf(stderr, "Error: failed to save attendance session: %s\n", detail);
+    const char* live_files[] = { "static/live_data.txt", "static/live_time.txt" };
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s%s", get_server_root_dir(), live_files[i]);
+        if (truncate(path, 0) == -1 && errno != ENOENT)
+            perror("Error: failed to clear live data");
+    }
+    snprintf(path, sizeof(path), "%sstatic/live_plot.png", get_server_root_dir());
+    unlink(path);
+
+    send_result_page(client_fd, "200 OK", "checkmark.png", "Successfully Reset Attendance Counter", "Return");
+}
+
+// ?range=cm&delay=ms&total=n: reconfigure the door without restarting it
+void configure_device(int client_fd, char* query)
+{
+    const char* names[] = { "range", "delay", "total" };
+    char value[16], command[64], detail[DEVICE_LINE_MAX];
+    long values[3];
+    for (int i = 0; i < 3; i++) {
+        char* end;
+        if (query_value(query, names[i], value, sizeof(value)) == -1 || !value[0]
+            || (values[i] = strtol(value, &end, 10)) < 0 || *end) {
+            send_result_page(client_fd, "400 Bad Request", "xmark.png", "Error: Invalid Configuration Values", "Return");
+            return;
         }
+    }
 
-        char mode[11]; // size of mode string
-        mode_to_str(file_stat.st_mode, mode);
+    snprintf(command, sizeof(command), "config %ld %ld %ld", values[0], values[1], values[2]);
+    device_result r = device_command(NULL, command, detail, sizeof(detail));
+    if (r != DEVICE_OK) {
+        send_device_failure(client_fd, r, detail);
+        return;
+    }
+    send_result_page(client_fd, "200 OK", "checkmark.png", "Successfully Configured Attendance Counter", "View Data");
+}
 
-        char* time = ctime(&file_stat.st_mtime); // get formatted time from file stats
-        if (time[strlen(time) - 1] == '\n') // remove newline char if needed
-            time[strlen(time) - 1] = '\0';
+// ?cmd=status|stats|count|reset|config[&range=&delay=&total=][&device=name]:
+// the command channel for scripts, answered in plain text
+void send_device(int client_fd, char* query)
+{
+    char cmd[16] = "status", device[DEVICE_NAME_MAX] = "-", body[4096], detail[DEVICE_LINE_MAX];
+    query_value(query, "cmd", cmd, sizeof(cmd));
+    query_value(query, "device", device, sizeof(device));
+
+    int len = 0;
+    const char* code = "200 OK";
+    if (strcmp(cmd, "status") == 0) {
+        const device_status* d;
+        for (int i = 0; (d = device_slot(i)) != NULL && len < (int)sizeof(body) - 128; i++) {
+            int connected = __atomic_load_n(&d->connected, __ATOMIC_ACQUIRE);
+            uint64_t updated = __atomic_load_n(&d->updated_ms, __ATOMIC_ACQUIRE);
+            if (!connected)
+                len += snprintf(body + len, sizeof(body) - len, "%s absent\n", d->name);
+            else if (!updated)
+                len += snprintf(body + len, sizeof(body) - len, "%s connected pending=%d\n", d->name, d->pending);
+            else
+                len += snprintf(body + len, sizeof(body) - len, "%s connected pending=%d count=%lld\n", d->name, d->pending,
+                    (long long)__atomic_load_n(&d->count, __ATOMIC_RELAXED));
+        }
+    } else if (strcmp(cmd, "stats") == 0) {
+        // the open session and the one the last reset closed, per device
+        const device_status* d;
+        char line[ANALYTICS_LINE_MAX];
+        analytics_session session;
+        for (int i = 0; (d = device_slot(i)) != NULL && len < (int)sizeof(body) - 2 * (ANALYTICS_LINE_MAX + DEVICE_NAME_MAX + 16); i++) {
+            if (strcmp(device, "-") != 0 && strcmp(device, d->name) != 0)
+                continue;
+            if (__atomic_load_n(&d->updated_ms, __ATOMIC_ACQUIRE) && analytics_current(i, &session) == 0) {
+                analytics_format(&session, line, sizeof(line));
+                len += snprintf(body + len, sizeof(body) - len, "%s session %s\n", d->name, line);
+            }
+            if (analytics_last(i, &session) == 0) {
+                analytics_format(&session, line, sizeof(line));
+                len += snprintf(body + len, sizeof(body) - len, "%s last %s\n", d->name, line);
+            }
+        }
+    } else {
+        char command[64] = "";
+        if (strcmp(cmd, "count") == 0 || strcmp(cmd, "reset") == 0) {
+            snprintf(command, sizeof(command), "%s", cmd);
+        } else if (strcmp(cmd, "config") == 0) {
+            char r[16], d[16], t[16];
+            if (query_value(query, "range", r, sizeof(r)) == 0 && query_value(query, "delay", d, sizeof(d)) == 0
+                && query_value(query, "total", t, sizeof(t)) == 0 && r[0] && d[0] && t[0]
+                && strspn(r, "0123456789") == strlen(r) && strspn(d, "0123456789") == strlen(d) && strspn(t, "0123456789") == strlen(t))
+                snprintf(command, sizeof(command), "config %s %s %s", r, d, t);
+        }
+        device_result r = command[0] ? device_command(device, command, detail, sizeof(detail)) : DEVICE_ERROR;
+        if (!command[0])
+            code = "400 Bad Request";
+        else if (r == DEVICE_NAK)
+            code = "409 Conflict";
+        else if (r == DEVICE_TIMEOUT)
+            code = "504 Gateway Timeout";
+        else if (r != DEVICE_OK)
+            code = "503 Service Unavailable";
+        len = snprintf(body, sizeof(body), "%s%s%s\n", command[0] ? device_result_name(r) : "unknown command",
+            detail[0] && command[0] ? " " : "", command[0] ? detail : "");
+    }
 
-        // // Format and send directory entry in ls -l format
-        char dir_entry[DEF_BUF_SIZE]; // Adjust the buffer size as needed
-        snprintf(dir_entry, sizeof(dir_entry), "%s %ld %s %s %ld %s %s\n",
-            mode,
-            file_stat.st_nlink,
-            getpwuid(file_stat.st_uid)->pw_name,
-            getgrgid(file_stat.st_gid)->gr_name,
-            file_stat.st_size,
-            time,
-            entry->d_name);
+    char head[128];
+    snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n", code, len);
+    send_http_res(client_fd, head);
+    if (fiber_write_all(client_fd, body, len) == len)
+        cur_req.bytes = len;
+    cur_req.status = atoi(code);
+}
 
-        send_http_res(client_fd, dir_entry);
+// state for one proxied response: forwarded to the client as it arrives
+// and collected for the cache while it still fits
+typedef struct {
+    int client_fd;
+    int client_gone;
+    int answered; // a status line went to the client
+    const char* content_type;
+    char* body;
+    long len;
+    long limit;
+    int overflow;
+    singleflight_call* flight; // set when other requests wait for this response
+} proxy_state;
+
+static int proxy_headers(void* arg, const upstream_response* resp)
+{
+    proxy_state* state = arg;
+    char header[256];
+    if (resp->content_type[0])
+        snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n\r\n", resp->status, resp->reason, resp->content_type);
+    else
+        snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\n%s", resp->status, resp->reason, state->content_type);
+    send_http_res(state->client_fd, header);
+    state->answered = 1;
+    if (state->flight)
+        singleflight_write(state->flight, header, strlen(header));
+    cur_req.route = ROUTE_PROXY;
+    cur_req.status = resp->status;
+    return 0;
+}
+
+static int proxy_body(void* arg, const char* data, size_t len)
+{
+    proxy_state* state = arg;
+    if (state->flight)
+        singleflight_write(state->flight, data, len);
+
+    if (!state->client_gone) {
+        if (fiber_write_all(state->client_fd, data, len) == -1) {
+            perror("Error: failed write\n");
+            if (!state->flight)
+                return -1; // client went away, stop reading upstream
+            state->client_gone = 1; // keep reading for the requests waiting on us
+        } else
+            cur_req.bytes += len;
     }
 
-    closedir(dir); // close the directory
-    system("ls -l -a");
+    if (state->overflow)
+        return 0;
+    if (state->len + (long)len > state->limit) { // too large to cache, keep streaming
+        state->overflow = 1;
+        free(state->body);
+        state->body = NULL;
+        return 0;
+    }
+    char* grown = realloc(state->body, state->len + len);
+    if (!grown) {
+        state->overflow = 1;
+        return 0;
+    }
+    state->body = grown;
+    memcpy(state->body + state->len, data, len);
+    state->len += len;
+    return 0;
 }
 
-// function which parses the query string and removes it from the initial request
-void parse_query_string(const char* request, char* query_string)
+// fetch a ?server= resource, streaming it to the client and caching
+// complete 200 responses that fit
+int serve_proxy(Cache* cache, int client_fd, char* content_type, char* resource, char* query, char* short_file_path)
 {
-    char* query_start = strchr(request, '?'); // find ? char indicating start of query string
+    char host[UPSTREAM_HOST_MAX];
+    int port;
+    if (upstream_parse_target(query, host, sizeof(host), &port) == -1)
+        return -1;
 
-    // handle case where query string is present
-    if (query_start != NULL) {
-        strcpy(query_string, query_start + 1); // Copy the query string into query_string
-        *query_start = '\0'; // Remove the query string from the original request
-    } else
-        strcpy(query_string, "");
+    // concurrent misses for the same upstream resource share one fetch
+    char target[UPSTREAM_HOST_MAX + 16], key[SINGLEFLIGHT_KEY_MAX];
+    singleflight_call flight;
+    singleflight_role role = SF_BYPASS;
+    snprintf(target, sizeof(target), "%s:%d", host, port);
+    if (singleflight_key(key, sizeof(key), "proxy", target, short_file_path) == 0)
+        role = singleflight_begin(key, 0, 0, 0, &flight);
+    if (role == SF_SHARED) {
+        cur_req.route = ROUTE_PROXY;
+        cur_req.status = flight.status;
+        cur_req.bytes = singleflight_send(&flight, client_fd);
+        close(client_fd);
+        return 0;
+    }
+
+    long limit = disk_cache_max_object() > cache->size_limit ? disk_cache_max_object() : cache->size_limit;
+    proxy_state state = { .client_fd = client_fd, .content_type = content_type, .limit = limit };
+    state.flight = role == SF_LEADER ? &flight : NULL;
+    upstream_handler handler = { proxy_headers, proxy_body, &state };
+    upstream_response resp;
+
+    uint64_t phase_start = metrics_now_us();
+    int status = upstream_get(host, port, short_file_path, &resp, &handler);
+    metrics_observe(PHASE_SEND, metrics_now_us() - phase_start);
+    if (role == SF_LEADER)
+        singleflight_finish(&flight, status != -1 && resp.complete, status);
+    if (status == -1) {
+        free(state.body);
+        if (!state.answered)
+            return -1;
+        close(client_fd); // cut short after the status line, the client sees it end early
+        return 0;
+    }
+
+    if (status == 200 && resp.complete && !state.overflow) {
+        unsigned long id = cache_key(resource, query);
+        if (state.len > cache->small_object_max)
+            disk_cache_insert_buf(id, state.body, state.len);
+        else {
+            sem_wait(cache->mutex);
+            CacheEntry* entry = cache_lookup(cache, id); // another child may have filled it meanwhile
+            if (!entry)
+                entry = cache_insert(cache, id, state.body ? state.body : "", state.len);
+            if (entry)
+                cache_detach(entry);
+            sem_post(cache->mutex);
+        }
+    }
+    free(state.body);
+    close(client_fd);
+    return 0;
 }
 
-// The child thread will execute this function
-void handle_client_req_threaded(void* arg)
+// serve a large object from the disk tier; a local file is checked against
+// the copy first, and one that misses is copied in once the admission
+// filter has seen it before
+static int serve_disk_tier(int client_fd, char* content_type, char* resource, char* query, char* short_file_path)
 {
-    assert(arg == NULL);
-    // thread functionality here...
-    int client_fd = newsockfd;
+    unsigned long key = cache_key(resource, query);
+    const file_cache_entry* file = NULL;
+    if (query[0] == '\0' && !(file = file_cache_get(short_file_path + 1)))
+        return -1;
 
-    char request[DEF_BUF_SIZE];
+    disk_cache_ref ref;
+    if (disk_cache_acquire(key, file ? &file->st : NULL, &ref) == -1) {
+        if (!file)
+            return -1; // proxied objects are inserted by serve_proxy
+        if (!S_ISREG(file->st.st_mode) || disk_cache_insert_fd(key, file->fd, &file->st, &ref) == -1)
+            return -1;
+    }
+
+    send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
+    send_http_res(client_fd, content_type);
+    cur_req.route = query[0] == '\0' ? ROUTE_CACHED : ROUTE_PROXY;
+    cur_req.status = 200;
+
+    uint64_t phase_start = metrics_now_us();
+    cur_req.bytes = disk_cache_send(&ref, client_fd);
+    metrics_observe(PHASE_SEND, metrics_now_us() - phase_start);
+    disk_cache_release(&ref);
+    close(client_fd);
+    return 0;
+}
+
+// answer from the shared memory tier, the disk tier or the upstream server;
+// 0 once a response was started, even one cut short, and the socket closed,
+// -1 if nothing was written and the caller still has to respond
+int check_cache(Cache* cache, int client_fd, char* content_type, char* resource, char* query, char* short_file_path)
+{
+    // Check Cache
+    sem_wait(cache->mutex);
+
+    uint64_t phase_start = metrics_now_us();
+    CacheEntry* entry = fetch_file(cache, resource, query);
+    metrics_observe(PHASE_CACHE_LOOKUP, metrics_now_us() - phase_start);
+    if (entry != NULL) {
+        // our attachment keeps the segment alive even if it is evicted while
+        // we send, so the lock is not held across a send that may yield
+        char* content = entry->content;
+        long size = entry->size;
+        int attached = entry->shm_id != -1;
+        sem_post(cache->mutex);
+
+        send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
+        send_http_res(client_fd, content_type);
+        cur_req.route = query[0] == '\0' ? ROUTE_CACHED : ROUTE_PROXY;
+        cur_req.status = 200;
+        phase_start = metrics_now_us();
+
+        ssize_t written = fiber_write_all(client_fd, content, size);
+        if (attached)
+            shmdt(content);
+        if (written == -1)
+            perror("Error: failed write\n"); // the status line is out, so the request is still answered
+        else
+            cur_req.bytes = written;
+        close(client_fd);
+        metrics_observe(PHASE_SEND, metrics_now_us() - phase_start);
+        return 0;
+    }
+    sem_post(cache->mutex);
+
+    // then the disk tier for objects too large for shared memory
+    if (disk_cache_enabled() && serve_disk_tier(client_fd, content_type, resource, query, short_file_path) == 0)
+        return 0;
+
+    // proxied resources are fetched without holding the cache lock
+    if (query[0] != '\0')
+        return serve_proxy(cache, client_fd, content_type, resource, query, short_file_path);
+    return -1;
+}
+
+// the io_uring loop and workers without -t can't wait for a script or for
+// another request's run of it: they answer from a recorded response when
+// there is one, and leave anything else to a child of their own
+static void handle_coalesced_cgi_req(const route* r, char* query, int client_fd)
+{
+    singleflight_call flight;
+    char key[SINGLEFLIGHT_KEY_MAX];
+    if (singleflight_key(key, sizeof(key), "cgi", r->fs_path, query) == 0
+        && singleflight_begin(key, r->coalesce_ms, r->stale_ms, 1, &flight) == SF_SHARED) {
+        send_shared_cgi(r->fs_path, query, client_fd, r->admission, &flight);
+        return;
+    }
+
+    pid_t p = fork();
+    if (p == -1) {
+        perror("Error: cannot fork to run CGI script!\n");
+        return;
+    }
+    if (p > 0) {
+        cur_req.finished = 1; // the child ends and counts it
+        tls_detach(&cur_tls);
+        return;
+    }
+    uring_detach(client_fd);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL); // the script is waited for
+    handle_cgi_script_req(r->fs_path, query, client_fd, r->coalesce_ms, r->stale_ms, r->admission);
+    close(client_fd);
+    finish_request();
+    tls_finish(&cur_tls);
+    exit(EXIT_SUCCESS);
+}
+
+// a path that is not below the web root is only served as a proxied
+// request, one naming an upstream server while the cache is on
+static int is_proxied(const char* query)
+{
+    char host[UPSTREAM_HOST_MAX];
+    int port;
+    return is_cached == 1 && upstream_parse_target(query, host, sizeof(host), &port) == 0;
+}
+
+// whether an exact route serves the request itself; a proxied request for
+// one that serves files takes the resolve path, where the cache fetches it
+static int serves_exact(const route* r, const char* query)
+{
+    if (!r || !r->exact)
+        return 0;
+    return !is_proxied(query) || r->handler == HANDLER_CGI || r->handler == HANDLER_NATIVE || r->handler == HANDLER_PLUGIN;
+}
+
+// serve a request that matched an exact route: the handler, file path and
+// MIME type were all resolved at startup, and static files come out of the
+// fd cache so a warm request makes no open/stat calls at all
+void serve_exact_route(const route* r, int client_fd, char* query, char* short_file_path, int threaded)
+{
+    if (r->handler != HANDLER_CGI && admit(client_fd, r->admission, threaded) == -1)
+        return; // scripts are admitted once coalescing has had its say
+
+    switch (r->handler) {
+    case HANDLER_NATIVE:
+        r->native(client_fd, query);
+        return;
+    case HANDLER_PLUGIN: {
+        char remote[INET_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET, &client_addr.sin_addr, remote, sizeof(remote));
+        cur_req.route = ROUTE_PLUGIN;
+        cur_req.bytes = plugin_serve(r->plugin, client_fd, short_file_path, query, remote, &cur_req.status);
+        return;
+    }
+    case HANDLER_DIR:
+        generate_dir_listing(r->rel_path, query, client_fd);
+        return;
+    case HANDLER_CGI:
+        if (!threaded || (r->coalesce_ms >= 0 && fiber_running()))
+            handle_cgi_script_req(r->fs_path, query, client_fd, r->coalesce_ms, r->stale_ms, r->admission);
+        else if (r->coalesce_ms >= 0)
+            handle_coalesced_cgi_req(r, query, client_fd);
+        else
+            handle_cgi_script_req_threaded(r->fs_path, query, client_fd, r->admission);
+        return;
+    case HANDLER_CACHED_STATIC:
+    case HANDLER_STATIC:
+        break;
+    }
+
+    char content_type[100];
+    snprintf(content_type, sizeof(content_type), "Content-Type: %s\r\n\r\n", r->mime_type);
+
+    if (r->handler == HANDLER_CACHED_STATIC && check_cache(global_cache, client_fd, content_type, r->fs_path, query, short_file_path) == 0)
+        return;
+
+    const file_cache_entry* file = file_cache_get(r->rel_path);
+    if (!file) { // removed since startup
+        send_404(client_fd);
+        return;
+    }
+
+    // Send 200 OK response
+    send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
+    send_http_res(client_fd, content_type);
+    cur_req.route = ROUTE_STATIC;
+    cur_req.status = 200;
+
+    // Transfer File Content
+    uint64_t phase_start = metrics_now_us();
+    cur_req.bytes = file_cache_send(file, client_fd);
+    metrics_observe(PHASE_SEND, metrics_now_us() - phase_start);
+}
+
+// serve a received request line in this process, closes client_fd
+void serve_request_threaded(int client_fd, char* request, uint64_t phase_start)
+{
     char resource[DEF_BUF_SIZE];
     char query[DEF_BUF_SIZE] = { 0 };
     char* requested_resource;
 
     // Parse HTTP Request
-    if (!(requested_resource = parse_HTTP_req(client_fd, request))) {
+    if (!request[0] || !(requested_resource = parse_request_line(request))) {
         send_404(client_fd);
         goto jump;
     }
+    metrics_observe(PHASE_PARSE, metrics_now_us() - phase_start);
+
+    snprintf(cur_req.path, sizeof(cur_req.path), "%.*s", (int)sizeof(cur_req.path) - 1, requested_resource); // the log keeps the start of a long path
 
     // extract the query string from the request
     parse_query_string(request, query);
 
-    printf("Client requested %s\n", request);
+    // Look up the route compiled at startup
+    phase_start = metrics_now_us();
+    const route* r = router_lookup(requested_resource);
+    if (serves_exact(r, query)) {
+        metrics_observe(PHASE_RESOLVE, metrics_now_us() - phase_start);
+        serve_exact_route(r, client_fd, query, requested_resource, 1);
+        goto jump;
+    }
 
     // Resolve Requested Resource
     if (!resolve_req_resource(requested_resource, resource))
         goto jump;
 
-    // Check if the requested resource is a directory
-    struct stat path_stat;
-    if (stat(resource, &path_stat) == 0) {
-        if (S_ISDIR(path_stat.st_mode)) {
-            generate_dir_listing_threaded(resource, client_fd); // Generate and send directory listing
-            goto jump;
-        }
-    } else {
+    // Look the file up relative to the web root, which also refuses ".."
+    const file_cache_entry* file = file_cache_get(requested_resource + 1);
+    if (!file && !is_proxied(query)) {
         send_404(client_fd);
         goto jump;
     }
+    if (file && S_ISDIR(file->st.st_mode)) {
+        if (admit(client_fd, CLASS_STATIC, 1) == 0)
+            generate_dir_listing(requested_resource + 1, query, client_fd); // Generate and send directory listing
+        goto jump;
+    }
 
     // Check if the requested file extension corresponds to a supported MIME type
     char* ext = strrchr(resource, '.');
-    char* mime_type = is_supported_type(ext + 1);
-    if (ext && mime_type == NULL) { // Send 404 response due to type not being supported
+    char* mime_type = ext ? is_supported_type(ext + 1) : NULL;
+    if (mime_type == NULL) { // Send 404 response due to type not being supported
         send_404(client_fd);
         goto jump;
     }
 
-    // Check if the requested file exists
-    if (access(resource, F_OK) == -1) {
-        send_404(client_fd); // Send 404 if file doesn't exist
+    char content_type[50];
+    sprintf(content_type, "Content-Type: %s\r\n\r\n", mime_type);
+
+    if (!file) { // proxied through ?server=, the pooled upstream connection outlives the request here
+        metrics_observe(PHASE_RESOLVE, metrics_now_us() - phase_start);
+        if (admit(client_fd, CLASS_CACHED, 1) == -1)
+            goto jump;
+        if (check_cache(global_cache, client_fd, content_type, resource, query, requested_resource) == 0) {
+            finish_request(); // check_cache closed the client socket
+            return;
+        }
+        send_404(client_fd);
         goto jump;
     }
 
     if (strcmp(ext, ".cgi") == 0) {
-        handle_cgi_script_req_threaded(resource, query, client_fd);
+        metrics_observe(PHASE_RESOLVE, metrics_now_us() - phase_start);
+        handle_cgi_script_req_threaded(resource, query, client_fd, CLASS_CGI);
         goto jump;
     }
-
-    // Open Requested File
-    int file_fd = open_req_file(resource);
-    if (file_fd == -1) { // Send 404 Not Found response
+    metrics_observe(PHASE_RESOLVE, metrics_now_us() - phase_start);
+    if (admit(client_fd, CLASS_STATIC, 1) == -1)
+        goto jump;
+    // other fibers ran while this one waited for a slot, and may have reused the entry
+    if (!(file = file_cache_get(requested_resource + 1))) {
         send_404(client_fd);
         goto jump;
     }
 
-    char content_type[50];
-    sprintf(content_type, "Content-Type: %s\r\n\r\n", mime_type);
-
     // Send 200 OK response
     send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
     send_http_res(client_fd, content_type);
+    cur_req.route = ROUTE_STATIC;
+    cur_req.status = 200;
 
     // Transfer File Content
-    transfer_file(file_fd, client_fd);
+    phase_start = metrics_now_us();
+    cur_req.bytes = file_cache_send(file, client_fd);
+    metrics_observe(PHASE_SEND, metrics_now_us() - phase_start);
 
 jump:
-    // Close file descriptors
-    close(file_fd);
+    // Close the client socket, file descriptors belong to the fd cache
     close(client_fd);
+    finish_request();
 }
 
-int check_cache(Cache* cache, int client_fd, char* content_type, char* resource, char* query, char* short_file_path)
+// give this process a fiber scheduler, the caller becomes its main fiber
+static int start_fibers(void)
 {
-    // Check Cache
-    sem_wait(cache->mutex);
+    if (fiber_init() == -1)
+        return -1;
+    fiber_local(&newsockfd, sizeof(newsockfd));
+    fiber_local(&client_addr, sizeof(client_addr));
+    fiber_local(&cur_req, sizeof(cur_req));
+    fiber_local(&cur_ticket, sizeof(cur_ticket));
+    fiber_local(&cur_tls, sizeof(cur_tls));
+    return 0;
+}
 
-    CacheEntry* entry = fetch_file(cache, resource, query, short_file_path);
-    if (entry != NULL) {
-        send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
-        send_http_res(client_fd, content_type);
+// one HTTP/2 stream, served like a connection of its own in its fiber
+static void serve_stream(int fd, char* request)
+{
+    metrics_stream_begin(&cur_req);
+    begin_deadlines(fd);
+    serve_request_threaded(fd, request, metrics_now_us());
+}
 
-        char buffer[BUFFER_SIZE];
-        ssize_t bytes_read, bytes_written, total_bytes_written = 0;
-        int count = 0;
-        while (count * BUFFER_SIZE < entry->size) {
+static const http2_ops http2_handlers = { serve_stream };
 
-            if (BUFFER_SIZE < entry->size - count * BUFFER_SIZE) {
-                bytes_read = BUFFER_SIZE;
-            } else {
-                bytes_read = entry->size - count * BUFFER_SIZE;
-            }
+// serve a connection that switched to HTTP/2, its streams run in fibers.
+// A process that has no scheduler gets one if the connection is all it
+// serves, otherwise (the io_uring loop, workers without -t) the connection
+// moves to a child of its own. Leaves client_fd to the caller.
+static void serve_http2(int client_fd, const http2_start* h2, int own_process)
+{
+    if (!tls_kernel_reads(cur_tls)) // every frame would have to go through OpenSSL
+        return;
+    if (!fiber_running() && !own_process) {
+        pid_t p = fork();
+        if (p == -1) {
+            perror("Error: cannot fork to serve HTTP/2 connection!\n");
+            return;
+        }
+        if (p > 0) {
+            cur_req.finished = 1; // the child ends and counts it
+            tls_detach(&cur_tls); // and the TLS session
+            return;
+        }
+        uring_detach(client_fd);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL); // its CGI scripts are waited for
+        serve_http2(client_fd, h2, 1);
+        exit(EXIT_SUCCESS);
+    }
+    if (!fiber_running() && start_fibers() == -1)
+        return;
+    http2_serve(client_fd, h2, &http2_handlers);
+    metrics_connection_end(&cur_req);
+}
 
-            memcpy(buffer, entry->content + count * BUFFER_SIZE, BUFFER_SIZE);
+// The child thread will execute this function
+void handle_client_req_threaded(void* arg)
+{
+    assert(arg == NULL);
+    // thread functionality here...
+    char request[DEF_BUF_SIZE];
+    http2_start h2;
 
-            bytes_written = write(client_fd, buffer, bytes_read);
-            if (bytes_written <= 0) {
-                perror("Error: failed write\n");
-                return -1; // Exit on write error
-            }
-            total_bytes_written += bytes_written;
-            count++;
-        }
-        close(client_fd);
-        sem_post(cache->mutex);
-        return 0;
+    metrics_request_begin(&cur_req);
+    begin_deadlines(newsockfd);
+    if (tls_enabled() && (newsockfd = tls_accept(newsockfd, &cur_tls)) == -1) {
+        finish_request();
+        return;
     }
-    sem_post(cache->mutex);
-    return -1;
+    uint64_t phase_start = metrics_now_us();
+    int received = receive_request(newsockfd, request, &h2);
+    if (received == -2)
+        serve_http2(newsockfd, &h2, 0);
+    if (received < 0) { // timed out and already answered, or done with HTTP/2
+        close(newsockfd);
+        finish_request();
+        tls_finish(&cur_tls);
+        return;
+    }
+    if (received == 0) {
+        printf("Receive Failed\n");
+        request[0] = '\0';
+    }
+    serve_request_threaded(newsockfd, request, phase_start);
+    tls_finish(&cur_tls);
 }
 
 // Function to handle client requests
@@ -539,49 +1488,78 @@ int handle_client_req(int client_fd)
     char resource[DEF_BUF_SIZE];
     char query[DEF_BUF_SIZE] = { 0 };
     char* requested_resource;
+    http2_start h2;
+    uint64_t phase_start = metrics_now_us();
     // Parse HTTP Request
-    if (!(requested_resource = parse_HTTP_req(client_fd, request))) {
-        send_404(client_fd);
+    int received = receive_request(client_fd, request, &h2);
+    if (received == -2) {
+        serve_http2(client_fd, &h2, 1); // this child serves only this connection
+        close(client_fd);
+        return 0;
+    }
+    if (received <= 0 || !(requested_resource = parse_request_line(request))) {
+        if (received == 0)
+            printf("Receive Failed\n");
+        if (received != -1) // a timed out client already got its 408
+            send_404(client_fd);
         return -1;
     }
+    metrics_observe(PHASE_PARSE, metrics_now_us() - phase_start);
+
+    snprintf(cur_req.path, sizeof(cur_req.path), "%.*s", (int)sizeof(cur_req.path) - 1, requested_resource); // the log keeps the start of a long path
 
     // extract the query string from the request
     parse_query_string(request, query);
 
-    printf("Client requested %s\n", request);
+    // Look up the route compiled at startup
+    phase_start = metrics_now_us();
+    const route* r = router_lookup(requested_resource);
+    if (serves_exact(r, query)) {
+        metrics_observe(PHASE_RESOLVE, metrics_now_us() - phase_start);
+        serve_exact_route(r, client_fd, query, requested_resource, 0);
+        close(client_fd);
+        return 0;
+    }
 
     // Resolve Requested Resource
     if (!resolve_req_resource(requested_resource, resource))
         return -1;
 
-    // Check if the requested resource is a directory
-    struct stat path_stat;
-    if (stat(resource, &path_stat) == 0) {
-        if (S_ISDIR(path_stat.st_mode)) {
-            generate_dir_listing(resource, client_fd); // generate and send directory listing to client
+    // Look the file up relative to the web root, which also refuses ".."; a
+    // missing file is only acceptable for a proxied request
+    const file_cache_entry* file = file_cache_get(requested_resource + 1);
+    if (file) {
+        if (S_ISDIR(file->st.st_mode)) {
+            if (admit(client_fd, CLASS_STATIC, 0) == -1)
+                return -1;
+            generate_dir_listing(requested_resource + 1, query, client_fd); // generate and send directory listing to client
             return 0;
         }
-    } else if (query[0] == '\0') {
+    } else if (!is_proxied(query)) {
         send_404(client_fd);
         return -1;
     }
 
     // Check if the requested file extension corresponds to a supported MIME type
     char* ext = strrchr(resource, '.');
-    char* mime_type = is_supported_type(ext + 1);
-    if (ext && mime_type == NULL) { // Send 404 response due to type not being supported
+    char* mime_type = ext ? is_supported_type(ext + 1) : NULL;
+    if (mime_type == NULL) { // Send 404 response due to type not being supported
         send_404(client_fd);
         return -1;
     }
 
+    metrics_observe(PHASE_RESOLVE, metrics_now_us() - phase_start);
+
     if (strcmp(ext, ".cgi") == 0) {
-        handle_cgi_script_req(resource, query, client_fd);
+        handle_cgi_script_req(resource, query, client_fd, -1, 0, CLASS_CGI);
         return 0;
     }
 
     char content_type[50];
     sprintf(content_type, "Content-Type: %s\r\n\r\n", mime_type);
 
+    if (admit(client_fd, is_cached == 1 ? CLASS_CACHED : CLASS_STATIC, 0) == -1)
+        return -1;
     if (is_cached == 1) {
         int valid = check_cache(global_cache, client_fd, content_type, resource, query, requested_resource);
         if (valid == 0) {
@@ -589,9 +1567,7 @@ int handle_client_req(int client_fd)
         }
     }
 
-    // Open Requested File
-    int file_fd = open_req_file(resource);
-    if (file_fd == -1) { // Send 404 Not Found response
+    if (!file) { // Send 404 Not Found response
         send_404(client_fd);
         return -1;
     }
@@ -599,26 +1575,209 @@ int handle_client_req(int client_fd)
     // Send 200 OK response
     send_http_res(client_fd, "HTTP/1.1 200 OK\r\n");
     send_http_res(client_fd, content_type);
+    cur_req.route = ROUTE_STATIC;
+    cur_req.status = 200;
 
     // Transfer File Content
-    transfer_file(file_fd, client_fd);
+    phase_start = metrics_now_us();
+    cur_req.bytes = file_cache_send(file, client_fd);
+    metrics_observe(PHASE_SEND, metrics_now_us() - phase_start);
 
-    // Close file descriptors
-    close(file_fd);
     close(client_fd);
 
     return 0;
 }
 
+#ifndef WEBSERV_NO_MAIN // main and the serving modes it sets up; the microbenchmarks link the server in without them
+
+// keep the descriptors of routed static files open before the first fork
+static void preload_route(const route* r)
+{
+    if (r->exact && (r->handler == HANDLER_STATIC || r->handler == HANDLER_CACHED_STATIC))
+        file_cache_get(r->rel_path);
+}
+
+// static files the io_uring loop can send by itself: exact static routes
+// and plain files below the web root, requested without a query string
+static int uring_route_static(char* request, uring_static_response* resp)
+{
+    if (strlen(request) >= DEF_BUF_SIZE || !strstr(request, " HTTP/"))
+        return -1;
+    char* requested_resource = parse_request_line(request);
+    if (!requested_resource || strchr(requested_resource, '?'))
+        return -1;
+
+    const route* r = router_lookup(requested_resource);
+    const file_cache_entry* file;
+    const char* mime_type;
+    if (r && r->exact) {
+        if (r->handler != HANDLER_STATIC && r->handler != HANDLER_CACHED_STATIC)
+            return -1;
+        if (admission_get_limits(r->admission)->limit)
+            return -1; // the handlers queue it under its class's limit
+        file = file_cache_get(r->rel_path);
+        mime_type = r->mime_type;
+    } else {
+        char* ext = strrchr(requested_resource, '.');
+        if (!ext || strcmp(ext, ".cgi") == 0 || !(mime_type = is_supported_type(ext + 1)))
+            return -1;
+        if (admission_get_limits(CLASS_STATIC)->limit)
+            return -1;
+        file = file_cache_get(requested_resource + 1);
+    }
+    if (!file || !S_ISREG(file->st.st_mode))
+        return -1;
+
+    resp->file_fd = file->fd;
+    resp->size = file->st.st_size;
+    snprintf(resp->header, sizeof(resp->header), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n\r\n", mime_type);
+    snprintf(resp->path, sizeof(resp->path), "%s", requested_resource);
+    return 0;
+}
+
+// everything else the io_uring loop passes back is served by a child of
+// its own: the handlers block on the client, and one that reads slowly
+// would stall every connection on the ring
+static void uring_handle(int client_fd, char* request, size_t len, const struct sockaddr_in* client)
+{
+    http2_start h2;
+    newsockfd = client_fd;
+    client_addr = *client;
+    pid_t p = fork();
+    if (p == -1) {
+        perror("Error: cannot fork to serve request!\n");
+        send_503(client_fd);
+        close(client_fd);
+        return;
+    }
+    if (p > 0) {
+        close(client_fd);
+        return;
+    }
+    uring_detach(client_fd);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL); // its CGI scripts are waited for
+
+    metrics_request_begin(&cur_req);
+    begin_deadlines(client_fd); // the loop already has the headers
+    if (wants_http2(request, len, &h2)) {
+        serve_http2(client_fd, &h2, 1);
+        close(client_fd);
+        finish_request();
+        exit(EXIT_SUCCESS);
+    }
+    request[strcspn(request, EOL)] = '\0';
+    request[DEF_BUF_SIZE - 1] = '\0'; // the handlers' buffers are this size
+    serve_request_threaded(client_fd, request, metrics_now_us());
+    exit(EXIT_SUCCESS);
+}
+
+static int is_worker = 0;
+
+static void uring_tick(void)
+{
+    file_cache_poll();
+    if (!is_worker) {
+        exit_on_sigint();
+        cache_snapshot_tick(global_cache);
+    }
+}
+
+static const uring_ops uring_handlers = {
+    .route_static = uring_route_static,
+    .handle = uring_handle,
+    .tick = uring_tick,
+    .header_timeout_ms = HEADER_TIMEOUT_MS,
+    .idle_timeout_ms = IDLE_TIMEOUT_MS,
+    .total_timeout_ms = REQUEST_TIMEOUT_MS,
+};
+
+static int worker_serve(int listen_fd)
+{
+    return uring_serve(listen_fd, &uring_handlers);
+}
+
+// threaded mode: every connection gets a fiber, which yields to the others
+// whenever its socket would block; returns only if the scheduler can't start
+static int serve_threaded(int listen_fd)
+{
+    if (start_fibers() == -1)
+        return -1;
+
+    set_nonblocking(listen_fd, 1);
+    fiber_set_timeout(FIBER_TIMEOUT_IDLE, SIGINT_CHECK_MS);
+
+    for (;;) {
+        socklen_t client_addr_len = sizeof(client_addr);
+        if ((newsockfd = fiber_accept(listen_fd, (struct sockaddr*)&client_addr, &client_addr_len)) < 0) {
+            if (errno == ETIMEDOUT) { // nobody connected for a while
+                fiber_take_timeout();
+                if (!is_worker)
+                    exit_on_sigint();
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) { // let open connections finish first
+                fiber_yield();
+                continue;
+            }
+            perror("Error: failed to accept client request!\n");
+            return -1;
+        }
+        file_cache_poll(); // drop descriptors of files changed on disk
+        if (!is_worker) {
+            exit_on_sigint();
+            cache_snapshot_tick(global_cache);
+        }
+        create_thread(handle_client_req_threaded);
+    }
+}
+
+// prefork workers take over the fd cache's change notifications
+static void worker_init(int index)
+{
+    (void)index;
+    is_worker = 1;
+    file_cache_adopt();
+}
+
+// prefork workers serve each connection in-process, as threaded mode does
+static void worker_handle(int client_fd, const struct sockaddr_in* client)
+{
+    newsockfd = client_fd;
+    client_addr = *client;
+    file_cache_poll();
+    handle_client_req_threaded(NULL);
+}
+
+static void master_tick(void)
+{
+    exit_on_sigint();
+    cache_snapshot_tick(global_cache);
+}
+
 int main(int argc, char* argv[])
 {
     int port_num;
     int opt = 1; // must be non-zero value
     pid_t p;
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_in server_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
-    if (signal(SIGINT, sigint_handler) == SIG_ERR) // set up signal handler to close socket on exit
+    // set up signal handler to close socket on exit; without SA_RESTART, so a
+    // blocking accept returns and the loop gets to act on it
+    struct sigaction interrupt;
+    memset(&interrupt, 0, sizeof(interrupt));
+    interrupt.sa_handler = sigint_handler;
+    if (sigaction(SIGINT, &interrupt, NULL) == -1)
+        error("Error setting up signal handler!\n");
+
+    // collect finished children (connections, threaded-mode CGIs) as they exit
+    struct sigaction reap;
+    memset(&reap, 0, sizeof(reap));
+    reap.sa_handler = prefork_reap;
+    reap.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&reap.sa_mask);
+    if (sigaction(SIGCHLD, &reap, NULL) == -1)
         error("Error setting up signal handler!\n");
 
     if (argc < 2) // check number of command line args
@@ -627,9 +1786,19 @@ int main(int argc, char* argv[])
     int c;
     char* port_str = NULL;
     char* cache_size_str = NULL;
+    char* access_log_path = "-";
+    char* routes_path = NULL;
+    char* disk_size_str = NULL;
+    char* mail_relay = MAIL_RELAY_DEFAULT;
+    char* device_paths[DEVICE_MAX];
+    int device_path_count = 0;
     int is_threaded = 0;
+    int worker_count = 0;
+    int use_uring = 0;
+    char* tls_cert = NULL;
+    char* tls_key = NULL;
 
-    while ((c = getopt(argc, argv, "p:c:t")) != -1) {
+    while ((c = getopt(argc, argv, "p:c:tl:r:d:w:um:s:T:K:")) != -1) {
         switch (c) {
         case 'p':
             port_str = optarg;
@@ -641,9 +1810,40 @@ int main(int argc, char* argv[])
         case 't':
             is_threaded = 1;
             break;
+        case 'l':
+            access_log_path = optarg;
+            break;
+        case 'r':
+            routes_path = optarg;
+            break;
+        case 'd':
+            disk_size_str = optarg;
+            break;
+        case 'w':
+            worker_count = atoi(optarg);
+            if (worker_count < 1 || worker_count > PREFORK_MAX_WORKERS)
+                error("Error: invalid worker count, must be in the range 1-64");
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'm':
+            mail_relay = optarg;
+            break;
+        case 's':
+            if (device_path_count == DEVICE_MAX)
+                error("Error: too many serial devices, at most 10");
+            device_paths[device_path_count++] = optarg;
+            break;
+        case 'T':
+            tls_cert = optarg;
+            break;
+        case 'K':
+            tls_key = optarg;
+            break;
 
         case '?':
-            if (optopt == 'c' || optopt == 'p')
+            if (optopt == 'c' || optopt == 'p' || optopt == 'l' || optopt == 'r' || optopt == 'd' || optopt == 'w' || optopt == 'm' || optopt == 's' || optopt == 'T' || optopt == 'K')
                 printf("Option -%c requires an argument.\n", optopt);
             else if (isprint(optopt))
                 printf("Unknown option `-%c'.\n", optopt);
@@ -659,6 +1859,30 @@ int main(int argc, char* argv[])
 
     if (port_num >= 65536 || port_num < 5000) // validate port number
         error("Error: invalid port number, must be in the range 5000-65536");
+    if (tls_key && !tls_cert)
+        error("Error: a TLS key (-K) needs a certificate (-T)");
+    if (tls_cert && use_uring) // the loop reads requests and sends files on the socket itself
+        error("Error: TLS (-T) can't be served by the io_uring loop (-u)");
+
+    if (metrics_init() == -1)
+        error("Error: failed to initialize metrics registry!\n");
+
+    if (access_log_init(access_log_path) == -1)
+        error("Error: failed to start access log!\n");
+
+    // emails are spooled to disk per port and sent by a background process
+    char mail_spool[128];
+    snprintf(mail_spool, sizeof(mail_spool), MAIL_SPOOL_PATH_FORMAT, port_num);
+    if (mail_queue_init(mail_spool, mail_relay) == -1)
+        error("Error: failed to start mail queue!\n");
+
+    // one process owns the Arduino's port, handlers and scripts send it
+    // commands; it keeps the session statistics as totals come in
+    if (analytics_init(get_server_root_dir(), DEVICE_MAX) == -1)
+        error("Error: failed to initialize session analytics!\n");
+    snprintf(device_socket_env, sizeof(device_socket_env), "WEBSERV_DEVICE_SOCKET=" DEVICE_SOCKET_PATH_FORMAT, port_num);
+    if (device_init(strchr(device_socket_env, '=') + 1, device_paths, device_path_count) == -1)
+        error("Error: failed to start device process!\n");
 
     if (cache_size_str != NULL) {
         int cache_size = atoi(cache_size_str);
@@ -668,6 +1892,75 @@ int main(int argc, char* argv[])
         global_cache = initialize_cache(cache_size);
     }
 
+    // large objects go to a file-backed tier next to the shared memory cache
+    if (disk_size_str != NULL) {
+        char* unit;
+        long disk_size = strtol(disk_size_str, &unit, 10);
+        if (*unit == 'k' || *unit == 'K')
+            disk_size *= 1024;
+        else if (*unit == 'm' || *unit == 'M')
+            disk_size *= 1024 * 1024;
+        else if (*unit == 'g' || *unit == 'G')
+            disk_size *= 1024L * 1024 * 1024;
+        if (!global_cache)
+            error("Error: the disk cache tier (-d) needs the memory cache (-c)");
+        if (disk_size < DISK_CACHE_SIZE_MIN)
+            error("Error: invalid disk cache size, must be at least 1048576");
+
+        char disk_path[128];
+        snprintf(disk_path, sizeof(disk_path), DISK_CACHE_PATH_FORMAT, port_num);
+        if (disk_cache_init(disk_path, disk_size) == -1)
+            error("Error: failed to create disk cache tier!\n");
+        if (global_cache->small_object_max > DISK_CACHE_SMALL_OBJECT_MAX)
+            global_cache->small_object_max = DISK_CACHE_SMALL_OBJECT_MAX;
+    }
+
+    // pick up where the previous run left off, entries are revalidated on first use
+    if (global_cache) {
+        char snapshot_path[128];
+        snprintf(snapshot_path, sizeof(snapshot_path), CACHE_SNAPSHOT_PATH_FORMAT, port_num);
+        cache_snapshot_init(global_cache, snapshot_path);
+    }
+
+    // compile the route table once, children inherit it
+    char default_routes[1024];
+    if (!routes_path) {
+        snprintf(default_routes, sizeof(default_routes), "%s%s", get_server_root_dir(), ROUTES_CONFIG_FILE);
+        routes_path = default_routes;
+    }
+    router_register_native("metrics", send_metrics);
+    router_register_native("email", send_email);
+    router_register_native("reset", reset_device);
+    router_register_native("configure", configure_device);
+    router_register_native("device", send_device);
+    if (router_init(get_server_root_dir(), routes_path, is_cached) == -1)
+        error("Error: failed to build route table!\n");
+
+    // hold the web root and the routed files open, children inherit both
+    if (file_cache_init(get_server_root_dir()) == -1)
+        error("Error: failed to open web root!\n");
+    router_visit(preload_route);
+    if (upstream_init() == -1)
+        error("Error: failed to set up resolver cache!\n");
+    if (singleflight_init() == -1)
+        error("Error: failed to set up request coalescing!\n");
+    if (admission_init() == -1)
+        error("Error: failed to set up admission control!\n");
+    if (dir_listing_init() == -1)
+        error("Error: failed to set up directory listing cache!\n");
+    if (tls_cert && tls_init(tls_cert, tls_key) == -1)
+        error("Error: failed to set up TLS!\n");
+
+    // prefork: long-lived workers each accept on their own SO_REUSEPORT socket
+    if (worker_count > 0) {
+        prefork_ops ops = { worker_init, use_uring ? worker_serve : is_threaded ? serve_threaded : NULL, worker_handle, master_tick };
+        printf("Link: %s://localhost:%i/\n", tls_enabled() ? "https" : "http", port_num);
+        printf("Listening to client requests on port %i with %d workers...\n", port_num, worker_count);
+        fflush(stdout);
+        if (prefork_run(worker_count, port_num, &ops) == -1)
+            error("Error: failed to bind server to port!\n");
+    }
+
     // Create socket
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
         error("Error: failed to open socket!\n");
@@ -689,36 +1982,54 @@ int main(int argc, char* argv[])
     if (listen(sockfd, SOMAXCONN) < 0)
         error("Error: cannot listen to client requests!\n");
 
-    printf("Link: http://localhost:%i/\n", port_num);
+    printf("Link: %s://localhost:%i/\n", tls_enabled() ? "https" : "http", port_num);
     printf("Listening to client requests on port %i...\n", port_num);
     fflush(stdout);
 
+    // io_uring event loop, only returns if this kernel can't run it
+    if (use_uring)
+        uring_serve(sockfd, &uring_handlers);
+
+    // fiber scheduler for threaded mode, only returns on failure
+    if (is_threaded && serve_threaded(sockfd) == -1)
+        error("Error: failed to run threaded mode!\n");
+
     // accept incoming connections
-    while (!sigint_received) {
-        if ((newsockfd = accept(sockfd, (struct sockaddr*)&client_addr, &client_addr_len)) < 0)
+    for (;;) {
+        exit_on_sigint();
+        if ((newsockfd = accept(sockfd, (struct sockaddr*)&client_addr, &client_addr_len)) < 0) {
+            if (errno == EINTR)
+                continue;
             error("Error: failed to accept client request!\n");
+        }
+        file_cache_poll(); // drop descriptors of files changed on disk before forking
+        cache_snapshot_tick(global_cache);
 
-        if (!is_threaded) {
-            // fork process to handle client request
-            p = fork();
+        // fork process to handle client request
+        p = fork();
 
-            if (p < 0) { // if failed to fork, close sockets and exit
-                close(sockfd);
-                close(newsockfd);
-                error("Error: cannot fork to handle client request!\n");
-            }
+        if (p < 0) { // if failed to fork, close sockets and exit
+            close(sockfd);
+            close(newsockfd);
+            error("Error: cannot fork to handle client request!\n");
+        }
 
-            if (p == 0) { // This is the client process
-                close(sockfd); // Close the original socket in child
-                signal(SIGINT, SIG_IGN); // ignore SIGINT signals in children to avoid multiple signal handling
-                handle_client_req(newsockfd); // Handle connection
-                exit(EXIT_SUCCESS); // Terminate child process
-            } else // Parent process
-                close(newsockfd); // Parent doesn't need this socket
-        } else
-            create_thread(handle_client_req_threaded);
+        if (p == 0) { // This is the client process
+            close(sockfd); // Close the original socket in child
+            signal(SIGINT, SIG_IGN); // ignore SIGINT signals in children to avoid multiple signal handling
+            signal(SIGCHLD, SIG_DFL); // the CGI path waits for its own child
+            metrics_request_begin(&cur_req);
+            begin_deadlines(newsockfd); // a client that never finishes its request can't pin this child
+            if (tls_enabled() && (newsockfd = tls_accept(newsockfd, &cur_tls)) == -1) {
+                finish_request();
+                exit(EXIT_SUCCESS);
+            }
+            handle_client_req(newsockfd); // Handle connection
+            finish_request();
+            tls_finish(&cur_tls);
+            exit(EXIT_SUCCESS); // Terminate child process
+        } else // Parent process
+            close(newsockfd); // Parent doesn't need this socket
     }
-
-    close(sockfd);
-    exit(EXIT_SUCCESS);
 }
+#endif /* WEBSERV_NO_MAIN */